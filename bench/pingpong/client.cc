@@ -102,23 +102,26 @@ public:
 		if (numConencted == 0)
 		{
 			LOG_WARN << "all disconnected";
-
-			int64_t totalBytesRead = 0;
-			int64_t totalMessagesRead = 0;
-			for (auto it = sessions.begin(); it != sessions.end(); ++it)
-			{
-				totalBytesRead += (*it)->getBytesRead();
-				totalMessagesRead += (*it)->getMessagesRead();
-			}
-
-			LOG_WARN << totalBytesRead << " total bytes read";
-			LOG_WARN << totalMessagesRead << " total messages read";
-			LOG_WARN << static_cast<double>(totalBytesRead) / static_cast<double>(totalMessagesRead) << " average message size";
-			LOG_WARN << static_cast<double>(totalBytesRead) / (timeOut * 1024 * 1024) << " MiB/s throughput";
 			conn->getLoop()->queueInLoop(std::bind(&Client::quit, this));
 		}
 	}
 
+	void report()
+	{
+		int64_t totalBytesRead = 0;
+		int64_t totalMessagesRead = 0;
+		for (auto it = sessions.begin(); it != sessions.end(); ++it)
+		{
+			totalBytesRead += (*it)->getBytesRead();
+			totalMessagesRead += (*it)->getMessagesRead();
+		}
+
+		LOG_WARN << totalBytesRead << " total bytes read";
+		LOG_WARN << totalMessagesRead << " total messages read";
+		LOG_WARN << static_cast<double>(totalBytesRead) / static_cast<double>(totalMessagesRead) << " average message size";
+		LOG_WARN << static_cast<double>(totalBytesRead) / (timeOut * 1024 * 1024) << " MiB/s throughput";
+	}
+
 	const std::string &getMessage() const { return message; }
 
 	void quit()
@@ -126,10 +129,15 @@ public:
 		loop->queueInLoop(std::bind(&EventLoop::quit, loop));
 	}
 
+	/* Counted at the deadline, sessions still echoing when shutdown is
+	 * asked for may never see their peer close. */
 	void handlerTimeout()
 	{
 		LOG_WARN << "stop";
+		report();
 		std::for_each(sessions.begin(), sessions.end(), std::mem_fn(&Connect::stop));
+		fflush(stdout);
+		_exit(0);
 	}
 
 private:
@@ -157,10 +165,10 @@ void Connect::connCallBack(const TcpConnectionPtr &conn)
 
 int main(int argc, char *argv[])
 {
-	if (argc != 7)
+	if (argc != 7 && argc != 8)
 	{
 		fprintf(stderr, "Usage: Client <host_ip> <port> <threads> <blocksize> ");
-		fprintf(stderr, "<sessions> <time>\n");
+		fprintf(stderr, "<sessions> <time> [epoll|io_uring]\n");
 	}
 	else
 	{
@@ -171,6 +179,10 @@ int main(int argc, char *argv[])
 		int blockSize = atoi(argv[4]);
 		int sessionCount = atoi(argv[5]);
 		int timeout = atoi(argv[6]);
+		if (argc == 8 && !strcmp(argv[7], "io_uring"))
+		{
+			EventLoop::setIoUring(true);
+		}
 
 		EventLoop loop;
 		Client cli(&loop, ip, port, blockSize, sessionCount, timeout, threadCount);
@@ -27,7 +27,7 @@ int main(int argc,char* argv[])
 {
 	if (argc < 4)
 	{
-		fprintf(stderr, "Usage: server <address> <port> <threads>\n");
+		fprintf(stderr, "Usage: server <address> <port> <threads> [epoll|io_uring]\n");
 	}
 	else
 	{
@@ -36,6 +36,10 @@ int main(int argc,char* argv[])
 		const char *ip = argv[1];
 		uint16_t port = static_cast<uint16_t>(atoi(argv[2]));
 		int threadCount = atoi(argv[3]);
+		if (argc > 4 && !strcmp(argv[4], "io_uring"))
+		{
+			EventLoop::setIoUring(true);
+		}
 
 		EventLoop loop;
 		TcpServer server(&loop, ip, port, nullptr);
@@ -4,16 +4,18 @@
 #include "tcpconnection.h"
 #include "tcpserver.h"
 #include "tcpclient.h"
-#include "timer.h"
+#include "util.h"
 
 const size_t frameLen = 2*sizeof(int64_t);
+const size_t sampleCount = 10000;
+std::vector<int64_t> roundTrips;
+
 void serverConnectionCallback(const TcpConnectionPtr &conn)
 {
 	if (conn->connected())
 	{
 		LOG_INFO<<" from client connect ";
-		Socket socket;
-		socket.setTcpNoDelay(conn->getSockfd(),false);
+		Socket::setTcpNoDelay(conn->getSockfd(), true);
 	}
 	else
 	{
@@ -28,16 +30,16 @@ void serverMessageCallback(const TcpConnectionPtr &conn,Buffer *buffer)
 	{
 		memcpy(message,buffer->peek(),frameLen);
 		buffer->retrieve(frameLen);
-		message[1] = TimeStamp::now().getMicroSecondsSinceEpoch();
+		message[1] = ustime();
 		conn->send(message, sizeof message);
 	}
 }
 
-void runServer(uint16_t port)
+void runServer(uint16_t port, int64_t busyPollUs)
 {
 	EventLoop loop;
-	TcpServer server;
-	server.init(&loop,"127.0.0.1",port,nullptr);
+	loop.setBusyPoll(busyPollUs);
+	TcpServer server(&loop, "127.0.0.1", port, nullptr);
 	server.setConnectionCallback(serverConnectionCallback);
 	server.setMessageCallback(serverMessageCallback);
 	server.start();
@@ -52,8 +54,7 @@ void clientConnectionCallback(const TcpConnectionPtr &conn)
 	{
 		LOG_INFO<<"  client connect ";
 		clientConnection = conn;
-		Socket socket;
-		socket.setSocketBlock(conn->getSockfd());
+		Socket::setTcpNoDelay(conn->getSockfd(), true);
 	}
 	else
 	{
@@ -71,32 +72,40 @@ void clientMessageCallback(const TcpConnectionPtr &conn,
 		memcpy(message, buffer->peek(), frameLen);
 		buffer->retrieve(frameLen);
 		int64_t send = message[0];
-		int64_t their = message[1];
-		int64_t back = TimeStamp::now().getMicroSecondsSinceEpoch();
-		int64_t mine = (back+send)/2;
-		LOG_INFO << "round trip " << back - send
-		         << " clock error " << their - mine;
+		int64_t back = ustime();
+		roundTrips.push_back(back - send);
+	}
+
+	if (roundTrips.size() >= sampleCount)
+	{
+		std::sort(roundTrips.begin(), roundTrips.end());
+		LOG_WARN << "round trip us p50 " << roundTrips[roundTrips.size() / 2]
+			<< " p99 " << roundTrips[roundTrips.size() * 99 / 100]
+			<< " p999 " << roundTrips[roundTrips.size() * 999 / 1000]
+			<< " max " << roundTrips.back();
+		roundTrips.clear();
 	}
 }
 
-void sendMyTime(void * data)
+void sendMyTime()
 {
 	if (clientConnection)
 	{
 		int64_t message[2] = { 0, 0 };
-		message[0] = TimeStamp::now().getMicroSecondsSinceEpoch();
+		message[0] = ustime();
 		clientConnection->send(message, sizeof message);
 	}
 }
 
-void runClient(const char* ip, uint16_t port)
+void runClient(const char* ip, uint16_t port, int64_t busyPollUs)
 {
 	EventLoop loop;
-	TcpClient client(&loop,nullptr);
+	loop.setBusyPoll(busyPollUs);
+	TcpClient client(&loop, ip, port, nullptr);
 	client.setConnectionCallback(clientConnectionCallback);
 	client.setMessageCallback(clientMessageCallback);
-	client.connect(ip,port);
-	loop.runAfter(0.2,nullptr,true,sendMyTime);
+	client.connect();
+	loop.runAfter(0.001, true, sendMyTime);
 	loop.run();
 }
 
@@ -105,21 +114,20 @@ int main(int argc, char* argv[])
 	if (argc > 2)
 	{
 		uint16_t port = static_cast<uint16_t>(atoi(argv[2]));
-		 if (strcmp(argv[1], "-s") == 0)
+		int64_t busyPollUs = argc > 3 ? atoll(argv[3]) : 0;
+		if (strcmp(argv[1], "-s") == 0)
 		{
-		  	runServer(port);
+			runServer(port, busyPollUs);
 		}
 		else
 		{
-		 	runClient(argv[1], port);
+			runClient(argv[1], port, busyPollUs);
 		}
 	}
 	else
 	{
-		printf("Usage:\n%s -s port\n%s ip port\n", argv[0], argv[0]);
+		printf("Usage:\n%s -s port [busy_poll_us]\n%s ip port [busy_poll_us]\n", argv[0], argv[0]);
 	}
 
 	return 0;
 }
-
-
@@ -0,0 +1,154 @@
+# Cluster failover on localhost: three masters, two slaves of the first one.
+# The first master is killed, one slave must take over its slots and the
+# other one must replicate from it.
+#
+# cd redis-cpp17/src/redis && make
+# python3 ../../example/failover/failover.py ./redis-server
+
+import os
+import shutil
+import signal
+import socket
+import subprocess
+import sys
+import tempfile
+import time
+
+SERVER = sys.argv[1] if len(sys.argv) > 1 else './redis-server'
+MASTERS = [7101, 7102, 7103]
+SLAVES = [7104, 7105]
+TIMEOUT = 2000
+
+
+class Client:
+	def __init__(self, port):
+		self.sock = socket.create_connection(('127.0.0.1', port))
+		self.sock.settimeout(5)
+		self.buf = b''
+
+	def line(self):
+		while b'\r\n' not in self.buf:
+			data = self.sock.recv(65536)
+			if not data:
+				raise EOFError
+			self.buf += data
+		line, self.buf = self.buf.split(b'\r\n', 1)
+		return line
+
+	def reply(self):
+		line = self.line()
+		if line[:1] == b'$':
+			n = int(line[1:])
+			if n < 0:
+				return None
+			while len(self.buf) < n + 2:
+				self.buf += self.sock.recv(65536)
+			data, self.buf = self.buf[:n], self.buf[n + 2:]
+			return data
+		if line[:1] == b'*':
+			return [self.reply() for i in range(int(line[1:]))]
+		return line
+
+	def cmd(self, *args):
+		args = [str(a).encode() for a in args]
+		out = b'*%d\r\n' % len(args)
+		for a in args:
+			out += b'$%d\r\n%s\r\n' % (len(a), a)
+		self.sock.sendall(out)
+		return self.reply()
+
+
+def keyslot(key):
+	crc = 0
+	for byte in key.encode():
+		crc ^= byte << 8
+		for i in range(8):
+			crc = ((crc << 1) ^ 0x1021 if crc & 0x8000 else crc << 1) & 0xffff
+	return crc % 16384
+
+
+def info(port, section):
+	text = Client(port).cmd('info', section).decode()
+	return dict(l.split(':', 1) for l in text.split('\r\n') if ':' in l)
+
+
+def wait(what, cond, seconds):
+	deadline = time.time() + seconds
+	while time.time() < deadline:
+		try:
+			if cond():
+				return
+		except (OSError, EOFError):
+			pass
+		time.sleep(0.2)
+	raise SystemExit('timed out waiting for ' + what)
+
+
+def main():
+	root = tempfile.mkdtemp()
+	procs = {}
+	try:
+		for port in MASTERS + SLAVES:
+			path = os.path.join(root, str(port))
+			os.mkdir(path)
+			procs[port] = subprocess.Popen([os.path.abspath(SERVER), '--port', str(port),
+				'--cluster-enabled', '--cluster-node-timeout', str(TIMEOUT)],
+				cwd=path, stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+		for port in MASTERS + SLAVES:
+			wait('port %d' % port, lambda: Client(port).cmd('ping') == b'+PONG', 10)
+
+		first = Client(MASTERS[0])
+		for port in MASTERS[1:] + SLAVES:
+			first.cmd('cluster', 'meet', '127.0.0.1', port)
+		for i, port in enumerate(MASTERS):
+			c = Client(port)
+			for slot in range(1 + i * 100, 101 + i * 100):
+				assert c.cmd('cluster', 'addslots', slot) == b'+OK'
+		for port in SLAVES:
+			assert Client(port).cmd('slaveof', '127.0.0.1', MASTERS[0]) == b'+OK'
+		for port in SLAVES:
+			wait('slave %d online' % port,
+				lambda: info(port, 'replication').get('master_link_status') == 'up', 20)
+		for port in MASTERS + SLAVES:
+			wait('slots known to %d' % port,
+				lambda: b'cluster_slots_assigned:300' in Client(port).cmd('cluster', 'info'), 20)
+
+		key, key2 = [k for k in ('k%d' % i for i in range(100000)) if 1 <= keyslot(k) <= 100][:2]
+		assert first.cmd('set', key, 'before') == b'+OK'
+		for port in SLAVES:
+			wait('the write to reach %d' % port, lambda: Client(port).cmd('dbsize') == b':1', 10)
+
+		procs[MASTERS[0]].send_signal(signal.SIGKILL)
+		procs[MASTERS[0]].wait()
+		start = time.time()
+
+		def promoted():
+			return any(info(p, 'replication').get('role') == 'master' for p in SLAVES)
+
+		wait('a slave to be promoted', promoted, TIMEOUT / 1000 * 10)
+		winner = next(p for p in SLAVES if info(p, 'replication').get('role') == 'master')
+		other = next(p for p in SLAVES if p != winner)
+		print('slave %d promoted after %.1fs' % (winner, time.time() - start))
+
+		wait('slots routed to %d' % winner,
+			lambda: b':%d' % winner in Client(MASTERS[1]).cmd('cluster', 'nodes'), 10)
+		wait('slave %d to replicate from %d' % (other, winner),
+			lambda: info(other, 'replication').get('master_port') == str(winner) and
+			info(other, 'replication').get('master_link_status') == 'up', 20)
+
+		c = Client(winner)
+		assert c.cmd('get', key) == b'before'
+		assert c.cmd('set', key2, 'after') == b'+OK'
+		wait('the write to reach %d' % other, lambda: Client(other).cmd('dbsize') == b':2', 10)
+		print('slave %d replicates from %d' % (other, winner))
+		print('ok')
+	finally:
+		for p in procs.values():
+			if p.poll() is None:
+				p.kill()
+				p.wait()
+		shutil.rmtree(root, ignore_errors=True)
+
+
+if __name__ == '__main__':
+	main()
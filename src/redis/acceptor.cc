@@ -14,6 +14,8 @@ Acceptor::Acceptor(EventLoop *loop, const char *ip, int16_t port)
 	assert(idleFd >= 0);
 #endif
 	channel.setReadCallback(std::bind(&Acceptor::handleRead, this));
+	channel.setAcceptCallback(std::bind(&Acceptor::handleAccept, this));
+	channel.setEdgeTriggered(true);
 }
 
 Acceptor::~Acceptor()
@@ -26,17 +28,22 @@ Acceptor::~Acceptor()
 void Acceptor::handleRead()
 {
 	loop->assertInLoopThread();
-	struct sockaddr_in6 address;
-	socklen_t len = sizeof(address);
+	/* Accepts until the backlog is empty, the channel is edge triggered. */
+	for (;;)
+	{
+		struct sockaddr_in6 address;
+		socklen_t len = sizeof(address);
 #ifdef __linux__
-	int32_t connfd = ::accept4(sockfd, (struct sockaddr*)&address,
-		&len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		int32_t connfd = ::accept4(sockfd, (struct sockaddr*)&address,
+			&len, SOCK_NONBLOCK | SOCK_CLOEXEC);
 #else
-	int32_t connfd = ::accept(sockfd, (struct sockaddr*)&address, &len);
+		int32_t connfd = ::accept(sockfd, (struct sockaddr*)&address, &len);
 #endif
+		if (connfd < 0)
+		{
+			break;
+		}
 
-	if (connfd >= 0)
-	{
 		if (newConnectionCallback)
 		{
 			socket.setSocketNonBlock(connfd);
@@ -44,12 +51,25 @@ void Acceptor::handleRead()
 		}
 		else
 		{
-			Socket::close(sockfd);
+			Socket::close(connfd);
 		}
 	}
-	else
-	{
+}
 
+/* Connections the poller accepted already (io_uring multishot accept). */
+void Acceptor::handleAccept()
+{
+	loop->assertInLoopThread();
+	for (auto &it : channel.getAccepted())
+	{
+		if (newConnectionCallback)
+		{
+			newConnectionCallback(it);
+		}
+		else
+		{
+			Socket::close(it);
+		}
 	}
 }
 
@@ -23,6 +23,7 @@ public:
 
 	void listen();
 	void handleRead();
+	void handleAccept();
 
 private:
 	Acceptor(const Acceptor&);
@@ -44,6 +44,7 @@
 #include <experimental/filesystem>
 #include <ratio>
 #include <chrono>
+#include <bitset>
 
 #ifdef _WIN64
 #include <WinSock2.h>
@@ -74,6 +75,7 @@ typedef SSIZE_T ssize_t;
 #include <pwd.h>
 #include <dirent.h>
 #include <sys/times.h>
+#include <sys/mman.h>
 #endif
 
 #ifdef __APPLE__
@@ -165,6 +167,20 @@ typedef SSIZE_T ssize_t;
 #define UNIT_SECONDS 0
 #define UNIT_MILLISECONDS 1
 
+/* Keyspace changes notification classes. */
+#define NOTIFY_KEYSPACE (1<<0)    /* K */
+#define NOTIFY_KEYEVENT (1<<1)    /* E */
+#define NOTIFY_GENERIC (1<<2)     /* g */
+#define NOTIFY_STRING (1<<3)      /* $ */
+#define NOTIFY_LIST (1<<4)        /* l */
+#define NOTIFY_SET (1<<5)         /* s */
+#define NOTIFY_HASH (1<<6)        /* h */
+#define NOTIFY_ZSET (1<<7)        /* z */
+#define NOTIFY_EXPIRED (1<<8)     /* x */
+#define NOTIFY_EVICTED (1<<9)     /* e */
+#define NOTIFY_ALL (NOTIFY_GENERIC | NOTIFY_STRING | NOTIFY_LIST | NOTIFY_SET | \
+	NOTIFY_HASH | NOTIFY_ZSET | NOTIFY_EXPIRED | NOTIFY_EVICTED) /* A */
+
 
 /* Static server configuration */
 #define REDIS_COMMAND_LENGTH    15
@@ -187,6 +203,9 @@ typedef SSIZE_T ssize_t;
 #define REDIS_AOF_REWRITE_ITEMS_PER_CMD 64
 #define REDIS_SLOWLOG_LOG_SLOWER_THAN 10000
 #define REDIS_SLOWLOG_MAX_LENGTH 128
+#define REDIS_DEFAULT_LATENCY_MONITOR_THRESHOLD 0
+#define LATENCY_TS_LEN 160
+#define REDIS_STATS_CRON_INTERVAL 0.1
 #define REDIS_MAX_CLIENTS 10000
 #define REDIS_AUTHPASS_MAX_LENGTH 512
 #define REDIS_DEFAULT_SLAVE_PRIORITY 100
@@ -197,6 +216,8 @@ typedef SSIZE_T ssize_t;
 #define REDIS_DEFAULT_REPL_BACKLOG_SIZE (1024*1024)    /* 1mb */
 #define REDIS_DEFAULT_REPL_BACKLOG_TIME_LIMIT (60*60)  /* 1 hour */
 #define REDIS_REPL_BACKLOG_MIN_SIZE (1024*16)          /* 16k */
+#define REDIS_DEFAULT_REPL_OUTPUT_LIMIT (256*1024*1024) /* 256mb */
+#define REDIS_DEFAULT_TRACKING_TABLE_MAX_KEYS 1000000 /* Keys remembered for tracking */
 #define REDIS_BGSAVE_RETRY_DELAY 5 /* Wait a few secs before trying again. */
 #define REDIS_DEFAULT_PID_FILE "/var/run/redis.pid"
 #define REDIS_DEFAULT_SYSLOG_IDENT "redis"
@@ -210,7 +231,11 @@ typedef SSIZE_T ssize_t;
 #define REDIS_DEFAULT_RDB_COMPRESSION 1
 #define REDIS_DEFAULT_RDB_CHECKSUM 1
 #define REDIS_DEFAULT_RDB_FILENGTHAME "dump.rdb"
+#define REDIS_DEFAULT_RDB_SEGMENTS 1
+#define REDIS_RDB_MAX_SEGMENTS 256
+#define REDIS_RDB_MANIFEST_SUFFIX ".manifest"
 #define REDIS_DEFAULT_SLAVE_SERVE_STALE_DATA 1
+#define REDIS_DEFAULT_SLAVE_MAX_LAG 0
 #define REDIS_DEFAULT_SLAVE_READ_ONLY 1
 #define REDIS_DEFAULT_REPL_DISABLE_TCP_NODELAY 0
 #define REDIS_DEFAULT_MAXMEMORY 0
@@ -219,6 +244,7 @@ typedef SSIZE_T ssize_t;
 #define REDIS_DEFAULT_AOF_NO_FSYNC_ON_REWRITE 0
 #define REDIS_DEFAULT_ACTIVE_REHASHING 1
 #define REDIS_DEFAULT_AOF_REWRITE_INCREMENTAL_FSYNC 1
+#define REDIS_DEFAULT_AOF_FSYNC AOF_FSYNC_EVERYSEC
 #define REDIS_DEFAULT_MIN_SLAVES_TO_WRITE 0
 #define REDIS_DEFAULT_MIN_SLAVES_MAX_LAG 10
 #define REDIS_IP_STR_LENGTH INET6_ADDRSTRLENGTH
@@ -319,6 +345,11 @@ typedef SSIZE_T ssize_t;
 #define LONG_STR_SIZE      21          /* Bytes needed for long -> str + '\0' */
 #define AOF_AUTOSYNC_BYTES (1024*1024*32) /* fdatasync every 32MB */
 
+/* Append only defines */
+#define AOF_FSYNC_NO 0
+#define AOF_FSYNC_ALWAYS 1
+#define AOF_FSYNC_EVERYSEC 2
+
 #define OBJ_SHARED_REFCOUNT INT_MAX
 #define REDIS_REPLY_STRING 1
 #define REDIS_REPLY_ARRAY 2
@@ -358,6 +389,21 @@ typedef SSIZE_T ssize_t;
 
 
 #define REDIS_SLAVE_SYNC_SIZE  65536 
+#define REDIS_DEFAULT_REPL_DISKLESS_SYNC 0
+#define REDIS_REPL_SYNC_EOF -1 /* Diskless payload: length prefixed chunks, empty one last */
+
+/* Slave states seen from the master. */
+#define REDIS_REPL_WAIT_BGSAVE_START 1 /* Waits for the next snapshot. */
+#define REDIS_REPL_WAIT_BGSAVE_END 2 /* Its snapshot is being produced. */
+#define REDIS_REPL_SEND_BULK 3 /* Receives the snapshot file. */
+#define REDIS_REPL_ONLINE 4 /* Receives the command stream. */
+
+/* States of the link of a slave to its master. */
+#define REDIS_REPL_RECEIVE_PORT 1 /* Waits for the reply to REPLCONF listening-port. */
+#define REDIS_REPL_RECEIVE_PSYNC 2 /* Waits for the reply to PSYNC. */
+#define REDIS_REPL_TRANSFER 3 /* Receives the snapshot payload. */
+#define REDIS_REPL_RECEIVE_OFFSET 4 /* Waits for the offset the stream starts at. */
+#define REDIS_REPL_CONNECTED 5 /* Applies the command stream. */
 #define REDIS_RECONNECT_COUNT 10
 
 #define CLUSTER_SLOTS 16384
@@ -365,6 +411,30 @@ typedef SSIZE_T ssize_t;
 #define CLUSTER_FAIL 1        /* The cluster can't work */
 #define CLUSTER_NAMELEN 40    /* sha1 hex lengthgth */
 #define CLUSTER_PORT_INCR 10000 /* Cluster port = baseport + PORT_INCR */
+#define CLUSTER_MIGRATE_PIPELINE 128 /* RESTOREs in flight per migration */
+#define CLUSTER_MIGRATE_PIPELINE_BYTES (4 * 1024 * 1024) /* Payload bytes in flight */
+#define CLUSTER_MIGRATE_DEFAULT_TIMEOUT 1000 /* Idle milliseconds before a migration fails */
+#define CLUSTER_DEFAULT_NODE_TIMEOUT 15000 /* Milliseconds without a pong before PFAIL */
+#define CLUSTER_FAIL_REPORT_VALIDITY_MULT 2 /* Node timeouts a failure report is valid */
+#define CLUSTER_FAIL_UNDO_TIME_MULT 2 /* Node timeouts before a reachable failed master is cleared */
+#define CLUSTER_BUS_CRON_INTERVAL 0.1 /* Seconds between cluster bus cron runs */
+#define MONITOR_CRON_INTERVAL 0.01 /* Seconds between MONITOR output flushes */
+
+/* Cluster bus message types. */
+#define CLUSTERMSG_TYPE_PING 0
+#define CLUSTERMSG_TYPE_PONG 1
+#define CLUSTERMSG_TYPE_MEET 2
+#define CLUSTERMSG_TYPE_FAIL 3
+#define CLUSTERMSG_TYPE_FAILOVER_AUTH_REQUEST 4
+#define CLUSTERMSG_TYPE_FAILOVER_AUTH_ACK 5
+
+/* Node flags carried on the cluster bus. */
+#define CLUSTER_NODE_MASTER 1
+#define CLUSTER_NODE_SLAVE 2
+#define CLUSTER_NODE_PFAIL 4
+#define CLUSTER_NODE_FAIL 8
+#define CLUSTER_NODE_MYSELF 16
+#define CLUSTER_NODE_HANDSHAKE 32
 
 
 #define NET_IP_STR_LEN 46
@@ -0,0 +1,623 @@
+#include "aof.h"
+#include "redis.h"
+
+Aof::Aof(Redis *redis)
+	:redis(redis),
+	fd(-1),
+	appendOffset(0),
+	writtenOffset(0),
+	syncedOffset(0),
+	rewriteCuts(new bool[Redis::kShards]()),
+	running(false),
+	rewriting(false),
+	rewriteScheduled(false),
+	fsyncPolicy(REDIS_DEFAULT_AOF_FSYNC),
+	currentSize(0),
+	baseSize(0),
+	lastFsync(0),
+	lastRewriteTime(-1)
+{
+
+}
+
+Aof::~Aof()
+{
+	stop();
+}
+
+bool Aof::start(const char *filename)
+{
+	fd = ::open(filename, O_WRONLY | O_APPEND | O_CREAT, 0644);
+	if (fd == -1)
+	{
+		LOG_WARN << "Can't open the append-only file: " << strerror(errno);
+		return false;
+	}
+
+	struct stat st;
+	if (::fstat(fd, &st) == 0)
+	{
+		currentSize = st.st_size;
+		baseSize = st.st_size;
+	}
+
+	this->filename = filename;
+	lastFsync = ustime();
+	running = true;
+	thread = std::thread(std::bind(&Aof::flushThread, this));
+	return true;
+}
+
+void Aof::stop()
+{
+	if (!running)
+	{
+		return;
+	}
+
+	{
+		std::unique_lock<std::mutex> lck(mtx);
+		running = false;
+	}
+
+	flushCondition.notify_one();
+	thread.join();
+
+	std::unique_lock<std::mutex> flck(fileMutex);
+	writing.append(pending.peek(), pending.readableBytes());
+	pending.retrieveAll();
+	writeBuffer();
+	fsyncFile();
+	::close(fd);
+	fd = -1;
+}
+
+void Aof::appendPending(std::unique_lock<std::mutex> &lck, const char *data, size_t len)
+{
+	pending.append(data, len);
+	appendOffset += len;
+
+	if (fsyncPolicy == AOF_FSYNC_ALWAYS)
+	{
+		int64_t offset = appendOffset;
+		flushCondition.notify_one();
+		syncCondition.wait(lck, [&] { return syncedOffset >= offset || !running; });
+	}
+	else if (pending.readableBytes() >= kFlushThreshold)
+	{
+		flushCondition.notify_one();
+	}
+}
+
+/* Called by the IO threads once per read batch with every write command of
+ * the batch already encoded, so one lock and at most one wakeup per batch.
+ * In always mode the caller blocks until the fsync covering its commands is
+ * done; concurrent callers share that fsync. */
+void Aof::feedAppendOnlyFile(Buffer *buffer)
+{
+	std::unique_lock<std::mutex> lck(mtx);
+	appendPending(lck, buffer->peek(), buffer->readableBytes());
+	buffer->retrieveAll();
+}
+
+/* While a rewrite is running write commands are executed under the snapshot
+ * lock of every shard they touch, so each one is known to land either in the
+ * shard snapshot or after it. Commands landing after the snapshot go to the
+ * rewrite buffer as well. They are fed right away instead of per batch so
+ * none is still queued in a session when the new file replaces the old one. */
+bool Aof::feedRewriteCommand(const RedisObjectPtr &cmd,
+	std::deque<RedisObjectPtr> &commands, const std::function<bool()> &execute)
+{
+	std::vector<int32_t> shards;
+	redis->getCommandShards(cmd, commands, shards);
+	for (auto &it : shards)
+	{
+		redis->getSnapshotLock(it).lock();
+	}
+
+	bool executed = execute();
+	Buffer buffer(0);
+	Buffer rewrite(0);
+	if (executed)
+	{
+		commands.push_front(cmd);
+		redis->structureRedisProtocol(buffer, commands);
+		redis->structureCutProtocol(rewrite, commands, rewriteCuts.get());
+		commands.pop_front();
+	}
+
+	std::unique_lock<std::mutex> lck(mtx);
+	if (rewriting && rewrite.readableBytes() > 0)
+	{
+		rewriteBuf.append(rewrite.peek(), rewrite.readableBytes());
+	}
+
+	for (auto it = shards.rbegin(); it != shards.rend(); ++it)
+	{
+		redis->getSnapshotLock(*it).unlock();
+	}
+
+	if (buffer.readableBytes() > 0)
+	{
+		appendPending(lck, buffer.peek(), buffer.readableBytes());
+	}
+	return executed;
+}
+
+int64_t Aof::getPendingBytes()
+{
+	std::unique_lock<std::mutex> lck(mtx);
+	return appendOffset - syncedOffset;
+}
+
+const char *Aof::getFsyncPolicyName()
+{
+	switch (fsyncPolicy)
+	{
+		case AOF_FSYNC_ALWAYS: return "always";
+		case AOF_FSYNC_EVERYSEC: return "everysec";
+		default: return "no";
+	}
+}
+
+void Aof::flushThread()
+{
+	ThreadPool::clearThreadAffinity();
+	while (running)
+	{
+		{
+			std::unique_lock<std::mutex> lck(mtx);
+			if (fsyncPolicy == AOF_FSYNC_ALWAYS)
+			{
+				flushCondition.wait_for(lck, std::chrono::milliseconds(100),
+					[this] { return pending.readableBytes() > 0 || !running; });
+			}
+			else
+			{
+				flushCondition.wait_for(lck, std::chrono::seconds(1),
+					[this] { return pending.readableBytes() >= kFlushThreshold || !running; });
+			}
+		}
+
+		std::unique_lock<std::mutex> flck(fileMutex);
+		int64_t offset;
+		{
+			std::unique_lock<std::mutex> lck(mtx);
+			if (writing.readableBytes() == 0)
+			{
+				pending.swap(writing);
+			}
+			else
+			{
+				writing.append(pending.peek(), pending.readableBytes());
+				pending.retrieveAll();
+			}
+			offset = appendOffset;
+		}
+
+		if (offset != writtenOffset)
+		{
+			if (!writeBuffer())
+			{
+				continue;
+			}
+			writtenOffset = offset;
+		}
+
+		if (writtenOffset == syncedOffset)
+		{
+			continue;
+		}
+
+		int32_t policy = fsyncPolicy;
+		if (policy == AOF_FSYNC_ALWAYS ||
+			(policy == AOF_FSYNC_EVERYSEC && ustime() - lastFsync >= 1000000))
+		{
+			if (!fsyncFile())
+			{
+				continue;
+			}
+		}
+		else if (policy == AOF_FSYNC_EVERYSEC)
+		{
+			continue;
+		}
+
+		std::unique_lock<std::mutex> lck(mtx);
+		syncedOffset = writtenOffset;
+		syncCondition.notify_all();
+	}
+
+	std::unique_lock<std::mutex> lck(mtx);
+	syncCondition.notify_all();
+}
+
+bool Aof::writeAll(int32_t fd, Buffer *buffer)
+{
+	while (buffer->readableBytes() > 0)
+	{
+		ssize_t n = ::write(fd, buffer->peek(), buffer->readableBytes());
+		if (n < 0)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+			return false;
+		}
+		buffer->retrieve(n);
+	}
+	return true;
+}
+
+bool Aof::writeBuffer()
+{
+	int32_t len = writing.readableBytes();
+	if (!writeAll(fd, &writing))
+	{
+		currentSize += len - writing.readableBytes();
+		LOG_WARN << "Error writing to the AOF file: " << strerror(errno);
+		std::this_thread::sleep_for(std::chrono::seconds(1));
+		return false;
+	}
+
+	currentSize += len;
+	return true;
+}
+
+bool Aof::fsyncFile()
+{
+	int64_t start = redis->getLatency()->start();
+#ifdef __linux__
+	if (::fdatasync(fd) == -1)
+#else
+	if (::fsync(fd) == -1)
+#endif
+	{
+		LOG_WARN << "Can't persist AOF for fsync error: " << strerror(errno);
+		return false;
+	}
+	redis->getLatency()->end("aof-fsync", start);
+
+	lastFsync = ustime();
+	return true;
+}
+
+bool Aof::rewriteBackground()
+{
+	bool expected = false;
+	if (!running || !rewriteScheduled.compare_exchange_strong(expected, true))
+	{
+		return false;
+	}
+
+	{
+		std::unique_lock<std::mutex> lck(mtx);
+		rewriteBuf.retrieveAll();
+		rewriting = true;
+	}
+
+	std::thread thread(std::bind(&Aof::rewriteThread, this));
+	thread.detach();
+	return true;
+}
+
+void Aof::rewriteCron()
+{
+	if (!running || rewriteScheduled)
+	{
+		return;
+	}
+
+	int64_t base = baseSize ? baseSize.load() : 1;
+	int64_t growth = (currentSize - base) * 100 / base;
+	if (currentSize > REDIS_AOF_REWRITE_MIN_SIZE && growth >= REDIS_AOF_REWRITE_PERC)
+	{
+		LOG_INFO << "Starting automatic rewriting of AOF on " << growth << "% growth";
+		rewriteBackground();
+	}
+}
+
+void Aof::rewriteThread()
+{
+	ThreadPool::clearThreadAffinity();
+	int64_t start = ustime();
+	char tmpfile[256];
+	snprintf(tmpfile, sizeof(tmpfile), "temp-rewriteaof-bg-%d.aof", (int32_t)getpid());
+	int32_t tmpfd = ::open(tmpfile, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (tmpfd == -1)
+	{
+		LOG_WARN << "Opening the temp file for AOF rewrite failed: " << strerror(errno);
+		rewriteDone(false, tmpfd, tmpfile, start);
+		return;
+	}
+
+	redis->waitForLoops();
+
+	Buffer buffer;
+	for (int32_t i = 0; i < Redis::kShards; i++)
+	{
+		rewriteShard(i, buffer);
+		if (buffer.readableBytes() >= kFlushThreshold && !writeAll(tmpfd, &buffer))
+		{
+			LOG_WARN << "Error writing the AOF rewrite file: " << strerror(errno);
+			rewriteDone(false, tmpfd, tmpfile, start);
+			return;
+		}
+	}
+
+	/* Drain most of the rewrite buffer before taking the locks that stall
+	 * the writers. */
+	{
+		std::unique_lock<std::mutex> lck(mtx);
+		buffer.append(rewriteBuf.peek(), rewriteBuf.readableBytes());
+		rewriteBuf.retrieveAll();
+	}
+
+	if (!writeAll(tmpfd, &buffer))
+	{
+		LOG_WARN << "Error writing the AOF rewrite file: " << strerror(errno);
+		rewriteDone(false, tmpfd, tmpfile, start);
+		return;
+	}
+
+	rewriteDone(true, tmpfd, tmpfile, start);
+}
+
+void Aof::rewriteShard(int32_t index, Buffer &buffer)
+{
+	auto &shard = redis->getRedisShards()[index];
+	Redis::StringMap stringMap;
+	Redis::HashMap hashMap;
+	Redis::ListMap listMap;
+	Redis::ZsetMap zsetMap;
+	Redis::SetMap setMap;
+
+	{
+		std::unique_lock<std::mutex> rlck(redis->getSnapshotLock(index));
+		if (rewriteCuts[index])
+		{
+			return;
+		}
+
+		std::unique_lock<std::mutex> lck(shard.mtx);
+		stringMap = shard.stringMap;
+		hashMap = shard.hashMap;
+		listMap = shard.listMap;
+		zsetMap = shard.zsetMap;
+		setMap = shard.setMap;
+		rewriteCuts[index] = true;
+	}
+
+	std::deque<RedisObjectPtr> argv;
+	int64_t now = ustime();
+	for (auto &it : stringMap)
+	{
+		argv.clear();
+		argv.push_back(shared.set);
+		argv.push_back(it.first);
+		argv.push_back(it.second);
+
+		int64_t expire = redis->getExpire(it.first);
+		if (expire != -1)
+		{
+			int64_t ms = (expire - now) / 1000;
+			if (ms <= 0)
+			{
+				continue;
+			}
+
+			argv.push_back(createStringObject((char*)"px", 2));
+			argv.push_back(createStringObjectFromLongLong(ms));
+		}
+		redis->structureRedisProtocol(buffer, argv);
+	}
+
+	/* lpush appends at the tail in this server, so the list is replayed in
+	 * its stored order. */
+	for (auto &it : listMap)
+	{
+		auto iter = it.second.begin();
+		while (iter != it.second.end())
+		{
+			argv.clear();
+			argv.push_back(shared.lpush);
+			argv.push_back(it.first);
+			for (int32_t i = 0; i < REDIS_AOF_REWRITE_ITEMS_PER_CMD &&
+				iter != it.second.end(); i++, ++iter)
+			{
+				argv.push_back(*iter);
+			}
+			redis->structureRedisProtocol(buffer, argv);
+		}
+	}
+
+	for (auto &it : hashMap)
+	{
+		auto iter = it.second.begin();
+		while (iter != it.second.end())
+		{
+			argv.clear();
+			argv.push_back(shared.hset);
+			argv.push_back(it.first);
+			for (int32_t i = 0; i < REDIS_AOF_REWRITE_ITEMS_PER_CMD &&
+				iter != it.second.end(); i++, ++iter)
+			{
+				argv.push_back(iter->first);
+				argv.push_back(iter->second);
+			}
+			redis->structureRedisProtocol(buffer, argv);
+		}
+	}
+
+	for (auto &it : setMap)
+	{
+		auto iter = it.second.begin();
+		while (iter != it.second.end())
+		{
+			argv.clear();
+			argv.push_back(shared.sadd);
+			argv.push_back(it.first);
+			for (int32_t i = 0; i < REDIS_AOF_REWRITE_ITEMS_PER_CMD &&
+				iter != it.second.end(); i++, ++iter)
+			{
+				argv.push_back(*iter);
+			}
+			redis->structureRedisProtocol(buffer, argv);
+		}
+	}
+
+	for (auto &it : zsetMap)
+	{
+		auto iter = it.second.second.begin();
+		while (iter != it.second.second.end())
+		{
+			argv.clear();
+			argv.push_back(shared.zadd);
+			argv.push_back(it.first);
+			for (int32_t i = 0; i < REDIS_AOF_REWRITE_ITEMS_PER_CMD &&
+				iter != it.second.second.end(); i++, ++iter)
+			{
+				char buf[128];
+				int32_t len = snprintf(buf, sizeof(buf), "%.17g", iter->first);
+				argv.push_back(createStringObject(buf, len));
+				argv.push_back(iter->second);
+			}
+			redis->structureRedisProtocol(buffer, argv);
+		}
+	}
+}
+
+/* Swap the new file in while holding both the file lock (no write in
+ * flight on the old descriptor) and the feed lock (no command in between).
+ * Everything still pending for the old file is covered by the snapshot or
+ * by the rewrite buffer, so it is dropped rather than written. */
+void Aof::rewriteDone(bool ok, int32_t tmpfd, const char *tmpfile, int64_t start)
+{
+	{
+		std::unique_lock<std::mutex> flck(fileMutex);
+		std::unique_lock<std::mutex> lck(mtx);
+		if (ok)
+		{
+			ok = writeAll(tmpfd, &rewriteBuf);
+#ifdef __linux__
+			ok = ok && ::fdatasync(tmpfd) == 0;
+#else
+			ok = ok && ::fsync(tmpfd) == 0;
+#endif
+			ok = ok && ::rename(tmpfile, filename.c_str()) == 0;
+			if (!ok)
+			{
+				LOG_WARN << "Error trying to rename the temporary AOF file: " << strerror(errno);
+			}
+		}
+
+		if (ok)
+		{
+			struct stat st;
+			::fstat(tmpfd, &st);
+			::close(fd);
+			fd = tmpfd;
+			pending.retrieveAll();
+			writing.retrieveAll();
+			writtenOffset = appendOffset;
+			syncedOffset = appendOffset;
+			currentSize = st.st_size;
+			baseSize = st.st_size;
+			lastFsync = ustime();
+			syncCondition.notify_all();
+		}
+		else
+		{
+			if (tmpfd != -1)
+			{
+				::close(tmpfd);
+			}
+			::unlink(tmpfile);
+		}
+
+		rewriteBuf.retrieveAll();
+		rewriting = false;
+	}
+
+	for (int32_t i = 0; i < Redis::kShards; i++)
+	{
+		std::unique_lock<std::mutex> lck(redis->getSnapshotLock(i));
+		rewriteCuts[i] = false;
+	}
+
+	lastRewriteTime = (ustime() - start) / 1000000;
+	rewriteScheduled = false;
+
+	if (ok)
+	{
+		LOG_INFO << "Background AOF rewrite terminated with success, size " << baseSize;
+	}
+	else
+	{
+		LOG_WARN << "Background AOF rewrite failed";
+	}
+}
+
+/* Replay the append only file through a detached session, the same way
+ * commands coming from the network are executed. */
+int32_t Aof::loadAppendOnlyFile(const char *filename)
+{
+	int32_t fd = ::open(filename, O_RDONLY);
+	if (fd == -1)
+	{
+		return REDIS_ERR;
+	}
+
+	TcpConnectionPtr conn(new TcpConnection(redis->getEventLoop(), -1, nullptr));
+	SessionPtr session(new Session(redis, conn));
+	Buffer buffer;
+	char buf[65536];
+	int64_t loaded = 0;
+	int32_t error = 0;
+
+	for (;;)
+	{
+		ssize_t n = ::read(fd, buf, sizeof(buf));
+		if (n < 0)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+
+			error = errno;
+			LOG_WARN << "Error reading the append only file: " << strerror(error);
+			break;
+		}
+
+		if (n == 0)
+		{
+			break;
+		}
+
+		loaded += n;
+		buffer.append(buf, n);
+		session->readCallback(conn, &buffer);
+		conn->outputBuffer()->retrieveAll();
+	}
+
+	if (buffer.readableBytes() > 0)
+	{
+		LOG_WARN << "AOF loaded anyway because aof-load-truncated is enabled, "
+			<< buffer.readableBytes() << " trailing bytes ignored";
+	}
+
+	conn->setState(TcpConnection::kDisconnected);
+	session.reset();
+	conn.reset();
+	::close(fd);
+	if (error)
+	{
+		errno = error;
+		return REDIS_ERR;
+	}
+
+	LOG_INFO << "AOF loaded " << loaded << " bytes";
+	return REDIS_OK;
+}
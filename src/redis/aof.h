@@ -0,0 +1,79 @@
+#pragma once
+#include "all.h"
+#include "buffer.h"
+#include "object.h"
+#include "util.h"
+#include "log.h"
+
+class Redis;
+class Aof
+{
+public:
+	Aof(Redis *redis);
+	~Aof();
+
+	bool start(const char *filename);
+	void stop();
+	int32_t loadAppendOnlyFile(const char *filename);
+
+	void feedAppendOnlyFile(Buffer *buffer);
+	bool feedRewriteCommand(const RedisObjectPtr &cmd,
+		std::deque<RedisObjectPtr> &commands, const std::function<bool()> &execute);
+
+	bool rewriteBackground();
+	void rewriteCron();
+	bool isRewriting() { return rewriting; }
+	bool isRewriteScheduled() { return rewriteScheduled; }
+
+	void setFsyncPolicy(int32_t policy) { fsyncPolicy = policy; }
+	int32_t getFsyncPolicy() { return fsyncPolicy; }
+	int64_t getCurrentSize() { return currentSize; }
+	int64_t getBaseSize() { return baseSize; }
+	int64_t getLastFsync() { return lastFsync; }
+	int64_t getLastRewriteTime() { return lastRewriteTime; }
+	int64_t getPendingBytes();
+	const char *getFsyncPolicyName();
+
+private:
+	Aof(const Aof&);
+	void operator=(const Aof&);
+
+	void flushThread();
+	void rewriteThread();
+	void rewriteShard(int32_t index, Buffer &buffer);
+	void rewriteDone(bool ok, int32_t tmpfd, const char *tmpfile, int64_t start);
+	void appendPending(std::unique_lock<std::mutex> &lck, const char *data, size_t len);
+	bool writeBuffer();
+	bool fsyncFile();
+
+	static bool writeAll(int32_t fd, Buffer *buffer);
+
+	static const int32_t kFlushThreshold = 1024 * 1024;
+
+	Redis *redis;
+	int32_t fd;
+	std::string filename;
+	std::thread thread;
+	std::mutex mtx;
+	std::mutex fileMutex;
+	std::condition_variable flushCondition;
+	std::condition_variable syncCondition;
+
+	Buffer pending;
+	Buffer writing;
+	Buffer rewriteBuf;
+	int64_t appendOffset;
+	int64_t writtenOffset;
+	int64_t syncedOffset;
+
+	std::unique_ptr<bool[]> rewriteCuts;
+
+	std::atomic<bool> running;
+	std::atomic<bool> rewriting;
+	std::atomic<bool> rewriteScheduled;
+	std::atomic<int32_t> fsyncPolicy;
+	std::atomic<int64_t> currentSize;
+	std::atomic<int64_t> baseSize;
+	std::atomic<int64_t> lastFsync;
+	std::atomic<int64_t> lastRewriteTime;
+};
@@ -4,12 +4,33 @@ const char Buffer::kCRLF[] = "\r\n";
 const char Buffer::CONTENT[] = "Content-Length";
 const int32_t Buffer::kCheapPrepend;
 const int32_t Buffer::kInitialSize;
+const int32_t BufferPool::kChunkSize;
+const int32_t BufferPool::kMaxChunks;
+
+void Buffer::acquire(BufferPool *pool)
+{
+	if (readableBytes() == 0 && buffer.size() < BufferPool::kChunkSize)
+	{
+		buffer = pool->acquire();
+		readerIndex = kCheapPrepend;
+		writerIndex = kCheapPrepend;
+	}
+}
+
+void Buffer::release(BufferPool *pool)
+{
+	assert(readableBytes() == 0);
+	pool->release(std::move(buffer));
+	std::vector<char>().swap(buffer);
+	readerIndex = kCheapPrepend;
+	writerIndex = kCheapPrepend;
+}
 
 ssize_t Buffer::readFd(int32_t fd, int32_t *saveErrno)
 {
-	char extrabuf[65536];
+	static thread_local char extrabuf[65536];
 	IOV_TYPE vec[2];
-	const int32_t writable = writableBytes();
+	const int32_t writable = buffer.empty() ? 0 : writableBytes();
 #ifdef _WIN64
 	vec[0].buf = begin() + writerIndex;
 	vec[0].len = writable;
@@ -37,7 +58,10 @@ ssize_t Buffer::readFd(int32_t fd, int32_t *saveErrno)
 	}
 	else
 	{
-		writerIndex = buffer.size();
+		if (!buffer.empty())
+		{
+			writerIndex = buffer.size();
+		}
 		append(extrabuf, n - writable);
 	}
 	return  n;
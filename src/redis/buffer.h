@@ -3,6 +3,7 @@
 #include "util.h"
 #include "socket.h"
 
+class BufferPool;
 class Buffer
 {
 public:
@@ -356,6 +357,8 @@ public:
 		return buffer.capacity();
 	}
 
+	void acquire(BufferPool *pool);
+	void release(BufferPool *pool);
 	ssize_t readFd(int32_t fd, int32_t *savedErrno);
 
 private:
@@ -364,7 +367,7 @@ private:
 
 	char *begin()
 	{
-		return &*buffer.begin();
+		return buffer.data();
 	}
 
 	char *prepeek()
@@ -374,7 +377,7 @@ private:
 
 	const char *begin() const
 	{
-		return &*buffer.begin();
+		return buffer.data();
 	}
 
 	void makeSpace(int32_t len)
@@ -406,6 +409,51 @@ private:
 	static const char CONTENT[];
 };
 
+class BufferPool
+{
+public:
+	static const int32_t kChunkSize = Buffer::kCheapPrepend + Buffer::kInitialSize;
+	static const int32_t kMaxChunks = 4096;
+
+	BufferPool()
+		:idleChunks(0),
+		clientBytes(0)
+	{
+
+	}
 
+	std::vector<char> acquire()
+	{
+		if (chunks.empty())
+		{
+			return std::vector<char>(kChunkSize);
+		}
 
+		std::vector<char> chunk(std::move(chunks.back()));
+		chunks.pop_back();
+		idleChunks = chunks.size();
+		return chunk;
+	}
 
+	void release(std::vector<char> &&chunk)
+	{
+		if (chunk.size() == kChunkSize && chunk.capacity() == kChunkSize
+			&& chunks.size() < kMaxChunks)
+		{
+			chunks.push_back(std::move(chunk));
+			idleChunks = chunks.size();
+		}
+	}
+
+	int64_t idleBytes() const { return int64_t(idleChunks) * kChunkSize; }
+	int64_t getClientBytes() const { return clientBytes; }
+	void setClientBytes(int64_t bytes) { clientBytes = bytes; }
+
+private:
+	BufferPool(const BufferPool&);
+	void operator=(const BufferPool&);
+
+	std::vector<std::vector<char>> chunks;
+	std::atomic<int32_t> idleChunks;
+	std::atomic<int64_t> clientBytes;
+};
@@ -18,6 +18,7 @@ class Channel;
 class TimerQueue;
 class Poll;
 class Epoll;
+class IoUring;
 class Thread;
 class RedisObject;
 class RedisReply;
@@ -56,6 +57,7 @@ typedef std::shared_ptr<Channel> ChannelPtr;
 typedef std::shared_ptr<TimerQueue> TimerQueuePtr;
 typedef std::shared_ptr<Poll> PollPtr;
 typedef std::shared_ptr<Epoll> EpollPtr;
+typedef std::shared_ptr<IoUring> IoUringPtr;
 typedef std::shared_ptr<Select> SelectPtr;
 typedef std::shared_ptr<Thread> ThreadPtr;
 typedef std::function<void()> TimerCallback;
@@ -11,9 +11,12 @@ Channel::Channel(EventLoop *loop, int32_t fd)
 	events(0),
 	revents(0),
 	index(-1),
+	sent(0),
 	tied(false),
 	eventHandling(false),
-	addedToLoop(false)
+	addedToLoop(false),
+	edgeTriggered(false),
+	sendDone(false)
 {
 
 }
@@ -76,7 +79,30 @@ void Channel::handleEventWithGuard()
 	const int POLLRDHUP = 0;
 #endif
 
-	if (revents & (POLLIN | POLLPRI | POLLRDHUP))
+	if (sendDone)
+	{
+		sendDone = false;
+		if (sendCallback)
+		{
+			sendCallback();
+		}
+	}
+
+	if (!accepted.empty())
+	{
+		if (acceptCallback)
+		{
+			acceptCallback();
+		}
+	}
+	else if (!received.empty())
+	{
+		if (recvCallback)
+		{
+			recvCallback();
+		}
+	}
+	else if (revents & (POLLIN | POLLPRI | POLLRDHUP))
 	{
 		if (readCallback)
 		{
@@ -109,6 +135,8 @@ void Channel::handleEvent()
 	{
 		handleEventWithGuard();
 	}
+	received.clear();
+	accepted.clear();
 }
 
 void Channel::setTie(const std::shared_ptr<void> &obj)
@@ -5,12 +5,14 @@ class Channel
 {
 public:
 	typedef std::function<void()> EventCallback;
+	typedef std::vector<std::pair<const char*, ssize_t>> ReceivedList;
 	Channel(EventLoop *loop, int32_t fd);
 	~Channel();
 
 	void handleEvent();
 	void setTie(const std::shared_ptr<void> &);
 	void setRevents(int32_t revt) { revents = revt; }
+	void addRevents(int32_t revt) { revents |= revt; }
 	void setEvents(int32_t revt) { events = revt; }
 	void setIndex(int32_t idx) { index = idx; }
 
@@ -34,6 +36,44 @@ public:
 		errorCallback = std::move(cb);
 	}
 
+	/* Pollers that receive data themselves (io_uring multishot recv) hand
+	 * it over as chunks instead of reporting readability, a chunk of 0 is
+	 * EOF and a negative one is -errno. The chunks live until the next
+	 * poll. */
+	void setRecvCallback(const EventCallback &&cb)
+	{
+		recvCallback = std::move(cb);
+	}
+
+	bool hasRecvCallback() const { return recvCallback != nullptr; }
+	void addReceived(const char *data, ssize_t n) { received.push_back(std::make_pair(data, n)); }
+	const ReceivedList &getReceived() const { return received; }
+
+	/* Likewise a listening socket may get its connections already accepted. */
+	void setAcceptCallback(const EventCallback &&cb)
+	{
+		acceptCallback = std::move(cb);
+	}
+
+	bool hasAcceptCallback() const { return acceptCallback != nullptr; }
+	void addAccepted(int32_t connfd) { accepted.push_back(connfd); }
+	const std::vector<int32_t> &getAccepted() const { return accepted; }
+
+	/* Pollers that send themselves report what the queued send wrote, a
+	 * negative count is -errno. */
+	void setSendCallback(const EventCallback &&cb)
+	{
+		sendCallback = std::move(cb);
+	}
+
+	void setSent(ssize_t n) { sent = n; sendDone = true; }
+	ssize_t getSent() const { return sent; }
+
+	/* The read handler consumes everything available, so readiness may be
+	 * reported edge triggered. */
+	void setEdgeTriggered(bool on) { edgeTriggered = on; }
+	bool isEdgeTriggered() const { return edgeTriggered; }
+
 	bool readEnabled() { return events & kReadEvent; }
 	bool writeEnabled() { return events & kWriteEvent; }
 	bool isNoneEvent() const { return events == kNoneEvent; }
@@ -64,6 +104,11 @@ private:
 	EventCallback writeCallback;
 	EventCallback closeCallback;
 	EventCallback errorCallback;
+	EventCallback recvCallback;
+	EventCallback acceptCallback;
+	EventCallback sendCallback;
+	ReceivedList received;
+	std::vector<int32_t> accepted;
 
 	static const int kNoneEvent;
 	static const int kReadEvent;
@@ -74,10 +119,13 @@ private:
 	int32_t events;
 	int32_t revents;
 	int32_t index;
+	ssize_t sent;
 	bool tied;
 	bool eventHandling;
 	bool addedToLoop;
 	bool logHup;
+	bool edgeTriggered;
+	bool sendDone;
 	std::weak_ptr<void> tie;
 
 };
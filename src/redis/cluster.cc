@@ -7,9 +7,13 @@ Cluster::Cluster(Redis *redis)
 	:redis(redis),
 	state(true),
 	isConnect(false),
-	replyCount(0)
+	migrations(0),
+	imports(0),
+	slotEpoch(0),
+	publishedEpoch(0),
+	bus(redis, this)
 {
-
+	publishSlotTable();
 }
 
 Cluster::~Cluster()
@@ -29,92 +33,131 @@ void Cluster::cretateClusterNode(int32_t slot, const std::string &ip,
 	node.master = nullptr;
 	node.slaves = nullptr;
 	clusterSlotNodes.insert(std::make_pair(slot, node));
+	publishSlot(slot);
 }
 
-void Cluster::readCallback(const TcpConnectionPtr &conn, Buffer *buffer)
+/* Routes are few, one per node serving slots, and shared by its slots. */
+const ClusterRoute *Cluster::getRoute(ClusterSlotTable *table, const ClusterNode &node)
 {
-	while (buffer->readableBytes() > 0)
+	for (auto &it : table->routes)
 	{
-		if (!memcmp(buffer->peek(), shared.ok->ptr, sdslen(shared.ok->ptr)))
+		if (it->port == node.port && it->ip == node.ip)
 		{
-			LOG_INFO << "reply to cluster ok";
-			std::unique_lock <std::mutex> lck(redis->getClusterMutex());
-			auto &clusterConn = redis->getClusterConn();
-			if (++replyCount == clusterConn.size())
-			{
-				redis->clusterRepliMigratEnabled = false;
-				if (redis->clusterMigratCached.readableBytes() > 0)
-				{
-					if (conn->connected())
-					{
-						conn->send(&redis->clusterMigratCached);
-					}
+			return it.get();
+		}
+	}
 
-					Buffer buffer;
-					buffer.swap(redis->clusterMigratCached);
-				}
+	std::shared_ptr<ClusterRoute> route(new ClusterRoute());
+	route->ip = node.ip;
+	route->port = node.port;
+	route->myself = (node.ip == redis->getIp() && node.port == redis->getPort());
+	route->moved = " " + node.ip + ":" + std::to_string(node.port) + "\r\n";
+	table->routes.push_back(route);
+	return route.get();
+}
 
-				replyCount = 0;
+void Cluster::storeSlotTable(const ClusterSlotTablePtr &table)
+{
+	std::atomic_store(&slotTable, table);
+	publishedEpoch.store(table->epoch, std::memory_order_release);
+}
 
-				for (auto &it : clusterConn)
-				{
-					SessionPtr session(new Session(redis, conn));
-					std::unique_lock <std::mutex> lck(redis->getMutex());
-					auto &sessions = redis->getSession();
-					sessions[conn->getSockfd()] = session;
-					auto &sessionConns = redis->getSessionConn();
-					sessionConns[conn->getSockfd()] = conn;
-				}
+/* Called with the cluster mutex held after a change of many slots. */
+void Cluster::publishSlotTable()
+{
+	ClusterSlotTablePtr table(new ClusterSlotTable());
+	table->epoch = ++slotEpoch;
+	table->assigned = 0;
+	for (int32_t i = 0; i < ClusterSlotTable::kChunks; i++)
+	{
+		table->chunks[i].reset(new ClusterSlotChunk());
+		memset(table->chunks[i]->slots, 0, sizeof(table->chunks[i]->slots));
+	}
 
-				char buf[64] = "";
-				uint16_t port = 0;
-				auto addr = Socket::getPeerAddr(conn->getSockfd());
-				Socket::toIp(buf, sizeof(buf), (const struct sockaddr *)&addr);
-				Socket::toPort(&port, (const struct sockaddr *)&addr);
+	for (auto &it : clusterSlotNodes)
+	{
+		if (it.first < 0 || it.first >= CLUSTER_SLOTS)
+		{
+			continue;
+		}
 
-				std::string ip = buf;
-				std::string ipPort = ip + "::" + std::to_string(port);
+		table->chunks[it.first / ClusterSlotChunk::kSlots]->slots[it.first % ClusterSlotChunk::kSlots] =
+			getRoute(table.get(), it.second);
+		table->assigned++;
+	}
 
-				for (auto &it : slotSets)
-				{
-					auto iter = clusterSlotNodes.find(it);
-					if (iter != clusterSlotNodes.end())
-					{
-						iter->second.ip = ip;
-						iter->second.port = port;
-					}
-					else
-					{
-						LOG_WARN << "slot not found error";
-					}
+	storeSlotTable(table);
+}
 
-				}
+void Cluster::publishSlot(int32_t slot)
+{
+	publishSlots(std::vector<int32_t>(1, slot));
+}
 
-				auto &redisShards = redis->getRedisShards();
-				for (auto &it : redisShards)
-				{
-					auto &mu = it.mtx;
-					auto &map = it.redisMap;
-					std::unique_lock <std::mutex> lck(mu);
+/* Called with the cluster mutex held after a change of some slots, once per
+ * command or bus packet. Writers are serialized by the mutex, so the current
+ * table is read as is. */
+void Cluster::publishSlots(const std::vector<int32_t> &slots)
+{
+	if (slotTable == nullptr)
+	{
+		publishSlotTable();
+		return;
+	}
 
-					for (auto &iter : map)
-					{
-						if (iter->type == OBJ_STRING)
-						{
+	ClusterSlotTablePtr table(new ClusterSlotTable(*slotTable));
+	table->epoch = ++slotEpoch;
 
-						}
-					}
-				}
-				migratingSlosTos.erase(ipPort);
-				clear();
-				LOG_INFO << "cluster migrate success " << ip << " " << port;
-			}
+	bool copied[ClusterSlotTable::kChunks] = { false };
+	for (auto &slot : slots)
+	{
+		if (slot < 0 || slot >= CLUSTER_SLOTS)
+		{
+			continue;
 		}
-		else
+
+		const ClusterRoute *route = nullptr;
+		auto it = clusterSlotNodes.find(slot);
+		if (it != clusterSlotNodes.end())
+		{
+			route = getRoute(table.get(), it->second);
+		}
+
+		int32_t chunk = slot / ClusterSlotChunk::kSlots;
+		if (!copied[chunk])
+		{
+			table->chunks[chunk].reset(new ClusterSlotChunk(*table->chunks[chunk]));
+			copied[chunk] = true;
+		}
+
+		const ClusterRoute *&old = table->chunks[chunk]->slots[slot % ClusterSlotChunk::kSlots];
+		table->assigned += (route != nullptr) - (old != nullptr);
+		old = route;
+	}
+	storeSlotTable(table);
+}
+
+const ClusterSlotTablePtr &Cluster::getSlotTable()
+{
+	thread_local ClusterSlotTablePtr table;
+	if (table == nullptr || table->epoch != publishedEpoch.load(std::memory_order_acquire))
+	{
+		table = std::atomic_load(&slotTable);
+	}
+	return table;
+}
+
+void Cluster::readCallback(const TcpConnectionPtr &conn, Buffer *buffer)
+{
+	while (buffer->readableBytes() > 0)
+	{
+		if (memcmp(buffer->peek(), shared.ok->ptr, sdslen(shared.ok->ptr)))
 		{
 			conn->forceClose();
 			break;
 		}
+
+		LOG_INFO << "reply to cluster ok";
 		buffer->retrieve(sdslen(shared.ok->ptr));
 	}
 }
@@ -154,6 +197,17 @@ void Cluster::clusterRedirectClient(const TcpConnectionPtr &conn, const SessionP
 	}
 }
 
+void Cluster::clusterRedirectMoved(const TcpConnectionPtr &conn,
+	const ClusterRoute *route, int32_t hashSlot)
+{
+	char buf[32];
+	int32_t len = ll2string(buf, sizeof(buf), hashSlot);
+	Buffer *buffer = conn->outputBuffer();
+	buffer->append("-MOVED ", 7);
+	buffer->append(buf, len);
+	buffer->append(route->moved.data(), route->moved.size());
+}
+
 
 void Cluster::syncClusterSlot()
 {
@@ -244,112 +298,10 @@ bool Cluster::getKeySlot(const std::string &name)
 
 void Cluster::clear()
 {
-	clusterDelCopys.clear();
-	clusterDelKeys.clear();
-	slotSets.clear();
 	redisCommands.clear();
 	buffer.retrieveAll();
 }
 
-bool Cluster::replicationToNode(const std::deque<RedisObjectPtr> &obj, const SessionPtr &session,
-	const std::string &ip, int16_t port, int8_t copy, int8_t replace, int32_t numKeys, int32_t firstKey)
-{
-	clear();
-
-	TcpConnectionPtr conn;
-	int8_t count = 0;
-
-	{
-		std::unique_lock <std::mutex> lck(redis->getClusterMutex());
-		auto &clusterConn = redis->getClusterConn();
-		for (auto &it : clusterConn)
-		{
-			char buf[64] = "";
-			uint16_t p = 0;
-			auto addr = Socket::getPeerAddr(it.second->getSockfd());
-			Socket::toIp(buf, sizeof(buf), (const struct sockaddr *)&addr);
-			Socket::toPort(&p, (const struct sockaddr *)&addr);
-
-			if (memcmp(ip.c_str(),buf,ip.size()) == 0 && p == port)
-			{
-				conn = it.second;
-				count++;
-			}
-		}
-
-		for (auto &it : clusterSlotNodes)
-		{
-			if (it.second.ip == ip && it.second.port == port)
-			{
-				std::string nodeName = it.second.name;
-				auto it = migratingSlosTos.find(std::move(nodeName));
-				if (it != migratingSlosTos.end())
-				{
-					slotSets = it->second;
-					count++;
-				}
-			}
-		}
-	}
-
-	if (count != 2)
-	{
-		return false;
-	}
-
-	if (copy == 0)
-	{
-		std::unique_lock <std::mutex> lck(redis->getClusterMutex());
-		for (int j = 0; j < numKeys; j++)
-		{
-			clusterDelKeys.push_back(
-				createRawStringObject(obj[firstKey + j]->type,
-					obj[firstKey + j]->ptr, sdslen(obj[firstKey + j]->ptr)));
-		}
-	}
-
-	if (!strcmp(obj[2]->ptr, ""))
-	{
-		std::unique_lock <std::mutex> lck(redis->getClusterMutex());
-		for (auto &it : clusterDelKeys)
-		{
-			char *key = it->ptr;
-			int32_t hashslot = keyHashSlot(key, sdslen(key));
-			auto iter = slotSets.find(hashslot);
-			if (iter == slotSets.end())
-			{
-				return false;
-			}
-
-			const RedisObjectPtr & dump = redis->createDumpPayload(it);
-			if (dump == nullptr)
-			{
-				return false;
-			}
-			conn->sendPipe(dump->ptr);
-		}
-	}
-	else
-	{
-		std::unique_lock <std::mutex> lck(redis->getClusterMutex());
-		char *key = obj[2]->ptr;
-		int32_t hashslot = keyHashSlot(key, sdslen(key));
-		auto iter = slotSets.find(hashslot);
-		if (iter == slotSets.end())
-		{
-			return false;
-		}
-
-		const RedisObjectPtr &dump = redis->createDumpPayload(obj[2]);
-		if (dump == nullptr)
-		{
-			return false;
-		}
-		conn->sendPipe(dump->ptr);
-	}
-	return true;
-}
-
 void Cluster::connCallback(const TcpConnectionPtr &conn)
 {
 	if (conn->connected())
@@ -409,7 +361,6 @@ void Cluster::connCallback(const TcpConnectionPtr &conn)
 			std::unique_lock <std::mutex> lck(redis->getClusterMutex());
 			redis->getClusterConn().erase(conn->getSockfd());
 
-			eraseClusterNode(ip, p);
 			migratingSlosTos.erase(ip + std::to_string(p));
 			importingSlotsFroms.erase(ip + std::to_string(p));
 
@@ -469,125 +420,32 @@ void Cluster::delSlotDeques(const RedisObjectPtr &obj, int32_t slot)
 	redisCommands.push_back(shared.delsync);
 	redisCommands.push_back(createStringObject(obj->ptr, sdslen(obj->ptr)));
 	clusterSlotNodes.erase(slot);
+	publishSlot(slot);
 }
 
 sds Cluster::showClusterNodes()
 {
-	sds ci = sdsempty(), ni = sdsempty();
-	{
-		std::unique_lock <std::mutex> lck(redis->getClusterMutex());
-		for (auto &it : clusterSlotNodes)
-		{
-			ni = sdscatprintf(sdsempty(), "%s %s:%d slot:",
-				it.second.name.c_str(), it.second.ip.c_str(), it.second.port);
-			ci = sdscatsds(ci, ni);
-			sdsfree(ni);
-			ni = sdscatprintf(sdsempty(), "%d ", it.first);
-			ci = sdscatsds(ci, ni);
-			sdsfree(ni);
-			ci = sdscatlen(ci, "\n", 1);
-		}
-	}
-
-	ci = sdscatlen(ci, "\n", 1);
-	return ci;
+	return bus.showNodes();
 }
 
 void Cluster::getKeyInSlot(int32_t hashslot, std::vector<RedisObjectPtr> &keys, int32_t count)
 {
-	int32_t j = 0;
 	auto &redisShards = redis->getRedisShards();
 	for (auto &it : redisShards)
 	{
-		auto &mu = it.mtx;
-		auto &map = it.redisMap;
-		auto &stringMap = it.stringMap;
-		auto &hashMap = it.hashMap;
-		auto &zsetMap = it.zsetMap;
-		auto &setMap = it.setMap;
-		auto &listMap = it.listMap;
+		std::unique_lock <std::mutex> lck(it.mtx);
+		auto iter = it.slotKeys.find(hashslot);
+		if (iter == it.slotKeys.end())
+		{
+			continue;
+		}
 
-		std::unique_lock <std::mutex> lck(mu);
-		for (auto &iter : map)
+		for (auto &key : iter->second)
 		{
-			if (iter->type == OBJ_STRING)
+			keys.push_back(createRawStringObject(key->type, key->ptr, sdslen(key->ptr)));
+			if (--count == 0)
 			{
-				auto iterr = stringMap.find(iter);
-				assert(iterr != stringMap.end());
-				assert(iterr->first->type == iter->type);
-				uint32_t slot = keyHashSlot(iter->ptr, sdslen(iter->ptr));
-				if (slot == hashslot)
-				{
-					keys.push_back(createRawStringObject(OBJ_STRING, iter->ptr, sdslen(iter->ptr)));
-					if (--count == 0)
-					{
-						return;
-					}
-				}
-			}
-			else if (iter->type == OBJ_HASH)
-			{
-				auto iterr = hashMap.find(iter);
-				assert(iterr != hashMap.end());
-				assert(iterr->first->type == iter->type);
-				uint32_t slot = keyHashSlot(iter->ptr, sdslen(iter->ptr));
-				if (slot == hashslot)
-				{
-					keys.push_back(createRawStringObject(OBJ_HASH, iter->ptr, sdslen(iter->ptr)));
-					if (--count == 0)
-					{
-						return;
-					}
-				}
-			}
-			else if (iter->type == OBJ_LIST)
-			{
-				auto iterr = listMap.find(iter);
-				assert(iterr != listMap.end());
-				assert(iterr->first->type == iter->type);
-				uint32_t slot = keyHashSlot(iter->ptr, sdslen(iter->ptr));
-				if (slot == hashslot)
-				{
-					keys.push_back(createRawStringObject(OBJ_LIST, iter->ptr, sdslen(iter->ptr)));
-					if (--count == 0)
-					{
-						return;
-					}
-				}
-			}
-			else if (iter->type == OBJ_ZSET)
-			{
-				auto iterr = zsetMap.find(iter);
-				assert(iterr != zsetMap.end());
-				assert(iterr->first->type == iter->type);
-				uint32_t slot = keyHashSlot(iter->ptr, sdslen(iter->ptr));
-				if (slot == hashslot)
-				{
-					keys.push_back(createRawStringObject(OBJ_ZSET, iter->ptr, sdslen(iter->ptr)));
-					if (--count == 0)
-					{
-						return;
-					}
-				}
-			}
-			else if (iter->type == OBJ_SET)
-			{
-				auto iterr = setMap.find(iter);
-				assert(iterr != setMap.end());
-				assert(iterr->first->type == iter->type);
-				uint32_t slot = keyHashSlot(iter->ptr, sdslen(iter->ptr));
-				if (slot == hashslot)
-				{
-					keys.push_back(createRawStringObject(OBJ_SET, iter->ptr, sdslen(iter->ptr)));
-					if (--count == 0)
-					{
-						return;
-					}
-				}
-			}
-			else
-			{
-				assert(false);
+				return;
 			}
 		}
 	}
@@ -598,6 +456,7 @@ void Cluster::eraseClusterNode(int32_t slot)
 	auto it = clusterSlotNodes.find(slot);
 	assert(it != clusterSlotNodes.end());
 	clusterSlotNodes.erase(slot);
+	publishSlot(slot);
 }
 
 void Cluster::eraseClusterNode(const std::string &ip, int16_t port)
@@ -612,6 +471,7 @@ void Cluster::eraseClusterNode(const std::string &ip, int16_t port)
 
 		++it;
 	}
+	publishSlotTable();
 }
 
 bool Cluster::connSetCluster(const char *ip, int16_t port)
@@ -633,6 +493,10 @@ void Cluster::connectCluster()
 {
 	EventLoop loop;
 	this->loop = &loop;
+	if (redis->clusterEnabled)
+	{
+		bus.start(&loop);
+	}
 	loop.run();
 }
 
@@ -641,6 +505,484 @@ void Cluster::reconnectTimer(const std::any &context)
 	LOG_INFO << "reconnect cluster";
 }
 
+void Cluster::startMigrate(const MigrateJobPtr &job,
+	const SessionPtr &session, const TcpConnectionPtr &conn)
+{
+	job->session = session;
+	job->conn = conn;
+	migrations++;
+	loop->runInLoop(std::bind(&Cluster::migrateConnect, this, job));
+}
+
+/* Called with the cluster mutex held, a slot is moved by one job at a time. */
+bool Cluster::addSlotMigration(const MigrateJobPtr &job)
+{
+	auto it = slotMigrations.find(job->slot);
+	if (it != slotMigrations.end())
+	{
+		return false;
+	}
+
+	slotMigrations.insert(std::make_pair(job->slot, job));
+	return true;
+}
+
+/* Called with the cluster mutex held. */
+ClusterNode *Cluster::getMigratingNode(int32_t slot)
+{
+	auto it = slotMigrations.find(slot);
+	if (it == slotMigrations.end())
+	{
+		return nullptr;
+	}
+	return &(it->second->node);
+}
+
+bool Cluster::checkKeyMigrating(const RedisObjectPtr &key)
+{
+	if (migrations == 0)
+	{
+		return false;
+	}
+
+	std::unique_lock <std::mutex> lck(migrateMutex);
+	return migratingKeys.find(key) != migratingKeys.end();
+}
+
+bool Cluster::markMigrating(const RedisObjectPtr &key)
+{
+	std::unique_lock <std::mutex> lck(migrateMutex);
+	return migratingKeys.insert(key).second;
+}
+
+void Cluster::unmarkMigrating(const RedisObjectPtr &key)
+{
+	std::unique_lock <std::mutex> lck(migrateMutex);
+	migratingKeys.erase(key);
+}
+
+/* Called with the cluster mutex held. */
+bool Cluster::setSlotImporting(int32_t slot)
+{
+	if (!importSlots.insert(slot).second)
+	{
+		return false;
+	}
+
+	imports++;
+	return true;
+}
+
+/* Called with the cluster mutex held. */
+void Cluster::setSlotStable(int32_t slot)
+{
+	if (importSlots.erase(slot) > 0)
+	{
+		imports--;
+	}
+}
+
+/* Called with the cluster mutex held. A slot handed to this node is claimed
+ * on the bus under a new config epoch, so the other nodes take it over from
+ * the old owner. */
+void Cluster::setSlotNode(int32_t slot, const std::string &ip, int16_t port)
+{
+	setSlotStable(slot);
+	bool myself = (ip == redis->getIp() && port == redis->getPort());
+	const std::string &name = myself ? bus.getName() : std::string();
+	ClusterNode *node = checkClusterSlot(slot);
+	if (node == nullptr)
+	{
+		cretateClusterNode(slot, ip, port, name);
+	}
+	else
+	{
+		node->ip = ip;
+		node->port = port;
+		node->name = name;
+		publishSlot(slot);
+	}
+
+	if (myself)
+	{
+		bus.claimSlots();
+	}
+}
+
+bool Cluster::checkSlotImporting(int32_t slot)
+{
+	if (imports == 0)
+	{
+		return false;
+	}
+
+	std::unique_lock <std::mutex> lck(redis->getClusterMutex());
+	return importSlots.find(slot) != importSlots.end();
+}
+
+void Cluster::migrateConnect(const MigrateJobPtr &job)
+{
+	std::weak_ptr<MigrateJob> weakJob(job);
+	TcpClientPtr client(new TcpClient(loop, job->node.ip.c_str(), job->node.port, nullptr));
+	client->setConnectionCallback(std::bind(&Cluster::migrateConnCallback,
+		this, weakJob, std::placeholders::_1));
+	client->setMessageCallback(std::bind(&Cluster::migrateReadCallback,
+		this, weakJob, std::placeholders::_1, std::placeholders::_2));
+	client->connect();
+
+	job->client = client;
+	job->lastIo = mstime();
+	job->timer = loop->runAfter(job->timeout / 1000.0, true,
+		std::bind(&Cluster::migrateTimeout, this, weakJob));
+	migrateJobs.insert(job);
+}
+
+void Cluster::migrateConnCallback(const std::weak_ptr<MigrateJob> &weakJob,
+	const TcpConnectionPtr &conn)
+{
+	MigrateJobPtr job = weakJob.lock();
+	if (job == nullptr || job->done)
+	{
+		return;
+	}
+
+	if (conn->connected())
+	{
+		Socket::setTcpNoDelay(conn->getSockfd(), true);
+		job->target = conn;
+		job->lastIo = mstime();
+
+		if (!job->password.empty())
+		{
+			std::deque<RedisObjectPtr> commands;
+			commands.push_back(shared.auth);
+			commands.push_back(createStringObject((char*)job->password.data(),
+				job->password.size()));
+			redis->structureRedisProtocol(job->output, commands);
+			job->inflight.push_back(std::make_pair(nullptr, 0));
+		}
+
+		if (job->slot >= 0)
+		{
+			migrateSetSlot(job, "importing", std::string(), 0);
+		}
+		migratePump(job);
+	}
+	else
+	{
+		migrateFinish(job, "IOERR error or timeout reading to target instance");
+	}
+}
+
+void Cluster::migrateTimeout(const std::weak_ptr<MigrateJob> &weakJob)
+{
+	MigrateJobPtr job = weakJob.lock();
+	if (job == nullptr || job->done)
+	{
+		return;
+	}
+
+	if (mstime() - job->lastIo >= job->timeout)
+	{
+		migrateFinish(job, job->target == nullptr ?
+			"IOERR error or timeout connecting to the client" :
+			"IOERR error or timeout reading to target instance");
+	}
+}
+
+/* Every reply settles the oldest RESTORE in flight. The keys the target took
+ * are dropped before they are unmarked, a write coming after finds them gone
+ * and, for a slot, is asked of the target. */
+void Cluster::migrateReadCallback(const std::weak_ptr<MigrateJob> &weakJob,
+	const TcpConnectionPtr &conn, Buffer *buffer)
+{
+	MigrateJobPtr job = weakJob.lock();
+	if (job == nullptr || job->done)
+	{
+		buffer->retrieveAll();
+		return;
+	}
+
+	job->lastIo = mstime();
+	std::vector<RedisObjectPtr> restored;
+	std::string err;
+	const char *crlf;
+	while (!job->inflight.empty() && (crlf = buffer->findCRLF()) != nullptr)
+	{
+		auto front = job->inflight.front();
+		job->inflight.pop_front();
+		job->inflightBytes -= front.second;
+
+		if (buffer->peek()[0] != '+')
+		{
+			err = "ERR Target instance replied with error: " +
+				std::string(buffer->peek() + 1, crlf);
+			buffer->retrieveUntil(crlf + 2);
+			if (front.first != nullptr)
+			{
+				unmarkMigrating(front.first);
+			}
+			break;
+		}
+
+		buffer->retrieveUntil(crlf + 2);
+		if (front.first != nullptr)
+		{
+			restored.push_back(front.first);
+		}
+	}
+
+	if (!job->copy && !restored.empty())
+	{
+		redis->removeMigratedKeys(restored);
+	}
+
+	for (auto &it : restored)
+	{
+		unmarkMigrating(it);
+	}
+
+	job->moved += restored.size();
+	if (!err.empty())
+	{
+		migrateFinish(job, err);
+		return;
+	}
+	migratePump(job);
+}
+
+/* Fills the window with RESTOREs and writes them out at once. */
+void Cluster::migratePump(const MigrateJobPtr &job)
+{
+	if (job->target == nullptr)
+	{
+		return;
+	}
+
+	while (!job->handoff && job->inflight.size() < CLUSTER_MIGRATE_PIPELINE &&
+		job->inflightBytes < CLUSTER_MIGRATE_PIPELINE_BYTES)
+	{
+		if (job->keys.empty())
+		{
+			migrateScanSlot(job);
+			if (job->keys.empty() && !migrateNextPass(job))
+			{
+				break;
+			}
+			continue;
+		}
+
+		RedisObjectPtr key = job->keys.front();
+		job->keys.pop_front();
+		if (!markMigrating(key))
+		{
+			continue;
+		}
+
+		RedisObjectPtr payload = redis->createDumpPayload(key);
+		if (payload == nullptr)
+		{
+			unmarkMigrating(key);
+			continue;
+		}
+
+		int64_t ttl = 0;
+		int64_t when = redis->getExpire(key);
+		if (when != -1)
+		{
+			ttl = std::max<int64_t>((when - ustime()) / 1000, 1);
+		}
+
+		std::deque<RedisObjectPtr> commands;
+		if (job->slot >= 0)
+		{
+			commands.push_back(shared.asking);
+			redis->structureRedisProtocol(job->output, commands);
+			job->inflight.push_back(std::make_pair(nullptr, 0));
+			commands.clear();
+		}
+
+		commands.push_back(shared.restore);
+		commands.push_back(key);
+		commands.push_back(createObject(REDIS_STRING, sdsfromlonglong(ttl)));
+		commands.push_back(payload);
+		if (job->replace)
+		{
+			commands.push_back(shared.replace);
+		}
+		redis->structureRedisProtocol(job->output, commands);
+
+		size_t bytes = sdslen(payload->ptr);
+		job->inflight.push_back(std::make_pair(key, bytes));
+		job->inflightBytes += bytes;
+	}
+
+	/* Every key is over, the target takes the slot, or leaves it be after
+	 * a COPY, before the job is done. */
+	if (job->inflight.empty() && job->slot >= 0 && !job->handoff)
+	{
+		job->handoff = true;
+		if (job->copy)
+		{
+			migrateSetSlot(job, "stable", std::string(), 0);
+		}
+		else
+		{
+			migrateSetSlot(job, "node", job->node.ip, job->node.port);
+		}
+	}
+
+	if (job->output.readableBytes() > 0)
+	{
+		job->target->send(&job->output);
+		job->output.retrieveAll();
+	}
+
+	if (job->inflight.empty())
+	{
+		migrateFinish(job, "");
+	}
+}
+
+/* Collects the keys of the slot shard by shard from the cursor on, only
+ * the keys each shard indexed under the slot are gone over. */
+void Cluster::migrateScanSlot(const MigrateJobPtr &job)
+{
+	if (job->slot < 0)
+	{
+		return;
+	}
+
+	auto &redisShards = redis->getRedisShards();
+	size_t count = job->keys.size();
+	while (job->keys.size() < CLUSTER_MIGRATE_PIPELINE && job->cursorShard < Redis::kShards)
+	{
+		auto &shard = redisShards[job->cursorShard++];
+		std::unique_lock <std::mutex> lck(shard.mtx);
+		auto it = shard.slotKeys.find(job->slot);
+		if (it == shard.slotKeys.end())
+		{
+			continue;
+		}
+
+		for (auto &iter : it->second)
+		{
+			job->keys.push_back(createStringObject(iter->ptr, sdslen(iter->ptr)));
+		}
+	}
+	job->passKeys += job->keys.size() - count;
+}
+
+/* Once a pass is through and settled, another one goes over the slot for
+ * keys written meanwhile, until one finds none. */
+bool Cluster::migrateNextPass(const MigrateJobPtr &job)
+{
+	if (job->slot < 0 || job->cursorShard < Redis::kShards || !job->inflight.empty())
+	{
+		return false;
+	}
+
+	if (job->copy || job->passKeys == 0)
+	{
+		return false;
+	}
+
+	LOG_INFO << "migrate slot " << job->slot << " pass " << job->passes
+		<< " keys " << job->passKeys;
+	job->passes++;
+	job->passKeys = 0;
+	job->cursorShard = 0;
+	return true;
+}
+
+/* Queues CLUSTER SETSLOT <slot> <state> [ip port] for the target, its reply
+ * is settled like the one of a RESTORE. */
+void Cluster::migrateSetSlot(const MigrateJobPtr &job, const char *state,
+	const std::string &ip, int16_t port)
+{
+	std::deque<RedisObjectPtr> commands;
+	commands.push_back(shared.cluster);
+	commands.push_back(shared.setslot);
+	commands.push_back(createObject(REDIS_STRING, sdsfromlonglong(job->slot)));
+	commands.push_back(createObject(REDIS_STRING, sdsnew(state)));
+	if (!ip.empty())
+	{
+		commands.push_back(createStringObject((char*)ip.data(), ip.size()));
+		commands.push_back(createObject(REDIS_STRING, sdsfromlonglong(port)));
+	}
+	redis->structureRedisProtocol(job->output, commands);
+	job->inflight.push_back(std::make_pair(nullptr, 0));
+}
+
+void Cluster::migrateFinish(const MigrateJobPtr &job, const std::string &err)
+{
+	job->done = true;
+	loop->cancelAfter(job->timer);
+	for (auto &it : job->inflight)
+	{
+		if (it.first != nullptr)
+		{
+			unmarkMigrating(it.first);
+		}
+	}
+	job->inflight.clear();
+	migrations--;
+
+	/* The target leaves importing state, as far as it can still be told. */
+	if (!err.empty() && job->slot >= 0 && job->target != nullptr && job->target->connected())
+	{
+		job->output.retrieveAll();
+		migrateSetSlot(job, "stable", std::string(), 0);
+		job->target->send(&job->output);
+		job->output.retrieveAll();
+	}
+
+	RedisObjectPtr reply;
+	if (!err.empty())
+	{
+		reply = createObject(REDIS_STRING, sdscatprintf(sdsempty(), "-%s\r\n", err.c_str()));
+		LOG_WARN << "migrate to " << job->node.ip << ":" << job->node.port << " " << err;
+	}
+	else if (job->slot >= 0)
+	{
+		reply = createObject(REDIS_STRING,
+			sdscatprintf(sdsempty(), ":%lld\r\n", (long long)job->moved));
+	}
+	else
+	{
+		reply = job->moved > 0 ? shared.ok : shared.nokey;
+	}
+
+	if (job->slot >= 0)
+	{
+		std::unique_lock <std::mutex> lck(redis->getClusterMutex());
+		slotMigrations.erase(job->slot);
+		/* From now on the slot is served by the target, clients get MOVED. */
+		if (err.empty() && !job->copy)
+		{
+			ClusterNode *node = checkClusterSlot(job->slot);
+			if (node != nullptr)
+			{
+				node->ip = job->node.ip;
+				node->port = job->node.port;
+				publishSlot(job->slot);
+			}
+		}
+
+		LOG_INFO << "migrate slot " << job->slot << " keys " << job->moved
+			<< " passes " << job->passes + 1;
+	}
+
+	job->conn->getLoop()->queueInLoop(std::bind(&Session::unblockReply,
+		job->session, job->conn, reply));
+
+	/* The client is dropped once the callback this runs in returned. */
+	loop->queueInLoop([this, job]
+	{
+		migrateJobs.erase(job);
+	});
+}
+
 
 
 
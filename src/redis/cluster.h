@@ -4,6 +4,7 @@
 #include "tcpclient.h"
 #include "socket.h"
 #include "session.h"
+#include "clusterbus.h"
 
 struct ClusterNode
 {
@@ -17,6 +18,108 @@ struct ClusterNode
 	struct ClusterNode *master;
 };
 
+/* Shared by every slot one node serves, a MOVED reply is "-MOVED <slot>"
+ * followed by the precomputed " ip:port\r\n". */
+struct ClusterRoute
+{
+	std::string ip;
+	int16_t port;
+	bool myself;
+	std::string moved;
+};
+
+/* A run of slots of the table, shared between tables while unchanged. */
+struct ClusterSlotChunk
+{
+	static const int32_t kSlots = 128;
+	const ClusterRoute *slots[kSlots];
+};
+
+typedef std::shared_ptr<ClusterSlotChunk> ClusterSlotChunkPtr;
+
+/* Dense slot to node table, published as a whole on every topology change
+ * so commands are routed without the cluster mutex, an old table stays valid
+ * as long as a reader holds it. A change copies the chunk pointers and only
+ * the chunks of the slots it touches, a bulk change rebuilds it from the
+ * slot map. */
+struct ClusterSlotTable
+{
+	static const int32_t kChunks = CLUSTER_SLOTS / ClusterSlotChunk::kSlots;
+	uint64_t epoch;
+	int32_t assigned;
+	std::vector<std::shared_ptr<ClusterRoute>> routes;
+	ClusterSlotChunkPtr chunks[kChunks];
+
+	const ClusterRoute *getSlot(int32_t slot) const
+	{
+		return chunks[slot / ClusterSlotChunk::kSlots]->slots[slot % ClusterSlotChunk::kSlots];
+	}
+};
+
+typedef std::shared_ptr<ClusterSlotTable> ClusterSlotTablePtr;
+
+/* One MIGRATE, or CLUSTER MIGRATESLOT when slot is set, run on the cluster
+ * loop. RESTOREs are pipelined to the target up to a window of keys and
+ * bytes, a slot is walked shard by shard from the cursor, pass after pass
+ * until one finds nothing left.
+ *
+ * A slot moves in four steps:
+ * 1. CLUSTER SETSLOT <slot> IMPORTING puts the target in importing state,
+ *    it serves the slot to clients that sent ASKING right before.
+ * 2. Keys still here are served here, a client asking for one that is gone
+ *    gets -ASK and retries on the target with ASKING.
+ * 3. Every RESTORE goes with ASKING, a key is dropped here once the target
+ *    took it.
+ * 4. CLUSTER SETSLOT <slot> NODE <ip> <port> hands the slot to the target,
+ *    which claims it on the bus under a new config epoch, then the slot
+ *    table here moves on and clients get -MOVED. A failed or COPY job
+ *    sends SETSLOT <slot> STABLE instead. */
+struct MigrateJob
+{
+	MigrateJob(const char *ip, int16_t port, int32_t slot)
+		:slot(slot),
+		timeout(CLUSTER_MIGRATE_DEFAULT_TIMEOUT),
+		copy(false),
+		replace(false),
+		done(false),
+		handoff(false),
+		inflightBytes(0),
+		cursorShard(0),
+		passKeys(0),
+		passes(0),
+		moved(0),
+		lastIo(0)
+	{
+		node.ip = ip;
+		node.port = port;
+	}
+
+	ClusterNode node;
+	int32_t slot;
+	int32_t timeout;
+	bool copy;
+	bool replace;
+	bool done;
+	bool handoff;
+	std::string password;
+	SessionPtr session;
+	TcpConnectionPtr conn;
+	TcpClientPtr client;
+	TcpConnectionPtr target;
+	TimerPtr timer;
+	Buffer output;
+	std::deque<RedisObjectPtr> keys;
+	std::deque<std::pair<RedisObjectPtr, size_t>> inflight;
+	size_t inflightBytes;
+	int32_t cursorShard;
+	int64_t passKeys;
+	int64_t passes;
+	int64_t moved;
+	int64_t lastIo;
+};
+
+typedef std::shared_ptr<MigrateJob> MigrateJobPtr;
+
 class Redis;
 class Cluster
 {
@@ -42,11 +145,27 @@ public:
 	void syncClusterSlot();
 	void clusterRedirectClient(const TcpConnectionPtr &conn, const SessionPtr &session,
 		ClusterNode *node, int32_t hashSlot, int32_t errCode);
-	bool replicationToNode(const std::deque<RedisObjectPtr> &obj,
-		const SessionPtr &session, const std::string &ip,
-		int16_t port, int8_t copy, int8_t replace, int32_t numKeys, int32_t firstKey);
+	void clusterRedirectMoved(const TcpConnectionPtr &conn,
+		const ClusterRoute *route, int32_t hashSlot);
 	void delClusterImport(std::deque<RedisObjectPtr> &robj);
 
+	void startMigrate(const MigrateJobPtr &job,
+		const SessionPtr &session, const TcpConnectionPtr &conn);
+	bool addSlotMigration(const MigrateJobPtr &job);
+	ClusterNode *getMigratingNode(int32_t slot);
+	bool checkKeyMigrating(const RedisObjectPtr &key);
+	bool hasMigrations() { return migrations > 0; }
+	bool setSlotImporting(int32_t slot);
+	void setSlotStable(int32_t slot);
+	void setSlotNode(int32_t slot, const std::string &ip, int16_t port);
+	bool checkSlotImporting(int32_t slot);
+
+	void publishSlotTable();
+	void publishSlot(int32_t slot);
+	void publishSlots(const std::vector<int32_t> &slots);
+	ClusterBus &getBus() { return bus; }
+	const ClusterSlotTablePtr &getSlotTable();
+
 	void eraseClusterNode(const std::string &ip, int16_t port);
 	void eraseClusterNode(int32_t slot);
 	void getKeyInSlot(int32_t slot, std::vector<RedisObjectPtr> &keys, int32_t count);
@@ -73,6 +192,23 @@ private:
 	Cluster(const Cluster&);
 	void operator=(const Cluster&);
 
+	void migrateConnect(const MigrateJobPtr &job);
+	void migrateConnCallback(const std::weak_ptr<MigrateJob> &weakJob,
+		const TcpConnectionPtr &conn);
+	void migrateReadCallback(const std::weak_ptr<MigrateJob> &weakJob,
+		const TcpConnectionPtr &conn, Buffer *buffer);
+	void migrateTimeout(const std::weak_ptr<MigrateJob> &weakJob);
+	void migratePump(const MigrateJobPtr &job);
+	void migrateScanSlot(const MigrateJobPtr &job);
+	bool migrateNextPass(const MigrateJobPtr &job);
+	void migrateFinish(const MigrateJobPtr &job, const std::string &err);
+	void migrateSetSlot(const MigrateJobPtr &job, const char *state,
+		const std::string &ip, int16_t port);
+	const ClusterRoute *getRoute(ClusterSlotTable *table, const ClusterNode &node);
+	void storeSlotTable(const ClusterSlotTablePtr &table);
+	bool markMigrating(const RedisObjectPtr &key);
+	void unmarkMigrating(const RedisObjectPtr &key);
+
 	EventLoop *loop;
 	Redis *redis;
 	std::atomic<bool> state;
@@ -81,12 +217,28 @@ private:
 	std::map<int32_t, ClusterNode> clusterSlotNodes;
 	std::unordered_map<std::string, std::unordered_set<int32_t>> migratingSlosTos;
 	std::unordered_map<std::string, std::unordered_set<int32_t>> importingSlotsFroms;
-	std::vector<RedisObjectPtr> clusterDelKeys;
-	std::vector<RedisObjectPtr> clusterDelCopys;
 	std::condition_variable condition;
-	std::atomic<int32_t> replyCount;
 	std::deque<RedisObjectPtr> redisCommands;
-	std::unordered_set<int32_t> slotSets;
 	Buffer buffer;
 
+	/* Jobs are owned by the cluster loop, slot ones are also found by slot
+	 * under the cluster mutex. Keys with a RESTORE in flight are marked so
+	 * writes to them are turned away until the target has them. */
+	std::unordered_set<MigrateJobPtr> migrateJobs;
+	std::unordered_map<int32_t, MigrateJobPtr> slotMigrations;
+	std::unordered_set<RedisObjectPtr, Hash, Equal> migratingKeys;
+	std::mutex migrateMutex;
+	std::atomic<int32_t> migrations;
+
+	/* Slots on their way here, under the cluster mutex. */
+	std::unordered_set<int32_t> importSlots;
+	std::atomic<int32_t> imports;
+
+	/* Readers keep the table of their thread until the published epoch
+	 * moves on, only then do they load the new one. */
+	ClusterSlotTablePtr slotTable;
+	uint64_t slotEpoch;
+	std::atomic<uint64_t> publishedEpoch;
+	ClusterBus bus;
+
 };
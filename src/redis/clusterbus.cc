@@ -0,0 +1,1028 @@
+#include "clusterbus.h"
+#include "cluster.h"
+#include "redis.h"
+
+static const char kBusSig[] = "RCmb";
+static const int32_t kHeaderSize = 8 + 3 * 2 + 3 * 8 +
+	2 * CLUSTER_NAMELEN + NET_IP_STR_LEN + CLUSTER_SLOTS / 8 + 2;
+static const int32_t kGossipSize = CLUSTER_NAMELEN + NET_IP_STR_LEN + 2 * 2;
+static const int32_t kMaxPacket = 1024 * 1024;
+
+static void appendField(Buffer &buffer, const std::string &s, int32_t len)
+{
+	char buf[NET_IP_STR_LEN];
+	memset(buf, 0, sizeof(buf));
+	memcpy(buf, s.data(), std::min<size_t>(s.size(), len));
+	buffer.append(buf, len);
+}
+
+static std::string readField(Buffer *buffer, int32_t len)
+{
+	std::string s(buffer->peek(), strnlen(buffer->peek(), len));
+	buffer->retrieve(len);
+	return s;
+}
+
+static void appendGossip(Buffer &buffer, const ClusterBusNodePtr &node)
+{
+	appendField(buffer, node->name, CLUSTER_NAMELEN);
+	appendField(buffer, node->ip, NET_IP_STR_LEN);
+	buffer.appendInt16(node->port);
+	buffer.appendInt16(node->flags);
+}
+
+static sds catFlags(sds ci, int16_t flags)
+{
+	if (flags & CLUSTER_NODE_MYSELF) ci = sdscat(ci, "myself,");
+	if (flags & CLUSTER_NODE_MASTER) ci = sdscat(ci, "master,");
+	if (flags & CLUSTER_NODE_SLAVE) ci = sdscat(ci, "slave,");
+	if (flags & CLUSTER_NODE_PFAIL) ci = sdscat(ci, "fail?,");
+	if (flags & CLUSTER_NODE_FAIL) ci = sdscat(ci, "fail,");
+	if (flags & CLUSTER_NODE_HANDSHAKE) ci = sdscat(ci, "handshake,");
+	if (sdslen(ci) > 0 && ci[sdslen(ci) - 1] == ',')
+	{
+		sdsrange(ci, 0, -2);
+	}
+	return ci;
+}
+
+static sds catSlots(sds ci, const ClusterSlotTablePtr &table,
+	const std::string &ip, int16_t port)
+{
+	int32_t start = -1;
+	for (int32_t slot = 0; slot <= CLUSTER_SLOTS; slot++)
+	{
+		const ClusterRoute *route = slot < CLUSTER_SLOTS ? table->getSlot(slot) : nullptr;
+		bool owned = route != nullptr && route->port == port && route->ip == ip;
+		if (owned && start == -1)
+		{
+			start = slot;
+		}
+		else if (!owned && start != -1)
+		{
+			if (start == slot - 1)
+			{
+				ci = sdscatprintf(ci, " %d", start);
+			}
+			else
+			{
+				ci = sdscatprintf(ci, " %d-%d", start, slot - 1);
+			}
+			start = -1;
+		}
+	}
+	return ci;
+}
+
+ClusterBus::ClusterBus(Redis *redis, Cluster *cluster)
+	:redis(redis),
+	cluster(cluster),
+	loop(nullptr),
+	nodeTimeout(CLUSTER_DEFAULT_NODE_TIMEOUT),
+	currentEpoch(0),
+	configEpoch(0),
+	lastVoteEpoch(0),
+	mySlots(0),
+	promoted(false),
+	failoverAuthTime(0),
+	failoverAuthEpoch(0),
+	failoverAuthSent(false)
+{
+	char buf[CLUSTER_NAMELEN];
+	getRandomHexChars(buf, CLUSTER_NAMELEN);
+	name.assign(buf, CLUSTER_NAMELEN);
+}
+
+ClusterBus::~ClusterBus()
+{
+
+}
+
+void ClusterBus::start(EventLoop *loop)
+{
+	this->loop = loop;
+	int16_t port = redis->getPort() + CLUSTER_PORT_INCR;
+	server.reset(new TcpServer(loop, redis->getIp().c_str(), port, nullptr));
+	server->setConnectionCallback(std::bind(&ClusterBus::connCallback,
+		this, std::placeholders::_1));
+	server->setMessageCallback(std::bind(&ClusterBus::readCallback,
+		this, std::weak_ptr<ClusterBusNode>(), std::placeholders::_1, std::placeholders::_2));
+	server->start();
+	loop->runAfter(CLUSTER_BUS_CRON_INTERVAL, true, std::bind(&ClusterBus::cron, this));
+	LOG_INFO << "cluster bus " << name << " listening on port " << port;
+}
+
+void ClusterBus::meet(const std::string &ip, int16_t port)
+{
+	if (loop == nullptr)
+	{
+		return;
+	}
+
+	loop->runInLoop([this, ip, port]
+	{
+		std::unique_lock <std::mutex> lck(mutex);
+		if (lookupNode(ip, port) != nullptr)
+		{
+			return;
+		}
+
+		char buf[CLUSTER_NAMELEN];
+		getRandomHexChars(buf, CLUSTER_NAMELEN);
+		createNode(std::string(buf, CLUSTER_NAMELEN), ip, port, CLUSTER_NODE_HANDSHAKE);
+	});
+}
+
+ClusterBusNodePtr ClusterBus::createNode(const std::string &name,
+	const std::string &ip, int16_t port, int16_t flags)
+{
+	ClusterBusNodePtr node(new ClusterBusNode(name, ip, port));
+	node->flags = flags;
+
+	/* The client keeps a pointer to the address string, which is never
+	 * changed for the life of the node. */
+	std::weak_ptr<ClusterBusNode> weakNode(node);
+	node->link.reset(new TcpClient(loop, node->ip.c_str(), port + CLUSTER_PORT_INCR, nullptr));
+	node->link->setConnectionCallback(std::bind(&ClusterBus::linkCallback,
+		this, weakNode, std::placeholders::_1));
+	node->link->setMessageCallback(std::bind(&ClusterBus::readCallback,
+		this, weakNode, std::placeholders::_1, std::placeholders::_2));
+	node->link->enableRetry();
+	node->link->connect();
+	nodes[name] = node;
+	LOG_INFO << "cluster bus node " << name << " " << ip << ":" << port << " added";
+	return node;
+}
+
+ClusterBusNodePtr ClusterBus::lookupNode(const std::string &ip, int16_t port)
+{
+	for (auto &it : nodes)
+	{
+		if (it.second->port == port && it.second->ip == ip)
+		{
+			return it.second;
+		}
+	}
+	return nullptr;
+}
+
+ClusterBusNodePtr ClusterBus::getMaster()
+{
+	if (redis->masterPort <= 0)
+	{
+		return nullptr;
+	}
+	return lookupNode(redis->masterHost, redis->masterPort);
+}
+
+/* The node is dropped once the callback this runs in returned, it may be
+ * the one of its own link. */
+void ClusterBus::renameNode(const ClusterBusNodePtr &node, const std::string &name)
+{
+	nodes.erase(node->name);
+	loop->queueInLoop([node] {});
+	if (name.empty() || nodes.find(name) != nodes.end())
+	{
+		return;
+	}
+
+	LOG_INFO << "cluster bus node " << node->name << " is " << name;
+	node->name = name;
+	node->flags &= ~CLUSTER_NODE_HANDSHAKE;
+	nodes[name] = node;
+}
+
+bool ClusterBus::isSlave()
+{
+	return redis->masterPort > 0 && !promoted;
+}
+
+bool ClusterBus::isVoter(const ClusterBusNodePtr &node)
+{
+	return (node->flags & CLUSTER_NODE_MASTER) && node->numSlots > 0;
+}
+
+int32_t ClusterBus::getQuorum()
+{
+	int32_t voters = (!isSlave() && mySlots > 0) ? 1 : 0;
+	for (auto &it : nodes)
+	{
+		if (isVoter(it.second))
+		{
+			voters++;
+		}
+	}
+	return voters / 2 + 1;
+}
+
+int32_t ClusterBus::countMySlots(uint8_t *slots)
+{
+	if (slots != nullptr)
+	{
+		memset(slots, 0, CLUSTER_SLOTS / 8);
+	}
+
+	int32_t count = 0;
+	ClusterSlotTablePtr table = cluster->getSlotTable();
+	for (int32_t slot = 0; slot < CLUSTER_SLOTS; slot++)
+	{
+		const ClusterRoute *route = table->getSlot(slot);
+		if (route != nullptr && route->myself)
+		{
+			if (slots != nullptr)
+			{
+				slots[slot >> 3] |= 1 << (slot & 7);
+			}
+			count++;
+		}
+	}
+	return count;
+}
+
+void ClusterBus::bumpEpoch()
+{
+	configEpoch = ++currentEpoch;
+	LOG_INFO << "cluster bus config epoch set to " << configEpoch;
+}
+
+/* Slots handed over by another master are claimed under a new config epoch,
+ * a PONG to every node spreads it before the next ping round. */
+void ClusterBus::claimSlots()
+{
+	if (loop == nullptr)
+	{
+		return;
+	}
+
+	loop->runInLoop([this]
+	{
+		std::unique_lock <std::mutex> lck(mutex);
+		bumpEpoch();
+		mySlots = countMySlots(nullptr);
+		broadcast(CLUSTERMSG_TYPE_PONG);
+	});
+}
+
+void ClusterBus::buildHeader(Buffer &buffer, int16_t type)
+{
+	uint8_t slots[CLUSTER_SLOTS / 8];
+	mySlots = countMySlots(slots);
+	bool slave = isSlave();
+	ClusterBusNodePtr master = slave ? getMaster() : nullptr;
+
+	buffer.appendInt16(type);
+	buffer.appendInt16(slave ? CLUSTER_NODE_SLAVE : CLUSTER_NODE_MASTER);
+	buffer.appendInt16(redis->getPort());
+	buffer.appendInt64(currentEpoch);
+	buffer.appendInt64(configEpoch);
+	buffer.appendInt64(redis->getReplication()->getReplOffset());
+	appendField(buffer, name, CLUSTER_NAMELEN);
+	appendField(buffer, redis->getIp(), NET_IP_STR_LEN);
+	appendField(buffer, master ? master->name : std::string(), CLUSTER_NAMELEN);
+	buffer.append(slots, sizeof(slots));
+}
+
+void ClusterBus::finishPacket(Buffer &buffer)
+{
+	buffer.prependInt32(buffer.readableBytes() + 8);
+	buffer.prepend(kBusSig, 4);
+}
+
+/* Gossips about a few random nodes and every one that looks failing. */
+void ClusterBus::sendPing(const TcpConnectionPtr &conn, int16_t type)
+{
+	Buffer buffer;
+	buildHeader(buffer, type);
+
+	std::vector<ClusterBusNodePtr> gossip;
+	std::vector<ClusterBusNodePtr> healthy;
+	for (auto &it : nodes)
+	{
+		if (it.second->flags & CLUSTER_NODE_HANDSHAKE)
+		{
+			continue;
+		}
+
+		if (it.second->flags & (CLUSTER_NODE_PFAIL | CLUSTER_NODE_FAIL))
+		{
+			gossip.push_back(it.second);
+		}
+		else
+		{
+			healthy.push_back(it.second);
+		}
+	}
+
+	size_t wanted = std::max<size_t>(3, nodes.size() / 10);
+	while (wanted > 0 && !healthy.empty())
+	{
+		size_t j = random() % healthy.size();
+		gossip.push_back(healthy[j]);
+		healthy[j] = healthy.back();
+		healthy.pop_back();
+		wanted--;
+	}
+
+	buffer.appendInt16(gossip.size());
+	for (auto &it : gossip)
+	{
+		appendGossip(buffer, it);
+	}
+
+	finishPacket(buffer);
+	conn->send(&buffer);
+}
+
+void ClusterBus::sendAuth(const TcpConnectionPtr &conn, int16_t type)
+{
+	Buffer buffer;
+	buildHeader(buffer, type);
+	buffer.appendInt16(0);
+	finishPacket(buffer);
+	conn->send(&buffer);
+}
+
+void ClusterBus::sendFail(const std::string &failing)
+{
+	auto iter = nodes.find(failing);
+	assert(iter != nodes.end());
+	Buffer buffer;
+	buildHeader(buffer, CLUSTERMSG_TYPE_FAIL);
+	buffer.appendInt16(1);
+	appendGossip(buffer, iter->second);
+	finishPacket(buffer);
+
+	for (auto &it : nodes)
+	{
+		TcpConnectionPtr conn = it.second->link->getConnection();
+		if (conn && conn->connected() && !(it.second->flags & CLUSTER_NODE_HANDSHAKE))
+		{
+			conn->send(buffer.peek(), buffer.readableBytes());
+		}
+	}
+}
+
+void ClusterBus::broadcast(int16_t type)
+{
+	for (auto &it : nodes)
+	{
+		TcpConnectionPtr conn = it.second->link->getConnection();
+		if (!conn || !conn->connected() || (it.second->flags & CLUSTER_NODE_HANDSHAKE))
+		{
+			continue;
+		}
+
+		if (type == CLUSTERMSG_TYPE_PING || type == CLUSTERMSG_TYPE_PONG)
+		{
+			sendPing(conn, type);
+		}
+		else
+		{
+			sendAuth(conn, type);
+		}
+	}
+}
+
+void ClusterBus::connCallback(const TcpConnectionPtr &conn)
+{
+	if (!conn->connected())
+	{
+		LOG_INFO << "cluster bus inbound link closed";
+	}
+}
+
+/* Every new link starts with a MEET, so a peer that forgot us or restarted
+ * learns about us again. */
+void ClusterBus::linkCallback(const std::weak_ptr<ClusterBusNode> &weakNode,
+	const TcpConnectionPtr &conn)
+{
+	if (!conn->connected())
+	{
+		return;
+	}
+
+	std::unique_lock <std::mutex> lck(mutex);
+	ClusterBusNodePtr node = weakNode.lock();
+	if (node == nullptr)
+	{
+		return;
+	}
+
+	sendPing(conn, CLUSTERMSG_TYPE_MEET);
+	node->pingSent = mstime();
+}
+
+void ClusterBus::readCallback(const std::weak_ptr<ClusterBusNode> &weakNode,
+	const TcpConnectionPtr &conn, Buffer *buffer)
+{
+	std::unique_lock <std::mutex> lck(mutex);
+	while (buffer->readableBytes() >= 8)
+	{
+		int32_t totlen = 0;
+		memcpy(&totlen, buffer->peek() + 4, sizeof(totlen));
+		totlen = Socket::networkToHost32(totlen);
+		if (memcmp(buffer->peek(), kBusSig, 4) || totlen < kHeaderSize || totlen > kMaxPacket)
+		{
+			LOG_WARN << "cluster bus protocol error, closing link";
+			conn->forceClose();
+			break;
+		}
+
+		if (buffer->readableBytes() < totlen)
+		{
+			break;
+		}
+
+		size_t readable = buffer->readableBytes();
+		buffer->retrieve(8);
+		ClusterBusHeader hdr;
+		int32_t count = readHeader(buffer, hdr) ? buffer->readInt16() : -1;
+		if (count >= 0 && count * kGossipSize <= totlen - kHeaderSize)
+		{
+			processPacket(weakNode.lock(), conn, hdr, buffer, count);
+		}
+
+		buffer->retrieve(totlen - (readable - buffer->readableBytes()));
+	}
+}
+
+bool ClusterBus::readHeader(Buffer *buffer, ClusterBusHeader &hdr)
+{
+	hdr.type = buffer->readInt16();
+	hdr.flags = buffer->readInt16();
+	hdr.port = buffer->readInt16();
+	hdr.currentEpoch = buffer->readInt64();
+	hdr.configEpoch = buffer->readInt64();
+	hdr.replOffset = buffer->readInt64();
+	hdr.name = readField(buffer, CLUSTER_NAMELEN);
+	hdr.ip = readField(buffer, NET_IP_STR_LEN);
+	hdr.master = readField(buffer, CLUSTER_NAMELEN);
+	memcpy(hdr.slots, buffer->peek(), sizeof(hdr.slots));
+	buffer->retrieve(sizeof(hdr.slots));
+	return hdr.name.size() == CLUSTER_NAMELEN && hdr.type >= CLUSTERMSG_TYPE_PING &&
+		hdr.type <= CLUSTERMSG_TYPE_FAILOVER_AUTH_ACK;
+}
+
+void ClusterBus::processPacket(const ClusterBusNodePtr &link, const TcpConnectionPtr &conn,
+	const ClusterBusHeader &hdr, Buffer *buffer, int32_t count)
+{
+	int64_t now = mstime();
+	ClusterBusNodePtr sender;
+	auto it = nodes.find(hdr.name);
+	if (it != nodes.end())
+	{
+		sender = it->second;
+	}
+
+	/* The first pong on the link of a node we were told to meet names it. */
+	if (link != nullptr && (link->flags & CLUSTER_NODE_HANDSHAKE) &&
+		hdr.type == CLUSTERMSG_TYPE_PONG)
+	{
+		renameNode(link, (sender == nullptr && hdr.name != name) ? hdr.name : std::string());
+		if (sender == nullptr && hdr.name != name)
+		{
+			sender = link;
+		}
+	}
+
+	if (sender == nullptr && hdr.type == CLUSTERMSG_TYPE_MEET && hdr.name != name)
+	{
+		sender = createNode(hdr.name, hdr.ip, hdr.port, 0);
+	}
+
+	if (hdr.type == CLUSTERMSG_TYPE_PING || hdr.type == CLUSTERMSG_TYPE_MEET)
+	{
+		sendPing(conn, CLUSTERMSG_TYPE_PONG);
+	}
+
+	/* Epochs only count from nodes in the table. */
+	if (sender == nullptr)
+	{
+		return;
+	}
+
+	currentEpoch = std::max(currentEpoch, std::max(hdr.currentEpoch, hdr.configEpoch));
+	sender->flags = (sender->flags & ~(CLUSTER_NODE_MASTER | CLUSTER_NODE_SLAVE)) |
+		(hdr.flags & (CLUSTER_NODE_MASTER | CLUSTER_NODE_SLAVE));
+	sender->configEpoch = hdr.configEpoch;
+	sender->replOffset = hdr.replOffset;
+	sender->master = hdr.master;
+
+	if (hdr.type == CLUSTERMSG_TYPE_PONG)
+	{
+		sender->pongReceived = now;
+		sender->pingSent = 0;
+		clearFailing(sender);
+	}
+
+	if (sender->flags & CLUSTER_NODE_MASTER)
+	{
+		int32_t numSlots = 0;
+		for (int32_t i = 0; i < CLUSTER_SLOTS / 8; i++)
+		{
+			numSlots += __builtin_popcount(hdr.slots[i]);
+		}
+		sender->numSlots = numSlots;
+
+		/* Two masters with the same config epoch, the one with the smaller
+		 * name moves on to a new one. */
+		if (!isSlave() && mySlots > 0 && configEpoch > 0 &&
+			hdr.configEpoch == configEpoch && hdr.name > name)
+		{
+			bumpEpoch();
+		}
+
+		if (numSlots > 0)
+		{
+			updateSlots(sender, hdr.slots);
+		}
+	}
+	else
+	{
+		sender->numSlots = 0;
+	}
+
+	if (hdr.type == CLUSTERMSG_TYPE_PING || hdr.type == CLUSTERMSG_TYPE_PONG ||
+		hdr.type == CLUSTERMSG_TYPE_MEET)
+	{
+		processGossip(sender, buffer, count);
+	}
+	else if (hdr.type == CLUSTERMSG_TYPE_FAIL && count == 1)
+	{
+		std::string failing = readField(buffer, CLUSTER_NAMELEN);
+		auto iter = nodes.find(failing);
+		if (iter != nodes.end() && !(iter->second->flags & CLUSTER_NODE_FAIL))
+		{
+			iter->second->flags = (iter->second->flags & ~CLUSTER_NODE_PFAIL) | CLUSTER_NODE_FAIL;
+			iter->second->failTime = now;
+			LOG_WARN << "FAIL message received from " << sender->name << " about " << failing;
+		}
+	}
+	else if (hdr.type == CLUSTERMSG_TYPE_FAILOVER_AUTH_REQUEST)
+	{
+		processAuthRequest(sender, conn, hdr);
+	}
+	else if (hdr.type == CLUSTERMSG_TYPE_FAILOVER_AUTH_ACK)
+	{
+		if (failoverAuthSent && isVoter(sender) && hdr.currentEpoch >= failoverAuthEpoch)
+		{
+			failoverVotes.insert(sender->name);
+		}
+	}
+}
+
+void ClusterBus::processGossip(const ClusterBusNodePtr &sender, Buffer *buffer, int32_t count)
+{
+	for (int32_t i = 0; i < count; i++)
+	{
+		std::string gname = readField(buffer, CLUSTER_NAMELEN);
+		std::string gip = readField(buffer, NET_IP_STR_LEN);
+		int16_t gport = buffer->readInt16();
+		int16_t gflags = buffer->readInt16();
+		if (gname == name)
+		{
+			continue;
+		}
+
+		auto it = nodes.find(gname);
+		if (it != nodes.end())
+		{
+			/* Only masters serving slots have a say on failures. */
+			if (!isVoter(sender))
+			{
+				continue;
+			}
+
+			if (gflags & (CLUSTER_NODE_PFAIL | CLUSTER_NODE_FAIL))
+			{
+				it->second->failReports[sender->name] = mstime();
+				markFailing(it->second);
+			}
+			else
+			{
+				it->second->failReports.erase(sender->name);
+			}
+		}
+		else if (!(gflags & (CLUSTER_NODE_PFAIL | CLUSTER_NODE_FAIL | CLUSTER_NODE_HANDSHAKE)) &&
+			lookupNode(gip, gport) == nullptr)
+		{
+			createNode(gname, gip, gport, gflags & (CLUSTER_NODE_MASTER | CLUSTER_NODE_SLAVE));
+		}
+	}
+}
+
+/* A slave asks for the vote of the masters once its master failed, each one
+ * votes at most once per epoch and once per failed master in two timeouts. */
+void ClusterBus::processAuthRequest(const ClusterBusNodePtr &sender,
+	const TcpConnectionPtr &conn, const ClusterBusHeader &hdr)
+{
+	if (isSlave() || mySlots == 0 || hdr.currentEpoch < currentEpoch ||
+		lastVoteEpoch == currentEpoch || !(sender->flags & CLUSTER_NODE_SLAVE))
+	{
+		return;
+	}
+
+	auto it = nodes.find(hdr.master);
+	if (it == nodes.end() || !(it->second->flags & CLUSTER_NODE_FAIL))
+	{
+		return;
+	}
+
+	int64_t now = mstime();
+	if (now - it->second->votedTime < nodeTimeout * 2)
+	{
+		return;
+	}
+
+	lastVoteEpoch = currentEpoch;
+	it->second->votedTime = now;
+	sendAuth(conn, CLUSTERMSG_TYPE_FAILOVER_AUTH_ACK);
+	LOG_WARN << "failover auth granted to " << sender->name << " for epoch " << currentEpoch;
+}
+
+/* Slots claimed by a master with a newer config epoch than their owner, or
+ * by no one yet, are routed to it from now on. A master left without slots
+ * becomes a slave of the one that took the last of them, and so do the
+ * slaves of such a master (a failover promoted one of their peers). */
+void ClusterBus::updateSlots(const ClusterBusNodePtr &sender, const uint8_t *slots)
+{
+	std::vector<int32_t> dirty;
+	bool lost = false;
+	ClusterBusNodePtr master = isSlave() ? getMaster() : nullptr;
+	bool masterLost = false;
+	{
+		std::unique_lock <std::mutex> lck(redis->getClusterMutex());
+		auto &map = cluster->getClusterNode();
+		for (int32_t slot = 0; slot < CLUSTER_SLOTS; slot++)
+		{
+			if (!(slots[slot >> 3] & (1 << (slot & 7))))
+			{
+				continue;
+			}
+
+			auto it = map.find(slot);
+			if (it == map.end())
+			{
+				ClusterNode node;
+				node.name = sender->name;
+				node.ip = sender->ip;
+				node.port = sender->port;
+				node.configEpoch = sender->configEpoch;
+				node.createTime = time(0);
+				node.master = nullptr;
+				node.slaves = nullptr;
+				map.insert(std::make_pair(slot, node));
+				dirty.push_back(slot);
+				continue;
+			}
+
+			ClusterNode &owner = it->second;
+			if (owner.port == sender->port && owner.ip == sender->ip)
+			{
+				owner.configEpoch = sender->configEpoch;
+				continue;
+			}
+
+			bool mine = owner.port == redis->getPort() && owner.ip == redis->getIp();
+			if ((mine ? configEpoch : owner.configEpoch) >= sender->configEpoch)
+			{
+				continue;
+			}
+
+			lost = lost || mine;
+			masterLost = masterLost || (master != nullptr && master != sender &&
+				owner.port == master->port && owner.ip == master->ip);
+			owner.name = sender->name;
+			owner.ip = sender->ip;
+			owner.port = sender->port;
+			owner.configEpoch = sender->configEpoch;
+			dirty.push_back(slot);
+		}
+
+		if (!dirty.empty())
+		{
+			cluster->publishSlots(dirty);
+		}
+
+		if (masterLost)
+		{
+			for (auto &it : map)
+			{
+				if (it.second.port == master->port && it.second.ip == master->ip)
+				{
+					masterLost = false;
+					break;
+				}
+			}
+		}
+	}
+
+	if (lost && !isSlave() && countMySlots(nullptr) == 0)
+	{
+		LOG_WARN << "lost the last slot to " << sender->name << ", becoming its slave";
+		replicateFrom(sender);
+	}
+	else if (masterLost)
+	{
+		LOG_WARN << "master " << master->name << " lost its last slot to "
+			<< sender->name << ", replicating from it";
+		replicateFrom(sender);
+	}
+}
+
+/* Replication runs on a loop of its own, the switch is posted there. */
+void ClusterBus::replicateFrom(const ClusterBusNodePtr &node)
+{
+	Replication *repli = redis->getReplication();
+	RedisObjectPtr ip = createStringObject(node->ip.data(), node->ip.size());
+	int16_t port = node->port;
+	repli->getLoop()->runInLoop([repli, ip, port]
+	{
+		repli->replicationSwitchMaster(ip, port);
+	});
+}
+
+/* A node timed out by us turns FAIL once a majority of the masters serving
+ * slots agree, counting the reports other masters gossiped recently. */
+void ClusterBus::markFailing(const ClusterBusNodePtr &node)
+{
+	if (!(node->flags & CLUSTER_NODE_PFAIL) || (node->flags & CLUSTER_NODE_FAIL))
+	{
+		return;
+	}
+
+	int64_t now = mstime();
+	int32_t reports = (!isSlave() && mySlots > 0) ? 1 : 0;
+	for (auto it = node->failReports.begin(); it != node->failReports.end();)
+	{
+		auto iter = nodes.find(it->first);
+		if (iter == nodes.end() || !isVoter(iter->second) ||
+			now - it->second > nodeTimeout * CLUSTER_FAIL_REPORT_VALIDITY_MULT)
+		{
+			it = node->failReports.erase(it);
+			continue;
+		}
+
+		reports++;
+		++it;
+	}
+
+	if (reports < getQuorum())
+	{
+		return;
+	}
+
+	node->flags = (node->flags & ~CLUSTER_NODE_PFAIL) | CLUSTER_NODE_FAIL;
+	node->failTime = now;
+	LOG_WARN << "marking node " << node->name << " as failing (quorum reached)";
+	sendFail(node->name);
+}
+
+/* A failed master serving slots is only cleared if no slave took over in a
+ * while, others as soon as they answer. */
+void ClusterBus::clearFailing(const ClusterBusNodePtr &node)
+{
+	node->flags &= ~CLUSTER_NODE_PFAIL;
+	if (!(node->flags & CLUSTER_NODE_FAIL))
+	{
+		return;
+	}
+
+	if (!isVoter(node) ||
+		mstime() - node->failTime > nodeTimeout * CLUSTER_FAIL_UNDO_TIME_MULT)
+	{
+		node->flags &= ~CLUSTER_NODE_FAIL;
+		node->failReports.clear();
+		LOG_INFO << "clear FAIL state for node " << node->name;
+	}
+}
+
+void ClusterBus::cron()
+{
+	std::unique_lock <std::mutex> lck(mutex);
+	int64_t now = mstime();
+	int32_t timeout = nodeTimeout;
+	if (promoted && redis->masterPort <= 0)
+	{
+		promoted = false;
+	}
+
+	/* A master serving slots needs an epoch of its own to claim them. */
+	mySlots = countMySlots(nullptr);
+	if (!isSlave() && mySlots > 0 && configEpoch == 0)
+	{
+		bumpEpoch();
+	}
+
+	std::vector<ClusterBusNodePtr> drops;
+	for (auto &it : nodes)
+	{
+		const ClusterBusNodePtr &node = it.second;
+		if (node->flags & CLUSTER_NODE_HANDSHAKE)
+		{
+			if (now - node->ctime > timeout)
+			{
+				drops.push_back(node);
+			}
+			continue;
+		}
+
+		TcpConnectionPtr conn = node->link->getConnection();
+		if (conn && conn->connected())
+		{
+			if (node->pingSent == 0 && now - node->pongReceived > timeout / 4)
+			{
+				sendPing(conn, CLUSTERMSG_TYPE_PING);
+				node->pingSent = now;
+			}
+			else if (node->pingSent > 0 && now - node->pingSent > timeout / 2)
+			{
+				/* The link may be stuck, a new one is tried. */
+				node->pingSent = 0;
+				conn->forceClose();
+			}
+		}
+
+		if (!(node->flags & (CLUSTER_NODE_PFAIL | CLUSTER_NODE_FAIL)) &&
+			now - node->pongReceived > timeout)
+		{
+			node->flags |= CLUSTER_NODE_PFAIL;
+			LOG_WARN << "node " << node->name << " possibly failing";
+		}
+
+		markFailing(node);
+	}
+
+	for (auto &it : drops)
+	{
+		LOG_WARN << "cluster bus handshake with " << it->ip << ":" << it->port << " timed out";
+		renameNode(it, std::string());
+	}
+
+	failoverCron();
+}
+
+void ClusterBus::failoverCron()
+{
+	ClusterBusNodePtr master = isSlave() ? getMaster() : nullptr;
+	if (master == nullptr || !(master->flags & CLUSTER_NODE_FAIL) || master->numSlots == 0)
+	{
+		failoverAuthTime = 0;
+		return;
+	}
+
+	int64_t now = mstime();
+	if (failoverAuthTime == 0 || now - failoverAuthTime > nodeTimeout * 2)
+	{
+		/* Slaves that got more of the stream ask first. */
+		int32_t rank = 0;
+		int64_t offset = redis->getReplication()->getReplOffset();
+		for (auto &it : nodes)
+		{
+			if ((it.second->flags & CLUSTER_NODE_SLAVE) &&
+				it.second->master == master->name && it.second->replOffset > offset)
+			{
+				rank++;
+			}
+		}
+
+		failoverAuthTime = now + 500 + random() % 500 + rank * 1000;
+		failoverAuthSent = false;
+		failoverVotes.clear();
+		LOG_WARN << "failover election in " << failoverAuthTime - now << " ms (rank " << rank << ")";
+		return;
+	}
+
+	if (now < failoverAuthTime)
+	{
+		return;
+	}
+
+	if (!failoverAuthSent)
+	{
+		failoverAuthEpoch = ++currentEpoch;
+		failoverAuthSent = true;
+		LOG_WARN << "starting a failover election for epoch " << failoverAuthEpoch;
+		broadcast(CLUSTERMSG_TYPE_FAILOVER_AUTH_REQUEST);
+		return;
+	}
+
+	if (failoverVotes.size() >= getQuorum())
+	{
+		failoverPromote(master);
+	}
+}
+
+void ClusterBus::failoverPromote(const ClusterBusNodePtr &master)
+{
+	LOG_WARN << "failover election won, taking over " << master->name
+		<< " in epoch " << failoverAuthEpoch;
+	configEpoch = failoverAuthEpoch;
+	promoted = true;
+	failoverAuthTime = 0;
+	failoverAuthSent = false;
+	failoverVotes.clear();
+	Replication *repli = redis->getReplication();
+	repli->getLoop()->runInLoop(std::bind(&Replication::disConnect, repli));
+
+	{
+		std::unique_lock <std::mutex> lck(redis->getClusterMutex());
+		for (auto &it : cluster->getClusterNode())
+		{
+			if (it.second.port == master->port && it.second.ip == master->ip)
+			{
+				it.second.name = name;
+				it.second.ip = redis->getIp();
+				it.second.port = redis->getPort();
+				it.second.configEpoch = configEpoch;
+			}
+		}
+		cluster->publishSlotTable();
+	}
+
+	mySlots = countMySlots(nullptr);
+	broadcast(CLUSTERMSG_TYPE_PONG);
+}
+
+sds ClusterBus::showNodes()
+{
+	std::unique_lock <std::mutex> lck(mutex);
+	ClusterSlotTablePtr table = cluster->getSlotTable();
+	ClusterBusNodePtr master = isSlave() ? getMaster() : nullptr;
+
+	sds ci = sdscatprintf(sdsempty(), "%s %s:%d@%d ", name.c_str(),
+		redis->getIp().c_str(), redis->getPort(), redis->getPort() + CLUSTER_PORT_INCR);
+	ci = catFlags(ci, CLUSTER_NODE_MYSELF |
+		(master ? CLUSTER_NODE_SLAVE : CLUSTER_NODE_MASTER));
+	ci = sdscatprintf(ci, " %s 0 0 %llu connected", master ? master->name.c_str() : "-",
+		(unsigned long long)configEpoch);
+	ci = catSlots(ci, table, redis->getIp(), redis->getPort());
+	ci = sdscatlen(ci, "\n", 1);
+
+	for (auto &it : nodes)
+	{
+		const ClusterBusNodePtr &node = it.second;
+		TcpConnectionPtr conn = node->link->getConnection();
+		ci = sdscatprintf(ci, "%s %s:%d@%d ", node->name.c_str(),
+			node->ip.c_str(), node->port, node->port + CLUSTER_PORT_INCR);
+		ci = catFlags(ci, node->flags);
+		ci = sdscatprintf(ci, " %s %lld %lld %llu %s",
+			node->master.empty() ? "-" : node->master.c_str(),
+			(long long)node->pingSent, (long long)node->pongReceived,
+			(unsigned long long)node->configEpoch,
+			(conn && conn->connected()) ? "connected" : "disconnected");
+		ci = catSlots(ci, table, node->ip, node->port);
+		ci = sdscatlen(ci, "\n", 1);
+	}
+	return ci;
+}
+
+sds ClusterBus::showInfo()
+{
+	std::unique_lock <std::mutex> lck(mutex);
+	ClusterSlotTablePtr table = cluster->getSlotTable();
+	int32_t pfail = 0, fail = 0, size = (!isSlave() && mySlots > 0) ? 1 : 0;
+	for (auto &it : nodes)
+	{
+		if (isVoter(it.second))
+		{
+			size++;
+		}
+	}
+
+	for (int32_t slot = 0; slot < CLUSTER_SLOTS; slot++)
+	{
+		const ClusterRoute *route = table->getSlot(slot);
+		if (route == nullptr || route->myself)
+		{
+			continue;
+		}
+
+		ClusterBusNodePtr node = lookupNode(route->ip, route->port);
+		if (node != nullptr && (node->flags & CLUSTER_NODE_FAIL))
+		{
+			fail++;
+		}
+		else if (node != nullptr && (node->flags & CLUSTER_NODE_PFAIL))
+		{
+			pfail++;
+		}
+	}
+
+	return sdscatprintf(sdsempty(),
+		"cluster_state:%s\r\n"
+		"cluster_slots_assigned:%d\r\n"
+		"cluster_slots_ok:%d\r\n"
+		"cluster_slots_pfail:%d\r\n"
+		"cluster_slots_fail:%d\r\n"
+		"cluster_known_nodes:%d\r\n"
+		"cluster_size:%d\r\n"
+		"cluster_current_epoch:%llu\r\n"
+		"cluster_my_epoch:%llu\r\n"
+		"cluster_slots_epoch:%llu\r\n",
+		(table->assigned == CLUSTER_SLOTS && fail == 0) ? "ok" : "fail",
+		table->assigned, table->assigned - pfail - fail, pfail, fail,
+		(int32_t)nodes.size() + 1, size,
+		(unsigned long long)currentEpoch, (unsigned long long)configEpoch,
+		(unsigned long long)table->epoch);
+}
@@ -0,0 +1,149 @@
+#pragma once
+#include "all.h"
+#include "buffer.h"
+#include "tcpclient.h"
+#include "tcpserver.h"
+#include "log.h"
+#include "util.h"
+#include "sds.h"
+
+/* A peer as seen on the cluster bus. The outbound link carries our pings,
+ * pongs come back on it, pings of the peer arrive on an inbound one. */
+struct ClusterBusNode
+{
+	ClusterBusNode(const std::string &name, const std::string &ip, int16_t port)
+		:name(name),
+		ip(ip),
+		port(port),
+		flags(0),
+		configEpoch(0),
+		replOffset(0),
+		ctime(mstime()),
+		pingSent(0),
+		pongReceived(mstime()),
+		failTime(0),
+		votedTime(0),
+		numSlots(0)
+	{
+
+	}
+
+	std::string name;
+	std::string ip;
+	int16_t port;
+	int16_t flags;
+	uint64_t configEpoch;
+	int64_t replOffset;
+	std::string master;
+	int64_t ctime;
+	int64_t pingSent;
+	int64_t pongReceived;
+	int64_t failTime;
+	int64_t votedTime;
+	int32_t numSlots;
+	std::unordered_map<std::string, int64_t> failReports;
+	TcpClientPtr link;
+};
+
+typedef std::shared_ptr<ClusterBusNode> ClusterBusNodePtr;
+
+/* Fixed part of every bus message, followed by gossip entries for PING,
+ * PONG and MEET or by the name of the failed node for FAIL. */
+struct ClusterBusHeader
+{
+	int16_t type;
+	int16_t flags;
+	int16_t port;
+	uint64_t currentEpoch;
+	uint64_t configEpoch;
+	int64_t replOffset;
+	std::string name;
+	std::string ip;
+	std::string master;
+	uint8_t slots[CLUSTER_SLOTS / 8];
+};
+
+class Redis;
+class Cluster;
+class ClusterBus
+{
+public:
+	ClusterBus(Redis *redis, Cluster *cluster);
+	~ClusterBus();
+
+	void start(EventLoop *loop);
+	void meet(const std::string &ip, int16_t port);
+	void claimSlots();
+	sds showNodes();
+	sds showInfo();
+
+	const std::string &getName() { return name; }
+	void setNodeTimeout(int32_t ms) { nodeTimeout = ms; }
+	int32_t getNodeTimeout() { return nodeTimeout; }
+
+private:
+	ClusterBus(const ClusterBus&);
+	void operator=(const ClusterBus&);
+
+	void cron();
+	void connCallback(const TcpConnectionPtr &conn);
+	void linkCallback(const std::weak_ptr<ClusterBusNode> &weakNode,
+		const TcpConnectionPtr &conn);
+	void readCallback(const std::weak_ptr<ClusterBusNode> &weakNode,
+		const TcpConnectionPtr &conn, Buffer *buffer);
+
+	bool readHeader(Buffer *buffer, ClusterBusHeader &hdr);
+	void processPacket(const ClusterBusNodePtr &link, const TcpConnectionPtr &conn,
+		const ClusterBusHeader &hdr, Buffer *buffer, int32_t count);
+	void processGossip(const ClusterBusNodePtr &sender, Buffer *buffer, int32_t count);
+	void processAuthRequest(const ClusterBusNodePtr &sender,
+		const TcpConnectionPtr &conn, const ClusterBusHeader &hdr);
+	void updateSlots(const ClusterBusNodePtr &sender, const uint8_t *slots);
+
+	void buildHeader(Buffer &buffer, int16_t type);
+	void finishPacket(Buffer &buffer);
+	void sendPing(const TcpConnectionPtr &conn, int16_t type);
+	void sendFail(const std::string &failing);
+	void sendAuth(const TcpConnectionPtr &conn, int16_t type);
+	void broadcast(int16_t type);
+
+	ClusterBusNodePtr createNode(const std::string &name,
+		const std::string &ip, int16_t port, int16_t flags);
+	ClusterBusNodePtr lookupNode(const std::string &ip, int16_t port);
+	ClusterBusNodePtr getMaster();
+	void renameNode(const ClusterBusNodePtr &node, const std::string &name);
+	void markFailing(const ClusterBusNodePtr &node);
+	void clearFailing(const ClusterBusNodePtr &node);
+	void failoverCron();
+	void failoverPromote(const ClusterBusNodePtr &master);
+	void replicateFrom(const ClusterBusNodePtr &node);
+	void bumpEpoch();
+
+	bool isSlave();
+	bool isVoter(const ClusterBusNodePtr &node);
+	int32_t countMySlots(uint8_t *slots);
+	int32_t getQuorum();
+
+	Redis *redis;
+	Cluster *cluster;
+	EventLoop *loop;
+	std::unique_ptr<TcpServer> server;
+	std::string name;
+	std::atomic<int32_t> nodeTimeout;
+	std::mutex mutex;
+
+	std::unordered_map<std::string, ClusterBusNodePtr> nodes;
+	uint64_t currentEpoch;
+	uint64_t configEpoch;
+	uint64_t lastVoteEpoch;
+	int32_t mySlots;
+	bool promoted;
+
+	/* A slave of a failed master waits until failoverAuthTime, asks the
+	 * masters for their vote in failoverAuthEpoch and takes over the slots
+	 * once a majority of them granted it. */
+	int64_t failoverAuthTime;
+	uint64_t failoverAuthEpoch;
+	bool failoverAuthSent;
+	std::unordered_set<std::string> failoverVotes;
+};
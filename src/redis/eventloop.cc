@@ -11,13 +11,32 @@ int createEventfd()
 	}
 	return evtfd;
 }
+
+IoUringPtr createIoUring(EventLoop *loop)
+{
+	if (!EventLoop::getIoUring())
+	{
+		return nullptr;
+	}
+
+	IoUringPtr uring(new IoUring(loop));
+	if (!uring->init())
+	{
+		LOG_WARN << "io_uring unavailable, falling back to epoll";
+		return nullptr;
+	}
+	return uring;
+}
 #endif
 
+std::atomic<bool> EventLoop::ioUringEnabled(false);
+
 EventLoop::EventLoop()
 	:threadId(std::this_thread::get_id()),
 #ifdef __linux__
 	wakeupFd(createEventfd()),
-	epoller(new Epoll(this)),
+	uring(createIoUring(this)),
+	epoller(uring ? nullptr : new Epoll(this)),
 	timerQueue(new TimerQueue(this)),
 	wakeupChannel(new Channel(this, wakeupFd)),
 #endif
@@ -36,9 +55,21 @@ EventLoop::EventLoop()
 	currentActiveChannel(nullptr),
 	running(false),
 	eventHandling(false),
-	callingPendingFunctors(false)
+	callingPendingFunctors(false),
+	queuedTasks(0),
+	sleeping(false),
+	wakeupPending(false),
+	connectionCount(0),
+	busyPollUs(0),
+	lastActiveTime(0),
+	netInputBytes(0),
+	netOutputBytes(0),
+	eventCount(0),
+	taskCount(0),
+	busyUs(0)
 {
 	wakeupChannel->setReadCallback(std::bind(&EventLoop::handleRead, this));
+	wakeupChannel->setEdgeTriggered(true);
 	wakeupChannel->enableReading();
 }
 
@@ -96,6 +127,13 @@ void EventLoop::updateChannel(Channel *channel)
 {
 	assert(channel->ownerLoop() == this);
 	assertInLoopThread();
+#ifdef __linux__
+	if (uring)
+	{
+		uring->updateChannel(channel);
+		return;
+	}
+#endif
 	epoller->updateChannel(channel);
 }
 
@@ -109,9 +147,37 @@ void EventLoop::removeChannel(Channel *channel)
 			std::find(activeChannels.begin(),
 				activeChannels.end(), channel) == activeChannels.end());
 	}
+#ifdef __linux__
+	if (uring)
+	{
+		uring->removeChannel(channel);
+		return;
+	}
+#endif
 	epoller->removeChannel(channel);
 }
 
+bool EventLoop::canQueueSend() const
+{
+#ifdef __linux__
+	return uring != nullptr;
+#else
+	return false;
+#endif
+}
+
+bool EventLoop::queueSend(Channel *channel, const BufferPtr &buffer)
+{
+	assert(channel->ownerLoop() == this);
+#ifdef __linux__
+	if (uring)
+	{
+		return uring->queueSend(channel, buffer);
+	}
+#endif
+	return false;
+}
+
 void EventLoop::cancelAfter(const TimerPtr &timer)
 {
 	timerQueue->cancelTimer(timer);
@@ -126,6 +192,12 @@ bool EventLoop::hasChannel(Channel *channel)
 {
 	assert(channel->ownerLoop() == this);
 	assertInLoopThread();
+#ifdef __linux__
+	if (uring)
+	{
+		return uring->hasChannel(channel);
+	}
+#endif
 	return epoller->hasChannel(channel);
 }
 
@@ -172,47 +244,12 @@ void EventLoop::wakeup()
 	assert(n == sizeof one);
 }
 
-void EventLoop::runInLoop(Functor &&cb)
-{
-	if (isInLoopThread())
-	{
-		cb();
-	}
-	else
-	{
-		queueInLoop(std::move(cb));
-	}
-}
-
-void EventLoop::queueInLoop(Functor &&cb)
-{
-	{
-		std::unique_lock<std::mutex> lk(mutex);
-		pendingFunctors.push_back(std::move(cb));
-	}
-
-	if (!isInLoopThread() || callingPendingFunctors)
-	{
-		wakeup();
-	}
-}
-
-void EventLoop::doPendingFunctors()
+size_t EventLoop::doPendingFunctors()
 {
 	callingPendingFunctors = true;
-
-	{
-		std::unique_lock<std::mutex> lk(mutex);
-		functors.swap(pendingFunctors);
-	}
-
-	for (size_t i = 0; i < functors.size(); ++i)
-	{
-		functors[i]();
-	}
-
-	functors.clear();
+	size_t n = pendingTasks.runAll();
 	callingPendingFunctors = false;
+	return n;
 }
 
 void EventLoop::run()
@@ -221,7 +258,29 @@ void EventLoop::run()
 	while (running)
 	{
 		activeChannels.clear();
-		epoller->epollWait(&activeChannels);
+		bool spinning = busyPollUs > 0 && ustime() - lastActiveTime < busyPollUs;
+		if (!spinning)
+		{
+			sleeping.store(true, std::memory_order_relaxed);
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+		}
+
+		int32_t msTime = (spinning || !pendingTasks.empty()) ? 0 : kPollTimeMs;
+#ifdef __linux__
+		if (uring)
+		{
+			uring->epollWait(&activeChannels, msTime);
+		}
+		else
+		{
+			epoller->epollWait(&activeChannels, msTime);
+		}
+#else
+		epoller->epollWait(&activeChannels, msTime);
+#endif
+		sleeping.store(false, std::memory_order_relaxed);
+		wakeupPending.store(false, std::memory_order_relaxed);
+		int64_t start = ustime();
 		eventHandling = true;
 
 		for (auto &it : activeChannels)
@@ -232,7 +291,18 @@ void EventLoop::run()
 
 		currentActiveChannel = nullptr;
 		eventHandling = false;
-		doPendingFunctors();
+		size_t n = doPendingFunctors();
+		if (n > 0 || !activeChannels.empty())
+		{
+			int64_t now = ustime();
+			busyUs.store(busyUs.load(std::memory_order_relaxed) + now - start,
+				std::memory_order_relaxed);
+			eventCount.store(eventCount.load(std::memory_order_relaxed) + activeChannels.size(),
+				std::memory_order_relaxed);
+			taskCount.store(taskCount.load(std::memory_order_relaxed) + n,
+				std::memory_order_relaxed);
+			lastActiveTime = now;
+		}
 	}
 }
 
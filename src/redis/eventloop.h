@@ -8,6 +8,7 @@
 
 #ifdef __linux__
 #include "epoll.h"
+#include "iouring.h"
 #endif
 
 #ifdef _WIN64
@@ -16,42 +17,106 @@
 
 #include "timerqueue.h"
 #include "callback.h"
+#include "buffer.h"
+#include "taskqueue.h"
 
 class EventLoop
 {
 public:
 	typedef std::function<void()> Functor;
+	static const int32_t kPollTimeMs = 100;
 	EventLoop();
 	~EventLoop();
 
 	void quit();
 	void run();
 	void handleRead();
-	void runInLoop(Functor &&cb);
-	void queueInLoop(Functor &&cb);
+
+	template<typename F>
+	void runInLoop(F &&cb)
+	{
+		if (isInLoopThread())
+		{
+			cb();
+		}
+		else
+		{
+			queueInLoop(std::forward<F>(cb));
+		}
+	}
+
+	template<typename F>
+	void queueInLoop(F &&cb)
+	{
+		pendingTasks.push(std::forward<F>(cb));
+		queuedTasks.fetch_add(1, std::memory_order_release);
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		if (sleeping.load(std::memory_order_relaxed)
+			&& !wakeupPending.exchange(true))
+		{
+			wakeup();
+		}
+	}
 	void wakeup();
 	void updateChannel(Channel *channel);
 	void removeChannel(Channel *channel);
 	bool hasChannel(Channel *channel);
+	/* With io_uring output is queued as a send and submitted with the next
+	 * wait instead of being written right away. */
+	bool canQueueSend() const;
+	bool queueSend(Channel *channel, const BufferPtr &buffer);
 	void cancelAfter(const TimerPtr &timer);
 	void assertInLoopThread();
 
 	TimerPtr runAfter(double when, bool repeat, TimerCallback &&cb);
 	TimerQueuePtr getTimerQueue();
+	BufferPool *getBufferPool() { return &bufferPool; }
 	void handlerTimerQueue();
 	bool isInLoopThread() const;
 	bool geteventHandling() const;
 	std::thread::id getThreadId() const;
 
+	void setBusyPoll(int64_t us) { busyPollUs = us; }
+	int64_t getBusyPoll() const { return busyPollUs; }
+
+	void incConnectionCount() { ++connectionCount; }
+	void decConnectionCount() { --connectionCount; }
+	int32_t getConnectionCount() const { return connectionCount; }
+
+	/* Counters written by the loop thread only, read by INFO. */
+	void addNetInputBytes(int64_t n)
+	{
+		netInputBytes.store(netInputBytes.load(std::memory_order_relaxed) + n,
+			std::memory_order_relaxed);
+	}
+
+	void addNetOutputBytes(int64_t n)
+	{
+		netOutputBytes.store(netOutputBytes.load(std::memory_order_relaxed) + n,
+			std::memory_order_relaxed);
+	}
+
+	int64_t getNetInputBytes() const { return netInputBytes.load(std::memory_order_relaxed); }
+	int64_t getNetOutputBytes() const { return netOutputBytes.load(std::memory_order_relaxed); }
+	int64_t getEventCount() const { return eventCount.load(std::memory_order_relaxed); }
+	int64_t getTaskCount() const { return taskCount.load(std::memory_order_relaxed); }
+	int64_t getBusyUs() const { return busyUs.load(std::memory_order_relaxed); }
+	size_t getQueueDepth() const { return pendingTasks.size(); }
+	/* Counts tasks once they are queued, a task queued after a value was
+	 * read changes it. */
+	uint64_t getQueuedTasks() const { return queuedTasks.load(std::memory_order_acquire); }
+
+	static void setIoUring(bool on) { ioUringEnabled = on; }
+	static bool getIoUring() { return ioUringEnabled; }
+
 private:
 	EventLoop(const EventLoop&);
 	void operator=(const EventLoop&);
 
 	void abortNotInLoopThread();
-	void doPendingFunctors();
+	size_t doPendingFunctors();
 
 	std::thread::id threadId;
-	mutable std::mutex mutex;
 #ifdef __APPLE__
 	PollPtr epoller;
 	int32_t op;
@@ -59,8 +124,9 @@ private:
 #endif
 
 #ifdef __linux__
-	EpollPtr epoller;
 	int32_t wakeupFd;
+	IoUringPtr uring;
+	EpollPtr epoller;
 #endif
 
 #ifdef _WIN64
@@ -71,6 +137,7 @@ private:
 
 	TimerQueuePtr timerQueue;
 	ChannelPtr wakeupChannel;
+	BufferPool bufferPool;
 
 	typedef std::vector<Channel*> ChannelList;
 	ChannelList activeChannels;
@@ -79,7 +146,18 @@ private:
 	bool running;
 	bool eventHandling;
 	bool callingPendingFunctors;
-	std::vector<Functor> functors;
-	std::vector<Functor> pendingFunctors;
+	TaskQueue pendingTasks;
+	std::atomic<uint64_t> queuedTasks;
+	std::atomic<bool> sleeping;
+	std::atomic<bool> wakeupPending;
+	std::atomic<int32_t> connectionCount;
+	int64_t busyPollUs;
+	int64_t lastActiveTime;
+	std::atomic<int64_t> netInputBytes;
+	std::atomic<int64_t> netOutputBytes;
+	std::atomic<int64_t> eventCount;
+	std::atomic<int64_t> taskCount;
+	std::atomic<int64_t> busyUs;
+	static std::atomic<bool> ioUringEnabled;
 };
 
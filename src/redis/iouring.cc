@@ -0,0 +1,724 @@
+#ifdef __linux__
+#include "iouring.h"
+#include "channel.h"
+#include "eventloop.h"
+#include "buffer.h"
+#include <sys/mman.h>
+
+#ifndef __NR_io_uring_setup
+#define __NR_io_uring_setup 425
+#endif
+
+#ifndef __NR_io_uring_enter
+#define __NR_io_uring_enter 426
+#endif
+
+#ifndef __NR_io_uring_register
+#define __NR_io_uring_register 427
+#endif
+
+const int32_t kNew = -1;
+const int32_t kAdded = 1;
+const int32_t kDeleted = 2;
+const int32_t kReadEvents = POLLIN | POLLPRI;
+const uint64_t kCancelUserData = UINT64_MAX;
+
+IoUring::IoUring(EventLoop *loop)
+	:loop(loop),
+	ringfd(-1),
+	nextGen(0),
+	toSubmit(0),
+	iteration(0),
+	sqRing(MAP_FAILED),
+	cqRing(MAP_FAILED),
+	sqRingSize(0),
+	cqRingSize(0),
+	sqes(static_cast<struct io_uring_sqe*>(MAP_FAILED)),
+	sqesSize(0),
+	recvEnabled(false),
+	acceptEnabled(true),
+	bufRing(nullptr),
+	recvBuffers(nullptr),
+	bufTail(0)
+{
+
+}
+
+IoUring::~IoUring()
+{
+	if (ringfd >= 0)
+	{
+		Socket::close(ringfd);
+	}
+
+	if (sqes != MAP_FAILED)
+	{
+		::munmap(sqes, sqesSize);
+	}
+
+	if (cqRing != MAP_FAILED && cqRing != sqRing)
+	{
+		::munmap(cqRing, cqRingSize);
+	}
+
+	if (sqRing != MAP_FAILED)
+	{
+		::munmap(sqRing, sqRingSize);
+	}
+
+	if (bufRing != nullptr)
+	{
+		::munmap(bufRing, kRecvBufferCount * sizeof(struct io_uring_buf));
+	}
+
+	if (recvBuffers != nullptr)
+	{
+		::munmap(recvBuffers, kRecvBufferCount * kRecvBufferSize);
+	}
+}
+
+bool IoUring::init(uint32_t entries)
+{
+	struct io_uring_params params;
+	memset(&params, 0, sizeof(params));
+	ringfd = ::syscall(__NR_io_uring_setup, entries, &params);
+	if (ringfd < 0)
+	{
+		LOG_WARN << "io_uring_setup failed " << strerror(errno);
+		return false;
+	}
+
+	if (!(params.features & IORING_FEAT_EXT_ARG))
+	{
+		LOG_WARN << "io_uring lacks IORING_FEAT_EXT_ARG";
+		return false;
+	}
+
+	sqRingSize = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+	cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	if (params.features & IORING_FEAT_SINGLE_MMAP)
+	{
+		sqRingSize = std::max(sqRingSize, cqRingSize);
+		cqRingSize = sqRingSize;
+	}
+
+	sqRing = ::mmap(nullptr, sqRingSize, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, ringfd, IORING_OFF_SQ_RING);
+	if (sqRing == MAP_FAILED)
+	{
+		LOG_WARN << "io_uring mmap sq ring failed " << strerror(errno);
+		return false;
+	}
+
+	if (params.features & IORING_FEAT_SINGLE_MMAP)
+	{
+		cqRing = sqRing;
+	}
+	else
+	{
+		cqRing = ::mmap(nullptr, cqRingSize, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, ringfd, IORING_OFF_CQ_RING);
+		if (cqRing == MAP_FAILED)
+		{
+			LOG_WARN << "io_uring mmap cq ring failed " << strerror(errno);
+			return false;
+		}
+	}
+
+	sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+	sqes = static_cast<struct io_uring_sqe*>(::mmap(nullptr, sqesSize,
+		PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringfd, IORING_OFF_SQES));
+	if (sqes == MAP_FAILED)
+	{
+		LOG_WARN << "io_uring mmap sqes failed " << strerror(errno);
+		return false;
+	}
+
+	char *sq = static_cast<char*>(sqRing);
+	char *cq = static_cast<char*>(cqRing);
+	sqHead = reinterpret_cast<uint32_t*>(sq + params.sq_off.head);
+	sqTail = reinterpret_cast<uint32_t*>(sq + params.sq_off.tail);
+	sqMask = reinterpret_cast<uint32_t*>(sq + params.sq_off.ring_mask);
+	sqEntries = reinterpret_cast<uint32_t*>(sq + params.sq_off.ring_entries);
+	sqArray = reinterpret_cast<uint32_t*>(sq + params.sq_off.array);
+	cqHead = reinterpret_cast<uint32_t*>(cq + params.cq_off.head);
+	cqTail = reinterpret_cast<uint32_t*>(cq + params.cq_off.tail);
+	cqMask = reinterpret_cast<uint32_t*>(cq + params.cq_off.ring_mask);
+	cqes = reinterpret_cast<struct io_uring_cqe*>(cq + params.cq_off.cqes);
+
+	recvEnabled = initRecvBuffers();
+	if (!recvEnabled)
+	{
+		LOG_WARN << "io_uring provided buffers unavailable, reading after poll";
+	}
+	return true;
+}
+
+bool IoUring::initRecvBuffers()
+{
+	void *ring = ::mmap(nullptr, kRecvBufferCount * sizeof(struct io_uring_buf),
+		PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (ring == MAP_FAILED)
+	{
+		return false;
+	}
+	bufRing = static_cast<struct io_uring_buf*>(ring);
+
+	void *buffers = ::mmap(nullptr, kRecvBufferCount * kRecvBufferSize,
+		PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (buffers == MAP_FAILED)
+	{
+		return false;
+	}
+	recvBuffers = static_cast<char*>(buffers);
+
+	struct io_uring_buf_reg reg;
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr = reinterpret_cast<uint64_t>(bufRing);
+	reg.ring_entries = kRecvBufferCount;
+	reg.bgid = kRecvBufferGroup;
+	if (::syscall(__NR_io_uring_register, ringfd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+	{
+		return false;
+	}
+
+	for (uint32_t i = 0; i < kRecvBufferCount; i++)
+	{
+		pendingRecycle.push_back(i);
+	}
+	recycleRecvBuffers();
+	return true;
+}
+
+/* Buffers handed out by the previous batch of completions go back to the
+ * kernel once their channels have run, all with a single tail update. The
+ * ring is addressed as a plain array: the tail aliases bufs[0].resv, and
+ * the flexible array of io_uring_buf_ring does not start at offset 0 when
+ * the header is compiled as C++. */
+void IoUring::recycleRecvBuffers()
+{
+	if (pendingRecycle.empty())
+	{
+		return;
+	}
+
+	const uint16_t mask = kRecvBufferCount - 1;
+	for (auto &it : pendingRecycle)
+	{
+		struct io_uring_buf *buf = &bufRing[bufTail & mask];
+		buf->addr = reinterpret_cast<uint64_t>(recvBuffers + static_cast<size_t>(it) * kRecvBufferSize);
+		buf->len = kRecvBufferSize;
+		buf->bid = it;
+		bufTail++;
+	}
+	__atomic_store_n(&bufRing[0].resv, bufTail, __ATOMIC_RELEASE);
+	pendingRecycle.clear();
+}
+
+/* An SQE is never dropped: a lost cancel would leave a poll or recv armed
+ * on a file whose fd may already be closed and reused. When the queue is
+ * full it is submitted, and if the kernel refuses because the completion
+ * queue overflowed, completions are moved aside for the next wait. */
+struct io_uring_sqe *IoUring::getSqe()
+{
+	uint32_t tail = *sqTail;
+	while (tail - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE) >= *sqEntries)
+	{
+		if (submit(0, 0) < 0)
+		{
+			if (errno == EBUSY)
+			{
+				reapCompletions();
+			}
+			else if (errno != EAGAIN && errno != EINTR)
+			{
+				LOG_WARN << "io_uring_enter failed " << strerror(errno);
+				return nullptr;
+			}
+		}
+	}
+
+	uint32_t index = tail & *sqMask;
+	struct io_uring_sqe *sqe = &sqes[index];
+	memset(sqe, 0, sizeof(*sqe));
+	sqArray[index] = index;
+	__atomic_store_n(sqTail, tail + 1, __ATOMIC_RELEASE);
+	toSubmit++;
+	return sqe;
+}
+
+int32_t IoUring::submit(uint32_t waitNr, int32_t msTime)
+{
+	struct __kernel_timespec ts;
+	ts.tv_sec = msTime / 1000;
+	ts.tv_nsec = (msTime % 1000) * 1000000LL;
+
+	struct io_uring_getevents_arg arg;
+	memset(&arg, 0, sizeof(arg));
+	arg.ts = reinterpret_cast<uint64_t>(&ts);
+
+	uint32_t flags = 0;
+	if (waitNr > 0)
+	{
+		flags = IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG;
+	}
+
+	int32_t ret = ::syscall(__NR_io_uring_enter, ringfd, toSubmit, waitNr,
+		flags, waitNr > 0 ? &arg : nullptr, waitNr > 0 ? sizeof(arg) : 0);
+	if (ret > 0)
+	{
+		toSubmit -= std::min<uint32_t>(ret, toSubmit);
+	}
+	return ret;
+}
+
+bool IoUring::usesRecv(const PollEntry &entry)
+{
+	return recvEnabled && entry.channel->hasRecvCallback();
+}
+
+bool IoUring::usesAccept(const PollEntry &entry)
+{
+	return acceptEnabled && entry.channel->hasAcceptCallback();
+}
+
+int32_t IoUring::wantedPollEvents(const PollEntry &entry)
+{
+	return (usesRecv(entry) || usesAccept(entry)) ? entry.events & ~kReadEvents : entry.events;
+}
+
+void IoUring::armPoll(int32_t fd, PollEntry &entry)
+{
+	struct io_uring_sqe *sqe = getSqe();
+	if (sqe == nullptr)
+	{
+		return;
+	}
+
+	entry.pollGen = ++nextGen;
+	entry.pollEvents = wantedPollEvents(entry);
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = fd;
+	sqe->poll32_events = entry.pollEvents;
+	/* A multishot poll only reports new readiness. That is enough for write
+	 * interest and for handlers that drain the fd, a handler reading once
+	 * needs the poll re-armed to see what it left behind. */
+	if (!(entry.pollEvents & kReadEvents) || entry.channel->isEdgeTriggered())
+	{
+		sqe->len = IORING_POLL_ADD_MULTI;
+	}
+	sqe->user_data = makeUserData(fd, entry.pollGen);
+	entry.pollArmed = true;
+}
+
+void IoUring::armRecv(int32_t fd, PollEntry &entry)
+{
+	struct io_uring_sqe *sqe = getSqe();
+	if (sqe == nullptr)
+	{
+		return;
+	}
+
+	entry.recvGen = ++nextGen;
+	sqe->opcode = IORING_OP_RECV;
+	sqe->fd = fd;
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = kRecvBufferGroup;
+	sqe->user_data = makeUserData(fd, entry.recvGen);
+	entry.recvArmed = true;
+	entry.recvCancelled = false;
+	entry.accepting = false;
+}
+
+/* A listening socket accepts through a multishot accept, which takes the
+ * recv slot of the entry. */
+void IoUring::armAccept(int32_t fd, PollEntry &entry)
+{
+	struct io_uring_sqe *sqe = getSqe();
+	if (sqe == nullptr)
+	{
+		return;
+	}
+
+	entry.recvGen = ++nextGen;
+	sqe->opcode = IORING_OP_ACCEPT;
+	sqe->fd = fd;
+	sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+	sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+	sqe->user_data = makeUserData(fd, entry.recvGen);
+	entry.recvArmed = true;
+	entry.recvCancelled = false;
+	entry.accepting = true;
+}
+
+void IoUring::armChannel(int32_t fd, PollEntry &entry)
+{
+	if ((entry.events & kReadEvents) && !entry.recvArmed)
+	{
+		if (usesAccept(entry))
+		{
+			armAccept(fd, entry);
+		}
+		else if (usesRecv(entry))
+		{
+			armRecv(fd, entry);
+		}
+	}
+
+	int32_t wanted = wantedPollEvents(entry);
+	if (entry.pollArmed && entry.pollEvents != wanted)
+	{
+		cancel(fd, entry.pollGen);
+		entry.pollArmed = false;
+	}
+
+	if (!entry.pollArmed && wanted != 0)
+	{
+		armPoll(fd, entry);
+	}
+}
+
+void IoUring::cancel(int32_t fd, uint32_t gen)
+{
+	struct io_uring_sqe *sqe = getSqe();
+	if (sqe == nullptr)
+	{
+		return;
+	}
+
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	sqe->fd = -1;
+	sqe->addr = makeUserData(fd, gen);
+	sqe->user_data = kCancelUserData;
+}
+
+/* The send goes out with the next submit, so everything a loop iteration
+ * writes reaches the kernel in the same io_uring_enter. The buffer must not
+ * change until the send completes. */
+bool IoUring::queueSend(Channel *channel, const std::shared_ptr<Buffer> &buffer)
+{
+	loop->assertInLoopThread();
+	int32_t fd = channel->getfd();
+	auto it = channels.find(fd);
+	if (it == channels.end() || it->second.channel != channel || it->second.sendArmed)
+	{
+		return false;
+	}
+
+	struct io_uring_sqe *sqe = getSqe();
+	if (sqe == nullptr)
+	{
+		return false;
+	}
+
+	PollEntry &entry = it->second;
+	entry.sendGen = ++nextGen;
+	sqe->opcode = IORING_OP_SEND;
+	sqe->fd = fd;
+	sqe->addr = reinterpret_cast<uint64_t>(buffer->peek());
+	sqe->len = buffer->readableBytes();
+	sqe->msg_flags = MSG_NOSIGNAL;
+	sqe->user_data = makeUserData(fd, entry.sendGen);
+	entry.sendBuffer = buffer;
+	entry.sendArmed = true;
+	return true;
+}
+
+void IoUring::queueArm(int32_t fd, PollEntry &entry)
+{
+	if (!entry.queued)
+	{
+		entry.queued = true;
+		pendingArms.push_back(fd);
+	}
+}
+
+void IoUring::epollWait(ChannelList *activeChannels, int32_t msTime)
+{
+	iteration++;
+	recycleRecvBuffers();
+
+	std::vector<int32_t> arms;
+	arms.swap(pendingArms);
+	for (auto &it : arms)
+	{
+		auto iter = channels.find(it);
+		if (iter == channels.end() || !iter->second.queued)
+		{
+			continue;
+		}
+
+		iter->second.queued = false;
+		if (iter->second.events != 0)
+		{
+			armChannel(it, iter->second);
+		}
+	}
+
+	int32_t ret = submit(completions.empty() ? 1 : 0, msTime);
+	if (ret < 0 && errno != ETIME && errno != EINTR && errno != EBUSY)
+	{
+		LOG_WARN << "io_uring_enter failed " << strerror(errno);
+	}
+	reapCompletions();
+	fillActiveChannels(activeChannels);
+}
+
+void IoUring::reapCompletions()
+{
+	uint32_t head = *cqHead;
+	uint32_t tail = __atomic_load_n(cqTail, __ATOMIC_ACQUIRE);
+	for (; head != tail; ++head)
+	{
+		completions.push_back(cqes[head & *cqMask]);
+	}
+	__atomic_store_n(cqHead, head, __ATOMIC_RELEASE);
+}
+
+void IoUring::activate(PollEntry &entry, int32_t revents, ChannelList *activeChannels)
+{
+	if (entry.activeIteration == iteration)
+	{
+		entry.channel->addRevents(revents);
+		return;
+	}
+
+	entry.activeIteration = iteration;
+	entry.channel->setRevents(revents);
+	activeChannels->push_back(entry.channel);
+}
+
+void IoUring::fillActiveChannels(ChannelList *activeChannels)
+{
+	for (auto &cqe : completions)
+	{
+		if (cqe.user_data == kCancelUserData)
+		{
+			continue;
+		}
+
+		auto retired = retiredSends.find(cqe.user_data);
+		if (retired != retiredSends.end())
+		{
+			retiredSends.erase(retired);
+			continue;
+		}
+
+		char *data = nullptr;
+		if (cqe.flags & IORING_CQE_F_BUFFER)
+		{
+			uint16_t bid = cqe.flags >> IORING_CQE_BUFFER_SHIFT;
+			data = recvBuffers + static_cast<size_t>(bid) * kRecvBufferSize;
+			pendingRecycle.push_back(bid);
+		}
+
+		int32_t fd = static_cast<int32_t>(cqe.user_data & 0xffffffff);
+		uint32_t gen = static_cast<uint32_t>(cqe.user_data >> 32);
+		auto it = channels.find(fd);
+		if (it == channels.end())
+		{
+			continue;
+		}
+
+		PollEntry &entry = it->second;
+		bool more = cqe.flags & IORING_CQE_F_MORE;
+		if (entry.sendArmed && gen == entry.sendGen)
+		{
+			entry.sendArmed = false;
+			entry.sendBuffer.reset();
+			entry.channel->setSent(cqe.res);
+			activate(entry, 0, activeChannels);
+			continue;
+		}
+
+		if (entry.recvArmed && gen == entry.recvGen && entry.accepting)
+		{
+			/* Connections accepted after a cancel was asked for are handed
+			 * over too, nobody else would close them. */
+			bool rearm = false;
+			if (!more)
+			{
+				entry.recvArmed = false;
+			}
+
+			if (cqe.res >= 0)
+			{
+				entry.channel->addAccepted(cqe.res);
+				activate(entry, POLLIN, activeChannels);
+				rearm = true;
+			}
+			else if (cqe.res == -ECANCELED)
+			{
+				rearm = true;
+			}
+			else if (cqe.res == -EINVAL)
+			{
+				LOG_WARN << "io_uring multishot accept unsupported, accepting after poll";
+				acceptEnabled = false;
+				rearm = true;
+			}
+			else
+			{
+				/* The read handler accepts and sees the error itself. */
+				activate(entry, POLLIN, activeChannels);
+				rearm = true;
+			}
+
+			if (!entry.recvArmed && rearm)
+			{
+				queueArm(fd, entry);
+			}
+			continue;
+		}
+
+		if (entry.recvArmed && gen == entry.recvGen)
+		{
+			/* Data received after a cancel was asked for is still delivered,
+			 * it is gone from the socket. A new recv is only armed once the
+			 * old one has ended, so chunks never overtake each other. */
+			bool rearm = false;
+			if (!more)
+			{
+				entry.recvArmed = false;
+			}
+
+			if (cqe.res > 0 && data != nullptr)
+			{
+				entry.channel->addReceived(data, cqe.res);
+				activate(entry, POLLIN, activeChannels);
+				rearm = true;
+			}
+			else if (cqe.res == -ENOBUFS || cqe.res == -ECANCELED)
+			{
+				rearm = true;
+			}
+			else if (cqe.res == -EINVAL)
+			{
+				LOG_WARN << "io_uring multishot recv unsupported, reading after poll";
+				recvEnabled = false;
+				rearm = true;
+			}
+			else
+			{
+				entry.channel->addReceived(nullptr, cqe.res);
+				activate(entry, POLLIN, activeChannels);
+			}
+
+			if (!entry.recvArmed && rearm)
+			{
+				queueArm(fd, entry);
+			}
+			continue;
+		}
+
+		if (!entry.pollArmed || gen != entry.pollGen)
+		{
+			continue;
+		}
+
+		if (!more)
+		{
+			entry.pollArmed = false;
+			queueArm(fd, entry);
+		}
+
+		if (cqe.res == -ECANCELED)
+		{
+			continue;
+		}
+		activate(entry, cqe.res < 0 ? POLLERR : cqe.res, activeChannels);
+	}
+	completions.clear();
+}
+
+bool IoUring::hasChannel(Channel *channel)
+{
+	loop->assertInLoopThread();
+	auto it = channels.find(channel->getfd());
+	return it != channels.end() && it->second.channel == channel;
+}
+
+void IoUring::updateChannel(Channel *channel)
+{
+	loop->assertInLoopThread();
+	const int32_t index = channel->getIndex();
+	int32_t fd = channel->getfd();
+	if (index == kNew)
+	{
+		assert(channels.find(fd) == channels.end());
+		PollEntry entry;
+		entry.channel = channel;
+		entry.pollGen = 0;
+		entry.recvGen = 0;
+		entry.sendGen = 0;
+		entry.events = 0;
+		entry.pollEvents = 0;
+		entry.activeIteration = 0;
+		entry.pollArmed = false;
+		entry.recvArmed = false;
+		entry.recvCancelled = false;
+		entry.accepting = false;
+		entry.sendArmed = false;
+		entry.queued = false;
+		channels[fd] = entry;
+	}
+
+	auto it = channels.find(fd);
+	assert(it != channels.end());
+	assert(it->second.channel == channel);
+
+	PollEntry &entry = it->second;
+	entry.events = channel->getEvents();
+	if (entry.pollArmed && entry.pollEvents != wantedPollEvents(entry))
+	{
+		cancel(fd, entry.pollGen);
+		entry.pollArmed = false;
+	}
+
+	if (entry.recvArmed && !entry.recvCancelled && !(entry.events & kReadEvents))
+	{
+		cancel(fd, entry.recvGen);
+		entry.recvCancelled = true;
+	}
+
+	if (channel->isNoneEvent())
+	{
+		channel->setIndex(kDeleted);
+	}
+	else
+	{
+		channel->setIndex(kAdded);
+		queueArm(fd, entry);
+	}
+}
+
+void IoUring::removeChannel(Channel *channel)
+{
+	loop->assertInLoopThread();
+	int32_t fd = channel->getfd();
+	auto it = channels.find(fd);
+	assert(it != channels.end());
+	assert(it->second.channel == channel);
+	assert(channel->isNoneEvent());
+
+	if (it->second.pollArmed)
+	{
+		cancel(fd, it->second.pollGen);
+	}
+
+	if (it->second.recvArmed && !it->second.recvCancelled)
+	{
+		cancel(fd, it->second.recvGen);
+	}
+
+	if (it->second.sendArmed)
+	{
+		cancel(fd, it->second.sendGen);
+		retiredSends[makeUserData(fd, it->second.sendGen)] = it->second.sendBuffer;
+	}
+
+	channels.erase(it);
+	channel->setIndex(kNew);
+}
+#endif
@@ -0,0 +1,114 @@
+#pragma once
+#ifdef __linux__
+#include "all.h"
+#include "util.h"
+#include "log.h"
+#include <linux/io_uring.h>
+
+class Channel;
+class EventLoop;
+class Buffer;
+
+class IoUring
+{
+public:
+	typedef std::vector<Channel*> ChannelList;
+	static const uint32_t kRecvBufferCount = 256;
+	static const uint32_t kRecvBufferSize = 16384;
+	static const uint16_t kRecvBufferGroup = 0;
+
+	IoUring(EventLoop *loop);
+	~IoUring();
+
+	bool init(uint32_t entries = 4096);
+	void epollWait(ChannelList *activeChannels, int32_t msTime = 100);
+	bool hasChannel(Channel *channel);
+	void updateChannel(Channel *channel);
+	void removeChannel(Channel *channel);
+	bool queueSend(Channel *channel, const std::shared_ptr<Buffer> &buffer);
+
+private:
+	IoUring(const IoUring&);
+	void operator=(const IoUring&);
+
+	/* A channel has at most one poll, one multishot recv (or accept on a
+	 * listening socket) and one send in flight, each told apart by the
+	 * generation carried in its user_data. */
+	struct PollEntry
+	{
+		Channel *channel;
+		std::shared_ptr<Buffer> sendBuffer;
+		uint32_t pollGen;
+		uint32_t recvGen;
+		uint32_t sendGen;
+		int32_t events;
+		int32_t pollEvents;
+		uint64_t activeIteration;
+		bool pollArmed;
+		bool recvArmed;
+		bool recvCancelled;
+		bool accepting;
+		bool sendArmed;
+		bool queued;
+	};
+
+	bool initRecvBuffers();
+	struct io_uring_sqe *getSqe();
+	bool usesRecv(const PollEntry &entry);
+	bool usesAccept(const PollEntry &entry);
+	int32_t wantedPollEvents(const PollEntry &entry);
+	void armPoll(int32_t fd, PollEntry &entry);
+	void armRecv(int32_t fd, PollEntry &entry);
+	void armAccept(int32_t fd, PollEntry &entry);
+	void armChannel(int32_t fd, PollEntry &entry);
+	void cancel(int32_t fd, uint32_t gen);
+	void queueArm(int32_t fd, PollEntry &entry);
+	void recycleRecvBuffers();
+	int32_t submit(uint32_t waitNr, int32_t msTime);
+	void reapCompletions();
+	void fillActiveChannels(ChannelList *activeChannels);
+	void activate(PollEntry &entry, int32_t revents, ChannelList *activeChannels);
+
+	static uint64_t makeUserData(int32_t fd, uint32_t gen)
+	{
+		return (static_cast<uint64_t>(gen) << 32) | static_cast<uint32_t>(fd);
+	}
+
+	std::unordered_map<int32_t, PollEntry> channels;
+	/* Buffers of sends still in flight on removed channels, the kernel may
+	 * read them until the send completes. */
+	std::unordered_map<uint64_t, std::shared_ptr<Buffer>> retiredSends;
+	std::vector<int32_t> pendingArms;
+	std::vector<struct io_uring_cqe> completions;
+	std::vector<uint16_t> pendingRecycle;
+	EventLoop *loop;
+	int32_t ringfd;
+	uint32_t nextGen;
+	uint32_t toSubmit;
+	uint64_t iteration;
+
+	void *sqRing;
+	void *cqRing;
+	size_t sqRingSize;
+	size_t cqRingSize;
+	struct io_uring_sqe *sqes;
+	size_t sqesSize;
+
+	uint32_t *sqHead;
+	uint32_t *sqTail;
+	uint32_t *sqMask;
+	uint32_t *sqEntries;
+	uint32_t *sqArray;
+	uint32_t *cqHead;
+	uint32_t *cqTail;
+	uint32_t *cqMask;
+	struct io_uring_cqe *cqes;
+
+	/* Provided buffer ring the kernel fills for multishot recv. */
+	bool recvEnabled;
+	bool acceptEnabled;
+	struct io_uring_buf *bufRing;
+	char *recvBuffers;
+	uint16_t bufTail;
+};
+#endif
@@ -0,0 +1,257 @@
+#include "latency.h"
+
+LatencyMonitor::LatencyMonitor()
+	:threshold(REDIS_DEFAULT_LATENCY_MONITOR_THRESHOLD)
+{
+
+}
+
+LatencyMonitor::~LatencyMonitor()
+{
+
+}
+
+void LatencyMonitor::addSample(const char *event, int64_t latency)
+{
+	int32_t now = time(nullptr);
+	std::unique_lock <std::mutex> lck(mutex);
+	LatencyTimeSeries &ts = events[event];
+	if (latency > ts.max)
+	{
+		ts.max = latency;
+	}
+
+	/* Samples within the same second are merged into the worst one. */
+	int32_t prev = (ts.idx + LATENCY_TS_LEN - 1) % LATENCY_TS_LEN;
+	if (ts.samples[prev].time == now)
+	{
+		if (latency > ts.samples[prev].latency)
+		{
+			ts.samples[prev].latency = latency;
+		}
+		return;
+	}
+
+	ts.samples[ts.idx].time = now;
+	ts.samples[ts.idx].latency = latency;
+	ts.idx = (ts.idx + 1) % LATENCY_TS_LEN;
+}
+
+/* Resets the given events, all of them when none is given. Returns how many
+ * were reset. */
+int32_t LatencyMonitor::reset(const std::vector<std::string> &names)
+{
+	std::unique_lock <std::mutex> lck(mutex);
+	int32_t count = 0;
+	if (names.empty())
+	{
+		count = events.size();
+		events.clear();
+		return count;
+	}
+
+	for (auto &it : names)
+	{
+		count += events.erase(it);
+	}
+	return count;
+}
+
+void LatencyMonitor::latest(std::vector<std::pair<std::string, LatencySample>> &result,
+	std::vector<uint32_t> &maxs)
+{
+	std::unique_lock <std::mutex> lck(mutex);
+	for (auto &it : events)
+	{
+		int32_t last = (it.second.idx + LATENCY_TS_LEN - 1) % LATENCY_TS_LEN;
+		result.push_back(std::make_pair(it.first, it.second.samples[last]));
+		maxs.push_back(it.second.max);
+	}
+}
+
+/* Oldest first. */
+bool LatencyMonitor::history(const std::string &event, std::vector<LatencySample> &result)
+{
+	std::unique_lock <std::mutex> lck(mutex);
+	auto it = events.find(event);
+	if (it == events.end())
+	{
+		return false;
+	}
+
+	for (int32_t j = 0; j < LATENCY_TS_LEN; j++)
+	{
+		const LatencySample &sample = it->second.samples[(it->second.idx + j) % LATENCY_TS_LEN];
+		if (sample.time == 0)
+		{
+			continue;
+		}
+		result.push_back(sample);
+	}
+	return true;
+}
+
+void LatencyMonitor::analyzeSeries(const LatencyTimeSeries &ts, LatencyStats *stats)
+{
+	int64_t sum = 0;
+	stats->all = ts.max;
+	stats->avg = 0;
+	stats->min = 0;
+	stats->max = 0;
+	stats->mad = 0;
+	stats->samples = 0;
+	stats->period = 0;
+
+	for (int32_t j = 0; j < LATENCY_TS_LEN; j++)
+	{
+		const LatencySample &sample = ts.samples[j];
+		if (sample.time == 0)
+		{
+			continue;
+		}
+
+		stats->samples++;
+		if (stats->samples == 1)
+		{
+			stats->min = sample.latency;
+			stats->max = sample.latency;
+			stats->period = sample.time;
+		}
+		else
+		{
+			stats->min = std::min(stats->min, sample.latency);
+			stats->max = std::max(stats->max, sample.latency);
+			stats->period = std::min(stats->period, (time_t)sample.time);
+		}
+		sum += sample.latency;
+	}
+
+	if (stats->samples == 0)
+	{
+		return;
+	}
+
+	stats->avg = sum / stats->samples;
+	stats->period = time(nullptr) - stats->period;
+	if (stats->period == 0)
+	{
+		stats->period = 1;
+	}
+
+	sum = 0;
+	for (int32_t j = 0; j < LATENCY_TS_LEN; j++)
+	{
+		const LatencySample &sample = ts.samples[j];
+		if (sample.time == 0)
+		{
+			continue;
+		}
+		sum += std::abs((int64_t)sample.latency - (int64_t)stats->avg);
+	}
+	stats->mad = sum / stats->samples;
+}
+
+/* A short human readable report of every event seen, followed by what can
+ * be done about the kinds of events that showed up. */
+sds LatencyMonitor::doctor()
+{
+	sds report = sdsempty();
+	bool adviseFork = false, adviseRdb = false, adviseFsync = false;
+	bool adviseExpire = false, adviseFlush = false, adviseTimer = false;
+	bool adviseRehash = false;
+
+	std::unique_lock <std::mutex> lck(mutex);
+	if (events.empty())
+	{
+		if (threshold == 0)
+		{
+			return sdscat(report, "The latency monitor is disabled, "
+				"enable it with CONFIG SET latency-monitor-threshold <milliseconds>.\n");
+		}
+		return sdscat(report, "No latency spikes were observed so far.\n");
+	}
+
+	report = sdscat(report, "Latency spikes observed:\n\n");
+	int32_t eventnum = 0;
+	for (auto &it : events)
+	{
+		LatencyStats stats;
+		analyzeSeries(it.second, &stats);
+		eventnum++;
+		report = sdscatprintf(report,
+			"%d. %s: %u latency spikes (average %ums, mean deviation %ums, "
+			"period %.2f sec). Worst all time event %ums.\n",
+			eventnum, it.first.c_str(), stats.samples, stats.avg, stats.mad,
+			(double)stats.period / stats.samples, stats.all);
+
+		const std::string &name = it.first;
+		if (name == "fork")
+		{
+			adviseFork = true;
+		}
+		else if (name == "rdb-save")
+		{
+			adviseRdb = true;
+		}
+		else if (name == "aof-fsync")
+		{
+			adviseFsync = true;
+		}
+		else if (name == "expire-del")
+		{
+			adviseExpire = true;
+		}
+		else if (name == "flushdb")
+		{
+			adviseFlush = true;
+		}
+		else if (name == "timer-queue")
+		{
+			adviseTimer = true;
+		}
+		else if (name == "rehash")
+		{
+			adviseRehash = true;
+		}
+	}
+
+	report = sdscat(report, "\nAdvices:\n");
+	if (adviseFork)
+	{
+		report = sdscat(report, "- fork() copies the page tables of the whole dataset, "
+			"its cost grows with used memory. Without --bgsave-fork snapshots are "
+			"taken online by a thread and nothing is forked.\n");
+	}
+	if (adviseRdb)
+	{
+		report = sdscat(report, "- Snapshots are slow to write. More rdb-segments "
+			"spread the work over more threads and files.\n");
+	}
+	if (adviseFsync)
+	{
+		report = sdscat(report, "- The disk is slow to sync the AOF. With appendfsync "
+			"always every write waits for it, everysec bounds the loss to a second "
+			"and keeps the wait off the clients.\n");
+	}
+	if (adviseExpire)
+	{
+		report = sdscat(report, "- Deleting expired keys is slow, check for big "
+			"aggregate values expiring.\n");
+	}
+	if (adviseFlush)
+	{
+		report = sdscat(report, "- FLUSHDB frees every key while holding the shard "
+			"locks, clients wait for the whole dataset to be freed.\n");
+	}
+	if (adviseTimer)
+	{
+		report = sdscat(report, "- The timers of the main loop are slow to run. Many "
+			"keys expiring at the same time all expire in one pass.\n");
+	}
+	if (adviseRehash)
+	{
+		report = sdscat(report, "- Pre-sizing the key tables for a snapshot being "
+			"loaded rehashes every shard holding keys already.\n");
+	}
+	return report;
+}
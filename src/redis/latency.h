@@ -0,0 +1,85 @@
+#pragma once
+#include "all.h"
+#include "util.h"
+#include "sds.h"
+
+/* One sample per second and event at most, the worst one wins. */
+struct LatencySample
+{
+	int32_t time;
+	uint32_t latency;
+};
+
+struct LatencyTimeSeries
+{
+	LatencyTimeSeries()
+		:idx(0),
+		max(0)
+	{
+		memset(samples, 0, sizeof(samples));
+	}
+
+	int32_t idx;
+	uint32_t max;
+	LatencySample samples[LATENCY_TS_LEN];
+};
+
+struct LatencyStats
+{
+	uint32_t all;
+	uint32_t avg;
+	uint32_t min;
+	uint32_t max;
+	uint32_t mad;
+	uint32_t samples;
+	time_t period;
+};
+
+/* Named internal events slower than latency-monitor-threshold milliseconds
+ * go into a ring of the last LATENCY_TS_LEN samples of that event. With the
+ * threshold at 0 a probe costs a single load. */
+class LatencyMonitor
+{
+public:
+	LatencyMonitor();
+	~LatencyMonitor();
+
+	int64_t start()
+	{
+		return threshold > 0 ? mstime() : 0;
+	}
+
+	void end(const char *event, int64_t start)
+	{
+		if (start == 0)
+		{
+			return;
+		}
+
+		int64_t duration = mstime() - start;
+		if (duration >= threshold && threshold > 0)
+		{
+			addSample(event, duration);
+		}
+	}
+
+	void addSample(const char *event, int64_t latency);
+	int32_t reset(const std::vector<std::string> &events);
+	void latest(std::vector<std::pair<std::string, LatencySample>> &result,
+		std::vector<uint32_t> &maxs);
+	bool history(const std::string &event, std::vector<LatencySample> &result);
+	sds doctor();
+
+	void setThreshold(int64_t ms) { threshold = ms; }
+	int64_t getThreshold() { return threshold; }
+
+private:
+	LatencyMonitor(const LatencyMonitor&);
+	void operator=(const LatencyMonitor&);
+
+	void analyzeSeries(const LatencyTimeSeries &ts, LatencyStats *stats);
+
+	std::atomic<int64_t> threshold;
+	std::mutex mutex;
+	std::map<std::string, LatencyTimeSeries> events;
+};
@@ -41,7 +41,135 @@ int main(int argc, char *argv[])
 	Logger::setOutput(dummyOutput);
 	printf("%s\n", logo);
 
-	Redis redis("127.0.0.1", 6379, 0);
+	int16_t port = 6379;
+	int16_t threadCount = 0;
+	bool reusePort = false;
+	bool leastConnections = false;
+	bool cpuAffinity = false;
+	int64_t busyPollUs = 0;
+	bool appendOnly = false;
+	bool bgsaveFork = false;
+	int32_t rdbSegments = REDIS_DEFAULT_RDB_SEGMENTS;
+	bool replDiskless = REDIS_DEFAULT_REPL_DISKLESS_SYNC;
+	int64_t replBacklogSize = REDIS_DEFAULT_REPL_BACKLOG_SIZE;
+	int64_t replOutputLimit = REDIS_DEFAULT_REPL_OUTPUT_LIMIT;
+	bool replServeStale = REDIS_DEFAULT_SLAVE_SERVE_STALE_DATA;
+	int32_t replMaxLag = REDIS_DEFAULT_SLAVE_MAX_LAG;
+	int32_t appendFsync = REDIS_DEFAULT_AOF_FSYNC;
+	bool clusterEnabled = false;
+	int32_t clusterNodeTimeout = CLUSTER_DEFAULT_NODE_TIMEOUT;
+	int64_t trackingMaxKeys = REDIS_DEFAULT_TRACKING_TABLE_MAX_KEYS;
+	for (int32_t i = 1; i < argc; i++)
+	{
+		if (!strcmp(argv[i], "--io-uring"))
+		{
+			EventLoop::setIoUring(true);
+		}
+		else if (!strcmp(argv[i], "--port") && i + 1 < argc)
+		{
+			port = atoi(argv[++i]);
+		}
+		else if (!strcmp(argv[i], "--threads") && i + 1 < argc)
+		{
+			threadCount = atoi(argv[++i]);
+		}
+		else if (!strcmp(argv[i], "--reuseport"))
+		{
+			reusePort = true;
+		}
+		else if (!strcmp(argv[i], "--least-connections"))
+		{
+			leastConnections = true;
+		}
+		else if (!strcmp(argv[i], "--cpu-affinity"))
+		{
+			cpuAffinity = true;
+		}
+		else if (!strcmp(argv[i], "--busy-poll") && i + 1 < argc)
+		{
+			busyPollUs = atoll(argv[++i]);
+		}
+		else if (!strcmp(argv[i], "--bgsave-fork"))
+		{
+			bgsaveFork = true;
+		}
+		else if (!strcmp(argv[i], "--rdb-segments") && i + 1 < argc)
+		{
+			rdbSegments = atoi(argv[++i]);
+			if (rdbSegments < 1 || rdbSegments > REDIS_RDB_MAX_SEGMENTS)
+			{
+				rdbSegments = REDIS_DEFAULT_RDB_SEGMENTS;
+			}
+		}
+		else if (!strcmp(argv[i], "--repl-diskless-sync"))
+		{
+			replDiskless = true;
+		}
+		else if (!strcmp(argv[i], "--repl-backlog-size") && i + 1 < argc)
+		{
+			replBacklogSize = atoll(argv[++i]);
+		}
+		else if (!strcmp(argv[i], "--repl-output-buffer-limit") && i + 1 < argc)
+		{
+			replOutputLimit = atoll(argv[++i]);
+		}
+		else if (!strcmp(argv[i], "--slave-serve-stale-data") && i + 1 < argc)
+		{
+			replServeStale = strcmp(argv[++i], "no") != 0;
+		}
+		else if (!strcmp(argv[i], "--slave-max-lag") && i + 1 < argc)
+		{
+			replMaxLag = atoi(argv[++i]);
+		}
+		else if (!strcmp(argv[i], "--appendonly"))
+		{
+			appendOnly = true;
+		}
+		else if (!strcmp(argv[i], "--cluster-enabled"))
+		{
+			clusterEnabled = true;
+		}
+		else if (!strcmp(argv[i], "--cluster-node-timeout") && i + 1 < argc)
+		{
+			clusterNodeTimeout = atoi(argv[++i]);
+		}
+		else if (!strcmp(argv[i], "--tracking-table-max-keys") && i + 1 < argc)
+		{
+			trackingMaxKeys = atoll(argv[++i]);
+		}
+		else if (!strcmp(argv[i], "--appendfsync") && i + 1 < argc)
+		{
+			i++;
+			if (!strcmp(argv[i], "always"))
+			{
+				appendFsync = AOF_FSYNC_ALWAYS;
+			}
+			else if (!strcmp(argv[i], "no"))
+			{
+				appendFsync = AOF_FSYNC_NO;
+			}
+			else
+			{
+				appendFsync = AOF_FSYNC_EVERYSEC;
+			}
+		}
+	}
+
+	Redis redis("127.0.0.1", port, threadCount, clusterEnabled);
+	redis.setReusePort(reusePort);
+	redis.setLeastConnections(leastConnections);
+	redis.setCpuAffinity(cpuAffinity);
+	redis.setBusyPoll(busyPollUs);
+	redis.setAppendOnly(appendOnly, appendFsync);
+	redis.setBgsaveFork(bgsaveFork);
+	redis.setRdbSegments(rdbSegments);
+	redis.setReplDiskless(replDiskless);
+	redis.setReplBacklogSize(replBacklogSize);
+	redis.setReplOutputLimit(replOutputLimit);
+	redis.setReplServeStale(replServeStale);
+	redis.setReplMaxLag(replMaxLag);
+	redis.setClusterNodeTimeout(clusterNodeTimeout);
+	redis.setTrackingMaxKeys(trackingMaxKeys);
 	redis.run();
 	return 0;
 }
@@ -0,0 +1,230 @@
+#include "monitor.h"
+#include "redis.h"
+
+static thread_local MonitorRing *localRing = nullptr;
+
+MonitorRing::MonitorRing()
+	:events(new MonitorEvent[kCapacity]),
+	head(0),
+	tail(0),
+	dropped(0)
+{
+
+}
+
+bool MonitorRing::push(const RedisObjectPtr &addr, const RedisObjectPtr &cmd,
+	const std::deque<RedisObjectPtr> &argv)
+{
+	uint64_t t = tail.load(std::memory_order_relaxed);
+	if (t - head.load(std::memory_order_acquire) == kCapacity)
+	{
+		dropped++;
+		return false;
+	}
+
+	MonitorEvent &event = events[t % kCapacity];
+	event.time = ustime();
+	event.addr = addr;
+	event.cmd = cmd;
+	event.argv.assign(argv.begin(), argv.end());
+	tail.store(t + 1, std::memory_order_release);
+	return true;
+}
+
+/* Move the pending events out of the ring. Returns how many were moved. */
+int64_t MonitorRing::drain(std::vector<MonitorEvent> *out)
+{
+	uint64_t h = head.load(std::memory_order_relaxed);
+	uint64_t t = tail.load(std::memory_order_acquire);
+	for (uint64_t i = h; i < t; i++)
+	{
+		MonitorEvent &event = events[i % kCapacity];
+		out->push_back(std::move(event));
+		event.addr.reset();
+		event.cmd.reset();
+		event.argv.clear();
+	}
+
+	head.store(t, std::memory_order_release);
+	return t - h;
+}
+
+/* Format events in the MONITOR output format. */
+void Monitor::formatEvents(const std::vector<MonitorEvent> &events, Buffer *buffer)
+{
+	sds cmdrepr = sdsempty();
+	for (auto &event : events)
+	{
+		cmdrepr = sdscatprintf(cmdrepr, "+%ld.%06ld [0 %s]",
+			(long)(event.time / 1000000), (long)(event.time % 1000000), event.addr->ptr);
+		cmdrepr = sdscatlen(cmdrepr, " ", 1);
+		cmdrepr = sdscatrepr(cmdrepr, event.cmd->ptr, sdslen(event.cmd->ptr));
+		for (auto &it : event.argv)
+		{
+			cmdrepr = sdscatlen(cmdrepr, " ", 1);
+			if (it->encoding == OBJ_ENCODING_INT)
+			{
+				cmdrepr = sdscatprintf(cmdrepr, "\"%ld\"", (long)it->ptr);
+			}
+			else
+			{
+				cmdrepr = sdscatrepr(cmdrepr, (char*)it->ptr, sdslen(it->ptr));
+			}
+		}
+
+		cmdrepr = sdscatlen(cmdrepr, "\r\n", 2);
+		buffer->append(cmdrepr, sdslen(cmdrepr));
+		sdsclear(cmdrepr);
+	}
+	sdsfree(cmdrepr);
+}
+
+/* Drop the pending events without formatting them. */
+void MonitorRing::clear()
+{
+	uint64_t h = head.load(std::memory_order_relaxed);
+	uint64_t t = tail.load(std::memory_order_acquire);
+	for (uint64_t i = h; i < t; i++)
+	{
+		MonitorEvent &event = events[i % kCapacity];
+		event.addr.reset();
+		event.cmd.reset();
+		event.argv.clear();
+	}
+	head.store(t, std::memory_order_release);
+}
+
+Monitor::Monitor(Redis *redis)
+	:redis(redis),
+	lagDropped(0)
+{
+
+}
+
+Monitor::~Monitor()
+{
+
+}
+
+MonitorRing *Monitor::getRing()
+{
+	if (localRing == nullptr)
+	{
+		std::unique_lock <std::mutex> lck(mutex);
+		rings.push_back(std::unique_ptr<MonitorRing>(new MonitorRing()));
+		localRing = rings.back().get();
+	}
+	return localRing;
+}
+
+void Monitor::clearRings()
+{
+	for (auto &it : rings)
+	{
+		it->clear();
+	}
+}
+
+void Monitor::feed(const RedisObjectPtr &addr, const RedisObjectPtr &cmd,
+	const std::deque<RedisObjectPtr> &argv)
+{
+	getRing()->push(addr, cmd, argv);
+}
+
+/* The flag the command threads check changes under the mutex, so a
+ * disconnect racing with MONITOR cannot leave it stale. */
+void Monitor::addMonitor(const TcpConnectionPtr &conn)
+{
+	std::unique_lock <std::mutex> lck(mutex);
+	monitors[conn->getSockfd()] = conn;
+	redis->monitorEnabled = true;
+	if (timer == nullptr)
+	{
+		/* Commands still in flight when the last monitor left. */
+		clearRings();
+		timer = redis->getEventLoop()->runAfter(MONITOR_CRON_INTERVAL,
+			true, std::bind(&Monitor::cron, this));
+	}
+}
+
+void Monitor::removeMonitor(int32_t sockfd)
+{
+	std::unique_lock <std::mutex> lck(mutex);
+	monitors.erase(sockfd);
+	redis->monitorEnabled = !monitors.empty();
+	if (monitors.empty() && timer != nullptr)
+	{
+		redis->getEventLoop()->cancelAfter(timer);
+		timer.reset();
+		clearRings();
+	}
+}
+
+size_t Monitor::getMonitors()
+{
+	std::unique_lock <std::mutex> lck(mutex);
+	return monitors.size();
+}
+
+int64_t Monitor::getRingDropped()
+{
+	int64_t count = 0;
+	std::unique_lock <std::mutex> lck(mutex);
+	for (auto &it : rings)
+	{
+		count += it->getDropped();
+	}
+	return count;
+}
+
+/* Runs in the server loop: collects what the command threads recorded and
+ * hands it to the loop of each monitor, which formats it. */
+void Monitor::cron()
+{
+	MonitorEventsPtr events(new std::vector<MonitorEvent>());
+	int64_t count = 0;
+	std::unordered_map<EventLoop*, std::vector<TcpConnectionPtr>> loops;
+	{
+		std::unique_lock <std::mutex> lck(mutex);
+		for (auto &it : rings)
+		{
+			count += it->drain(events.get());
+		}
+
+		if (count == 0)
+		{
+			return;
+		}
+
+		for (auto &it : monitors)
+		{
+			loops[it.second->getLoop()].push_back(it.second);
+		}
+	}
+
+	for (auto &it : loops)
+	{
+		it.first->runInLoop(std::bind(&Monitor::sendEvents,
+			this, events, std::move(it.second)));
+	}
+}
+
+void Monitor::sendEvents(const MonitorEventsPtr &events,
+	const std::vector<TcpConnectionPtr> &conns)
+{
+	Buffer buffer;
+	for (auto &it : conns)
+	{
+		if (it->getWriteBytes() > kMaxBacklog)
+		{
+			lagDropped += events->size();
+			continue;
+		}
+
+		if (buffer.readableBytes() == 0)
+		{
+			formatEvents(*events, &buffer);
+		}
+		it->sendPipe(std::string_view(buffer.peek(), buffer.readableBytes()));
+	}
+}
@@ -0,0 +1,81 @@
+#pragma once
+#include "all.h"
+#include "buffer.h"
+#include "object.h"
+#include "callback.h"
+#include "tcpconnection.h"
+
+/* A command as it was executed, kept by reference until it is formatted. */
+struct MonitorEvent
+{
+	int64_t time;
+	RedisObjectPtr addr;
+	RedisObjectPtr cmd;
+	std::vector<RedisObjectPtr> argv;
+};
+
+typedef std::shared_ptr<std::vector<MonitorEvent>> MonitorEventsPtr;
+
+/* Single producer, single consumer ring. The thread executing commands
+ * pushes, the monitor cron pops. A full ring drops the event. */
+class MonitorRing
+{
+public:
+	static const int32_t kCapacity = 8192;
+
+	MonitorRing();
+
+	bool push(const RedisObjectPtr &addr, const RedisObjectPtr &cmd,
+		const std::deque<RedisObjectPtr> &argv);
+	int64_t drain(std::vector<MonitorEvent> *out);
+	void clear();
+	int64_t getDropped() { return dropped; }
+
+private:
+	MonitorRing(const MonitorRing&);
+	void operator=(const MonitorRing&);
+
+	std::unique_ptr<MonitorEvent[]> events;
+	std::atomic<uint64_t> head;
+	std::atomic<uint64_t> tail;
+	std::atomic<int64_t> dropped;
+};
+
+class Redis;
+class Monitor
+{
+public:
+	Monitor(Redis *redis);
+	~Monitor();
+
+	void feed(const RedisObjectPtr &addr, const RedisObjectPtr &cmd,
+		const std::deque<RedisObjectPtr> &argv);
+	void addMonitor(const TcpConnectionPtr &conn);
+	void removeMonitor(int32_t sockfd);
+
+	size_t getMonitors();
+	int64_t getRingDropped();
+	int64_t getLagDropped() { return lagDropped; }
+
+private:
+	Monitor(const Monitor&);
+	void operator=(const Monitor&);
+
+	void cron();
+	void sendEvents(const MonitorEventsPtr &events,
+		const std::vector<TcpConnectionPtr> &conns);
+	static void formatEvents(const std::vector<MonitorEvent> &events, Buffer *buffer);
+	MonitorRing *getRing();
+	void clearRings();
+
+	/* A monitor with more than this much output still unsent misses
+	 * events until it caught up. */
+	static const int64_t kMaxBacklog = 64 * 1024 * 1024;
+
+	Redis *redis;
+	std::mutex mutex;
+	std::unordered_map<int32_t, TcpConnectionPtr> monitors;
+	std::vector<std::unique_ptr<MonitorRing>> rings;
+	TimerPtr timer;
+	std::atomic<int64_t> lagDropped;
+};
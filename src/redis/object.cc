@@ -233,6 +233,8 @@ void createSharedObjects()
 		"-BUSY Redis is busy running a script. You can only call SCRIPT KILL or SHUTDOWN NOSAVE.\r\n"));
 	shared.masterdownerr = createObject(REDIS_STRING, sdsnew(
 		"-MASTERDOWN Link with MASTER is down and slave-serve-stale-data is set to 'no'.\r\n"));
+	shared.slavelagerr = createObject(REDIS_STRING, sdsnew(
+		"-LAGGING Nothing heard from MASTER for more than slave-max-lag seconds.\r\n"));
 	shared.bgsaveerr = createObject(REDIS_STRING, sdsnew(
 		"-MISCONF Redis is configured to save RDB snapshots, but is currently no able to persist on disk. Commands that may modify the data set are disabled. Please check Redis logs for details about the error.\r\n"));
 	shared.roslaveerr = createObject(REDIS_STRING, sdsnew(
@@ -247,6 +249,9 @@ void createSharedObjects()
 		"-NOREPLICAS Not enough good slaves to write.\r\n"));
 	shared.busykeyerr = createObject(REDIS_STRING, sdsnew(
 		"-BUSYKEY Target key name already exists.\r\n"));
+	shared.tryagainerr = createObject(REDIS_STRING, sdsnew(
+		"-TRYAGAIN Key is being migrated, try again later.\r\n"));
+	shared.nokey = createObject(REDIS_STRING, sdsnew("+NOKEY\r\n"));
 
 	shared.space = createObject(REDIS_STRING, sdsnew(" "));
 	shared.colon = createObject(REDIS_STRING, sdsnew(":"));
@@ -277,7 +282,7 @@ void createSharedObjects()
 	shared.slaveof = createObject(REDIS_STRING, sdsnew("slaveof"));
 	shared.command = createObject(REDIS_STRING, sdsnew("command"));
 	shared.config = createObject(REDIS_STRING, sdsnew("config"));
-	shared.auth = createObject(REDIS_STRING, sdsnew("rpush"));
+	shared.auth = createObject(REDIS_STRING, sdsnew("auth"));
 	shared.info = createObject(REDIS_STRING, sdsnew("info"));
 	shared.echo = createObject(REDIS_STRING, sdsnew("echo"));
 	shared.client = createObject(REDIS_STRING, sdsnew("client"));
@@ -300,6 +305,8 @@ void createSharedObjects()
 	shared.clusterconnect = createObject(REDIS_STRING, sdsnew("clusterconnect"));
 	shared.sync = createObject(REDIS_STRING, sdsnew("sync"));
 	shared.psync = createObject(REDIS_STRING, sdsnew("psync"));
+	shared.wait = createObject(REDIS_STRING, sdsnew("wait"));
+	shared.replconf = createObject(REDIS_STRING, sdsnew("replconf"));
 	shared.delsync = createObject(REDIS_STRING, sdsnew("delsync"));
 	shared.zadd = createObject(REDIS_STRING, sdsnew("zadd"));
 	shared.zrange = createObject(REDIS_STRING, sdsnew("zrange"));
@@ -307,6 +314,7 @@ void createSharedObjects()
 	shared.zcard = createObject(REDIS_STRING, sdsnew("zcard"));
 	shared.dump = createObject(REDIS_STRING, sdsnew("dump"));
 	shared.restore = createObject(REDIS_STRING, sdsnew("restore"));
+	shared.replace = createObject(REDIS_STRING, sdsnew("replace"));
 	shared.incr = createObject(REDIS_STRING, sdsnew("incr"));
 	shared.decr = createObject(REDIS_STRING, sdsnew("decr"));
 	shared.monitor = createObject(REDIS_STRING, sdsnew("monitor"));
@@ -315,6 +323,12 @@ void createSharedObjects()
 	shared.select = createObject(REDIS_STRING, sdsnew("select"));
 	shared.unsubscribe = createObject(REDIS_STRING, sdsnew("unsubscribe"));
 	shared.publish =  createObject(REDIS_STRING, sdsnew("publish"));
+	shared.pubsub = createObject(REDIS_STRING, sdsnew("pubsub"));
+	shared.psubscribe = createObject(REDIS_STRING, sdsnew("psubscribe"));
+	shared.punsubscribe = createObject(REDIS_STRING, sdsnew("punsubscribe"));
+	shared.slowlog = createObject(REDIS_STRING, sdsnew("slowlog"));
+	shared.latency = createObject(REDIS_STRING, sdsnew("latency"));
+	shared.bgrewriteaof = createObject(REDIS_STRING, sdsnew("bgrewriteaof"));
 
 	for (j = 0; j < REDIS_SHARED_INTEGERS; j++)
 	{
@@ -0,0 +1,223 @@
+#include "pubsub.h"
+
+GlobPattern::GlobPattern(const char *pattern, size_t len)
+{
+	size_t i = 0;
+	while (i < len)
+	{
+		Token token;
+		switch (pattern[i])
+		{
+		case '*':
+			while (i < len && pattern[i] == '*')
+			{
+				i++;
+			}
+			token.type = kStar;
+			tokens.push_back(std::move(token));
+			continue;
+		case '?':
+			token.type = kAny;
+			tokens.push_back(std::move(token));
+			i++;
+			continue;
+		case '[':
+		{
+			bool no = false;
+			i++;
+			if (i < len && pattern[i] == '^')
+			{
+				no = true;
+				i++;
+			}
+
+			while (i < len && pattern[i] != ']')
+			{
+				if (pattern[i] == '\\' && i + 1 < len)
+				{
+					token.set.set((uint8_t)pattern[++i]);
+				}
+				else if (i + 2 < len && pattern[i + 1] == '-')
+				{
+					uint8_t start = pattern[i];
+					uint8_t end = pattern[i + 2];
+					if (start > end)
+					{
+						std::swap(start, end);
+					}
+
+					for (int32_t c = start; c <= end; c++)
+					{
+						token.set.set(c);
+					}
+					i += 2;
+				}
+				else
+				{
+					token.set.set((uint8_t)pattern[i]);
+				}
+				i++;
+			}
+
+			if (no)
+			{
+				token.set.flip();
+			}
+
+			token.type = kClass;
+			tokens.push_back(std::move(token));
+			i++;
+			continue;
+		}
+		case '\\':
+			if (i + 1 < len)
+			{
+				i++;
+			}
+			/* fall through */
+		default:
+			if (tokens.empty() || tokens.back().type != kLiteral)
+			{
+				token.type = kLiteral;
+				tokens.push_back(std::move(token));
+			}
+			tokens.back().literal.push_back(pattern[i++]);
+			break;
+		}
+	}
+
+	if (!tokens.empty() && tokens.front().type == kLiteral)
+	{
+		prefix = std::move(tokens.front().literal);
+		tokens.erase(tokens.begin());
+	}
+}
+
+/* Every token but the star consumes a fixed length, so backtracking to
+ * the last star seen is enough. */
+bool GlobPattern::match(const char *str, size_t len) const
+{
+	size_t ti = 0;
+	size_t si = 0;
+	size_t starTi = tokens.size();
+	size_t starSi = 0;
+
+	while (ti < tokens.size() || si < len)
+	{
+		if (ti < tokens.size())
+		{
+			const Token &token = tokens[ti];
+			if (token.type == kStar)
+			{
+				starTi = ti++;
+				starSi = si;
+				continue;
+			}
+			else if (token.type == kAny)
+			{
+				if (si < len)
+				{
+					ti++;
+					si++;
+					continue;
+				}
+			}
+			else if (token.type == kClass)
+			{
+				if (si < len && token.set.test((uint8_t)str[si]))
+				{
+					ti++;
+					si++;
+					continue;
+				}
+			}
+			else if (len - si >= token.literal.size() &&
+				memcmp(str + si, token.literal.data(), token.literal.size()) == 0)
+			{
+				si += token.literal.size();
+				ti++;
+				continue;
+			}
+		}
+
+		if (starTi < tokens.size() && starSi < len)
+		{
+			si = ++starSi;
+			ti = starTi + 1;
+			continue;
+		}
+		return false;
+	}
+	return true;
+}
+
+PatternIndex::PatternIndex()
+{
+
+}
+
+bool PatternIndex::subscribe(const RedisObjectPtr &pattern, const TcpConnectionPtr &conn)
+{
+	auto it = patterns.find(pattern);
+	if (it == patterns.end())
+	{
+		PatternEntryPtr entry(new PatternEntry(pattern));
+		Node *node = &root;
+		for (auto c : entry->glob.getPrefix())
+		{
+			auto &child = node->children[c];
+			if (!child)
+			{
+				child.reset(new Node());
+			}
+			node = child.get();
+		}
+
+		node->entries.push_back(entry);
+		it = patterns.insert(std::make_pair(pattern, entry)).first;
+	}
+	return it->second->conns.insert(std::make_pair(conn->getSockfd(), conn)).second;
+}
+
+bool PatternIndex::unsubscribe(const RedisObjectPtr &pattern, int32_t sockfd)
+{
+	auto it = patterns.find(pattern);
+	if (it == patterns.end())
+	{
+		return false;
+	}
+
+	bool retval = it->second->conns.erase(sockfd) > 0;
+	if (it->second->conns.empty())
+	{
+		removeEntry(it->second);
+		patterns.erase(it);
+	}
+	return retval;
+}
+
+void PatternIndex::removeEntry(const PatternEntryPtr &entry)
+{
+	const std::string &prefix = entry->glob.getPrefix();
+	std::vector<Node*> path;
+	Node *node = &root;
+	path.push_back(node);
+	for (auto c : prefix)
+	{
+		node = node->children[c].get();
+		path.push_back(node);
+	}
+
+	auto &entries = node->entries;
+	entries.erase(std::find(entries.begin(), entries.end(), entry));
+
+	/* Prune the nodes left without patterns or children. */
+	for (size_t i = prefix.size(); i > 0; i--)
+	{
+		if (!path[i]->entries.empty() || !path[i]->children.empty())
+		{
+			break;
+		}
+		path[i - 1]->children.erase(prefix[i - 1]);
+	}
+}
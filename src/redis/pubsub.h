@@ -0,0 +1,104 @@
+#pragma once
+#include "all.h"
+#include "object.h"
+#include "tcpconnection.h"
+
+/* A glob pattern parsed once into tokens, with the same semantics as
+ * stringmatchlen(). The leading literal is split off as the prefix, match()
+ * is given what follows it in the channel. */
+class GlobPattern
+{
+public:
+	GlobPattern(const char *pattern, size_t len);
+
+	const std::string &getPrefix() const { return prefix; }
+	bool match(const char *str, size_t len) const;
+
+private:
+	enum
+	{
+		kLiteral,
+		kAny,
+		kStar,
+		kClass,
+	};
+
+	struct Token
+	{
+		int32_t type;
+		std::string literal;
+		std::bitset<256> set;
+	};
+
+	std::string prefix;
+	std::vector<Token> tokens;
+};
+
+struct PatternEntry
+{
+	PatternEntry(const RedisObjectPtr &pattern)
+		:pattern(pattern),
+		glob(pattern->ptr, sdslen(pattern->ptr))
+	{
+
+	}
+
+	RedisObjectPtr pattern;
+	GlobPattern glob;
+	std::unordered_map<int32_t, TcpConnectionPtr> conns;
+};
+
+typedef std::shared_ptr<PatternEntry> PatternEntryPtr;
+
+/* Patterns hang off a trie keyed by their literal prefix, a channel walks
+ * down it once and only the patterns found on its path are evaluated.
+ * Not thread safe, callers hold their own lock. */
+class PatternIndex
+{
+public:
+	PatternIndex();
+
+	bool subscribe(const RedisObjectPtr &pattern, const TcpConnectionPtr &conn);
+	bool unsubscribe(const RedisObjectPtr &pattern, int32_t sockfd);
+	size_t size() const { return patterns.size(); }
+
+	template <typename F>
+	void match(const char *channel, size_t len, F &&f) const
+	{
+		const Node *node = &root;
+		size_t depth = 0;
+		while (node)
+		{
+			for (auto &it : node->entries)
+			{
+				if (it->glob.match(channel + depth, len - depth))
+				{
+					f(*it);
+				}
+			}
+
+			if (depth == len)
+			{
+				break;
+			}
+
+			auto iter = node->children.find(channel[depth++]);
+			node = iter == node->children.end() ? nullptr : iter->second.get();
+		}
+	}
+
+private:
+	PatternIndex(const PatternIndex&);
+	void operator=(const PatternIndex&);
+
+	struct Node
+	{
+		std::unordered_map<char, std::unique_ptr<Node>> children;
+		std::vector<PatternEntryPtr> entries;
+	};
+
+	void removeEntry(const PatternEntryPtr &entry);
+
+	Node root;
+	std::unordered_map<RedisObjectPtr, PatternEntryPtr, Hash, Equal> patterns;
+};
@@ -13,6 +13,177 @@ Rdb::~Rdb()
 
 }
 
+RdbStream::RdbStream()
+	:closed(false),
+	aborted(false)
+{
+
+}
+
+bool RdbStream::write(const char *data, size_t len)
+{
+	std::unique_lock <std::mutex> lck(mtx);
+	while (input.readableBytes() >= kMaxPending && !aborted)
+	{
+		condition.wait(lck);
+	}
+
+	if (aborted)
+	{
+		return false;
+	}
+
+	input.append(data, len);
+	condition.notify_all();
+	return true;
+}
+
+/* Returns 0 when the stream was closed before len bytes arrived. */
+size_t RdbStream::read(void *buf, size_t len)
+{
+	if (output.readableBytes() < len)
+	{
+		std::unique_lock <std::mutex> lck(mtx);
+		while (output.readableBytes() + input.readableBytes() < len && !closed)
+		{
+			condition.wait(lck);
+		}
+
+		output.append(input.peek(), input.readableBytes());
+		input.retrieveAll();
+		condition.notify_all();
+		if (output.readableBytes() < len)
+		{
+			return 0;
+		}
+	}
+
+	memcpy(buf, output.peek(), len);
+	output.retrieve(len);
+	return len;
+}
+
+void RdbStream::close()
+{
+	std::unique_lock <std::mutex> lck(mtx);
+	closed = true;
+	condition.notify_all();
+}
+
+void RdbStream::abort()
+{
+	std::unique_lock <std::mutex> lck(mtx);
+	aborted = true;
+	closed = true;
+	condition.notify_all();
+}
+
+RdbInserter::RdbInserter(int32_t count)
+	:finished(false)
+{
+	for (int32_t i = 0; i < count; i++)
+	{
+		workers.push_back(std::unique_ptr<Worker>(new Worker()));
+	}
+
+	for (auto &it : workers)
+	{
+		Worker *worker = it.get();
+		worker->thread = std::thread([this, worker]() { run(worker); });
+	}
+}
+
+RdbInserter::~RdbInserter()
+{
+	finish();
+}
+
+void RdbInserter::insert(size_t index, Functor &&cb)
+{
+	Worker *worker = workers[index % workers.size()].get();
+	worker->batch.push_back(std::move(cb));
+	if (worker->batch.size() >= kBatch)
+	{
+		flush(worker);
+	}
+}
+
+/* The decoder waits while a worker is too far behind, so what is decoded but
+ * not inserted yet stays bounded. */
+void RdbInserter::flush(Worker *worker)
+{
+	std::unique_lock <std::mutex> lck(worker->mtx);
+	while (worker->pending.size() >= kMaxPending)
+	{
+		worker->condition.wait(lck);
+	}
+
+	if (worker->pending.empty())
+	{
+		worker->pending.swap(worker->batch);
+	}
+	else
+	{
+		std::move(worker->batch.begin(), worker->batch.end(),
+			std::back_inserter(worker->pending));
+		worker->batch.clear();
+	}
+	worker->condition.notify_all();
+}
+
+void RdbInserter::run(Worker *worker)
+{
+	ThreadPool::clearThreadAffinity();
+	std::vector<Functor> tasks;
+	while (1)
+	{
+		{
+			std::unique_lock <std::mutex> lck(worker->mtx);
+			while (worker->pending.empty() && !worker->closed)
+			{
+				worker->condition.wait(lck);
+			}
+
+			if (worker->pending.empty())
+			{
+				break;
+			}
+
+			tasks.swap(worker->pending);
+			worker->condition.notify_all();
+		}
+
+		for (auto &it : tasks)
+		{
+			it();
+		}
+		tasks.clear();
+	}
+}
+
+/* Returns once everything handed over so far is inserted. */
+void RdbInserter::finish()
+{
+	if (finished)
+	{
+		return;
+	}
+
+	finished = true;
+	for (auto &it : workers)
+	{
+		flush(it.get());
+		std::unique_lock <std::mutex> lck(it->mtx);
+		it->closed = true;
+		it->condition.notify_all();
+	}
+
+	for (auto &it : workers)
+	{
+		it->thread.join();
+	}
+}
+
 /* Returns REDIS_OK or 0 for success/failure. */
 size_t Rdb::rioBufferWrite(Rio *r, const void *buf, size_t len)
 {
@@ -60,9 +231,9 @@ size_t Rdb::rioWrite(Rio *r, const void *buf, size_t len)
 	{
 		size_t bytesToWrite = (r->maxProcessingChunk &&
 			r->maxProcessingChunk < len) ? r->maxProcessingChunk : len;
-		if (r->updateFuc)
+		if (r->checksum)
 		{
-			r->updateFuc(r, buf, bytesToWrite);
+			rioGenericUpdateChecksum(r, buf, bytesToWrite);
 		}
 
 		if (r->writeFuc(r, buf, bytesToWrite) == 0)
@@ -86,9 +257,9 @@ size_t Rdb::rioRepliRead(Rio *r, void *buf, size_t len)
 		return 0;
 	}
 
-	if (r->updateFuc)
+	if (r->checksum)
 	{
-		r->updateFuc(r, buf, readBytes);
+		rioGenericUpdateChecksum(r, buf, readBytes);
 	}
 
 	r->processedBytes += readBytes;
@@ -101,14 +272,31 @@ size_t Rdb::rioRead(Rio *r, void *buf, size_t len)
 	{
 		size_t bytesToRead = (r->maxProcessingChunk &&
 			r->maxProcessingChunk < len) ? r->maxProcessingChunk : len;
-		if (r->readFuc(r, buf, bytesToRead) == 0)
+		size_t retval;
+		switch (r->type)
+		{
+		case RIO_TYPE_MMAP:
+			retval = rioMmapRead(r, buf, bytesToRead);
+			break;
+		case RIO_TYPE_STREAM:
+			retval = rioStreamRead(r, buf, bytesToRead);
+			break;
+		case RIO_TYPE_FILE:
+			retval = rioFileRead(r, buf, bytesToRead);
+			break;
+		default:
+			retval = rioBufferRead(r, buf, bytesToRead);
+			break;
+		}
+
+		if (retval == 0)
 		{
 			return 0;
 		}
 
-		if (r->updateFuc)
+		if (r->checksum)
 		{
-			r->updateFuc(r, buf, bytesToRead);
+			rioGenericUpdateChecksum(r, buf, bytesToRead);
 		}
 
 		buf = (char*)buf + bytesToRead;
@@ -118,6 +306,39 @@ size_t Rdb::rioRead(Rio *r, void *buf, size_t len)
 	return REDIS_OK;
 }
 
+size_t Rdb::rioMmapRead(Rio *r, void *buf, size_t len)
+{
+	if (r->io.mmap.size - r->io.mmap.pos < len)
+	{
+		return 0;
+	}
+
+	memcpy(buf, r->io.mmap.base + r->io.mmap.pos, len);
+	r->io.mmap.pos += len;
+	return REDIS_OK;
+}
+
+off_t Rdb::rioMmapTell(Rio *r)
+{
+	return r->io.mmap.pos;
+}
+
+size_t Rdb::rioStreamRead(Rio *r, void *buf, size_t len)
+{
+	if (r->io.stream.stream->read(buf, len) == 0)
+	{
+		return 0;
+	}
+
+	r->io.stream.pos += len;
+	return REDIS_OK;
+}
+
+off_t Rdb::rioStreamTell(Rio *r)
+{
+	return r->io.stream.pos;
+}
+
 size_t Rdb::rioFileRead(Rio *r, void *buf, size_t len)
 {
 	return ::fread(buf, len, 1, r->io.file.fp);
@@ -157,34 +378,72 @@ void Rdb::rioGenericUpdateChecksum(Rio *r, const void *buf, size_t len)
 
 void Rdb::rioInitWithBuffer(Rio *r, sds s)
 {
-	r->readFuc = std::bind(&Rdb::rioBufferRead, this,
-		std::placeholders::_1, std::placeholders::_2, std::placeholders::_3);
+	r->type = RIO_TYPE_BUFFER;
+	r->checksum = false;
 	r->writeFuc = std::bind(&Rdb::rioBufferWrite, this,
 		std::placeholders::_1, std::placeholders::_2, std::placeholders::_3);
 	r->tellFuc = std::bind(&Rdb::rioBufferTell, this, std::placeholders::_1);
 	r->flushFuc = std::bind(&Rdb::rioBufferFlush, this, std::placeholders::_1);
+	r->staging = false;
+	r->inserter = nullptr;
 	r->io.buffer.ptr = s;
 	r->io.buffer.pos = 0;
 }
 
 void Rdb::rioInitWithFile(Rio *r, FILE *fp)
 {
-	r->readFuc = std::bind(&Rdb::rioFileRead, this,
-		std::placeholders::_1, std::placeholders::_2, std::placeholders::_3);
+	r->type = RIO_TYPE_FILE;
+	r->checksum = true;
 	r->writeFuc = std::bind(&Rdb::rioFileWrite, this,
 		std::placeholders::_1, std::placeholders::_2, std::placeholders::_3);
 	r->tellFuc = std::bind(&Rdb::rioFileTell, this, std::placeholders::_1);
 	r->flushFuc = std::bind(&Rdb::rioFileFlush, this, std::placeholders::_1);
-	r->updateFuc = std::bind(&Rdb::rioGenericUpdateChecksum, this,
-		std::placeholders::_1, std::placeholders::_2, std::placeholders::_3);
 	r->cksum = 0;
 	r->processedBytes = 0;
 	r->maxProcessingChunk = 1024 * 64;
+	r->staging = false;
+	r->inserter = nullptr;
 	r->io.file.fp = fp;
 	r->io.file.buffered = 0;
 	r->io.file.autosync = 0;
 }
 
+/* Read-only view of a mapped file. Reads are plain memcpy and the whole file
+ * is consumed in one pass, so no chunking is needed. */
+void Rdb::rioInitWithMmap(Rio *r, const char *base, size_t size)
+{
+	r->type = RIO_TYPE_MMAP;
+	r->checksum = true;
+	r->writeFuc = nullptr;
+	r->tellFuc = std::bind(&Rdb::rioMmapTell, this, std::placeholders::_1);
+	r->flushFuc = nullptr;
+	r->cksum = 0;
+	r->processedBytes = 0;
+	r->maxProcessingChunk = 0;
+	r->staging = false;
+	r->inserter = nullptr;
+	r->io.mmap.base = base;
+	r->io.mmap.size = size;
+	r->io.mmap.pos = 0;
+}
+
+/* Reads of a stream are chunked so none waits for more than it may buffer. */
+void Rdb::rioInitWithStream(Rio *r, RdbStream *stream)
+{
+	r->type = RIO_TYPE_STREAM;
+	r->checksum = true;
+	r->writeFuc = nullptr;
+	r->tellFuc = std::bind(&Rdb::rioStreamTell, this, std::placeholders::_1);
+	r->flushFuc = nullptr;
+	r->cksum = 0;
+	r->processedBytes = 0;
+	r->maxProcessingChunk = 1024 * 64;
+	r->staging = false;
+	r->inserter = nullptr;
+	r->io.stream.stream = stream;
+	r->io.stream.pos = 0;
+}
+
 int32_t Rdb::rdbEncodeInteger(int64_t value, uint8_t *enc)
 {
 	if (value >= -(1 << 7) && value <= (1 << 7) - 1)
@@ -413,6 +672,9 @@ RedisObjectPtr Rdb::rdbGenericLoadStringObject(Rio *rdb, int32_t encode)
 	{
 		return nullptr;
 	}
+
+	/* The hash was taken over the zeroed buffer; redo it on the payload. */
+	o->calHash();
 	return o;
 }
 
@@ -427,25 +689,57 @@ int32_t Rdb::rdbSaveBinaryDoubleValue(Rio *rdb, double val)
 	return rdbWriteRaw(rdb, &val, sizeof(val));
 }
 
-int32_t Rdb::rdbSaveStruct(Rio *rdb)
+int32_t Rdb::rdbSaveStruct(Rio *rdb, int32_t begin, int32_t end)
 {
 	int64_t now = mstime();
 	size_t n = 0;
 	auto &redisShards = redis->getRedisShards();
-	for (auto &it : redisShards)
-	{
-		auto &mu = it.mtx;
-		auto &map = it.redisMap;
-		auto &stringMap = it.stringMap;
-		auto &hashMap = it.hashMap;
-		auto &listMap = it.listMap;
-		auto &zsetMap = it.zsetMap;
-		auto &setMap = it.setMap;
+	bool *cuts = redis->getReplCuts();
+	bool cutting = redis->replSnapshotting;
+	for (int32_t i = begin; i < end; i++)
+	{
+		auto &it = redisShards[i];
+		/* Values are replaced rather than mutated in place, so a shallow copy
+		 * of one shard taken under its lock is a consistent view of it. For a
+		 * replica sync the copy is also the cut between the snapshot and the
+		 * commands held for the slaves. */
+		Redis::RedisMap map;
+		Redis::StringMap stringMap;
+		Redis::HashMap hashMap;
+		Redis::ListMap listMap;
+		Redis::ZsetMap zsetMap;
+		Redis::SetMap setMap;
+		{
+			std::unique_lock <std::mutex> clck(redis->getSnapshotLock(i), std::defer_lock);
+			if (cutting)
+			{
+				clck.lock();
+				if (cuts[i])
+				{
+					continue;
+				}
+				cuts[i] = true;
+			}
+
+			std::unique_lock <std::mutex> lck(it.mtx, std::defer_lock);
+			if (blockEnabled) lck.lock();
+			map = it.redisMap;
+			stringMap = it.stringMap;
+			hashMap = it.hashMap;
+			listMap = it.listMap;
+			zsetMap = it.zsetMap;
+			setMap = it.setMap;
+		}
 
-		if (blockEnabled) mu.lock();
 		for (auto &iter : map)
 		{
+			/* Timers keep microseconds, the file keeps milliseconds. */
 			int64_t expire = redis->getExpire(iter);
+			if (expire != -1)
+			{
+				expire /= 1000;
+			}
+
 			if (iter->type == OBJ_STRING)
 			{
 				auto iterr = stringMap.find(iter);
@@ -569,8 +863,6 @@ int32_t Rdb::rdbSaveStruct(Rio *rdb)
 				assert(false);
 			}
 		}
-
-		if (blockEnabled) mu.unlock();
 	}
 	return REDIS_OK;
 }
@@ -608,17 +900,25 @@ int32_t Rdb::rdbLoadSet(Rio *rdb, int32_t type)
 
 	assert(!set.empty());
 
-	auto &redisShards = redis->getRedisShards();
 	size_t index = key->hash % redis->kShards;
-	auto &mu = redisShards[index].mtx;
-	auto &map = redisShards[index].redisMap;
-	auto &setMap = redisShards[index].setMap;
+	bool staging = rdb->staging;
+	rdbInsert(rdb, index, [this, index, staging, key, set = std::move(set)]() mutable
 	{
+		auto &redisShards = redis->getLoadShards(staging);
+		auto &mu = redisShards[index].mtx;
+		auto &map = redisShards[index].redisMap;
+		auto &setMap = redisShards[index].setMap;
 		std::unique_lock <std::mutex> lck(mu);
 		auto it = setMap.find(key);
 		assert(it == setMap.end());
+
+		auto iter = map.find(key);
+		assert(iter == map.end());
+
 		setMap.insert(std::make_pair(key, std::move(set)));
-	}
+		map.insert(key);
+		redis->addSlotKey(index, key, staging);
+	});
 	return REDIS_OK;
 }
 
@@ -661,12 +961,15 @@ int32_t Rdb::rdbLoadZset(Rio *rdb, int32_t type)
 	assert(!sortMap.empty());
 	assert(!indexMap.empty());
 
-	auto &redisShards = redis->getRedisShards();
 	size_t index = key->hash % redis->kShards;
-	auto &mu = redisShards[index].mtx;
-	auto &map = redisShards[index].redisMap;
-	auto &zsetMap = redisShards[index].zsetMap;
-	{
+	bool staging = rdb->staging;
+	rdbInsert(rdb, index, [this, index, staging, key,
+		indexMap = std::move(indexMap), sortMap = std::move(sortMap)]() mutable
+	{
+		auto &redisShards = redis->getLoadShards(staging);
+		auto &mu = redisShards[index].mtx;
+		auto &map = redisShards[index].redisMap;
+		auto &zsetMap = redisShards[index].zsetMap;
 		std::unique_lock <std::mutex> lck(mu);
 		auto it = zsetMap.find(key);
 		assert(it == zsetMap.end());
@@ -676,7 +979,8 @@ int32_t Rdb::rdbLoadZset(Rio *rdb, int32_t type)
 
 		zsetMap.insert(std::make_pair(key, std::make_pair(std::move(indexMap), std::move(sortMap))));
 		map.insert(key);
-	}
+		redis->addSlotKey(index, key, staging);
+	});
 	return REDIS_OK;
 }
 
@@ -709,12 +1013,14 @@ int32_t Rdb::rdbLoadList(Rio *rdb, int32_t type)
 	}
 
 	assert(!list.empty());
-	auto &redisShards = redis->getRedisShards();
 	size_t index = key->hash % redis->kShards;
-	auto &mu = redisShards[index].mtx;
-	auto &map = redisShards[index].redisMap;
-	auto &listMap = redisShards[index].listMap;
+	bool staging = rdb->staging;
+	rdbInsert(rdb, index, [this, index, staging, key, list = std::move(list)]() mutable
 	{
+		auto &redisShards = redis->getLoadShards(staging);
+		auto &mu = redisShards[index].mtx;
+		auto &map = redisShards[index].redisMap;
+		auto &listMap = redisShards[index].listMap;
 		std::unique_lock <std::mutex> lck(mu);
 		auto it = listMap.find(key);
 		assert(it == listMap.end());
@@ -723,8 +1029,9 @@ int32_t Rdb::rdbLoadList(Rio *rdb, int32_t type)
 		assert(iter == map.end());
 
 		map.insert(key);
+		redis->addSlotKey(index, key, staging);
 		listMap.insert(std::make_pair(key, std::move(list)));
-	}
+	});
 
 	return REDIS_OK;
 }
@@ -765,12 +1072,14 @@ int32_t Rdb::rdbLoadHash(Rio *rdb, int32_t type)
 	}
 
 	assert(!rhash.empty());
-	auto &redisShards = redis->getRedisShards();
 	size_t index = key->hash % redis->kShards;
-	auto &mu = redisShards[index].mtx;
-	auto &map = redisShards[index].redisMap;
-	auto &hashMap = redisShards[index].hashMap;
+	bool staging = rdb->staging;
+	rdbInsert(rdb, index, [this, index, staging, key, rhash = std::move(rhash)]() mutable
 	{
+		auto &redisShards = redis->getLoadShards(staging);
+		auto &mu = redisShards[index].mtx;
+		auto &map = redisShards[index].redisMap;
+		auto &hashMap = redisShards[index].hashMap;
 		std::unique_lock <std::mutex> lck(mu);
 		auto it = hashMap.find(key);
 		assert(it == hashMap.end());
@@ -780,7 +1089,8 @@ int32_t Rdb::rdbLoadHash(Rio *rdb, int32_t type)
 
 		hashMap.insert(std::make_pair(key, std::move(rhash)));
 		map.insert(key);
-	}
+		redis->addSlotKey(index, key, staging);
+	});
 	return REDIS_OK;
 }
 
@@ -799,12 +1109,14 @@ int32_t Rdb::rdbLoadString(Rio *rdb, int32_t type, int64_t expiretime, int64_t n
 
 	key->type = OBJ_STRING;
 	val->type = OBJ_STRING;
-	auto &redisShards = redis->getRedisShards();
 	size_t index = key->hash % redis->kShards;
-	auto &mu = redisShards[index].mtx;
-	auto &map = redisShards[index].redisMap;
-	auto &stringMap = redisShards[index].stringMap;
+	bool staging = rdb->staging;
+	rdbInsert(rdb, index, [this, index, staging, key, val]()
 	{
+		auto &redisShards = redis->getLoadShards(staging);
+		auto &mu = redisShards[index].mtx;
+		auto &map = redisShards[index].redisMap;
+		auto &stringMap = redisShards[index].stringMap;
 		std::unique_lock <std::mutex> lck(mu);
 		auto it = map.find(key);
 		assert(it == map.end());
@@ -812,61 +1124,23 @@ int32_t Rdb::rdbLoadString(Rio *rdb, int32_t type, int64_t expiretime, int64_t n
 		auto iter = stringMap.find(key);
 		assert(iter == stringMap.end());
 		map.insert(key);
+		redis->addSlotKey(index, key, staging);
 		stringMap.insert(std::make_pair(key, val));
-	}
+	});
 
-	if (now < expiretime)
+	if (rdb->staging && expiretime != REDIS_ERR)
 	{
 		RedisObjectPtr k = createStringObject(key->ptr, sdslen(key->ptr));
 		k->type = OBJ_EXPIRE;
-		redis->setExpire(k, (expiretime - now) / 1000);
+		redis->setStagingExpire(k, expiretime);
 	}
-	return REDIS_OK;
-}
-
-bool Rdb::rdbReplication(char *filename, const TcpConnectionPtr &conn)
-{
-	Rio rdb;
-	FILE *fp;
-	if ((fp = ::fopen(filename, "r")) == nullptr)
+	else if (now < expiretime)
 	{
-		return false;
-	}
-
-	rioInitWithFile(&rdb, fp);
-	int32_t sendlen = startLoading(fp);
-
-	Buffer buf;
-	buf.appendInt32(sendlen);
-	conn->send(&buf);
-
-#ifdef _WIN64
-	int32_t fd = ::_fileno(fp);
-#else
-	int32_t fd = ::fileno(fp);
-#endif
-
-	if (fd < 0)
-	{
-		return false;
-	}
-
-	off_t offset = 0;
-	ssize_t nwrote = 0;
-
-	while (sendlen)
-	{
-#ifdef __linux__
-		nwrote = ::sendfile(conn->getSockfd(), fd, &offset, REDIS_SLAVE_SYNC_SIZE);
-#endif
-		if (nwrote >= 0)
-		{
-			sendlen -= nwrote;
-		}
+		RedisObjectPtr k = createStringObject(key->ptr, sdslen(key->ptr));
+		k->type = OBJ_EXPIRE;
+		redis->setExpire(k, (expiretime - now) / 1000.0);
 	}
-
-	::fclose(fp);
-	return true;
+	return REDIS_OK;
 }
 
 int32_t Rdb::rdbSyncWrite(const char *buf, FILE *fp, size_t len)
@@ -895,8 +1169,18 @@ int32_t Rdb::createDumpPayload(Rio *rdb, const RedisObjectPtr &obj)
 	{
 		std::unique_lock <std::mutex> lck(mu);
 		auto iter = map.find(obj);
-		if (iter != map.end())
+		if (iter == map.end())
 		{
+			return REDIS_ERR;
+		}
+		else
+		{
+			/* The type leads the value, the key is given again to RESTORE. */
+			if (rdbSaveObjectType(rdb, *iter) == REDIS_ERR)
+			{
+				return REDIS_ERR;
+			}
+
 			if ((*iter)->type == OBJ_STRING)
 			{
 				auto iterr = stringMap.find(obj);
@@ -938,8 +1222,12 @@ int32_t Rdb::createDumpPayload(Rio *rdb, const RedisObjectPtr &obj)
 
 				for (auto &iterrr : iterr->second)
 				{
-					if (rdbSaveKeyValuePair(rdb, iterrr.first,
-						iterrr.second, -1, -1) == REDIS_ERR)
+					if (rdbSaveValue(rdb, iterrr.first) == REDIS_ERR)
+					{
+						return REDIS_ERR;
+					}
+
+					if (rdbSaveValue(rdb, iterrr.second) == REDIS_ERR)
 					{
 						return REDIS_ERR;
 					}
@@ -993,17 +1281,56 @@ int32_t Rdb::createDumpPayload(Rio *rdb, const RedisObjectPtr &obj)
 			}
 		}
 	}
+	return REDIS_OK;
+}
 
-	if (rdbSaveType(rdb, RDB_OPCODE_EOF) == REDIS_ERR)
+/* Loads a payload of DUMP under the key it is restored to, put back in front
+ * of the value it reads as a record of a snapshot. */
+int32_t Rdb::loadDumpPayload(const RedisObjectPtr &key,
+	const char *payload, size_t len, int64_t ttl)
+{
+	if (len < 2)
 	{
 		return REDIS_ERR;
 	}
-	return REDIS_OK;
-}
 
-int32_t Rdb::verifyDumpPayload(Rio *rdb, const RedisObjectPtr &obj)
-{
-	return REDIS_OK;
+	Rio rdb;
+	rioInitWithBuffer(&rdb, sdsnewlen(payload, 1));
+	if (rdbSaveStringObject(&rdb, key) == REDIS_ERR)
+	{
+		sdsfree(rdb.io.buffer.ptr);
+		return REDIS_ERR;
+	}
+
+	rdb.io.buffer.ptr = sdscatlen(rdb.io.buffer.ptr, payload + 1, len - 1);
+	rdb.io.buffer.pos = 0;
+
+	int64_t now = mstime();
+	int32_t type = rdbLoadType(&rdb);
+	int32_t ret = REDIS_ERR;
+	if (type == REDIS_STRING)
+	{
+		ret = rdbLoadString(&rdb, type, ttl > 0 ? now + ttl : REDIS_ERR, now);
+	}
+	else if (type == REDIS_HASH)
+	{
+		ret = rdbLoadHash(&rdb, type);
+	}
+	else if (type == REDIS_LIST)
+	{
+		ret = rdbLoadList(&rdb, type);
+	}
+	else if (type == REDIS_SET)
+	{
+		ret = rdbLoadSet(&rdb, type);
+	}
+	else if (type == REDIS_ZSET)
+	{
+		ret = rdbLoadZset(&rdb, type);
+	}
+
+	sdsfree(rdb.io.buffer.ptr);
+	return ret;
 }
 
 int32_t Rdb::rdbSyncClose(const char *fileName, FILE *fp)
@@ -1103,6 +1430,8 @@ int32_t Rdb::rdbLoadRio(Rio *rdb)
 	uint32_t dbid;
 	int32_t type, rdbver;
 	char buf[1024];
+	rdb->shardBegin = 0;
+	rdb->shardEnd = redis->kShards;
 
 	if (rioRead(rdb, buf, REDIS_RDB_VERSION) == 0)
 	{
@@ -1184,6 +1513,8 @@ int32_t Rdb::rdbLoadRio(Rio *rdb)
 			{
 				return REDIS_ERR;
 			}
+
+			redis->reserveShards(dbSize, rdb->staging, rdb->shardBegin, rdb->shardEnd);
 			continue;
 		}
 		else if (type == RDB_OPCODE_AUX)
@@ -1211,6 +1542,15 @@ int32_t Rdb::rdbLoadRio(Rio *rdb)
 				 * level of NOTICE. */
 				LOG_WARN << "RDB " << (char*)auxkey->ptr << " " << (char*)auxval->ptr;
 			}
+			else if (!strcmp((char*)auxkey->ptr, "shard-begin"))
+			{
+				/* A segment only holds keys of its own shard range. */
+				rdb->shardBegin = std::max(0, atoi((char*)auxval->ptr));
+			}
+			else if (!strcmp((char*)auxkey->ptr, "shard-end"))
+			{
+				rdb->shardEnd = std::min((int32_t)redis->kShards, atoi((char*)auxval->ptr));
+			}
 			continue; /* Read type again. */
 		}
 		else if (type == REDIS_STRING)
@@ -1278,11 +1618,57 @@ int32_t Rdb::rdbLoadRio(Rio *rdb)
 	return REDIS_OK;
 }
 
+/* A single file is decoded by one thread, the inserts into the shards are
+ * spread over the other cores. */
 int32_t Rdb::rdbLoad(const char *filename)
 {
-	FILE *fp;
+	int32_t workers = std::thread::hardware_concurrency() - 1;
+	return rdbLoadFile(filename, std::min(workers, (int32_t)redis->kShards));
+}
+
+int32_t Rdb::rdbLoadFile(const char *filename, int32_t workers)
+{
 	Rio rdb;
 	int32_t retval;
+	std::unique_ptr<RdbInserter> inserter;
+	if (workers > 0)
+	{
+		inserter.reset(new RdbInserter(workers));
+	}
+#ifndef _WIN64
+	int32_t fd = ::open(filename, O_RDONLY);
+	if (fd < 0)
+	{
+		return REDIS_ERR;
+	}
+
+	struct stat sb;
+	if (::fstat(fd, &sb) < 0 || sb.st_size == 0)
+	{
+		::close(fd);
+		errno = EINVAL;
+		return REDIS_ERR;
+	}
+
+	LOG_INFO << filename << " file size " << sb.st_size;
+	void *base = ::mmap(nullptr, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	::close(fd);
+	if (base == MAP_FAILED)
+	{
+		return REDIS_ERR;
+	}
+
+	::madvise(base, sb.st_size, MADV_SEQUENTIAL);
+	rioInitWithMmap(&rdb, (const char*)base, sb.st_size);
+	rdb.inserter = inserter.get();
+	retval = rdbLoadRio(&rdb);
+	if (inserter)
+	{
+		inserter->finish();
+	}
+	::munmap(base, sb.st_size);
+#else
+	FILE *fp;
 	if ((fp = ::fopen(filename, "r")) == nullptr)
 	{
 		return REDIS_ERR;
@@ -1290,8 +1676,29 @@ int32_t Rdb::rdbLoad(const char *filename)
 
 	startLoading(fp);
 	rioInitWithFile(&rdb, fp);
+	rdb.inserter = inserter.get();
 	retval = rdbLoadRio(&rdb);
+	if (inserter)
+	{
+		inserter->finish();
+	}
 	::fclose(fp);
+#endif
+	return retval;
+}
+
+/* Loads a snapshot as it arrives into the staging keyspace, the stream is
+ * aborted on failure so its writer stops waiting. */
+int32_t Rdb::rdbLoadStream(RdbStream *stream)
+{
+	Rio rdb;
+	rioInitWithStream(&rdb, stream);
+	rdb.staging = true;
+	int32_t retval = rdbLoadRio(&rdb);
+	if (retval != REDIS_OK)
+	{
+		stream->abort();
+	}
 	return retval;
 }
 
@@ -1738,11 +2145,15 @@ int32_t Rdb::rdbWriteRaw(Rio *rdb, void *p, size_t len)
  * integer pointed by 'error' is set to the value of errno just after the I/O
  * error. */
 
-int32_t Rdb::rdbSaveRio(Rio *rdb, int32_t *error, int32_t flags)
+int32_t Rdb::rdbSaveRio(Rio *rdb, int32_t *error, int32_t flags, int32_t begin, int32_t end)
 {
 	char magic[10];
 	int64_t now = time(0);
 	uint64_t cksum;
+	if (end < 0)
+	{
+		end = redis->kShards;
+	}
 
 	snprintf(magic, sizeof(magic), "REDIS%04d", REDIS_RDB_VERSION);
 	if (rdbWriteRaw(rdb, magic, 9) == REDIS_ERR)
@@ -1754,6 +2165,15 @@ int32_t Rdb::rdbSaveRio(Rio *rdb, int32_t *error, int32_t flags)
 		goto werr;
 	}
 
+	if (begin != 0 || end != redis->kShards)
+	{
+		if (rdbSaveAuxFieldStrInt(rdb, "shard-begin", begin) == REDIS_ERR ||
+			rdbSaveAuxFieldStrInt(rdb, "shard-end", end) == REDIS_ERR)
+		{
+			goto werr;
+		}
+	}
+
 	for (int i = 0; i < redis->dbnum; i++)
 	{
 		if (rdbSaveType(rdb, RDB_OPCODE_SELECTDB) == REDIS_ERR)
@@ -1767,7 +2187,7 @@ int32_t Rdb::rdbSaveRio(Rio *rdb, int32_t *error, int32_t flags)
 		}
 
 		uint32_t dbSize, expireSize;
-		dbSize = redis->getDbsize();
+		dbSize = redis->getDbsize(begin, end);
 		expireSize = redis->getExpireSize();
 
 		if (rdbSaveType(rdb, RDB_OPCODE_RESIZEDB) == REDIS_ERR)
@@ -1785,7 +2205,7 @@ int32_t Rdb::rdbSaveRio(Rio *rdb, int32_t *error, int32_t flags)
 			goto werr;
 		}
 
-		if (rdbSaveStruct(rdb) == REDIS_ERR)
+		if (rdbSaveStruct(rdb, begin, end) == REDIS_ERR)
 		{
 			goto werr;
 		}
@@ -1808,13 +2228,13 @@ werr:
 	return REDIS_ERR;
 }
 
-int32_t Rdb::rdbSave(const char *filename)
+int32_t Rdb::rdbSave(const char *filename, int32_t begin, int32_t end)
 {
 	char tmpfile[256];
 	FILE *fp;
 	Rio rdb;
 	int32_t error;
-	snprintf(tmpfile, 256, "temp-%d.rdb", std::this_thread::get_id());
+	snprintf(tmpfile, 256, "temp-%d-%s", (int32_t)getpid(), filename);
 	fp = ::fopen(tmpfile, "w");
 	if (!fp)
 	{
@@ -1823,7 +2243,7 @@ int32_t Rdb::rdbSave(const char *filename)
 	}
 
 	rioInitWithFile(&rdb, fp);
-	if (rdbSaveRio(&rdb, &error, RDB_SAVE_NONE) == REDIS_ERR)
+	if (rdbSaveRio(&rdb, &error, RDB_SAVE_NONE, begin, end) == REDIS_ERR)
 	{
 		goto werr;
 	}
@@ -1855,6 +2275,245 @@ werr:
 	return REDIS_ERR;
 }
 
+/* Diskless snapshot: the payload is handed to sink in chunks of
+ * REDIS_SLAVE_SYNC_SIZE instead of being written to a file. */
+int32_t Rdb::rdbSaveStream(const std::function<bool(const char *, size_t)> &sink)
+{
+	Rio rdb;
+	int32_t error;
+	rioInitWithBuffer(&rdb, sdsempty());
+	rdb.checksum = true;
+	rdb.cksum = 0;
+	rdb.processedBytes = 0;
+	rdb.maxProcessingChunk = 0;
+	rdb.writeFuc = [&](Rio *r, const void *buf, size_t len) -> size_t
+	{
+		rioBufferWrite(r, buf, len);
+		if (sdslen(r->io.buffer.ptr) < REDIS_SLAVE_SYNC_SIZE)
+		{
+			return REDIS_OK;
+		}
+
+		bool ok = sink(r->io.buffer.ptr, sdslen(r->io.buffer.ptr));
+		sdsclear(r->io.buffer.ptr);
+		return ok ? REDIS_OK : 0;
+	};
+
+	int32_t retval = rdbSaveRio(&rdb, &error, RDB_SAVE_NONE);
+	if (retval != REDIS_ERR && sdslen(rdb.io.buffer.ptr) > 0 &&
+		!sink(rdb.io.buffer.ptr, sdslen(rdb.io.buffer.ptr)))
+	{
+		retval = REDIS_ERR;
+	}
+
+	sdsfree(rdb.io.buffer.ptr);
+	return retval == REDIS_ERR ? REDIS_ERR : REDIS_OK;
+}
+
+/* Segmented snapshot: each thread writes a contiguous shard range as a
+ * standalone RDB file, then the manifest naming them is renamed into place.
+ * Segment names carry a generation so a crash never mixes two snapshots. */
+int32_t Rdb::rdbSaveSegments(const char *filename, int32_t segments)
+{
+	if (segments > redis->kShards)
+	{
+		segments = redis->kShards;
+	}
+
+	/* Names that do not fit are refused up front rather than truncated into
+	 * a manifest that points at the wrong files. */
+	int64_t generation = ustime();
+	std::vector<std::string> names(segments);
+	char manifest[256];
+	char tmpfile[sizeof(manifest) + 32];
+	bool fits = snprintf(manifest, sizeof(manifest), "%s%s",
+		filename, REDIS_RDB_MANIFEST_SUFFIX) < (int32_t)sizeof(manifest);
+	for (int32_t i = 0; fits && i < segments; i++)
+	{
+		char name[256];
+		fits = snprintf(name, sizeof(name), "%s.%lld.%d",
+			filename, (long long)generation, i) < (int32_t)sizeof(name);
+		names[i] = name;
+	}
+
+	if (!fits)
+	{
+		LOG_WARN << "Segmented DB file name too long: " << filename;
+		errno = ENAMETOOLONG;
+		return REDIS_ERR;
+	}
+	snprintf(tmpfile, sizeof(tmpfile), "temp-%d-%s", (int32_t)getpid(), manifest);
+
+	std::vector<std::string> olds;
+	rdbReadManifest(filename, olds);
+
+	std::vector<int32_t> results(segments, REDIS_ERR);
+	std::vector<std::thread> threads;
+	for (int32_t i = 0; i < segments; i++)
+	{
+		int32_t begin = i * redis->kShards / segments;
+		int32_t end = (i + 1) * redis->kShards / segments;
+		threads.push_back(std::thread([this, &names, &results, i, begin, end]()
+		{
+			ThreadPool::clearThreadAffinity();
+			results[i] = rdbSave(names[i].c_str(), begin, end);
+		}));
+	}
+
+	bool ok = true;
+	for (int32_t i = 0; i < segments; i++)
+	{
+		threads[i].join();
+		if (results[i] != REDIS_OK)
+		{
+			ok = false;
+		}
+	}
+
+	FILE *fp = nullptr;
+	if (ok)
+	{
+		fp = ::fopen(tmpfile, "w");
+		ok = fp != nullptr;
+	}
+
+	if (ok)
+	{
+		fprintf(fp, "segments %d\n", segments);
+		for (auto &it : names)
+		{
+			fprintf(fp, "%s\n", it.c_str());
+		}
+
+		ok = ::fflush(fp) != EOF;
+#ifndef _WIN64
+		ok = ok && ::fsync(fileno(fp)) != REDIS_ERR;
+#endif
+		ok = (::fclose(fp) != EOF) && ok;
+		ok = ok && ::rename(tmpfile, manifest) != REDIS_ERR;
+	}
+
+	if (!ok)
+	{
+		LOG_WARN << "Write error saving segmented DB on disk:" << strerror(errno);
+		::unlink(tmpfile);
+		for (auto &it : names)
+		{
+			::unlink(it.c_str());
+		}
+		return REDIS_ERR;
+	}
+
+	for (auto &it : olds)
+	{
+		::unlink(it.c_str());
+	}
+	return REDIS_OK;
+}
+
+bool Rdb::rdbReadManifest(const char *filename, std::vector<std::string> &segments)
+{
+	char manifest[256];
+	snprintf(manifest, sizeof(manifest), "%s%s", filename, REDIS_RDB_MANIFEST_SUFFIX);
+	FILE *fp = ::fopen(manifest, "r");
+	if (fp == nullptr)
+	{
+		return false;
+	}
+
+	int32_t count = 0;
+	char line[512];
+	if (fscanf(fp, "segments %d\n", &count) != 1 ||
+		count <= 0 || count > REDIS_RDB_MAX_SEGMENTS)
+	{
+		::fclose(fp);
+		errno = EINVAL;
+		return false;
+	}
+
+	while ((int32_t)segments.size() < count && fgets(line, sizeof(line), fp))
+	{
+		line[strcspn(line, "\r\n")] = '\0';
+		segments.push_back(line);
+	}
+
+	::fclose(fp);
+	if ((int32_t)segments.size() != count)
+	{
+		segments.clear();
+		errno = EINVAL;
+		return false;
+	}
+	return true;
+}
+
+/* Segments cover disjoint shard ranges, so workers never insert into the
+ * same shard and only contend on the expire table. */
+int32_t Rdb::rdbLoadSegments(const char *filename)
+{
+	std::vector<std::string> segments;
+	if (!rdbReadManifest(filename, segments))
+	{
+		return REDIS_ERR;
+	}
+
+	int32_t workers = std::thread::hardware_concurrency();
+	if (workers <= 0 || workers > (int32_t)segments.size())
+	{
+		workers = segments.size();
+	}
+
+	std::atomic<int32_t> next(0);
+	std::atomic<bool> ok(true);
+	std::vector<std::thread> threads;
+	for (int32_t i = 0; i < workers; i++)
+	{
+		threads.push_back(std::thread([this, &segments, &next, &ok]()
+		{
+			ThreadPool::clearThreadAffinity();
+			int32_t index;
+			while (ok && (index = next++) < (int32_t)segments.size())
+			{
+				if (rdbLoadFile(segments[index].c_str(), 0) != REDIS_OK)
+				{
+					LOG_WARN << "Error loading DB segment " << segments[index];
+					ok = false;
+				}
+			}
+		}));
+	}
+
+	for (auto &it : threads)
+	{
+		it.join();
+	}
+
+	if (!ok)
+	{
+		errno = EINVAL;
+		return REDIS_ERR;
+	}
+	return REDIS_OK;
+}
+
+int32_t Rdb::rdbRemoveSegments(const char *filename)
+{
+	std::vector<std::string> segments;
+	if (!rdbReadManifest(filename, segments))
+	{
+		return REDIS_ERR;
+	}
+
+	char manifest[256];
+	snprintf(manifest, sizeof(manifest), "%s%s", filename, REDIS_RDB_MANIFEST_SUFFIX);
+	::unlink(manifest);
+	for (auto &it : segments)
+	{
+		::unlink(it.c_str());
+	}
+	return REDIS_OK;
+}
+
 /* Save a string object as [len][data] on disk. If the object is a string
  * representation of an integer value we try to save it in a special form */
 ssize_t Rdb::rdbSaveRawString(Rio *rdb, uint8_t *s, size_t len)
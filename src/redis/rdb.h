@@ -15,6 +15,77 @@
 #define RDB_CHECK_DOING_READ_LEN 6
 #define RDB_CHECK_DOING_READ_AUX 7
 
+/* Backend of a Rio, switched on directly by reads so loading a key does not
+ * go through an indirect call per field. */
+#define RIO_TYPE_BUFFER 0
+#define RIO_TYPE_FILE 1
+#define RIO_TYPE_MMAP 2
+#define RIO_TYPE_STREAM 3
+
+/* Bytes of a snapshot on their way from the link to the master to the thread
+ * loading it. The loop appends what it receives and waits while too much is
+ * pending; the loader takes all that arrived at once and reads it unlocked. */
+class RdbStream
+{
+public:
+	RdbStream();
+
+	bool write(const char *data, size_t len);
+	size_t read(void *buf, size_t len);
+	void close();
+	void abort();
+
+private:
+	RdbStream(const RdbStream&);
+	void operator=(const RdbStream&);
+
+	static const int32_t kMaxPending = 64 * 1024 * 1024;
+
+	std::mutex mtx;
+	std::condition_variable condition;
+	Buffer input;
+	Buffer output;
+	bool closed;
+	bool aborted;
+};
+
+/* Inserts what a single loader decodes. Each worker owns the shards equal to
+ * its index modulo the worker count, so workers never meet on a shard lock,
+ * and entries of a shard keep the order they were decoded in. */
+class RdbInserter
+{
+public:
+	typedef std::function<void()> Functor;
+	RdbInserter(int32_t workers);
+	~RdbInserter();
+
+	void insert(size_t index, Functor &&cb);
+	void finish();
+
+private:
+	RdbInserter(const RdbInserter&);
+	void operator=(const RdbInserter&);
+
+	static const int32_t kBatch = 256;
+	static const int32_t kMaxPending = 64 * 1024;
+
+	struct Worker
+	{
+		std::mutex mtx;
+		std::condition_variable condition;
+		std::vector<Functor> pending;
+		std::vector<Functor> batch;
+		bool closed = false;
+		std::thread thread;
+	};
+
+	void flush(Worker *worker);
+	void run(Worker *worker);
+
+	std::vector<std::unique_ptr<Worker>> workers;
+	bool finished;
+};
+
 struct Rio
 {
 	union
@@ -32,6 +103,13 @@ struct Rio
 			off_t autosync;
 		}file;
 
+		struct
+		{
+			const char *base;
+			size_t size;
+			off_t pos;
+		}mmap;
+
 		struct
 		{
 			int32_t *fds;
@@ -40,17 +118,27 @@ struct Rio
 			off_t pos;
 			sds buf;
 		}fdset;
+
+		struct
+		{
+			RdbStream *stream;
+			off_t pos;
+		}stream;
 	}io;
 
+	int32_t type;
+	int32_t shardBegin;
+	int32_t shardEnd;
+	bool staging;
+	bool checksum;
 	uint64_t cksum;
+	RdbInserter *inserter;
 	size_t processedBytes;
 	size_t maxProcessingChunk;
 
-	std::function<size_t(Rio *, void *buf, size_t len)> readFuc;
 	std::function<size_t(Rio *, const void *buf, size_t len)> writeFuc;
 	std::function<off_t(Rio *)> tellFuc;
 	std::function<int32_t(Rio *)> flushFuc;
-	std::function<void(Rio *, const void *buf, size_t len)> updateFuc;
 };
 
 struct RdbState
@@ -103,7 +191,15 @@ public:
 	off_t rioBufferTell(Rio *r);
 	int32_t rioBufferFlush(Rio *r);
 
+	size_t rioMmapRead(Rio *r, void *buf, size_t len);
+	off_t rioMmapTell(Rio *r);
+
+	size_t rioStreamRead(Rio *r, void *buf, size_t len);
+	off_t rioStreamTell(Rio *r);
+
 	void rioInitWithFile(Rio *r, FILE *fp);
+	void rioInitWithMmap(Rio *r, const char *base, size_t size);
+	void rioInitWithStream(Rio *r, RdbStream *stream);
 	void rioInitWithBuffer(Rio *r, sds s);
 
 	int32_t rdbLoadRio(Rio *rdb);
@@ -113,8 +209,14 @@ public:
 	int32_t rdbSaveMillisecondTime(Rio *rdb, int64_t t);
 	int32_t rdbSaveType(Rio *rdb, uint8_t type);
 	size_t rdbSaveLen(Rio *rdb, uint32_t len);
-	int32_t rdbSave(const char *filename);
-	int32_t rdbSaveRio(Rio *rdb, int32_t *error, int32_t flags);
+	int32_t rdbSave(const char *filename, int32_t begin = 0, int32_t end = -1);
+	int32_t rdbSaveRio(Rio *rdb, int32_t *error, int32_t flags,
+		int32_t begin = 0, int32_t end = -1);
+	int32_t rdbSaveSegments(const char *filename, int32_t segments);
+	int32_t rdbSaveStream(const std::function<bool(const char *, size_t)> &sink);
+	int32_t rdbLoadSegments(const char *filename);
+	int32_t rdbRemoveSegments(const char *filename);
+	bool rdbReadManifest(const char *filename, std::vector<std::string> &segments);
 	int32_t rdbSaveObject(Rio *rdb, const RedisObjectPtr &o);
 	int32_t rdbSaveStringObject(Rio *rdb, const RedisObjectPtr &obj);
 	int32_t rdbSaveKeyValuePair(Rio *rdb, const RedisObjectPtr &key,
@@ -123,7 +225,7 @@ public:
 	int32_t rdbSaveLzfStringObject(Rio *rdb, uint8_t *s, size_t len);
 	int32_t rdbSaveValue(Rio *rdb, const RedisObjectPtr &value);
 	int32_t rdbSaveKey(Rio *rdb, const RedisObjectPtr &value);
-	int32_t rdbSaveStruct(Rio *rdb);
+	int32_t rdbSaveStruct(Rio *rdb, int32_t begin, int32_t end);
 	int32_t rdbSaveObjectType(Rio *rdb, const RedisObjectPtr &o);
 
 	int32_t rdbLoadType(Rio *rdb);
@@ -140,7 +242,8 @@ public:
 	uint32_t rdbLoadLen(Rio *rdb, int32_t *isencoded);
 
 	int32_t rdbLoad(const char *fileName);
-	bool rdbReplication(char *filename, const TcpConnectionPtr &conn);
+	int32_t rdbLoadFile(const char *fileName, int32_t workers);
+	int32_t rdbLoadStream(RdbStream *stream);
 
 	RedisObjectPtr rdbLoadObject(int32_t type, Rio *rdb);
 	RedisObjectPtr rdbLoadStringObject(Rio *rdb);
@@ -158,7 +261,21 @@ public:
 	int32_t rdbSyncClose(const char *fileName, FILE *fp);
 	void setBlockEnable(bool enabled) { blockEnabled = enabled; }
 	int32_t createDumpPayload(Rio *rdb, const RedisObjectPtr &obj);
-	int32_t verifyDumpPayload(Rio *rdb, const RedisObjectPtr &obj);
+	int32_t loadDumpPayload(const RedisObjectPtr &key,
+		const char *payload, size_t len, int64_t ttl);
+
+	template <typename F>
+	void rdbInsert(Rio *rdb, size_t index, F &&f)
+	{
+		if (rdb->inserter != nullptr)
+		{
+			rdb->inserter->insert(index, std::forward<F>(f));
+		}
+		else
+		{
+			f();
+		}
+	}
 
 private:
 	Rdb(const Rdb&);
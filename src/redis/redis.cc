@@ -7,10 +7,12 @@ Redis::Redis(const char *ip, int16_t port, int16_t threadCount, bool enbaledClus
 	clusterEnabled(enbaledCluster),
 	repli(this),
 	clus(this),
-	rdb(this)
+	rdb(this),
+	aof(this),
+	tracking(this),
+	monitor(this)
 {
 	initConfig();
-	loadDataFromDisk();
 	server.setConnectionCallback(std::bind(&Redis::connCallBack, this, std::placeholders::_1));
 	server.setThreadNum(threadCount);
 	if (threadCount > 1)
@@ -18,8 +20,9 @@ Redis::Redis(const char *ip, int16_t port, int16_t threadCount, bool enbaledClus
 		this->threadCount = threadCount;
 	}
 
-	server.start();
+	loop.getTimerQueue()->setLatencyMonitor(&latency);
 	loop.runAfter(1.0, true, std::bind(&Redis::serverCron, this));
+	loop.runAfter(REDIS_STATS_CRON_INTERVAL, true, std::bind(&Redis::statsCron, this));
 	loop.runAfter(60, true, std::bind(&Redis::bgsaveCron, this));
 
 	{
@@ -31,8 +34,6 @@ Redis::Redis(const char *ip, int16_t port, int16_t threadCount, bool enbaledClus
 		std::thread thread(std::bind(&Cluster::connectCluster, &clus));
 		thread.detach();
 	}
-
-	LOG_INFO << "Ready to accept connections";
 }
 
 
@@ -58,8 +59,46 @@ void Redis::bgsaveCron()
 #endif
 }
 
+void Redis::clientsCron()
+{
+	std::unordered_map<EventLoop*, std::vector<TcpConnectionPtr>> loopConns;
+	for (auto &it : server.getThreadPool()->getAllLoops())
+	{
+		loopConns[it];
+	}
+
+	{
+		std::unique_lock <std::mutex> lck(mtx);
+		for (auto &it : sessionConns)
+		{
+			loopConns[it.second->getLoop()].push_back(it.second);
+		}
+	}
+
+	for (auto &it : loopConns)
+	{
+		it.first->runInLoop(std::bind(&Redis::clientsCronShrink,
+			this, it.first, std::move(it.second)));
+	}
+}
+
+void Redis::clientsCronShrink(EventLoop *loop, const std::vector<TcpConnectionPtr> &conns)
+{
+	int64_t bytes = 0;
+	for (auto &it : conns)
+	{
+		bytes += it->shrinkBuffers();
+	}
+	loop->getBufferPool()->setClientBytes(bytes);
+}
+
 void Redis::serverCron()
 {
+	clientsCron();
+	if (aofEnabled)
+	{
+		aof.rewriteCron();
+	}
 #ifndef _WIN64
 	if (rdbChildPid != -1)
 	{
@@ -76,40 +115,17 @@ void Redis::serverCron()
 			{
 				if (!bysignal && exitcode == 0)
 				{
-					LOG_INFO << "Background saving terminated with success";
-					if (slavefd != -1)
-					{
-						std::unique_lock <std::mutex> lck(slaveMutex);
-						auto it = slaveConns.find(slavefd);
-						if (it == slaveConns.end())
-						{
-							LOG_WARN << "Master sync send failure";
-						}
-						else
-						{
-							if (!rdb.rdbReplication("dump.rdb", it->second))
-							{
-								it->second->forceClose();
-								LOG_WARN << "Master sync send failure";
-							}
-							else
-							{
-								LOG_INFO << "Master sync send success ";
-							}
-						}
-
-						slavefd = -1;
-					}
+					bgsaveDone(true);
 				}
 				else if (!bysignal && exitcode != 0)
 				{
-					LOG_INFO << "Background saving error";
+					bgsaveDone(false);
 				}
 				else
 				{
 					LOG_WARN << "Background saving terminated by signal " << bysignal;
 					char tmpfile[256];
-					snprintf(tmpfile, 256, "temp-%d.rdb", (int32_t)rdbChildPid);
+					snprintf(tmpfile, 256, "temp-%d-%s", (int32_t)rdbChildPid, REDIS_DEFAULT_RDB_FILENGTHAME);
 					unlink(tmpfile);
 					if (bysignal != SIGUSR1)
 					{
@@ -122,18 +138,68 @@ void Redis::serverCron()
 				LOG_WARN << "Warning, detected child with unmatched pid: " << pid;
 			}
 			rdbChildPid = -1;
+
+			/* The child reports the copy-on-write size of its snapshot. */
+			if (childInfoPipe[0] != -1)
+			{
+				size_t cow;
+				if (::read(childInfoPipe[0], &cow, sizeof(cow)) == sizeof(cow))
+				{
+					lastCowSize = cow;
+				}
+				::close(childInfoPipe[0]);
+				childInfoPipe[0] = -1;
+			}
 		}
 	}
 #endif
 }
 
+/* Samples the instantaneous rates reported by INFO. */
+void Redis::statsCron()
+{
+	int64_t now = mstime();
+	int64_t input = 0;
+	int64_t output = 0;
+	std::vector<EventLoop*> loops = getAllLoops();
+
+	std::unique_lock <std::mutex> lck(statsMutex);
+	for (auto &it : loops)
+	{
+		input += it->getNetInputBytes();
+		output += it->getNetOutputBytes();
+		loopBusy[it].track(it->getBusyUs(), now);
+	}
+
+	opsSec.track(commandStats.getTotalCalls(), now);
+	netInputSec.track(input, now);
+	netOutputSec.track(output, now);
+}
+
+void Redis::bgsaveDone(bool ok)
+{
+	lastBgsaveOk = ok;
+	lastBgsaveTime = (mstime() - bgsaveStart) / 1000;
+	if (!ok)
+	{
+		LOG_INFO << "Background saving error";
+		repli.startBgsaveForSync();
+		return;
+	}
+
+	LOG_INFO << "Background saving terminated with success";
+	lastSaveTime = time(nullptr);
+	/* Slaves that asked for a sync meanwhile get the next snapshot. */
+	repli.startBgsaveForSync();
+}
+
 void Redis::slaveRepliTimeOut(int32_t context)
 {
 	std::unique_lock <std::mutex> lck(slaveMutex);
 	auto it = slaveConns.find(context);
 	if (it != slaveConns.end())
 	{
-		it->second->forceClose();
+		it->second->conn->forceClose();
 	}
 	LOG_INFO << "sync connect repli timeout ";
 }
@@ -145,20 +211,65 @@ void Redis::clearCommand(std::deque<RedisObjectPtr> &commands)
 
 void Redis::clearPubSubState(int32_t sockfd)
 {
+	SessionPtr session;
 	{
-		std::unique_lock <std::mutex> lck(pubsubMutex);
-		for (auto &it : pubSubs)
+		std::unique_lock <std::mutex> lck(mtx);
+		auto it = sessions.find(sockfd);
+		if (it == sessions.end())
 		{
-			for (auto iter = it.second.begin(); iter != it.second.end();)
-			{
-				if (iter->first == sockfd)
-				{
-					it.second.erase(iter++);
-					continue;
-				}
-				++iter;
-			}
+			return;
 		}
+		session = it->second;
+	}
+
+	auto channels = std::move(session->getPubSubChannels());
+	for (auto &it : channels)
+	{
+		unsubscribeChannel(session, it, sockfd);
+	}
+	session->getPubSubChannels().clear();
+
+	auto patterns = std::move(session->getPubSubPatterns());
+	for (auto &it : patterns)
+	{
+		unsubscribePattern(session, it, sockfd);
+	}
+	session->getPubSubPatterns().clear();
+}
+
+bool Redis::unsubscribeChannel(const SessionPtr &session,
+	const RedisObjectPtr &channel, int32_t sockfd)
+{
+	session->getPubSubChannels().erase(channel);
+	auto &shard = pubsubShards[channel->hash % kPubSubShards];
+	std::unique_lock <std::mutex> lck(shard.mtx);
+	auto it = shard.channels.find(channel);
+	if (it == shard.channels.end())
+	{
+		return false;
+	}
+
+	bool retval = it->second.erase(sockfd) > 0;
+	if (it->second.empty())
+	{
+		shard.channels.erase(it);
+	}
+	return retval;
+}
+
+bool Redis::unsubscribePattern(const SessionPtr &session,
+	const RedisObjectPtr &pattern, int32_t sockfd)
+{
+	session->getPubSubPatterns().erase(pattern);
+	std::unique_lock <std::mutex> lck(patternMutex);
+	return pubsubPatterns.unsubscribe(pattern, sockfd);
+}
+
+void Redis::deliverMessage(const std::vector<std::pair<BufferPtr, TcpConnectionPtr>> &messages)
+{
+	for (auto &it : messages)
+	{
+		it.second->sendPipe(std::string_view(it.first->peek(), it.first->readableBytes()));
 	}
 }
 
@@ -185,12 +296,22 @@ void Redis::clearClusterState(int32_t sockfd)
 
 void Redis::clearMonitorState(int32_t sockfd)
 {
-	std::unique_lock <std::mutex> lck(monitorMutex);
-	monitorConns.erase(sockfd);
-	if (monitorConns.empty())
+	monitor.removeMonitor(sockfd);
+}
+
+void Redis::clearTrackingState(int32_t sockfd)
+{
+	int64_t id;
 	{
-		monitorEnabled = false;
+		std::unique_lock <std::mutex> lck(mtx);
+		auto it = sessions.find(sockfd);
+		if (it == sessions.end())
+		{
+			return;
+		}
+		id = it->second->getId();
 	}
+	tracking.disable(id);
 }
 
 void Redis::clearSessionState(int32_t sockfd)
@@ -212,28 +333,34 @@ void Redis::clearRepliState(int32_t sockfd)
 		auto it = slaveConns.find(sockfd);
 		if (it != slaveConns.end())
 		{
-			salveCount--;
-			slaveConns.erase(sockfd);
-			if (slaveConns.size() == 0)
+			auto iter = repliTimers.find(sockfd);
+			if (iter != repliTimers.end())
 			{
-				repliEnabled = false;
-				Buffer buffer;
-				slaveCached.swap(buffer);
+				it->second->conn->getLoop()->cancelAfter(iter->second);
+				repliTimers.erase(iter);
 			}
-		}
 
-		auto iter = repliTimers.find(sockfd);
-		if (iter != repliTimers.end())
-		{
-			loop.cancelAfter(iter->second);
-			repliTimers.erase(iter);
+			slaveConns.erase(it);
+			/* The backlog keeps being fed for slaves coming back. */
+			if (slaveConns.size() == 0 && !repli.hasBacklog())
+			{
+				repliEnabled = false;
+			}
 		}
 	}
 }
 
 void Redis::setExpireTimeOut(const RedisObjectPtr &expire)
 {
-	removeCommand(expire);
+	int64_t start = latency.start();
+	bool removed = removeCommand(expire);
+	latency.end("expire-del", start);
+	if (removed)
+	{
+		stats.expiredKey();
+		signalModifiedKey(expire, -1);
+		notifyKeyspaceEvent(NOTIFY_EXPIRED, "expired", expire);
+	}
 }
 
 void Redis::writeCompleteCallBack(const TcpConnectionPtr &conn)
@@ -268,6 +395,7 @@ void Redis::connCallBack(const TcpConnectionPtr &conn)
 			1024 * 1024);
 
 		SessionPtr session(new Session(this, conn));
+		totalConnections++;
 		std::unique_lock <std::mutex> lck(mtx);
 		auto it = sessions.find(conn->getSockfd());
 		assert(it == sessions.end());
@@ -278,64 +406,63 @@ void Redis::connCallBack(const TcpConnectionPtr &conn)
 	else
 	{
 		clearRepliState(conn->getSockfd());
+		repli.clearWaiter(conn->getSockfd());
 		clearClusterState(conn->getSockfd());
 		clearMonitorState(conn->getSockfd());
+		clearPubSubState(conn->getSockfd());
+		clearTrackingState(conn->getSockfd());
 		clearSessionState(conn->getSockfd());
 
 		LOG_INFO << "Client disconnect ";
 	}
 }
 
-void Redis::feedMonitor(const std::deque<RedisObjectPtr> &obj, int32_t sockfd)
+/* Returns true when the dataset came from the append only file. A missing
+ * or empty one falls back to the snapshot, a broken one stops the server
+ * instead of appending to it. */
+bool Redis::loadDataFromDisk()
 {
-	char buf[64] = "";
-	auto addr = Socket::getPeerAddr(sockfd);
-	Socket::toIpPort(buf, sizeof(buf), (const struct sockaddr *)&addr);
-
-	int j = 0;
-	sds cmdrepr = sdsnew("+");
-	RedisObjectPtr cmdobj;
-#ifdef _WIN64
-	cmdrepr = sdscatprintf(cmdrepr, "%ld.%06ld ", time(0), 0);
-#else
-	struct timeval tv;
-	gettimeofday(&tv, nullptr);
-	cmdrepr = sdscatprintf(cmdrepr, "%ld.%06ld ", (long)tv.tv_sec, (long)tv.tv_usec);
-#endif
-	cmdrepr = sdscatprintf(cmdrepr, "[%d %s] ", 0, buf);
-
-	for (auto &it : obj)
+	int64_t start = ustime();
+	if (aofEnabled)
 	{
-		j++;
-		if (it->encoding == OBJ_ENCODING_INT)
+		struct stat st;
+		int32_t ret = REDIS_OK;
+		if (::stat(REDIS_DEFAULT_AOF_FILENGTHAME, &st) == -1)
 		{
-			cmdrepr = sdscatprintf(cmdrepr, "\"%ld\"", (long)it->ptr);
+			ret = errno == ENOENT ? REDIS_OK : REDIS_ERR;
 		}
-		else
+		else if (st.st_size > 0)
 		{
-			cmdrepr = sdscatrepr(cmdrepr, (char*)it->ptr,
-				sdslen(it->ptr));
+			/* Keep replayed commands out of the file being replayed. */
+			aofEnabled = false;
+			ret = aof.loadAppendOnlyFile(REDIS_DEFAULT_AOF_FILENGTHAME);
+			aofEnabled = true;
+
+			if (ret == REDIS_OK)
+			{
+				LOG_INFO << "DB loaded from append only file seconds: " << double(ustime() - start) / 1000;
+				return true;
+			}
 		}
-		if (j != obj.size() - 1)
+
+		if (ret == REDIS_ERR)
 		{
-			cmdrepr = sdscatlen(cmdrepr, " ", 1);
+			LOG_WARN << "Fatal error loading the append only file: " << strerror(errno) << ", exiting";
+			exit(1);
 		}
 	}
 
-	cmdrepr = sdscatlen(cmdrepr, "\r\n", 2);
-	cmdobj = createObject(OBJ_STRING, cmdrepr);
-
-	std::unique_lock <std::mutex> lck(monitorMutex);
-	for (auto &it : monitorConns)
+	if (rdb.rdbLoadSegments(REDIS_DEFAULT_RDB_FILENGTHAME) == REDIS_OK)
 	{
-		it.second->sendPipe(cmdobj->ptr, sdslen(cmdobj->ptr));
+		LOG_INFO << "DB loaded from segmented snapshot seconds: " << double(ustime() - start) / 1000;
+		return false;
+	}
+	else if (errno != ENOENT)
+	{
+		LOG_WARN << "Fatal error loading the segmented snapshot: " << strerror(errno);
 	}
-}
 
-void Redis::loadDataFromDisk()
-{
-	int64_t start = ustime();
-	if (rdb.rdbLoad("dump.rdb") == REDIS_OK)
+	if (rdb.rdbLoad(REDIS_DEFAULT_RDB_FILENGTHAME) == REDIS_OK)
 	{
 		int64_t end = ustime();
 		double diff = double(end - end) / (1000 * 1000);
@@ -345,6 +472,7 @@ void Redis::loadDataFromDisk()
 	{
 		LOG_WARN << "Fatal error loading the DB: Exiting." << strerror(errno);
 	}
+	return false;
 }
 
 bool Redis::subscribeCommand(const std::deque<RedisObjectPtr> &obj,
@@ -355,37 +483,20 @@ bool Redis::subscribeCommand(const std::deque<RedisObjectPtr> &obj,
 		return false;
 	}
 
-	bool retval;
-	int sub = 0;
+	auto &channels = session->getPubSubChannels();
 	for (int i = 0; i < obj.size(); i++)
 	{
+		if (channels.insert(obj[i]).second)
 		{
-			std::unique_lock <std::mutex> lck(pubsubMutex);
-			auto it = pubSubs.find(obj[i]);
-			if (it == pubSubs.end())
-			{
-				std::unordered_map<int32_t, TcpConnectionPtr> maps;
-				maps[conn->getSockfd()] = conn;
-				pubSubs[obj[i]] = std::move(maps);
-				retval = true;
-				sub++;
-			}
-			else
-			{
-				retval = false;
-				auto iter = it->second.find(conn->getSockfd());
-				if (iter == it->second.end())
-				{
-					sub++;
-				}
-				it->second[conn->getSockfd()] = conn;
-			}
+			auto &shard = pubsubShards[obj[i]->hash % kPubSubShards];
+			std::unique_lock <std::mutex> lck(shard.mtx);
+			shard.channels[obj[i]][conn->getSockfd()] = conn;
 		}
 
 		addReply(conn->outputBuffer(), shared.mbulkhdr[3]);
 		addReply(conn->outputBuffer(), shared.subscribebulk);
 		addReplyBulk(conn->outputBuffer(), obj[i]);
-		addReplyLongLong(conn->outputBuffer(), sub);
+		addReplyLongLong(conn->outputBuffer(), session->getPubSubCount());
 	}
 	return true;
 }
@@ -393,191 +504,940 @@ bool Redis::subscribeCommand(const std::deque<RedisObjectPtr> &obj,
 bool Redis::unsubscribeCommand(const std::deque<RedisObjectPtr> &obj,
 	const SessionPtr &session, const TcpConnectionPtr &conn)
 {
-	return false;
-}
-
-bool Redis::psubscribeCommand(const std::deque<RedisObjectPtr> &obj,
-	const SessionPtr &session, const TcpConnectionPtr &conn)
-{
-	return false;
-}
-
-bool Redis::punsubscribeCommand(const std::deque<RedisObjectPtr> &obj,
-	const SessionPtr &session, const TcpConnectionPtr &conn)
-{
-	return false;
-}
-
-bool Redis::publishCommand(const std::deque<RedisObjectPtr> &obj,
-	const SessionPtr &session, const TcpConnectionPtr &conn)
-{
-	return false;
-}
-
-bool Redis::pubsubCommand(const std::deque<RedisObjectPtr> &obj,
-	const SessionPtr &session, const TcpConnectionPtr &conn)
-{
-	return false;
-}
+	auto &channels = session->getPubSubChannels();
+	std::deque<RedisObjectPtr> targets;
+	if (obj.empty())
+	{
+		targets.assign(channels.begin(), channels.end());
+		if (targets.empty())
+		{
+			addReply(conn->outputBuffer(), shared.mbulkhdr[3]);
+			addReply(conn->outputBuffer(), shared.unsubscribebulk);
+			addReply(conn->outputBuffer(), shared.nullbulk);
+			addReplyLongLong(conn->outputBuffer(), session->getPubSubCount());
+			return true;
+		}
+	}
 
-bool Redis::sentinelCommand(const std::deque<RedisObjectPtr> &obj,
-	const SessionPtr &session, const TcpConnectionPtr &conn)
-{
-	return false;
+	const std::deque<RedisObjectPtr> &names = obj.empty() ? targets : obj;
+	for (auto &it : names)
+	{
+		unsubscribeChannel(session, it, conn->getSockfd());
+		addReply(conn->outputBuffer(), shared.mbulkhdr[3]);
+		addReply(conn->outputBuffer(), shared.unsubscribebulk);
+		addReplyBulk(conn->outputBuffer(), it);
+		addReplyLongLong(conn->outputBuffer(), session->getPubSubCount());
+	}
+	return true;
 }
 
-bool Redis::memoryCommand(const std::deque<RedisObjectPtr> &obj,
+bool Redis::psubscribeCommand(const std::deque<RedisObjectPtr> &obj,
 	const SessionPtr &session, const TcpConnectionPtr &conn)
 {
-	if (obj.size() > 2)
+	if (obj.size() < 1)
 	{
 		return false;
 	}
-#ifdef USE_JEMALLOC
 
-	char tmp[32];
-	unsigned narenas = 0;
-	size_t sz = sizeof(unsigned);
-	if (!je_mallctl("arenas.narenas", &narenas, &sz, nullptr, 0))
+	auto &patterns = session->getPubSubPatterns();
+	for (int i = 0; i < obj.size(); i++)
 	{
-		sprintf(tmp, "arena.%d.purge", narenas);
-		if (!je_mallctl(tmp, nullptr, 0, nullptr, 0))
+		if (patterns.insert(obj[i]).second)
 		{
-			addReply(conn->outputBuffer(), ok);
-			return  true;
+			std::unique_lock <std::mutex> lck(patternMutex);
+			pubsubPatterns.subscribe(obj[i], conn);
 		}
-	}
 
-#endif
-
-	addReply(conn->outputBuffer(), shared.ok);
+		addReply(conn->outputBuffer(), shared.mbulkhdr[3]);
+		addReply(conn->outputBuffer(), shared.psubscribebulk);
+		addReplyBulk(conn->outputBuffer(), obj[i]);
+		addReplyLongLong(conn->outputBuffer(), session->getPubSubCount());
+	}
 	return true;
 }
 
-bool Redis::infoCommand(const std::deque<RedisObjectPtr> &obj,
+bool Redis::punsubscribeCommand(const std::deque<RedisObjectPtr> &obj,
 	const SessionPtr &session, const TcpConnectionPtr &conn)
 {
-	if (obj.size() < 0)
+	auto &patterns = session->getPubSubPatterns();
+	std::deque<RedisObjectPtr> targets;
+	if (obj.empty())
 	{
-		return false;
+		targets.assign(patterns.begin(), patterns.end());
+		if (targets.empty())
+		{
+			addReply(conn->outputBuffer(), shared.mbulkhdr[3]);
+			addReply(conn->outputBuffer(), shared.punsubscribebulk);
+			addReply(conn->outputBuffer(), shared.nullbulk);
+			addReplyLongLong(conn->outputBuffer(), session->getPubSubCount());
+			return true;
+		}
 	}
 
-#ifndef _WIN64
-	struct rusage self_ru, c_ru;
-	getrusage(RUSAGE_SELF, &self_ru);
-	getrusage(RUSAGE_CHILDREN, &c_ru);
-	sds info = sdsempty();
-
-	char hmem[64];
-	size_t zmallocUsed = zmalloc_used_memory();
-
-	bytesToHuman(hmem, zmallocUsed);
-
-	info = sdscat(info, "\r\n");
-	info = sdscatprintf(info,
-		"# Memory\r\n"
-		"used_memory:%zu\r\n"
-		"used_memory_human:%s\r\n"
-		"mem_allocator:%s\r\n",
-		zmallocUsed,
-		hmem,
-		ZMALLOC_LIB);
-
-
-	info = sdscat(info, "\r\n");
-	info = sdscatprintf(info,
-		"# CPU\r\n"
-		"used_cpu_sys:%.2f\r\n"
-		"used_cpu_user:%.2f\r\n"
-		"used_cpu_sys_children:%.2f\r\n"
-		"used_cpu_user_children:%.2f\r\n",
-		(float)self_ru.ru_stime.tv_sec + (float)self_ru.ru_stime.tv_usec / 1000000,
-		(float)self_ru.ru_utime.tv_sec + (float)self_ru.ru_utime.tv_usec / 1000000,
-		(float)c_ru.ru_stime.tv_sec + (float)c_ru.ru_stime.tv_usec / 1000000,
-		(float)c_ru.ru_utime.tv_sec + (float)c_ru.ru_utime.tv_usec / 1000000);
-
-	info = sdscat(info, "\r\n");
-	info = sdscatprintf(info,
-		"# Server\r\n"
-		"tcp_connect_count:%d\r\n"
-		"local_ip:%s\r\n"
-		"local_port:%d\r\n"
-		"local_thread_count:%d\n",
-		sessions.size(),
-		ip.c_str(),
-		port,
-		threadCount);
-	addReplyBulkSds(conn->outputBuffer(), info);
-#endif
+	const std::deque<RedisObjectPtr> &names = obj.empty() ? targets : obj;
+	for (auto &it : names)
+	{
+		unsubscribePattern(session, it, conn->getSockfd());
+		addReply(conn->outputBuffer(), shared.mbulkhdr[3]);
+		addReply(conn->outputBuffer(), shared.punsubscribebulk);
+		addReplyBulk(conn->outputBuffer(), it);
+		addReplyLongLong(conn->outputBuffer(), session->getPubSubCount());
+	}
 	return true;
 }
 
-bool Redis::clientCommand(const std::deque<RedisObjectPtr> &obj,
+bool Redis::publishCommand(const std::deque<RedisObjectPtr> &obj,
 	const SessionPtr &session, const TcpConnectionPtr &conn)
 {
-	if (obj.size() > 1)
+	if (obj.size() != 2)
 	{
 		return false;
 	}
 
-	addReply(conn->outputBuffer(), shared.ok);
+	addReplyLongLong(conn->outputBuffer(), publishMessage(obj[0], obj[1]));
 	return true;
 }
 
-bool Redis::echoCommand(const std::deque<RedisObjectPtr> &obj,
-	const SessionPtr &session, const TcpConnectionPtr &conn)
+TcpConnectionPtr Redis::getSubscriber(const RedisObjectPtr &channel, int32_t sockfd)
 {
-	if (obj.size() > 1)
+	auto &shard = pubsubShards[channel->hash % kPubSubShards];
+	std::unique_lock <std::mutex> lck(shard.mtx);
+	auto it = shard.channels.find(channel);
+	if (it == shard.channels.end())
 	{
-		return false;
+		return nullptr;
 	}
 
-	addReplyBulk(conn->outputBuffer(), obj[0]);
-	return true;
+	auto iter = it->second.find(sockfd);
+	if (iter == it->second.end())
+	{
+		return nullptr;
+	}
+	return iter->second;
 }
 
-bool Redis::authCommand(const std::deque<RedisObjectPtr> &obj,
-	const SessionPtr &session, const TcpConnectionPtr &conn)
+int64_t Redis::publishMessage(const RedisObjectPtr &channel, const RedisObjectPtr &msg)
 {
-	if (obj.size() > 1)
+	std::vector<TcpConnectionPtr> conns;
 	{
-		return false;
+		auto &shard = pubsubShards[channel->hash % kPubSubShards];
+		std::unique_lock <std::mutex> lck(shard.mtx);
+		auto it = shard.channels.find(channel);
+		if (it != shard.channels.end())
+		{
+			for (auto &iter : it->second)
+			{
+				conns.push_back(iter.second);
+			}
+		}
 	}
 
-	if (password.c_str() == nullptr)
+	std::vector<std::pair<RedisObjectPtr, std::vector<TcpConnectionPtr>>> matches;
 	{
-		addReplyError(conn->outputBuffer(), "client sent auth, but no password is set");
-		return true;
+		std::unique_lock <std::mutex> lck(patternMutex);
+		pubsubPatterns.match(channel->ptr, sdslen(channel->ptr),
+			[&matches](const PatternEntry &entry)
+			{
+				std::vector<TcpConnectionPtr> patternConns;
+				for (auto &it : entry.conns)
+				{
+					patternConns.push_back(it.second);
+				}
+				matches.push_back(std::make_pair(entry.pattern, std::move(patternConns)));
+			});
 	}
 
-	if (!strcmp(obj[0]->ptr, password.c_str()))
+	/* Subscribers are grouped by the loop owning their connection, each
+	 * loop gets one task and all of them share the encoded message. */
+	std::unordered_map<EventLoop*, std::vector<std::pair<BufferPtr, TcpConnectionPtr>>> loops;
+	int64_t receivers = 0;
+	if (!conns.empty())
 	{
-		session->setAuth(true);
-		addReply(conn->outputBuffer(), shared.ok);
+		BufferPtr message(new Buffer());
+		addReply(message.get(), shared.mbulkhdr[3]);
+		addReply(message.get(), shared.messagebulk);
+		addReplyBulk(message.get(), channel);
+		addReplyBulk(message.get(), msg);
+
+		for (auto &it : conns)
+		{
+			loops[it->getLoop()].push_back(std::make_pair(message, it));
+			receivers++;
+		}
 	}
-	else
+
+	for (auto &it : matches)
 	{
-		addReplyError(conn->outputBuffer(), "invalid password");
+		BufferPtr message(new Buffer());
+		addReply(message.get(), shared.mbulkhdr[4]);
+		addReply(message.get(), shared.pmessagebulk);
+		addReplyBulk(message.get(), it.first);
+		addReplyBulk(message.get(), channel);
+		addReplyBulk(message.get(), msg);
+
+		for (auto &iter : it.second)
+		{
+			loops[iter->getLoop()].push_back(std::make_pair(message, iter));
+			receivers++;
+		}
 	}
-	return true;
+
+	for (auto &it : loops)
+	{
+		it.first->runInLoop(std::bind(&Redis::deliverMessage, this, std::move(it.second)));
+	}
+	return receivers;
 }
 
-bool Redis::configCommand(const std::deque<RedisObjectPtr> &obj,
-	const SessionPtr &session, const TcpConnectionPtr &conn)
+/* Publish the event of a keyspace change to __keyspace@0__:<key> and the
+ * key to __keyevent@0__:<event>, for the classes enabled in
+ * notify-keyspace-events. */
+void Redis::notifyKeyspaceEvent(int32_t type, const char *event, const RedisObjectPtr &key)
 {
-	if (obj.size() > 3 || obj.size() == 0)
+	int32_t flags = notifyKeyspaceEvents;
+	if (!(flags & type))
 	{
-		return false;
+		return;
 	}
 
-	if (!strcmp(obj[0]->ptr, "set"))
+	RedisObjectPtr eventobj = createStringObject((char*)event, strlen(event));
+	if (flags & NOTIFY_KEYSPACE)
 	{
-		if (obj.size() != 3)
-		{
-			addReplyErrorFormat(conn->outputBuffer(),
-				"Wrong number of arguments for CONFIG %s", (char*)obj[0]->ptr);
-			return true;
-		}
+		sds chan = sdsnewlen("__keyspace@0__:", 15);
+		chan = sdscatsds(chan, key->ptr);
+		publishMessage(createObject(OBJ_STRING, chan), eventobj);
+	}
+
+	if (flags & NOTIFY_KEYEVENT)
+	{
+		sds chan = sdsnewlen("__keyevent@0__:", 15);
+		chan = sdscat(chan, event);
+		publishMessage(createObject(OBJ_STRING, chan), key);
+	}
+}
+
+void Redis::signalModifiedKey(const RedisObjectPtr &key, int64_t id)
+{
+	tracking.invalidateKey(key, id);
+}
+
+bool Redis::pubsubCommand(const std::deque<RedisObjectPtr> &obj,
+	const SessionPtr &session, const TcpConnectionPtr &conn)
+{
+	if (obj.size() < 1)
+	{
+		return false;
+	}
+
+	if (!strcasecmp(obj[0]->ptr, "channels") && obj.size() <= 2)
+	{
+		std::vector<RedisObjectPtr> channels;
+		for (auto &shard : pubsubShards)
+		{
+			std::unique_lock <std::mutex> lck(shard.mtx);
+			for (auto &it : shard.channels)
+			{
+				if (obj.size() == 2 && !stringmatchlen(obj[1]->ptr, sdslen(obj[1]->ptr),
+					it.first->ptr, sdslen(it.first->ptr), 0))
+				{
+					continue;
+				}
+				channels.push_back(it.first);
+			}
+		}
+
+		addReplyMultiBulkLen(conn->outputBuffer(), channels.size());
+		for (auto &it : channels)
+		{
+			addReplyBulk(conn->outputBuffer(), it);
+		}
+	}
+	else if (!strcasecmp(obj[0]->ptr, "numsub"))
+	{
+		addReplyMultiBulkLen(conn->outputBuffer(), (obj.size() - 1) * 2);
+		for (int i = 1; i < obj.size(); i++)
+		{
+			size_t count = 0;
+			{
+				auto &shard = pubsubShards[obj[i]->hash % kPubSubShards];
+				std::unique_lock <std::mutex> lck(shard.mtx);
+				auto it = shard.channels.find(obj[i]);
+				if (it != shard.channels.end())
+				{
+					count = it->second.size();
+				}
+			}
+
+			addReplyBulk(conn->outputBuffer(), obj[i]);
+			addReplyLongLong(conn->outputBuffer(), count);
+		}
+	}
+	else if (!strcasecmp(obj[0]->ptr, "numpat") && obj.size() == 1)
+	{
+		std::unique_lock <std::mutex> lck(patternMutex);
+		addReplyLongLong(conn->outputBuffer(), pubsubPatterns.size());
+	}
+	else
+	{
+		addReplyErrorFormat(conn->outputBuffer(),
+			"Unknown PUBSUB subcommand or wrong number of arguments for '%s'",
+			(char*)obj[0]->ptr);
+	}
+	return true;
+}
+
+bool Redis::sentinelCommand(const std::deque<RedisObjectPtr> &obj,
+	const SessionPtr &session, const TcpConnectionPtr &conn)
+{
+	return false;
+}
+
+bool Redis::memoryCommand(const std::deque<RedisObjectPtr> &obj,
+	const SessionPtr &session, const TcpConnectionPtr &conn)
+{
+	if (obj.size() > 2)
+	{
+		return false;
+	}
+#ifdef USE_JEMALLOC
+
+	char tmp[32];
+	unsigned narenas = 0;
+	size_t sz = sizeof(unsigned);
+	if (!je_mallctl("arenas.narenas", &narenas, &sz, nullptr, 0))
+	{
+		sprintf(tmp, "arena.%d.purge", narenas);
+		if (!je_mallctl(tmp, nullptr, 0, nullptr, 0))
+		{
+			addReply(conn->outputBuffer(), ok);
+			return  true;
+		}
+	}
+
+#endif
+
+	addReply(conn->outputBuffer(), shared.ok);
+	return true;
+}
+
+bool Redis::infoCommand(const std::deque<RedisObjectPtr> &obj,
+	const SessionPtr &session, const TcpConnectionPtr &conn)
+{
+	if (obj.size() > 1)
+	{
+		return false;
+	}
+
+	addReplyBulkSds(conn->outputBuffer(),
+		genRedisInfoString(obj.empty() ? "default" : obj[0]->ptr));
+	return true;
+}
+
+/* INFO [section]. The per command sections are only part of "all", like
+ * upstream. Every counter here is kept per thread or per loop and summed on
+ * read, so frequent scraping costs the command path nothing. */
+sds Redis::genRedisInfoString(const char *section)
+{
+	sds info = sdsempty();
+	bool allsections = !strcasecmp(section, "all") || !strcasecmp(section, "everything");
+	bool defsections = !strcasecmp(section, "default");
+	int32_t sections = 0;
+
+#ifndef _WIN64
+	int64_t clientBufferBytes = 0;
+	int64_t clientBufferIdle = 0;
+	for (auto &it : server.getThreadPool()->getAllLoops())
+	{
+		clientBufferBytes += it->getBufferPool()->getClientBytes();
+		clientBufferIdle += it->getBufferPool()->idleBytes();
+	}
+
+	if (allsections || defsections || !strcasecmp(section, "server"))
+	{
+		size_t connects;
+		{
+			std::unique_lock <std::mutex> lck(mtx);
+			connects = sessions.size();
+		}
+
+		if (sections++) info = sdscat(info, "\r\n");
+		info = sdscatprintf(info,
+			"# Server\r\n"
+			"process_id:%d\r\n"
+			"uptime_in_seconds:%lld\r\n"
+			"tcp_connect_count:%d\r\n"
+			"local_ip:%s\r\n"
+			"local_port:%d\r\n"
+			"local_thread_count:%d\r\n"
+			"cluster_enabled:%d\r\n",
+			(int32_t)getpid(),
+			(long long)(time(nullptr) - startTime),
+			(int32_t)connects,
+			ip.c_str(),
+			port,
+			threadCount,
+			clusterEnabled ? 1 : 0);
+	}
+
+	if (allsections || defsections || !strcasecmp(section, "clients"))
+	{
+		size_t clients = 0;
+		int32_t blockedClients = 0;
+		{
+			std::unique_lock <std::mutex> lck(mtx);
+			clients = sessions.size();
+			for (auto &it : sessions)
+			{
+				if (it.second->isBlocked())
+				{
+					blockedClients++;
+				}
+			}
+		}
+
+		if (sections++) info = sdscat(info, "\r\n");
+		info = sdscatprintf(info,
+			"# Clients\r\n"
+			"connected_clients:%zu\r\n"
+			"client_buffer_bytes:%lld\r\n"
+			"client_buffer_pool_bytes:%lld\r\n"
+			"blocked_clients:%d\r\n"
+			"tracking_clients:%zu\r\n"
+			"monitor_clients:%zu\r\n",
+			clients,
+			(long long)clientBufferBytes,
+			(long long)clientBufferIdle,
+			blockedClients,
+			tracking.getClients(),
+			monitor.getMonitors());
+	}
+
+	if (allsections || defsections || !strcasecmp(section, "memory"))
+	{
+		char hmem[64];
+		char hclient[64];
+		size_t zmallocUsed = zmalloc_used_memory();
+		bytesToHuman(hmem, zmallocUsed);
+		bytesToHuman(hclient, clientBufferBytes + clientBufferIdle);
+
+		if (sections++) info = sdscat(info, "\r\n");
+		info = sdscatprintf(info,
+			"# Memory\r\n"
+			"used_memory:%zu\r\n"
+			"used_memory_human:%s\r\n"
+			"mem_clients_buffer:%lld\r\n"
+			"mem_clients_buffer_pool:%lld\r\n"
+			"mem_clients_buffer_human:%s\r\n"
+			"mem_allocator:%s\r\n",
+			zmallocUsed,
+			hmem,
+			(long long)clientBufferBytes,
+			(long long)clientBufferIdle,
+			hclient,
+			ZMALLOC_LIB);
+	}
+
+	if (allsections || defsections || !strcasecmp(section, "persistence"))
+	{
+		if (sections++) info = sdscat(info, "\r\n");
+		info = sdscatprintf(info,
+			"# Persistence\r\n"
+			"aof_enabled:%d\r\n"
+			"aof_fsync:%s\r\n"
+			"aof_current_size:%lld\r\n"
+			"aof_pending_fsync_bytes:%lld\r\n"
+			"aof_last_fsync_ago:%lld\r\n"
+			"aof_rewrite_in_progress:%d\r\n"
+			"aof_last_rewrite_time_sec:%lld\r\n"
+			"aof_base_size:%lld\r\n"
+			"rdb_bgsave_in_progress:%d\r\n"
+			"rdb_bgsave_mode:%s\r\n"
+			"rdb_segments:%d\r\n"
+			"rdb_last_save_time:%lld\r\n"
+			"rdb_last_bgsave_status:%s\r\n"
+			"rdb_last_bgsave_time_sec:%lld\r\n"
+			"rdb_current_bgsave_time_sec:%lld\r\n"
+			"rdb_last_cow_size:%lld\r\n",
+			aofEnabled ? 1 : 0,
+			aof.getFsyncPolicyName(),
+			(long long)aof.getCurrentSize(),
+			(long long)(aofEnabled ? aof.getPendingBytes() : 0),
+			(long long)(aofEnabled ? (ustime() - aof.getLastFsync()) / 1000000 : -1),
+			aof.isRewriteScheduled() ? 1 : 0,
+			(long long)aof.getLastRewriteTime(),
+			(long long)aof.getBaseSize(),
+			isBgsaveRunning() ? 1 : 0,
+			bgsaveFork ? "fork" : "online",
+			(int32_t)rdbSegments,
+			(long long)lastSaveTime,
+			lastBgsaveOk ? "ok" : "err",
+			(long long)lastBgsaveTime,
+			(long long)(isBgsaveRunning() ? (mstime() - bgsaveStart) / 1000 : -1),
+			(long long)lastCowSize);
+	}
+
+	if (allsections || defsections || !strcasecmp(section, "stats"))
+	{
+		int64_t input = 0;
+		int64_t output = 0;
+		for (auto &it : getAllLoops())
+		{
+			input += it->getNetInputBytes();
+			output += it->getNetOutputBytes();
+		}
+
+		int64_t hits, misses, expired;
+		stats.collect(&hits, &misses, &expired);
+
+		int64_t ops, inputRate, outputRate;
+		{
+			std::unique_lock <std::mutex> lck(statsMutex);
+			ops = opsSec.get();
+			inputRate = netInputSec.get();
+			outputRate = netOutputSec.get();
+		}
+
+		if (sections++) info = sdscat(info, "\r\n");
+		info = sdscatprintf(info,
+			"# Stats\r\n"
+			"total_connections_received:%lld\r\n"
+			"total_commands_processed:%lld\r\n"
+			"instantaneous_ops_per_sec:%lld\r\n"
+			"total_net_input_bytes:%lld\r\n"
+			"total_net_output_bytes:%lld\r\n"
+			"instantaneous_input_kbps:%.2f\r\n"
+			"instantaneous_output_kbps:%.2f\r\n"
+			"expired_keys:%lld\r\n"
+			"evicted_keys:0\r\n"
+			"keyspace_hits:%lld\r\n"
+			"keyspace_misses:%lld\r\n"
+			"latest_fork_usec:%lld\r\n"
+			"monitor_ring_dropped:%lld\r\n"
+			"monitor_lag_dropped:%lld\r\n",
+			(long long)totalConnections,
+			(long long)commandStats.getTotalCalls(),
+			(long long)ops,
+			(long long)input,
+			(long long)output,
+			(double)inputRate / 1024,
+			(double)outputRate / 1024,
+			(long long)expired,
+			(long long)hits,
+			(long long)misses,
+			(long long)lastForkUsec,
+			(long long)monitor.getRingDropped(),
+			(long long)monitor.getLagDropped());
+	}
+
+	if (allsections || defsections || !strcasecmp(section, "replication"))
+	{
+		int32_t onlineSlaves = 0;
+		int32_t syncingSlaves = 0;
+		sds slaves = sdsempty();
+		int64_t backlogSize, backlogOff, backlogHistlen;
+		bool backlogActive;
+		{
+			std::unique_lock <std::mutex> lck(slaveMutex);
+			time_t now = time(nullptr);
+			int64_t masterOffset = repli.getMasterReplOffset();
+			for (auto &it : slaveConns)
+			{
+				auto &slave = it.second;
+				if (slave->state != REDIS_REPL_ONLINE)
+				{
+					syncingSlaves++;
+					continue;
+				}
+
+				/* The port is the one the slave listens on, the peer port
+				 * of its link only when it did not tell. */
+				char ip[64] = "";
+				uint16_t slavePort = 0;
+				auto addr = Socket::getPeerAddr(it.first);
+				Socket::toIp(ip, sizeof(ip), (const struct sockaddr *)&addr);
+				Socket::toPort(&slavePort, (const struct sockaddr *)&addr);
+				if (slave->listeningPort > 0)
+				{
+					slavePort = slave->listeningPort;
+				}
+
+				slaves = sdscatprintf(slaves,
+					"slave%d:ip=%s,port=%d,state=online,offset=%lld,lag=%lld,offset_lag=%lld\r\n",
+					onlineSlaves, ip, slavePort, (long long)slave->ackOffset,
+					(long long)(now - slave->ackTime),
+					(long long)std::max<int64_t>(0, masterOffset - slave->ackOffset));
+				onlineSlaves++;
+			}
+
+			backlogActive = repli.hasBacklog();
+			backlogSize = repli.getBacklogSize();
+			backlogOff = repli.getBacklogOff();
+			backlogHistlen = repli.getBacklogHistlen();
+		}
+
+		if (sections++) info = sdscat(info, "\r\n");
+		info = sdscatprintf(info,
+			"# Replication\r\n"
+			"role:%s\r\n",
+			masterPort > 0 ? "slave" : "master");
+		if (masterPort > 0)
+		{
+			info = sdscatprintf(info,
+				"master_host:%s\r\n"
+				"master_port:%d\r\n"
+				"master_link_status:%s\r\n"
+				"master_sync_in_progress:%d\r\n"
+				"master_last_io_seconds_ago:%d\r\n"
+				"slave_repl_offset:%lld\r\n"
+				"slave_serve_stale_data:%d\r\n"
+				"slave_max_lag:%d\r\n",
+				masterHost.c_str(),
+				masterPort,
+				repli.isLinkUp() ? "up" : "down",
+				repli.isSyncing() ? 1 : 0,
+				static_cast<int32_t>(repli.getMasterLag()),
+				(long long)repli.getReplOffset(),
+				replServeStale ? 1 : 0,
+				replMaxLag.load());
+		}
+
+		info = sdscatprintf(info,
+			"connected_slaves:%d\r\n"
+			"syncing_slaves:%d\r\n"
+			"%s"
+			"master_replid:%s\r\n"
+			"master_repl_offset:%lld\r\n"
+			"repl_backlog_active:%d\r\n"
+			"repl_backlog_size:%lld\r\n"
+			"repl_backlog_first_byte_offset:%lld\r\n"
+			"repl_backlog_histlen:%lld\r\n"
+			"repl_diskless_sync:%d\r\n",
+			onlineSlaves,
+			syncingSlaves,
+			slaves,
+			repli.getReplid().c_str(),
+			(long long)repli.getMasterReplOffset(),
+			backlogActive ? 1 : 0,
+			(long long)backlogSize,
+			(long long)backlogOff,
+			(long long)backlogHistlen,
+			replDiskless ? 1 : 0);
+		sdsfree(slaves);
+	}
+
+	if (allsections || defsections || !strcasecmp(section, "cpu"))
+	{
+		struct rusage self_ru, c_ru;
+		getrusage(RUSAGE_SELF, &self_ru);
+		getrusage(RUSAGE_CHILDREN, &c_ru);
+
+		if (sections++) info = sdscat(info, "\r\n");
+		info = sdscatprintf(info,
+			"# CPU\r\n"
+			"used_cpu_sys:%.2f\r\n"
+			"used_cpu_user:%.2f\r\n"
+			"used_cpu_sys_children:%.2f\r\n"
+			"used_cpu_user_children:%.2f\r\n",
+			(float)self_ru.ru_stime.tv_sec + (float)self_ru.ru_stime.tv_usec / 1000000,
+			(float)self_ru.ru_utime.tv_sec + (float)self_ru.ru_utime.tv_usec / 1000000,
+			(float)c_ru.ru_stime.tv_sec + (float)c_ru.ru_stime.tv_usec / 1000000,
+			(float)c_ru.ru_utime.tv_sec + (float)c_ru.ru_utime.tv_usec / 1000000);
+	}
+
+	/* One line per event loop: the io loops by index, then the server loop
+	 * and the replication loop when they are not io loops themselves. */
+	if (allsections || defsections || !strcasecmp(section, "threads"))
+	{
+		std::vector<std::pair<std::string, EventLoop*>> loops;
+		std::vector<EventLoop*> ioLoops = server.getThreadPool()->getAllLoops();
+		for (size_t i = 0; i < ioLoops.size(); i++)
+		{
+			loops.push_back(std::make_pair(ioLoops[i] == &loop ?
+				std::string("main") : std::to_string(i), ioLoops[i]));
+		}
+
+		if (std::find(ioLoops.begin(), ioLoops.end(), &loop) == ioLoops.end())
+		{
+			loops.push_back(std::make_pair(std::string("main"), &loop));
+		}
+
+		if (repli.getLoop() != nullptr)
+		{
+			loops.push_back(std::make_pair(std::string("repl"), repli.getLoop()));
+		}
+
+		if (sections++) info = sdscat(info, "\r\n");
+		info = sdscat(info, "# Threads\r\n");
+		std::unique_lock <std::mutex> lck(statsMutex);
+		for (auto &it : loops)
+		{
+			EventLoop *eventLoop = it.second;
+			auto iter = loopBusy.find(eventLoop);
+			int64_t busy = iter == loopBusy.end() ? 0 : iter->second.get();
+			info = sdscatprintf(info,
+				"loop_%s:connections=%d,events=%lld,tasks=%lld,queue_depth=%zu,"
+				"busy_ratio=%.2f,net_input_bytes=%lld,net_output_bytes=%lld\r\n",
+				it.first.c_str(),
+				eventLoop->getConnectionCount(),
+				(long long)eventLoop->getEventCount(),
+				(long long)eventLoop->getTaskCount(),
+				eventLoop->getQueueDepth(),
+				(double)busy / 1000000,
+				(long long)eventLoop->getNetInputBytes(),
+				(long long)eventLoop->getNetOutputBytes());
+		}
+	}
+
+	if (allsections || !strcasecmp(section, "commandstats"))
+	{
+		if (sections++) info = sdscat(info, "\r\n");
+		info = genCommandStatsInfo(info);
+	}
+
+	if (allsections || !strcasecmp(section, "latencystats"))
+	{
+		if (sections++) info = sdscat(info, "\r\n");
+		info = genLatencyStatsInfo(info);
+	}
+
+	if (allsections || defsections || !strcasecmp(section, "keyspace"))
+	{
+		size_t keys = getDbsize();
+		size_t expires = getExpireSize();
+
+		if (sections++) info = sdscat(info, "\r\n");
+		info = sdscat(info, "# Keyspace\r\n");
+		if (keys > 0)
+		{
+			info = sdscatprintf(info, "db0:keys=%zu,expires=%zu\r\n", keys, expires);
+		}
+	}
+#endif
+	return info;
+}
+
+sds Redis::genCommandStatsInfo(sds info)
+{
+	std::vector<CommandStatInfo> infos;
+	commandStats.collect(infos);
+
+	info = sdscat(info, "# Commandstats\r\n");
+	for (auto &it : infos)
+	{
+		if (it.calls == 0)
+		{
+			continue;
+		}
+
+		info = sdscatprintf(info,
+			"cmdstat_%s:calls=%lld,usec=%lld,usec_per_call=%.2f\r\n",
+			it.name->ptr, (long long)it.calls, (long long)it.usec,
+			(double)it.usec / it.calls);
+	}
+	return info;
+}
+
+sds Redis::genLatencyStatsInfo(sds info)
+{
+	std::vector<CommandStatInfo> infos;
+	commandStats.collect(infos);
+
+	info = sdscat(info, "# Latencystats\r\n");
+	for (auto &it : infos)
+	{
+		uint64_t total = 0;
+		for (auto &count : it.counts)
+		{
+			total += count;
+		}
+
+		if (total == 0)
+		{
+			continue;
+		}
+
+		info = sdscatprintf(info,
+			"latency_percentiles_usec_%s:p50=%lld,p99=%lld,p99.9=%lld\r\n",
+			it.name->ptr,
+			(long long)LatencyHistogram::percentile(it.counts.data(), total, 50),
+			(long long)LatencyHistogram::percentile(it.counts.data(), total, 99),
+			(long long)LatencyHistogram::percentile(it.counts.data(), total, 99.9));
+	}
+	return info;
+}
+
+bool Redis::clientCommand(const std::deque<RedisObjectPtr> &obj,
+	const SessionPtr &session, const TcpConnectionPtr &conn)
+{
+	if (obj.size() == 1 && !strcasecmp(obj[0]->ptr, "id"))
+	{
+		addReplyLongLong(conn->outputBuffer(), session->getId());
+		return true;
+	}
+	else if (obj.size() >= 2 && !strcasecmp(obj[0]->ptr, "tracking"))
+	{
+		return clientTrackingCommand(obj, session, conn);
+	}
+
+	if (obj.size() > 1)
+	{
+		return false;
+	}
+
+	addReply(conn->outputBuffer(), shared.ok);
+	return true;
+}
+
+/* CLIENT TRACKING on|off REDIRECT id [BCAST] [PREFIX prefix] [NOLOOP].
+ * Without RESP3 pushes invalidations cannot share the connection with
+ * replies, they go to the redirect client, which has to be subscribed to
+ * __redis__:invalidate. */
+bool Redis::clientTrackingCommand(const std::deque<RedisObjectPtr> &obj,
+	const SessionPtr &session, const TcpConnectionPtr &conn)
+{
+	if (!strcasecmp(obj[1]->ptr, "off") && obj.size() == 2)
+	{
+		session->setTracking(false);
+		tracking.disable(session->getId());
+		addReply(conn->outputBuffer(), shared.ok);
+		return true;
+	}
+	else if (strcasecmp(obj[1]->ptr, "on"))
+	{
+		addReply(conn->outputBuffer(), shared.syntaxerr);
+		return true;
+	}
+
+	TrackingClientPtr client(new TrackingClient(conn, session->getId()));
+	for (int32_t i = 2; i < obj.size(); i++)
+	{
+		bool moreargs = i + 1 < obj.size();
+		if (!strcasecmp(obj[i]->ptr, "redirect") && moreargs)
+		{
+			int64_t id;
+			if (getLongLongFromObjectOrReply(conn->outputBuffer(),
+				obj[++i], &id, nullptr) != REDIS_OK)
+			{
+				return true;
+			}
+
+			{
+				std::unique_lock <std::mutex> lck(mtx);
+				for (auto &it : sessions)
+				{
+					if (it.second->getId() == id)
+					{
+						client->redirectFd = it.first;
+						break;
+					}
+				}
+			}
+
+			if (client->redirectFd < 0)
+			{
+				addReplyError(conn->outputBuffer(),
+					"The client ID you want redirect to does not exist");
+				return true;
+			}
+			client->redirect = id;
+		}
+		else if (!strcasecmp(obj[i]->ptr, "bcast"))
+		{
+			client->bcast = true;
+		}
+		else if (!strcasecmp(obj[i]->ptr, "noloop"))
+		{
+			client->noloop = true;
+		}
+		else if (!strcasecmp(obj[i]->ptr, "prefix") && moreargs)
+		{
+			client->prefixes.push_back(std::string(obj[i + 1]->ptr, sdslen(obj[i + 1]->ptr)));
+			i++;
+		}
+		else
+		{
+			addReply(conn->outputBuffer(), shared.syntaxerr);
+			return true;
+		}
+	}
+
+	if (client->redirect < 0)
+	{
+		addReplyError(conn->outputBuffer(),
+			"CLIENT TRACKING needs REDIRECT to a client subscribed to "
+			"__redis__:invalidate, RESP3 is not supported");
+		return true;
+	}
+
+	if (!client->bcast && !client->prefixes.empty())
+	{
+		addReplyError(conn->outputBuffer(),
+			"PREFIX option requires BCAST mode to be enabled");
+		return true;
+	}
+
+	/* Broadcast clients match written keys on their prefixes, the keys
+	 * they read are not remembered. */
+	session->setTracking(!client->bcast);
+	tracking.enable(client);
+	addReply(conn->outputBuffer(), shared.ok);
+	return true;
+}
+
+bool Redis::echoCommand(const std::deque<RedisObjectPtr> &obj,
+	const SessionPtr &session, const TcpConnectionPtr &conn)
+{
+	if (obj.size() > 1)
+	{
+		return false;
+	}
+
+	addReplyBulk(conn->outputBuffer(), obj[0]);
+	return true;
+}
+
+bool Redis::authCommand(const std::deque<RedisObjectPtr> &obj,
+	const SessionPtr &session, const TcpConnectionPtr &conn)
+{
+	if (obj.size() > 1)
+	{
+		return false;
+	}
+
+	if (password.c_str() == nullptr)
+	{
+		addReplyError(conn->outputBuffer(), "client sent auth, but no password is set");
+		return true;
+	}
+
+	if (!strcmp(obj[0]->ptr, password.c_str()))
+	{
+		session->setAuth(true);
+		addReply(conn->outputBuffer(), shared.ok);
+	}
+	else
+	{
+		addReplyError(conn->outputBuffer(), "invalid password");
+	}
+	return true;
+}
+
+bool Redis::configCommand(const std::deque<RedisObjectPtr> &obj,
+	const SessionPtr &session, const TcpConnectionPtr &conn)
+{
+	if (obj.size() > 3 || obj.size() == 0)
+	{
+		return false;
+	}
+
+	if (!strcmp(obj[0]->ptr, "set"))
+	{
+		if (obj.size() != 3)
+		{
+			addReplyErrorFormat(conn->outputBuffer(),
+				"Wrong number of arguments for CONFIG %s", (char*)obj[0]->ptr);
+			return true;
+		}
 
 		if (!strcmp(obj[1]->ptr, "requirepass"))
 		{
@@ -586,6 +1446,190 @@ bool Redis::configCommand(const std::deque<RedisObjectPtr> &obj,
 			session->setAuth(false);
 			addReply(conn->outputBuffer(), shared.ok);
 		}
+		else if (!strcmp(obj[1]->ptr, "rdb-segments"))
+		{
+			int32_t segments;
+			if (getLongFromObjectOrReply(conn->outputBuffer(), obj[2], &segments, nullptr) != REDIS_OK)
+			{
+				return true;
+			}
+
+			if (segments < 1 || segments > REDIS_RDB_MAX_SEGMENTS)
+			{
+				addReplyErrorFormat(conn->outputBuffer(),
+					"Invalid argument '%s' for CONFIG SET 'rdb-segments'",
+					(char*)obj[2]->ptr);
+				return true;
+			}
+			rdbSegments = segments;
+			addReply(conn->outputBuffer(), shared.ok);
+		}
+		else if (!strcmp(obj[1]->ptr, "repl-diskless-sync"))
+		{
+			if (!strcmp(obj[2]->ptr, "yes"))
+			{
+				replDiskless = true;
+			}
+			else if (!strcmp(obj[2]->ptr, "no"))
+			{
+				replDiskless = false;
+			}
+			else
+			{
+				addReplyErrorFormat(conn->outputBuffer(),
+					"Invalid argument '%s' for CONFIG SET 'repl-diskless-sync'",
+					(char*)obj[2]->ptr);
+				return true;
+			}
+			addReply(conn->outputBuffer(), shared.ok);
+		}
+		else if (!strcmp(obj[1]->ptr, "slave-serve-stale-data"))
+		{
+			if (!strcmp(obj[2]->ptr, "yes"))
+			{
+				replServeStale = true;
+			}
+			else if (!strcmp(obj[2]->ptr, "no"))
+			{
+				replServeStale = false;
+			}
+			else
+			{
+				addReplyErrorFormat(conn->outputBuffer(),
+					"Invalid argument '%s' for CONFIG SET 'slave-serve-stale-data'",
+					(char*)obj[2]->ptr);
+				return true;
+			}
+			addReply(conn->outputBuffer(), shared.ok);
+		}
+		else if (!strcmp(obj[1]->ptr, "slave-max-lag"))
+		{
+			int64_t seconds;
+			if (!string2ll(obj[2]->ptr, sdslen(obj[2]->ptr), &seconds)
+				|| seconds < 0 || seconds > INT_MAX)
+			{
+				addReplyErrorFormat(conn->outputBuffer(),
+					"Invalid argument '%s' for CONFIG SET 'slave-max-lag'",
+					(char*)obj[2]->ptr);
+				return true;
+			}
+			replMaxLag = static_cast<int32_t>(seconds);
+			addReply(conn->outputBuffer(), shared.ok);
+		}
+		else if (!strcmp(obj[1]->ptr, "repl-backlog-size"))
+		{
+			int64_t size;
+			if (!string2ll(obj[2]->ptr, sdslen(obj[2]->ptr), &size) || size <= 0)
+			{
+				addReplyErrorFormat(conn->outputBuffer(),
+					"Invalid argument '%s' for CONFIG SET 'repl-backlog-size'",
+					(char*)obj[2]->ptr);
+				return true;
+			}
+			repli.setBacklogSize(size);
+			addReply(conn->outputBuffer(), shared.ok);
+		}
+		else if (!strcmp(obj[1]->ptr, "repl-output-buffer-limit"))
+		{
+			int64_t limit;
+			if (!string2ll(obj[2]->ptr, sdslen(obj[2]->ptr), &limit) || limit < 0)
+			{
+				addReplyErrorFormat(conn->outputBuffer(),
+					"Invalid argument '%s' for CONFIG SET 'repl-output-buffer-limit'",
+					(char*)obj[2]->ptr);
+				return true;
+			}
+			repli.setOutputLimit(limit);
+			addReply(conn->outputBuffer(), shared.ok);
+		}
+		else if (!strcmp(obj[1]->ptr, "tracking-table-max-keys"))
+		{
+			int64_t keys;
+			if (!string2ll(obj[2]->ptr, sdslen(obj[2]->ptr), &keys) || keys < 0)
+			{
+				addReplyErrorFormat(conn->outputBuffer(),
+					"Invalid argument '%s' for CONFIG SET 'tracking-table-max-keys'",
+					(char*)obj[2]->ptr);
+				return true;
+			}
+			tracking.setMaxKeys(keys);
+			addReply(conn->outputBuffer(), shared.ok);
+		}
+		else if (!strcmp(obj[1]->ptr, "notify-keyspace-events"))
+		{
+			int32_t flags = keyspaceEventsStringToFlags(obj[2]->ptr);
+			if (flags == -1)
+			{
+				addReplyErrorFormat(conn->outputBuffer(),
+					"Invalid argument '%s' for CONFIG SET 'notify-keyspace-events'",
+					(char*)obj[2]->ptr);
+				return true;
+			}
+			notifyKeyspaceEvents = flags;
+			addReply(conn->outputBuffer(), shared.ok);
+		}
+		else if (!strcmp(obj[1]->ptr, "slowlog-log-slower-than"))
+		{
+			int64_t us;
+			if (!string2ll(obj[2]->ptr, sdslen(obj[2]->ptr), &us))
+			{
+				addReplyErrorFormat(conn->outputBuffer(),
+					"Invalid argument '%s' for CONFIG SET 'slowlog-log-slower-than'",
+					(char*)obj[2]->ptr);
+				return true;
+			}
+			slowlog.setSlowerThan(us);
+			addReply(conn->outputBuffer(), shared.ok);
+		}
+		else if (!strcmp(obj[1]->ptr, "slowlog-max-len"))
+		{
+			int64_t len;
+			if (!string2ll(obj[2]->ptr, sdslen(obj[2]->ptr), &len) || len < 0)
+			{
+				addReplyErrorFormat(conn->outputBuffer(),
+					"Invalid argument '%s' for CONFIG SET 'slowlog-max-len'",
+					(char*)obj[2]->ptr);
+				return true;
+			}
+			slowlog.setMaxLen(len);
+			addReply(conn->outputBuffer(), shared.ok);
+		}
+		else if (!strcmp(obj[1]->ptr, "latency-monitor-threshold"))
+		{
+			int64_t ms;
+			if (!string2ll(obj[2]->ptr, sdslen(obj[2]->ptr), &ms) || ms < 0)
+			{
+				addReplyErrorFormat(conn->outputBuffer(),
+					"Invalid argument '%s' for CONFIG SET 'latency-monitor-threshold'",
+					(char*)obj[2]->ptr);
+				return true;
+			}
+			latency.setThreshold(ms);
+			addReply(conn->outputBuffer(), shared.ok);
+		}
+		else if (!strcmp(obj[1]->ptr, "appendfsync"))
+		{
+			if (!strcmp(obj[2]->ptr, "always"))
+			{
+				aof.setFsyncPolicy(AOF_FSYNC_ALWAYS);
+			}
+			else if (!strcmp(obj[2]->ptr, "everysec"))
+			{
+				aof.setFsyncPolicy(AOF_FSYNC_EVERYSEC);
+			}
+			else if (!strcmp(obj[2]->ptr, "no"))
+			{
+				aof.setFsyncPolicy(AOF_FSYNC_NO);
+			}
+			else
+			{
+				addReplyErrorFormat(conn->outputBuffer(),
+					"Invalid argument '%s' for CONFIG SET 'appendfsync'",
+					(char*)obj[2]->ptr);
+				return true;
+			}
+			addReply(conn->outputBuffer(), shared.ok);
+		}
 		else
 		{
 			addReplyErrorFormat(conn->outputBuffer(),
@@ -594,6 +1638,12 @@ bool Redis::configCommand(const std::deque<RedisObjectPtr> &obj,
 		}
 
 	}
+	else if (!strcmp(obj[0]->ptr, "resetstat") && obj.size() == 1)
+	{
+		commandStats.reset();
+		stats.reset();
+		addReply(conn->outputBuffer(), shared.ok);
+	}
 	else
 	{
 		addReplyError(conn->outputBuffer(),
@@ -602,6 +1652,9 @@ bool Redis::configCommand(const std::deque<RedisObjectPtr> &obj,
 	return true;
 }
 
+/* MIGRATE host port key|"" destination-db timeout [COPY] [REPLACE] [AUTH password]
+ * [KEYS key1 key2 ... keyN]. The keys are pipelined to the target from the
+ * cluster loop, the client is blocked until all of them are settled. */
 bool Redis::migrateCommand(const std::deque<RedisObjectPtr> &obj,
 	const SessionPtr &session, const TcpConnectionPtr &conn)
 {
@@ -610,30 +1663,24 @@ bool Redis::migrateCommand(const std::deque<RedisObjectPtr> &obj,
 		return false;
 	}
 
-	if (!clusterEnabled)
-	{
-		addReplyError(conn->outputBuffer(), "this instance has cluster support disabled");
-		return true;
-	}
-
-	int32_t firstKey = 3; /* Argument index of the first key. */
+	int32_t firstKey = 2; /* Argument index of the first key. */
 	int32_t numKeys = 1;  /* By default only migrate the 'key' argument. */
 
-	int8_t copy = 0, replace = 0;
+	bool copy = false, replace = false;
 	char *password = nullptr;
 
 	for (int i = 5; i < obj.size(); i++)
 	{
 		int moreargs = i < obj.size() - 1;
-		if (!strcmp(obj[i]->ptr, "copy"))
+		if (!STRCMP(obj[i]->ptr, "copy"))
 		{
-			copy = 1;
+			copy = true;
 		}
-		else if (!strcmp(obj[i]->ptr, "replace"))
+		else if (!STRCMP(obj[i]->ptr, "replace"))
 		{
-			replace = 1;
+			replace = true;
 		}
-		else if (!strcmp(obj[i]->ptr, "auth"))
+		else if (!STRCMP(obj[i]->ptr, "auth"))
 		{
 			if (!moreargs)
 			{
@@ -643,7 +1690,7 @@ bool Redis::migrateCommand(const std::deque<RedisObjectPtr> &obj,
 			i++;
 			password = obj[i]->ptr;
 		}
-		else if (!strcmp(obj[i]->ptr, "keys"))
+		else if (!STRCMP(obj[i]->ptr, "keys"))
 		{
 			if (sdslen(obj[2]->ptr) != 0)
 			{
@@ -675,12 +1722,18 @@ bool Redis::migrateCommand(const std::deque<RedisObjectPtr> &obj,
 		return true;
 	}
 
-	if (timeout <= 0) timeout = 1000;
+	if (timeout <= 0) timeout = CLUSTER_MIGRATE_DEFAULT_TIMEOUT;
+
+	if (dbid < 0 || dbid >= dbnum)
+	{
+		addReplyError(conn->outputBuffer(), "DB index is out of range");
+		return true;
+	}
 
 	if (getLongLongFromObject(obj[1], &port) != REDIS_OK)
 	{
 		addReplyErrorFormat(conn->outputBuffer(), "Invalid TCP port specified: %s",
-			(char*)obj[2]->ptr);
+			(char*)obj[1]->ptr);
 		return true;
 	}
 
@@ -691,20 +1744,118 @@ bool Redis::migrateCommand(const std::deque<RedisObjectPtr> &obj,
 		return true;
 	}
 
-	clus.replicationToNode(obj, session, ip, port, copy, replace, numKeys, firstKey);
-	addReply(conn->outputBuffer(), shared.ok);
-	return true;
-}
+	MigrateJobPtr job(new MigrateJob(obj[0]->ptr, port, -1));
+	job->timeout = timeout;
+	job->copy = copy;
+	job->replace = replace;
+	if (password != nullptr)
+	{
+		job->password = password;
+	}
+
+	for (int32_t j = 0; j < numKeys; j++)
+	{
+		job->keys.push_back(obj[firstKey + j]);
+	}
+
+	session->setBlocked();
+	clus.startMigrate(job, session, conn);
+	return true;
+}
+
+/* The next command of the client is served for a slot being imported here,
+ * it was sent by -ASK from the node the slot is leaving. */
+bool Redis::askingCommand(const std::deque<RedisObjectPtr> &obj,
+	const SessionPtr &session, const TcpConnectionPtr &conn)
+{
+	if (obj.size() > 0)
+	{
+		return false;
+	}
+
+	if (!clusterEnabled)
+	{
+		addReplyError(conn->outputBuffer(), "This instance has cluster support disabled");
+		return true;
+	}
+
+	session->setAsking();
+	addReply(conn->outputBuffer(), shared.ok);
+	return true;
+}
+
+bool Redis::clusterCommand(const std::deque<RedisObjectPtr> &obj,
+	const SessionPtr &session, const TcpConnectionPtr &conn)
+{
+	if (!clusterEnabled)
+	{
+		return false;
+	}
+
+	/* CLUSTER MIGRATESLOT slot host port [COPY] [REPLACE], replies the number
+	 * of keys moved once the slot is empty here. */
+	if (!STRCMP(obj[0]->ptr, "migrateslot"))
+	{
+		if (obj.size() < 4)
+		{
+			return false;
+		}
+
+		int32_t slot;
+		int64_t port;
+		if ((slot = clus.getSlotOrReply(session, obj[1], conn)) == REDIS_ERR)
+		{
+			return true;
+		}
+
+		if (getLongLongFromObject(obj[3], &port) != REDIS_OK)
+		{
+			addReplyErrorFormat(conn->outputBuffer(), "Invalid TCP port specified: %s",
+				(char*)obj[3]->ptr);
+			return true;
+		}
+
+		MigrateJobPtr job(new MigrateJob(obj[2]->ptr, port, slot));
+		for (int32_t i = 4; i < obj.size(); i++)
+		{
+			if (!STRCMP(obj[i]->ptr, "copy"))
+			{
+				job->copy = true;
+			}
+			else if (!STRCMP(obj[i]->ptr, "replace"))
+			{
+				job->replace = true;
+			}
+			else
+			{
+				addReply(conn->outputBuffer(), shared.syntaxerr);
+				return true;
+			}
+		}
+
+		{
+			std::unique_lock <std::mutex> lck(clusterMutex);
+			ClusterNode *node = clus.checkClusterSlot(slot);
+			if (node == nullptr || node->ip != ip || node->port != this->port)
+			{
+				addReplyErrorFormat(conn->outputBuffer(),
+					"I'm not the owner of hash slot %d", slot);
+				return true;
+			}
+
+			if (!clus.addSlotMigration(job))
+			{
+				addReplyErrorFormat(conn->outputBuffer(),
+					"Hash slot %d is already being migrated", slot);
+				return true;
+			}
+		}
 
-bool Redis::clusterCommand(const std::deque<RedisObjectPtr> &obj,
-	const SessionPtr &session, const TcpConnectionPtr &conn)
-{
-	if (!clusterEnabled)
-	{
-		return false;
+		session->setBlocked();
+		clus.startMigrate(job, session, conn);
+		return true;
 	}
-
-	if (!strcmp(obj[0]->ptr, "meet"))
+	else if (!strcmp(obj[0]->ptr, "meet"))
 	{
 		if (obj.size() != 3)
 		{
@@ -748,13 +1899,10 @@ bool Redis::clusterCommand(const std::deque<RedisObjectPtr> &obj,
 			}
 		}
 
-		if (!clus.connSetCluster(obj[1]->ptr, port))
-		{
-			addReplyErrorFormat(conn->outputBuffer(),
-				"Invaild node address specified: %s:%s",
-				(char*)obj[1]->ptr, (char*)obj[2]->ptr);
-			return true;
-		}
+		/* The bus introduces the node to the rest of the cluster, the
+		 * command link is only kept to the first node met. */
+		clus.getBus().meet(obj[1]->ptr, port);
+		clus.connSetCluster(obj[1]->ptr, port);
 	}
 	else if (!strcmp(obj[0]->ptr, "connect") && obj.size() == 3)
 	{
@@ -788,7 +1936,14 @@ bool Redis::clusterCommand(const std::deque<RedisObjectPtr> &obj,
 	}
 	else if (!strcmp(obj[0]->ptr, "info") && obj.size() == 1)
 	{
-		return false;
+		addReplyBulkSds(conn->outputBuffer(), clus.getBus().showInfo());
+		return true;
+	}
+	else if (!strcmp(obj[0]->ptr, "myid") && obj.size() == 1)
+	{
+		const std::string &name = clus.getBus().getName();
+		addReplyBulkCBuffer(conn->outputBuffer(), name.data(), name.size());
+		return true;
 	}
 	else if (!strcmp(obj[0]->ptr, "flushslots") && obj.size() == 1)
 	{
@@ -837,7 +1992,7 @@ bool Redis::clusterCommand(const std::deque<RedisObjectPtr> &obj,
 
 		std::vector<RedisObjectPtr> keys;
 		clus.getKeyInSlot(slot, keys, maxkeys);
-		addReplyMultiBulkLen(conn->outputBuffer(), numkeys);
+		addReplyMultiBulkLen(conn->outputBuffer(), keys.size());
 
 		for (auto &it : keys)
 		{
@@ -856,6 +2011,47 @@ bool Redis::clusterCommand(const std::deque<RedisObjectPtr> &obj,
 			clus.keyHashSlot((char*)key, sdslen(key)));
 		return true;
 	}
+	/* CLUSTER SETSLOT <slot> IMPORTING|STABLE and CLUSTER SETSLOT <slot> NODE
+	 * <ip> <port>, sent by CLUSTER MIGRATESLOT to its target, see MigrateJob. */
+	else if (!strcmp(obj[0]->ptr, "setslot") && ((obj.size() == 3 &&
+		(!STRCMP(obj[2]->ptr, "importing") || !STRCMP(obj[2]->ptr, "stable"))) ||
+		(obj.size() == 5 && !STRCMP(obj[2]->ptr, "node"))))
+	{
+		int32_t slot;
+		if ((slot = clus.getSlotOrReply(session, obj[1], conn)) == REDIS_ERR)
+		{
+			return true;
+		}
+
+		std::unique_lock <std::mutex> lck(clusterMutex);
+		if (!STRCMP(obj[2]->ptr, "importing"))
+		{
+			ClusterNode *node = clus.checkClusterSlot(slot);
+			if (node != nullptr && node->ip == ip && node->port == this->port)
+			{
+				addReplyErrorFormat(conn->outputBuffer(),
+					"I'm already the owner of hash slot %d", slot);
+				return true;
+			}
+			clus.setSlotImporting(slot);
+		}
+		else if (!STRCMP(obj[2]->ptr, "stable"))
+		{
+			clus.setSlotStable(slot);
+		}
+		else
+		{
+			int64_t port;
+			if (getLongLongFromObject(obj[4], &port) != REDIS_OK)
+			{
+				addReplyErrorFormat(conn->outputBuffer(), "Invalid TCP port specified: %s",
+					(char*)obj[4]->ptr);
+				return true;
+			}
+			clus.setSlotNode(slot, obj[3]->ptr, port);
+			LOG_INFO << "cluster slot " << slot << " served by " << obj[3]->ptr << ":" << port;
+		}
+	}
 	else if (!strcmp(obj[0]->ptr, "setslot") && obj.size() >= 3)
 	{
 		if (!!strcmp(obj[1]->ptr, "stable"))
@@ -894,21 +2090,25 @@ bool Redis::clusterCommand(const std::deque<RedisObjectPtr> &obj,
 				return true;
 			}
 
+			std::vector<int32_t> moved;
+			bool invalid = false;
+			std::unique_lock <std::mutex> lck(clusterMutex);
 			for (int32_t i = 4; i < obj.size(); i++)
 			{
 				int32_t slot;
 				if ((slot = clus.getSlotOrReply(session, obj[i], conn)) == -1)
 				{
 					addReplyErrorFormat(conn->outputBuffer(), "Invalid slot %s", obj[i]->ptr);
-					return true;
+					invalid = true;
+					break;
 				}
 
-				std::unique_lock <std::mutex> lck(clusterMutex);
 				auto it = clus.checkClusterSlot(slot);
 				if (it != nullptr)
 				{
 					it->ip = fromIp;
 					it->port = fromPort;
+					moved.push_back(slot);
 				}
 				else
 				{
@@ -916,6 +2116,12 @@ bool Redis::clusterCommand(const std::deque<RedisObjectPtr> &obj,
 				}
 			}
 
+			clus.publishSlots(moved);
+			if (invalid)
+			{
+				return true;
+			}
+
 			addReply(conn->outputBuffer(), shared.ok);
 			LOG_INFO << "cluster async replication success " << imipPort;
 			return true;
@@ -1115,16 +2321,9 @@ bool Redis::clusterCommand(const std::deque<RedisObjectPtr> &obj,
 			}
 
 			std::unique_lock <std::mutex> lck(clusterMutex);
-			if (clusterConns.empty())
-			{
-				addReplyErrorFormat(conn->outputBuffer(), "execute cluster meet ip:port");
-				return true;
-			}
-
 			if (clus.checkClusterSlot(slot) == nullptr)
 			{
-				char name[CLUSTER_NAMELEN];
-				getRandomHexChars(name, CLUSTER_NAMELEN);
+				const std::string &name = clus.getBus().getName();
 				clus.cretateClusterNode(slot, this->ip, this->port, name);
 				clus.addSlotDeques(obj[j], name);
 				clus.syncClusterSlot();
@@ -1170,6 +2369,111 @@ void Redis::structureRedisProtocol(Buffer &buffer, std::deque<RedisObjectPtr> &r
 	}
 }
 
+/* Appends the part of a command, given with its name first, that lands after
+ * the copy of its shard: a flushdb cuts every shard still to be copied, a del
+ * keeps only the keys whose shard is already copied. */
+void Redis::structureCutProtocol(Buffer &buffer, std::deque<RedisObjectPtr> &robjs, bool *cuts)
+{
+	if (Equal()(robjs[0], shared.flushdb))
+	{
+		for (int32_t i = 0; i < kShards; i++)
+		{
+			cuts[i] = true;
+		}
+		structureRedisProtocol(buffer, robjs);
+	}
+	else if (Equal()(robjs[0], shared.del))
+	{
+		std::deque<RedisObjectPtr> keys;
+		for (size_t i = 1; i < robjs.size(); i++)
+		{
+			if (cuts[robjs[i]->hash % kShards])
+			{
+				keys.push_back(robjs[i]);
+			}
+		}
+
+		if (!keys.empty())
+		{
+			keys.push_front(robjs[0]);
+			structureRedisProtocol(buffer, keys);
+		}
+	}
+	else if (robjs.size() > 1 && cuts[robjs[1]->hash % kShards])
+	{
+		structureRedisProtocol(buffer, robjs);
+	}
+}
+
+void Redis::getCommandShards(const RedisObjectPtr &cmd,
+	const std::deque<RedisObjectPtr> &commands, std::vector<int32_t> &shards)
+{
+	if (Equal()(cmd, shared.flushdb))
+	{
+		for (int32_t i = 0; i < kShards; i++)
+		{
+			shards.push_back(i);
+		}
+	}
+	else if (Equal()(cmd, shared.del))
+	{
+		for (auto &it : commands)
+		{
+			shards.push_back(it->hash % kShards);
+		}
+		std::sort(shards.begin(), shards.end());
+		shards.erase(std::unique(shards.begin(), shards.end()), shards.end());
+	}
+	else if (!commands.empty())
+	{
+		shards.push_back(commands[0]->hash % kShards);
+	}
+}
+
+bool Redis::executeSnapshotCommand(const RedisObjectPtr &cmd,
+	std::deque<RedisObjectPtr> &commands, const std::function<bool()> &execute)
+{
+	std::vector<int32_t> shards;
+	getCommandShards(cmd, commands, shards);
+	for (auto &it : shards)
+	{
+		snapshotLocks[it].lock();
+	}
+
+	bool executed = execute();
+	for (auto it = shards.rbegin(); it != shards.rend(); ++it)
+	{
+		snapshotLocks[*it].unlock();
+	}
+	return executed;
+}
+
+/* Every loop runs a no-op task after finishing its current read batch, so
+ * once all of them ran, every write command executed before a snapshot flag
+ * was raised has been fed where that flag would have sent it. */
+void Redis::waitForLoops()
+{
+	std::vector<EventLoop*> loops = getAllLoops();
+	std::mutex barrierMutex;
+	std::condition_variable barrierCondition;
+	size_t remaining = loops.size();
+
+	for (auto &it : loops)
+	{
+		it->queueInLoop([&]
+		{
+			std::unique_lock<std::mutex> lck(barrierMutex);
+			if (--remaining == 0)
+			{
+				barrierCondition.notify_one();
+			}
+		});
+	}
+
+	std::unique_lock<std::mutex> lck(barrierMutex);
+	barrierCondition.wait(lck, [&] { return remaining == 0; });
+}
+
 bool Redis::getClusterMap(const RedisObjectPtr &command)
 {
 	auto it = cluterCommands.find(command);
@@ -1183,7 +2487,7 @@ bool Redis::getClusterMap(const RedisObjectPtr &command)
 #ifndef _WIN64
 bool Redis::bgsave(const SessionPtr &session, const TcpConnectionPtr &conn, bool enabled)
 {
-	if (rdbChildPid != -1)
+	if (isBgsaveRunning())
 	{
 		if (!enabled)
 		{
@@ -1220,7 +2524,7 @@ bool Redis::save(const SessionPtr &session, const TcpConnectionPtr &conn)
 
 	int64_t now = mstime();
 	{
-		if (rdb.rdbSave("dump.rdb") == REDIS_OK)
+		if (rdbSaveSnapshot(false) == REDIS_OK)
 		{
 			int64_t end = mstime();
 			LOG_INFO << "DB saved on disk milliseconds: " << (end - now);
@@ -1246,7 +2550,7 @@ void Redis::clearFork()
 
 	for (auto &it : slaveConns)
 	{
-		it.second->forceClose();
+		it.second->conn->forceClose();
 	}
 
 	slaveConns.clear();
@@ -1261,15 +2565,32 @@ void Redis::clearFork()
 #ifndef _WIN64
 int32_t Redis::rdbSaveBackground(bool enabled)
 {
-	if (rdbChildPid != -1) return REDIS_ERR;
+	if (isBgsaveRunning()) return REDIS_ERR;
+
+	bgsaveStart = mstime();
+	if (!bgsaveFork)
+	{
+		rdbSaving = true;
+		std::thread thread(std::bind(&Redis::rdbSaveThread, this));
+		thread.detach();
+		return REDIS_OK;
+	}
+
+	if (::pipe(childInfoPipe) == -1)
+	{
+		childInfoPipe[0] = -1;
+		childInfoPipe[1] = -1;
+	}
 
 	pid_t childpid;
+	int64_t start = latency.start();
+	int64_t forkStart = ustime();
 	if ((childpid = fork()) == 0)
 	{
 		clearFork();
 		int32_t retval;
 		rdb.setBlockEnable(enabled);
-		retval = rdb.rdbSave("dump.rdb");
+		retval = rdbSaveSnapshot(false);
 		if (retval == REDIS_OK)
 		{
 			size_t privateDirty = zmalloc_get_private_dirty(getpid());
@@ -1277,6 +2598,12 @@ int32_t Redis::rdbSaveBackground(bool enabled)
 			{
 				LOG_INFO << "RDB: " << privateDirty / (1024 * 1024) << "MB of memory used by copy-on-write";
 			}
+
+			if (childInfoPipe[1] != -1)
+			{
+				ssize_t n = ::write(childInfoPipe[1], &privateDirty, sizeof(privateDirty));
+				(void)n;
+			}
 		}
 		else
 		{
@@ -1286,9 +2613,22 @@ int32_t Redis::rdbSaveBackground(bool enabled)
 	}
 	else
 	{
+		lastForkUsec = ustime() - forkStart;
+		latency.end("fork", start);
+		if (childInfoPipe[1] != -1)
+		{
+			::close(childInfoPipe[1]);
+			childInfoPipe[1] = -1;
+		}
+
 		if (childpid == -1)
 		{
 			LOG_WARN << "childpid error";
+			if (childInfoPipe[0] != -1)
+			{
+				::close(childInfoPipe[0]);
+				childInfoPipe[0] = -1;
+			}
 			return REDIS_ERR;
 		}
 
@@ -1299,6 +2639,48 @@ int32_t Redis::rdbSaveBackground(bool enabled)
 
 #endif
 
+/* A replica full sync streams dump.rdb, so it always gets the single-file
+ * format; otherwise rdbSegments > 1 selects the parallel segmented one. */
+int32_t Redis::rdbSaveSnapshot(bool singleFile)
+{
+	if (!singleFile && rdbSegments > 1)
+	{
+		if (rdb.rdbSaveSegments(REDIS_DEFAULT_RDB_FILENGTHAME, rdbSegments) != REDIS_OK)
+		{
+			return REDIS_ERR;
+		}
+
+		::unlink(REDIS_DEFAULT_RDB_FILENGTHAME);
+		return REDIS_OK;
+	}
+
+	if (rdb.rdbSave(REDIS_DEFAULT_RDB_FILENGTHAME) != REDIS_OK)
+	{
+		return REDIS_ERR;
+	}
+
+	rdb.rdbRemoveSegments(REDIS_DEFAULT_RDB_FILENGTHAME);
+	return REDIS_OK;
+}
+
+void Redis::rdbSaveThread()
+{
+	ThreadPool::clearThreadAffinity();
+	int64_t start = latency.start();
+	int32_t retval = rdbSaveSnapshot(false);
+	latency.end("rdb-save", start);
+	if (retval != REDIS_OK)
+	{
+		LOG_WARN << "rdbSave failure";
+	}
+
+	loop.runInLoop([this, retval]()
+	{
+		rdbSaving = false;
+		bgsaveDone(retval == REDIS_OK);
+	});
+}
+
 bool Redis::bgsaveCommand(const std::deque<RedisObjectPtr> &obj,
 	const SessionPtr &session, const TcpConnectionPtr &conn)
 {
@@ -1313,6 +2695,29 @@ bool Redis::bgsaveCommand(const std::deque<RedisObjectPtr> &obj,
 	return true;
 }
 
+bool Redis::bgrewriteaofCommand(const std::deque<RedisObjectPtr> &obj,
+	const SessionPtr &session, const TcpConnectionPtr &conn)
+{
+	if (obj.size() > 0)
+	{
+		return false;
+	}
+
+	if (!aofEnabled)
+	{
+		addReplyError(conn->outputBuffer(), "Append only file is disabled");
+	}
+	else if (aof.rewriteBackground())
+	{
+		addReplyStatus(conn->outputBuffer(), "Background append only file rewriting started");
+	}
+	else
+	{
+		addReplyError(conn->outputBuffer(), "Background append only file rewriting already in progress");
+	}
+	return true;
+}
+
 bool Redis::saveCommand(const std::deque<RedisObjectPtr> &obj,
 	const SessionPtr &session, const TcpConnectionPtr &conn)
 {
@@ -1321,7 +2726,7 @@ bool Redis::saveCommand(const std::deque<RedisObjectPtr> &obj,
 		return false;
 	}
 
-	if (rdbChildPid != -1)
+	if (isBgsaveRunning())
 	{
 		addReplyError(conn->outputBuffer(), "Background save already in progress");
 		return true;
@@ -1392,6 +2797,117 @@ bool Redis::commandCommand(const std::deque<RedisObjectPtr> &obj,
 	return true;
 }
 
+/* SLOWLOG GET [count] | LEN | RESET */
+bool Redis::slowlogCommand(const std::deque<RedisObjectPtr> &obj,
+	const SessionPtr &session, const TcpConnectionPtr &conn)
+{
+	if (obj.size() < 1 || obj.size() > 2)
+	{
+		return false;
+	}
+
+	if (!strcasecmp(obj[0]->ptr, "reset") && obj.size() == 1)
+	{
+		slowlog.reset();
+		addReply(conn->outputBuffer(), shared.ok);
+	}
+	else if (!strcasecmp(obj[0]->ptr, "len") && obj.size() == 1)
+	{
+		addReplyLongLong(conn->outputBuffer(), slowlog.len());
+	}
+	else if (!strcasecmp(obj[0]->ptr, "get"))
+	{
+		int64_t count = 10;
+		if (obj.size() == 2 && (!string2ll(obj[1]->ptr,
+			sdslen(obj[1]->ptr), &count) || count < 0))
+		{
+			addReplyError(conn->outputBuffer(), "value is out of range or not an integer");
+			return true;
+		}
+
+		std::vector<SlowLogEntry> entries;
+		slowlog.get(count, entries);
+		addReplyMultiBulkLen(conn->outputBuffer(), entries.size());
+		for (auto &it : entries)
+		{
+			addReplyMultiBulkLen(conn->outputBuffer(), 6);
+			addReplyLongLong(conn->outputBuffer(), it.id);
+			addReplyLongLong(conn->outputBuffer(), it.time);
+			addReplyLongLong(conn->outputBuffer(), it.duration);
+			addReplyMultiBulkLen(conn->outputBuffer(), it.argv.size());
+			for (auto &iter : it.argv)
+			{
+				addReplyBulk(conn->outputBuffer(), iter);
+			}
+			addReplyBulk(conn->outputBuffer(), it.addr);
+			addReplyBulkCBuffer(conn->outputBuffer(), "", 0);
+		}
+	}
+	else
+	{
+		addReplyError(conn->outputBuffer(),
+			"Unknown SLOWLOG subcommand or wrong number of arguments");
+	}
+	return true;
+}
+
+/* LATENCY LATEST | HISTORY event | RESET [event ...] | DOCTOR */
+bool Redis::latencyCommand(const std::deque<RedisObjectPtr> &obj,
+	const SessionPtr &session, const TcpConnectionPtr &conn)
+{
+	if (obj.size() < 1)
+	{
+		return false;
+	}
+
+	if (!strcasecmp(obj[0]->ptr, "latest") && obj.size() == 1)
+	{
+		std::vector<std::pair<std::string, LatencySample>> samples;
+		std::vector<uint32_t> maxs;
+		latency.latest(samples, maxs);
+		addReplyMultiBulkLen(conn->outputBuffer(), samples.size());
+		for (size_t i = 0; i < samples.size(); i++)
+		{
+			addReplyMultiBulkLen(conn->outputBuffer(), 4);
+			addReplyBulkCString(conn->outputBuffer(), samples[i].first.c_str());
+			addReplyLongLong(conn->outputBuffer(), samples[i].second.time);
+			addReplyLongLong(conn->outputBuffer(), samples[i].second.latency);
+			addReplyLongLong(conn->outputBuffer(), maxs[i]);
+		}
+	}
+	else if (!strcasecmp(obj[0]->ptr, "history") && obj.size() == 2)
+	{
+		std::vector<LatencySample> samples;
+		latency.history(std::string(obj[1]->ptr, sdslen(obj[1]->ptr)), samples);
+		addReplyMultiBulkLen(conn->outputBuffer(), samples.size());
+		for (auto &it : samples)
+		{
+			addReplyMultiBulkLen(conn->outputBuffer(), 2);
+			addReplyLongLong(conn->outputBuffer(), it.time);
+			addReplyLongLong(conn->outputBuffer(), it.latency);
+		}
+	}
+	else if (!strcasecmp(obj[0]->ptr, "reset"))
+	{
+		std::vector<std::string> events;
+		for (size_t i = 1; i < obj.size(); i++)
+		{
+			events.push_back(std::string(obj[i]->ptr, sdslen(obj[i]->ptr)));
+		}
+		addReplyLongLong(conn->outputBuffer(), latency.reset(events));
+	}
+	else if (!strcasecmp(obj[0]->ptr, "doctor") && obj.size() == 1)
+	{
+		addReplyBulkSds(conn->outputBuffer(), latency.doctor());
+	}
+	else
+	{
+		addReplyError(conn->outputBuffer(),
+			"Unknown LATENCY subcommand or wrong number of arguments");
+	}
+	return true;
+}
+
 void Redis::forkWait()
 {
 	forkCondWaitCount++;
@@ -1433,6 +2949,7 @@ bool Redis::lpushCommand(const std::deque<RedisObjectPtr> &obj,
 				list.push_back(obj[i]);
 			}
 			map.insert(obj[0]);
+			addSlotKey(index, obj[0]);
 			listMap.insert(std::make_pair(obj[0], std::move(list)));
 		}
 		else
@@ -1457,6 +2974,8 @@ bool Redis::lpushCommand(const std::deque<RedisObjectPtr> &obj,
 		}
 	}
 
+	signalModifiedKey(obj[0], session->getId());
+	notifyKeyspaceEvent(NOTIFY_LIST, "lpush", obj[0]);
 	addReplyLongLong(conn->outputBuffer(), pushed);
 	return true;
 }
@@ -1474,6 +2993,8 @@ bool Redis::lpopCommand(const std::deque<RedisObjectPtr> &obj,
 	auto &mu = redisShards[index].mtx;
 	auto &map = redisShards[index].redisMap;
 	auto &listMap = redisShards[index].listMap;
+	bool popped = false;
+	bool emptied = false;
 	{
 		std::unique_lock <std::mutex> lck(mu);
 		auto it = map.find(obj[0]);
@@ -1497,13 +3018,26 @@ bool Redis::lpopCommand(const std::deque<RedisObjectPtr> &obj,
 			assert((*it)->type == iter->first->type);
 			addReplyBulk(conn->outputBuffer(), iter->second.back());
 			iter->second.pop_back();
+			popped = true;
 			if (iter->second.empty())
 			{
 				listMap.erase(iter);
+				delSlotKey(index, *it);
 				map.erase(it);
+				emptied = true;
 			}
 		}
 	}
+
+	if (popped)
+	{
+		signalModifiedKey(obj[0], session->getId());
+		notifyKeyspaceEvent(NOTIFY_LIST, "lpop", obj[0]);
+		if (emptied)
+		{
+			notifyKeyspaceEvent(NOTIFY_GENERIC, "del", obj[0]);
+		}
+	}
 	return true;
 }
 
@@ -1531,6 +3065,7 @@ bool Redis::lrangeCommand(const std::deque<RedisObjectPtr> &obj,
 	{
 		std::unique_lock <std::mutex> lck(mu);
 		auto it = map.find(obj[0]);
+		stats.lookupKey(it != map.end());
 		if (it == map.end())
 		{
 			auto iter = listMap.find(obj[0]);
@@ -1620,6 +3155,7 @@ bool Redis::rpushCommand(const std::deque<RedisObjectPtr> &obj,
 				list.push_front(obj[i]);
 			}
 			map.insert(obj[0]);
+			addSlotKey(index, obj[0]);
 			listMap.insert(std::make_pair(obj[0], std::move(list)));
 		}
 		else
@@ -1644,6 +3180,8 @@ bool Redis::rpushCommand(const std::deque<RedisObjectPtr> &obj,
 		}
 	}
 
+	signalModifiedKey(obj[0], session->getId());
+	notifyKeyspaceEvent(NOTIFY_LIST, "rpush", obj[0]);
 	addReplyLongLong(conn->outputBuffer(), pushed);
 	return true;
 }
@@ -1660,6 +3198,8 @@ bool Redis::rpopCommand(const std::deque<RedisObjectPtr> &obj, const SessionPtr
 	auto &mu = redisShards[index].mtx;
 	auto &map = redisShards[index].redisMap;
 	auto &listMap = redisShards[index].listMap;
+	bool popped = false;
+	bool emptied = false;
 	{
 		std::unique_lock <std::mutex> lck(mu);
 		auto it = map.find(obj[0]);
@@ -1683,13 +3223,26 @@ bool Redis::rpopCommand(const std::deque<RedisObjectPtr> &obj, const SessionPtr
 			assert((*it)->type == iter->first->type);
 			addReplyBulk(conn->outputBuffer(), iter->second.front());
 			iter->second.pop_front();
+			popped = true;
 			if (iter->second.empty())
 			{
 				listMap.erase(iter);
+				delSlotKey(index, *it);
 				map.erase(it);
+				emptied = true;
 			}
 		}
 	}
+
+	if (popped)
+	{
+		signalModifiedKey(obj[0], session->getId());
+		notifyKeyspaceEvent(NOTIFY_LIST, "rpop", obj[0]);
+		if (emptied)
+		{
+			notifyKeyspaceEvent(NOTIFY_GENERIC, "del", obj[0]);
+		}
+	}
 	return false;
 }
 
@@ -1708,6 +3261,7 @@ bool Redis::llenCommand(const std::deque<RedisObjectPtr> &obj, const SessionPtr
 	{
 		std::unique_lock <std::mutex> lck(mu);
 		auto it = map.find(obj[0]);
+		stats.lookupKey(it != map.end());
 		if (it == map.end())
 		{
 			auto iter = listMap.find(obj[0]);
@@ -1723,88 +3277,126 @@ bool Redis::llenCommand(const std::deque<RedisObjectPtr> &obj, const SessionPtr
 			return true;
 		}
 
-		auto iter = listMap.find(obj[0]);
-		assert(iter != listMap.end());
-		assert((*it)->type == iter->first->type);
-		addReplyLongLong(conn->outputBuffer(), iter->second.size());
+		auto iter = listMap.find(obj[0]);
+		assert(iter != listMap.end());
+		assert((*it)->type == iter->first->type);
+		addReplyLongLong(conn->outputBuffer(), iter->second.size());
+	}
+	return true;
+}
+
+bool Redis::syncCommand(const std::deque<RedisObjectPtr> &obj, const SessionPtr &session, const TcpConnectionPtr &conn)
+{
+	if (obj.size() > 0)
+	{
+		return false;
+	}
+
+	if (!repli.syncSlave(conn, false, session->getListeningPort()))
+	{
+		LOG_WARN << "client repeat send sync ";
+		conn->forceClose();
+	}
+	return true;
+}
+
+bool Redis::psyncCommand(const std::deque<RedisObjectPtr> &obj, const SessionPtr &session, const TcpConnectionPtr &conn)
+{
+	if (obj.size() != 2)
+	{
+		return false;
+	}
+
+	if (repli.tryPartialResync(conn, session->getListeningPort(), obj[0], obj[1]))
+	{
+		return true;
+	}
+
+	if (!repli.syncSlave(conn, true, session->getListeningPort()))
+	{
+		LOG_WARN << "client repeat send psync ";
+		conn->forceClose();
 	}
 	return true;
 }
 
-bool Redis::syncCommand(const std::deque<RedisObjectPtr> &obj, const SessionPtr &session, const TcpConnectionPtr &conn)
+/* Slaves send REPLCONF ACK inline on the master link, the master asks for
+ * one with REPLCONF GETACK through the stream. */
+bool Redis::replconfCommand(const std::deque<RedisObjectPtr> &obj,
+	const SessionPtr &session, const TcpConnectionPtr &conn)
 {
-	if (obj.size() > 0)
+	if (obj.size() == 0 || (obj.size() % 2) != 0)
 	{
 		return false;
 	}
 
-	TimerPtr timer;
+	for (size_t i = 0; i < obj.size(); i += 2)
 	{
-		std::unique_lock <std::mutex> lck(slaveMutex);
-		auto it = repliTimers.find(conn->getSockfd());
-		if (it != repliTimers.end())
+		if (!strcasecmp(obj[i]->ptr, "getack"))
 		{
-			LOG_WARN << "client repeat send sync ";
-			conn->forceClose();
+			if (conn->getSockfd() == masterfd)
+			{
+				repli.requestAckToMaster();
+			}
 			return true;
 		}
-
-		slavefd = conn->getSockfd();
-		timer = conn->getLoop()->runAfter(REPLI_TIME_OUT,
-			false, std::bind(&Redis::slaveRepliTimeOut, this, slavefd));
-		repliTimers.insert(std::make_pair(conn->getSockfd(), timer));
-		slaveConns.insert(std::make_pair(conn->getSockfd(), conn));
-	}
-
-	auto threadPoolVec = server.getThreadPool()->getAllLoops();
-	for (auto &it : threadPoolVec)
-	{
-		if (conn->getLoop()->getThreadId() == it->getThreadId())
+		else if (!strcasecmp(obj[i]->ptr, "listening-port"))
 		{
-			continue;
+			int64_t port;
+			if (getLongLongFromObjectOrReply(conn->outputBuffer(),
+				obj[i + 1], &port, nullptr) != REDIS_OK)
+			{
+				return true;
+			}
+			session->setListeningPort((int32_t)port);
 		}
-
-		it->runInLoop(std::bind(&Redis::forkWait, this));
-	}
-
-	if (threadCount > 1)
-	{
-		std::unique_lock <std::mutex> lck(forkMutex);
-		while (forkCondWaitCount < threadCount)
+		else if (strcasecmp(obj[i]->ptr, "ip-address")
+			&& strcasecmp(obj[i]->ptr, "capa"))
 		{
-			expireCondition.wait(lck);
+			addReplyErrorFormat(conn->outputBuffer(),
+				"Unrecognized REPLCONF option: %s", (char*)obj[i]->ptr);
+			return true;
 		}
 	}
 
-	repliEnabled = true;
-	forkCondWaitCount = 0;
-	conn->setMessageCallback(std::bind(&Replication::slaveCallback,
-		&repli, std::placeholders::_1, std::placeholders::_2));
+	addReply(conn->outputBuffer(), shared.ok);
+	return true;
+}
 
-#ifndef _WIN64
-	if (!bgsave(session, conn, true))
+/* WAIT numreplicas timeout: blocks the client until numreplicas slaves
+ * acknowledged everything propagated so far, or the timeout in milliseconds,
+ * zero meaning forever, expired. Replies with the slaves that did. */
+bool Redis::waitCommand(const std::deque<RedisObjectPtr> &obj,
+	const SessionPtr &session, const TcpConnectionPtr &conn)
+{
+	if (obj.size() != 2)
 	{
-		{
-			std::unique_lock <std::mutex> lck(slaveMutex);
-			repliTimers.erase(conn->getSockfd());
-			conn->getLoop()->cancelAfter(timer);
-			slaveConns.erase(conn->getSockfd());
-		}
-		slavefd = -1;
-		conn->forceClose();
+		return false;
 	}
-#endif
 
-	if (threadCount > 1)
+	if (masterPort > 0)
 	{
-		forkCondition.notify_all();
+		addReplyError(conn->outputBuffer(), "WAIT cannot be used with slave instances.");
+		return true;
 	}
-	return true;
-}
 
-bool Redis::psyncCommand(const std::deque<RedisObjectPtr> &obj, const SessionPtr &session, const TcpConnectionPtr &conn)
-{
-	return false;
+	int64_t numreplicas, timeout;
+	if (getLongLongFromObjectOrReply(conn->outputBuffer(),
+		obj[0], &numreplicas, nullptr) != REDIS_OK)
+		return true;
+
+	if (getLongLongFromObjectOrReply(conn->outputBuffer(),
+		obj[1], &timeout, nullptr) != REDIS_OK)
+		return true;
+
+	if (timeout < 0)
+	{
+		addReplyError(conn->outputBuffer(), "timeout is negative");
+		return true;
+	}
+
+	repli.waitForSlaves(session, conn, numreplicas, timeout);
+	return true;
 }
 
 int64_t Redis::getExpire(const RedisObjectPtr &obj)
@@ -1820,21 +3412,45 @@ int64_t Redis::getExpire(const RedisObjectPtr &obj)
 	return it->second->getWhen();
 }
 
+/* Pre-size the key tables from the RESIZEDB hint so loading does not
+ * rehash every shard repeatedly. A segment only sizes its own shards. */
+void Redis::reserveShards(size_t keys, bool staging, int32_t begin, int32_t end)
+{
+	if (begin >= end)
+	{
+		return;
+	}
+
+	size_t perShard = keys / (end - begin) + 1;
+	int64_t start = latency.start();
+	auto &shards = getLoadShards(staging);
+	for (int32_t i = begin; i < end; i++)
+	{
+		auto &it = shards[i];
+		std::unique_lock <std::mutex> lck(it.mtx);
+		if (it.redisMap.bucket_count() < perShard)
+		{
+			it.redisMap.reserve(perShard);
+			it.stringMap.reserve(perShard);
+		}
+	}
+	latency.end("rehash", start);
+}
+
 size_t Redis::getExpireSize()
 {
 	std::unique_lock <std::mutex> lck(expireMutex);
 	return expireTimers.size();
 }
 
-size_t Redis::getDbsize()
+size_t Redis::getDbsize(int32_t begin, int32_t end)
 {
 	size_t size = 0;
 
-	for (auto &it : redisShards)
+	for (int32_t i = begin; i < end; i++)
 	{
-		std::unique_lock <std::mutex> lck(it.mtx);
-		auto &map = it.redisMap;
-		size += map.size();
+		std::unique_lock <std::mutex> lck(redisShards[i].mtx);
+		size += redisShards[i].redisMap.size();
 	}
 	return size;
 }
@@ -1850,6 +3466,32 @@ bool Redis::dbsizeCommand(const std::deque<RedisObjectPtr> &obj, const SessionPt
 	return true;
 }
 
+void Redis::addSlotKey(size_t index, const RedisObjectPtr &key, bool staging)
+{
+	if (clusterEnabled)
+	{
+		auto &slotKeys = getLoadShards(staging)[index].slotKeys;
+		slotKeys[clus.keyHashSlot(key->ptr, sdslen(key->ptr))].insert(key);
+	}
+}
+
+void Redis::delSlotKey(size_t index, const RedisObjectPtr &key)
+{
+	if (clusterEnabled)
+	{
+		auto &slotKeys = redisShards[index].slotKeys;
+		auto it = slotKeys.find(clus.keyHashSlot(key->ptr, sdslen(key->ptr)));
+		if (it != slotKeys.end())
+		{
+			it->second.erase(key);
+			if (it->second.empty())
+			{
+				slotKeys.erase(it);
+			}
+		}
+	}
+}
+
 bool Redis::removeCommand(const RedisObjectPtr &obj)
 {
 	size_t hash = obj->hash;
@@ -1914,6 +3556,7 @@ bool Redis::removeCommand(const RedisObjectPtr &obj)
 				assert(false);
 			}
 
+			delSlotKey(index, *it);
 			map.erase(it);
 			return true;
 		}
@@ -1921,6 +3564,70 @@ bool Redis::removeCommand(const RedisObjectPtr &obj)
 	return false;
 }
 
+/* Keys handed over to another node are dropped the way a DEL drops them, so
+ * slaves and the append only file forget them too. */
+void Redis::removeMigratedKeys(const std::vector<RedisObjectPtr> &keys)
+{
+	bool propagate = repliEnabled && masterPort == 0;
+	Buffer buffer(0);
+	for (auto &it : keys)
+	{
+		std::deque<RedisObjectPtr> commands;
+		commands.push_back(it);
+		auto execute = [&]()
+		{
+			if (removeCommand(it))
+			{
+				signalModifiedKey(it, -1);
+			}
+
+			if (propagate)
+			{
+				repli.feedSlaves(shared.del, commands);
+			}
+			return true;
+		};
+
+		bool rewriteFeed = aofEnabled && aof.isRewriting();
+		if (rewriteFeed)
+		{
+			aof.feedRewriteCommand(shared.del, commands, execute);
+		}
+		else if (replSnapshotting)
+		{
+			executeSnapshotCommand(shared.del, commands, execute);
+		}
+		else
+		{
+			execute();
+		}
+
+		if (!rewriteFeed && aofEnabled)
+		{
+			commands.push_front(shared.del);
+			structureRedisProtocol(buffer, commands);
+		}
+	}
+
+	if (buffer.readableBytes() > 0)
+	{
+		aof.feedAppendOnlyFile(&buffer);
+	}
+
+	if (propagate)
+	{
+		repli.flushSlaves();
+	}
+}
+
+bool Redis::checkKeyExists(const RedisObjectPtr &obj)
+{
+	size_t index = obj->hash % kShards;
+	std::unique_lock <std::mutex> lck(redisShards[index].mtx);
+	auto &map = redisShards[index].redisMap;
+	return map.find(obj) != map.end();
+}
+
 bool Redis::delCommand(const std::deque<RedisObjectPtr> &obj,
 	const SessionPtr &session, const TcpConnectionPtr &conn)
 {
@@ -1934,6 +3641,8 @@ bool Redis::delCommand(const std::deque<RedisObjectPtr> &obj,
 	{
 		if (removeCommand(it))
 		{
+			signalModifiedKey(it, session->getId());
+			notifyKeyspaceEvent(NOTIFY_GENERIC, "del", it);
 			count++;
 		}
 	}
@@ -2047,9 +3756,79 @@ void Redis::clearCommand()
 			}
 		}
 		map.clear();
+		it.slotKeys.clear();
 	}
 }
 
+void Redis::createStaging()
+{
+	stagingShards.reset(new std::array<RedisMapLock, kShards>());
+	stagingExpires.clear();
+}
+
+/* Every shard is locked for the swap, readers see the old data set or the
+ * new one and never a mix of both. The old one is freed off the loop. */
+void Redis::swapStaging()
+{
+	{
+		std::unique_lock <std::mutex> lck(expireMutex);
+		for (auto &it : expireTimers)
+		{
+			loop.cancelAfter(it.second);
+		}
+		expireTimers.clear();
+	}
+
+	{
+		std::vector<std::unique_lock<std::mutex>> locks;
+		locks.reserve(kShards);
+		for (auto &it : redisShards)
+		{
+			locks.emplace_back(it.mtx);
+		}
+
+		for (int32_t i = 0; i < kShards; i++)
+		{
+			auto &live = redisShards[i];
+			auto &staged = (*stagingShards)[i];
+			live.redisMap.swap(staged.redisMap);
+			live.stringMap.swap(staged.stringMap);
+			live.hashMap.swap(staged.hashMap);
+			live.listMap.swap(staged.listMap);
+			live.zsetMap.swap(staged.zsetMap);
+			live.setMap.swap(staged.setMap);
+			live.slotKeys.swap(staged.slotKeys);
+		}
+	}
+
+	/* Deadlines stay absolute while loading, a long transfer must not push
+	 * them back. Those already passed fire on the next loop iteration. */
+	int64_t now = mstime();
+	for (auto &it : stagingExpires)
+	{
+		setExpire(it.first, std::max<int64_t>(it.second - now, 0) / 1000.0);
+	}
+	stagingExpires.clear();
+
+	std::thread thread([](std::unique_ptr<std::array<RedisMapLock, kShards>> old)
+	{
+		ThreadPool::clearThreadAffinity();
+	},
+		std::move(stagingShards));
+	thread.detach();
+}
+
+void Redis::discardStaging()
+{
+	stagingShards.reset();
+	stagingExpires.clear();
+}
+
+void Redis::setStagingExpire(const RedisObjectPtr &key, int64_t when)
+{
+	stagingExpires.push_back(std::make_pair(key, when));
+}
+
 bool Redis::keysCommand(const std::deque<RedisObjectPtr> &obj,
 	const SessionPtr &session, const TcpConnectionPtr &conn)
 {
@@ -2128,7 +3907,10 @@ bool Redis::flushdbCommand(const std::deque<RedisObjectPtr> &obj,
 		return false;
 	}
 
+	int64_t start = latency.start();
 	clearCommand();
+	latency.end("flushdb", start);
+	tracking.invalidateAll();
 	addReply(conn->outputBuffer(), shared.ok);
 	return true;
 }
@@ -2188,7 +3970,7 @@ bool Redis::zaddCommand(const std::deque<RedisObjectPtr> &obj,
 			{
 				obj[i + 1]->type = OBJ_ZSET;
 				if (getDoubleFromObjectOrReply(conn->outputBuffer(),
-					obj[1], &scores, nullptr) != REDIS_OK)
+					obj[i], &scores, nullptr) != REDIS_OK)
 				{
 					return false;
 				}
@@ -2211,13 +3993,13 @@ bool Redis::zaddCommand(const std::deque<RedisObjectPtr> &obj,
 							if (!memcmp(iterr->second->ptr,
 								obj[i + 1]->ptr, sdslen(obj[i + 1]->ptr)))
 							{
-								const RedisObjectPtr &v = iterr->second;
+								RedisObjectPtr v = iterr->second;
 								sortMap.erase(iterr);
 								sortMap.insert(std::make_pair(scores, v));
 								mark = true;
 								break;
 							}
-							++it;
+							++iterr;
 						}
 
 						assert(mark);
@@ -2228,10 +4010,9 @@ bool Redis::zaddCommand(const std::deque<RedisObjectPtr> &obj,
 			}
 
 			map.insert(obj[0]);
+			addSlotKey(index, obj[0]);
 			zsetMap.insert(std::make_pair(obj[0],
 				std::make_pair(std::move(indexMap), std::move(sortMap))));
-			addReplyLongLong(conn->outputBuffer(), added);
-			return true;
 		}
 		else
 		{
@@ -2271,7 +4052,7 @@ bool Redis::zaddCommand(const std::deque<RedisObjectPtr> &obj,
 						{
 							if (!memcmp(iterrr->second->ptr, obj[i + 1]->ptr, sdslen(obj[i + 1]->ptr)))
 							{
-								const RedisObjectPtr & v = iterrr->second;
+								RedisObjectPtr v = iterrr->second;
 								iter->second.second.erase(iterrr);
 								iter->second.second.insert(std::make_pair(scores, v));
 								mark = true;
@@ -2289,6 +4070,9 @@ bool Redis::zaddCommand(const std::deque<RedisObjectPtr> &obj,
 		}
 		addReplyLongLong(conn->outputBuffer(), added);
 	}
+
+	signalModifiedKey(obj[0], session->getId());
+	notifyKeyspaceEvent(NOTIFY_ZSET, "zadd", obj[0]);
 	return true;
 }
 
@@ -2315,6 +4099,7 @@ bool Redis::zcardCommand(const std::deque<RedisObjectPtr> &obj,
 	{
 		std::unique_lock <std::mutex> lck(mu);
 		auto it = map.find(obj[0]);
+		stats.lookupKey(it != map.end());
 		if (it != map.end())
 		{
 			if ((*it)->type != OBJ_ZSET)
@@ -2363,6 +4148,7 @@ bool Redis::scardCommand(const std::deque<RedisObjectPtr> &obj,
 	{
 		std::unique_lock <std::mutex> lck(mu);
 		auto it = map.find(obj[0]);
+		stats.lookupKey(it != map.end());
 		if (it != map.end())
 		{
 			if ((*it)->type != OBJ_SET)
@@ -2393,7 +4179,7 @@ RedisObjectPtr Redis::createDumpPayload(const RedisObjectPtr &dump)
 	buf[1] = (REDIS_RDB_VERSION >> 8) & 0xff;
 	if (rdb.createDumpPayload(&payload, dump) == REDIS_ERR)
 	{
-		LOG_WARN << "RDB dump error";
+		sdsfree(payload.io.buffer.ptr);
 		return nullptr;
 	}
 
@@ -2417,7 +4203,7 @@ bool Redis::dumpCommand(const std::deque<RedisObjectPtr> &obj,
 	RedisObjectPtr dumpobj = createDumpPayload(obj[0]);
 	if (dumpobj == nullptr)
 	{
-		addReplyErrorFormat(conn->outputBuffer(), "RDB dump error");
+		addReply(conn->outputBuffer(), shared.nullbulk);
 		return true;
 	}
 
@@ -2438,7 +4224,7 @@ bool Redis::restoreCommand(const std::deque<RedisObjectPtr> &obj,
 
 	for (int i = 3; i < obj.size(); i++)
 	{
-		if (!strcmp(obj[i]->ptr, "replace"))
+		if (!STRCMP(obj[i]->ptr, "replace"))
 		{
 			replace = 1;
 		}
@@ -2455,7 +4241,7 @@ bool Redis::restoreCommand(const std::deque<RedisObjectPtr> &obj,
 	{
 		std::unique_lock <std::mutex> lck(mu);
 		auto it = map.find(obj[0]);
-		if (it == map.end() && !replace)
+		if (it != map.end() && !replace)
 		{
 			addReply(conn->outputBuffer(), shared.busykeyerr);
 			return true;
@@ -2472,12 +4258,6 @@ bool Redis::restoreCommand(const std::deque<RedisObjectPtr> &obj,
 		return true;
 	}
 
-	if (replace)
-	{
-		removeCommand(obj[0]);
-	}
-
-	Rio payload;
 	size_t len = sdslen(obj[2]->ptr);
 	unsigned char *p = (unsigned char *)obj[2]->ptr;
 	unsigned char *footer;
@@ -2486,44 +4266,34 @@ bool Redis::restoreCommand(const std::deque<RedisObjectPtr> &obj,
 
 	if (len < 10)
 	{
-		return false;
+		addReplyError(conn->outputBuffer(), "DUMP payload version or checksum are wrong");
+		return true;
 	}
 
 	footer = p + (len - 10);
 	rdbver = (footer[1] << 8) | footer[0];
-	if (rdbver > REDIS_RDB_VERSION)
+	crc = crc64(0, p, len - 8);
+	memrev64ifbe(&crc);
+	if (rdbver > REDIS_RDB_VERSION || memcmp(&crc, footer + 2, 8) != 0)
 	{
-		return false;
+		addReplyError(conn->outputBuffer(), "DUMP payload version or checksum are wrong");
+		return true;
 	}
 
-	crc = crc64(0, p, len - 8);
-	memrev64ifbe(&crc);
-	if (memcmp(&crc, footer + 2, 8) != 0)
+	if (replace)
 	{
-		LOG_WARN << "DUMP payload version or checksum are wrong";
-		return false;
+		removeCommand(obj[0]);
 	}
 
-	rdb.rioInitWithBuffer(&payload, obj[2]->ptr);
 	RedisObjectPtr key = createStringObject(obj[0]->ptr, sdslen(obj[0]->ptr));
-	if (rdb.verifyDumpPayload(&payload, key) == REDIS_ERR)
+	if (rdb.loadDumpPayload(key, obj[2]->ptr, len - 10, ttl) == REDIS_ERR)
 	{
 		addReplyError(conn->outputBuffer(), "Bad data format");
 		return true;
 	}
 
-	if (ttl > 0)
-	{
-		RedisObjectPtr ex = createStringObject(obj[0]->ptr, sdslen(obj[0]->ptr));
-		ex->type = OBJ_EXPIRE;
-		std::unique_lock <std::mutex> lck(slaveMutex);
-		TimerPtr timer = loop.runAfter(ttl / 1000,
-			false, std::bind(&Redis::setExpireTimeOut, this, ex));
-		auto it = expireTimers.find(ex);
-		assert(it == expireTimers.end());
-		expireTimers.insert(std::make_pair(ex, timer));
-	}
-
+	signalModifiedKey(obj[0], session->getId());
+	notifyKeyspaceEvent(NOTIFY_GENERIC, "restore", obj[0]);
 	addReply(conn->outputBuffer(), shared.ok);
 	return true;
 }
@@ -2595,6 +4365,7 @@ bool Redis::saddCommand(const std::deque<RedisObjectPtr> &obj,
 				}
 				setMap.insert(std::make_pair(obj[0], std::move(set)));
 				map.insert(obj[0]);
+				addSlotKey(index, obj[0]);
 			}
 		}
 		else
@@ -2627,6 +4398,11 @@ bool Redis::saddCommand(const std::deque<RedisObjectPtr> &obj,
 		}
 	}
 
+	if (len > 0)
+	{
+		signalModifiedKey(obj[0], session->getId());
+		notifyKeyspaceEvent(NOTIFY_SET, "sadd", obj[0]);
+	}
 	addReplyLongLong(conn->outputBuffer(), len);
 	return true;
 }
@@ -2677,6 +4453,7 @@ bool Redis::zrangeGenericCommand(const std::deque<RedisObjectPtr> &obj,
 	{
 		std::unique_lock <std::mutex> lck(mu);
 		auto it = map.find(obj[0]);
+		stats.lookupKey(it != map.end());
 		if (it == map.end())
 		{
 			auto iter = zsetMap.find(obj[0]);
@@ -2785,6 +4562,7 @@ bool Redis::hgetallCommand(const std::deque<RedisObjectPtr> &obj,
 	{
 		std::unique_lock <std::mutex> lck(mu);
 		auto it = map.find(obj[0]);
+		stats.lookupKey(it != map.end());
 		if (it == map.end())
 		{
 			auto iter = hashMap.find(obj[0]);
@@ -2832,6 +4610,7 @@ bool Redis::hgetCommand(const std::deque<RedisObjectPtr> &obj,
 	{
 		std::unique_lock <std::mutex> lck(mu);
 		auto it = map.find(obj[0]);
+		stats.lookupKey(it != map.end());
 		if (it == map.end())
 		{
 			auto iter = hashMap.find(obj[0]);
@@ -2928,6 +4707,7 @@ bool Redis::hlenCommand(const std::deque<RedisObjectPtr> &obj,
 	{
 		std::unique_lock <std::mutex> lck(mu);
 		auto it = map.find(obj[0]);
+		stats.lookupKey(it != map.end());
 		if (it == map.end())
 		{
 			auto iter = hashMap.find(obj[0]);
@@ -2957,16 +4737,18 @@ bool Redis::hlenCommand(const std::deque<RedisObjectPtr> &obj,
 bool Redis::hsetCommand(const std::deque<RedisObjectPtr> &obj,
 	const SessionPtr &session, const TcpConnectionPtr &conn)
 {
-	if (obj.size() != 3)
+	if (obj.size() < 3 || obj.size() % 2 == 0)
 	{
 		return false;
 	}
 
 	obj[0]->type = OBJ_HASH;
-	obj[1]->type = OBJ_HASH;
-	obj[2]->type = OBJ_HASH;
+	for (int32_t i = 1; i < obj.size(); i++)
+	{
+		obj[i]->type = OBJ_HASH;
+	}
 
-	bool update = false;
+	size_t created = 0;
 
 	size_t hash = obj[0]->hash;
 	size_t index = hash % kShards;
@@ -2981,9 +4763,20 @@ bool Redis::hsetCommand(const std::deque<RedisObjectPtr> &obj,
 			auto iter = hashMap.find(obj[0]);
 			assert(iter == hashMap.end());
 			std::unordered_map<RedisObjectPtr, RedisObjectPtr, Hash, Equal> rhash;
-			rhash.insert(std::make_pair(obj[1], obj[2]));
+			for (int32_t i = 1; i < obj.size(); i += 2)
+			{
+				if (rhash.insert(std::make_pair(obj[i], obj[i + 1])).second)
+				{
+					created++;
+				}
+				else
+				{
+					rhash[obj[i]] = obj[i + 1];
+				}
+			}
 			hashMap.insert(std::make_pair(obj[0], std::move(rhash)));
 			map.insert(obj[0]);
+			addSlotKey(index, obj[0]);
 		}
 		else
 		{
@@ -2997,20 +4790,25 @@ bool Redis::hsetCommand(const std::deque<RedisObjectPtr> &obj,
 			auto iter = hashMap.find(obj[0]);
 			assert(iter != hashMap.end());
 
-			auto iterr = iter->second.find(obj[1]);
-			if (iterr == iter->second.end())
-			{
-				iter->second.insert(std::make_pair(obj[1], obj[2]));
-			}
-			else
+			for (int32_t i = 1; i < obj.size(); i += 2)
 			{
-				iterr->second = obj[2];
-				update = true;
+				auto iterr = iter->second.find(obj[i]);
+				if (iterr == iter->second.end())
+				{
+					iter->second.insert(std::make_pair(obj[i], obj[i + 1]));
+					created++;
+				}
+				else
+				{
+					iterr->second = obj[i + 1];
+				}
 			}
 		}
 	}
 
-	addReply(conn->outputBuffer(), update ? shared.czero : shared.cone);
+	signalModifiedKey(obj[0], session->getId());
+	notifyKeyspaceEvent(NOTIFY_HASH, "hset", obj[0]);
+	addReplyLongLong(conn->outputBuffer(), created);
 	return true;
 }
 
@@ -3109,6 +4907,7 @@ bool Redis::setCommand(const std::deque<RedisObjectPtr> &obj,
 			assert(iter == stringMap.end());
 
 			map.insert(obj[0]);
+			addSlotKey(index, obj[0]);
 			stringMap.insert(std::make_pair(obj[0], obj[1]));
 
 			if (expire)
@@ -3153,10 +4952,16 @@ bool Redis::setCommand(const std::deque<RedisObjectPtr> &obj,
 				loop.cancelAfter(iter->second);
 				expireTimers.erase(iter);
 			}
-			setExpire(ex, milliseconds / 1000);
 		}
+		setExpire(ex, milliseconds / 1000.0);
 	}
 
+	signalModifiedKey(obj[0], session->getId());
+	notifyKeyspaceEvent(NOTIFY_STRING, "set", obj[0]);
+	if (expire)
+	{
+		notifyKeyspaceEvent(NOTIFY_GENERIC, "expire", obj[0]);
+	}
 	addReply(conn->outputBuffer(), shared.ok);
 	return true;
 }
@@ -3177,6 +4982,7 @@ bool Redis::getCommand(const std::deque<RedisObjectPtr> &obj,
 	{
 		std::unique_lock <std::mutex> lck(mu);
 		auto it = map.find(obj[0]);
+		stats.lookupKey(it != map.end());
 		if (it == map.end())
 		{
 			auto iter = stringMap.find(obj[0]);
@@ -3239,10 +5045,10 @@ bool Redis::incrDecrCommand(const RedisObjectPtr &obj,
 
 			obj->type = OBJ_STRING;
 			map.insert(obj);
+			addSlotKey(index, obj);
 
 			stringMap.insert(std::make_pair(obj, createStringObjectFromLongLong(incr)));
 			addReplyLongLong(conn->outputBuffer(), incr);
-			return true;
 		}
 		else
 		{
@@ -3273,9 +5079,12 @@ bool Redis::incrDecrCommand(const RedisObjectPtr &obj,
 			addReply(conn->outputBuffer(), shared.colon);
 			addReply(conn->outputBuffer(), iter->second);
 			addReply(conn->outputBuffer(), shared.crlf);
-			return true;
 		}
 	}
+
+	signalModifiedKey(obj, session->getId());
+	notifyKeyspaceEvent(NOTIFY_STRING, "incrby", obj);
+	return true;
 }
 
 bool Redis::ttlCommand(const std::deque<RedisObjectPtr> &obj,
@@ -3309,9 +5118,7 @@ bool Redis::monitorCommand(const std::deque<RedisObjectPtr> &obj,
 		return false;
 	}
 
-	monitorEnabled = true;
-	std::unique_lock <std::mutex> lck(monitorMutex);
-	monitorConns[conn->getSockfd()] = conn;
+	monitor.addMonitor(conn);
 	addReply(conn->outputBuffer(), shared.ok);
 	return true;
 }
@@ -3331,13 +5138,71 @@ bool Redis::checkCommand(const RedisObjectPtr &cmd)
 	return true;
 }
 
+bool Redis::checkStaleCommand(const RedisObjectPtr &cmd)
+{
+	auto it = staleCommands.find(cmd);
+	if (it == staleCommands.end())
+	{
+		return false;
+	}
+	return true;
+}
+
+bool Redis::checkTrackCommand(const RedisObjectPtr &cmd)
+{
+	auto it = trackCommands.find(cmd);
+	if (it == trackCommands.end())
+	{
+		return false;
+	}
+	return true;
+}
+
+std::vector<EventLoop*> Redis::getAllLoops()
+{
+	std::vector<EventLoop*> loops = server.getThreadPool()->getAllLoops();
+	if (std::find(loops.begin(), loops.end(), &loop) == loops.end())
+	{
+		loops.push_back(&loop);
+	}
+
+	if (repli.getLoop() != nullptr)
+	{
+		loops.push_back(repli.getLoop());
+	}
+	return loops;
+}
+
 void Redis::timeOut()
 {
 	loop.quit();
 }
 
+void Redis::setAppendOnly(bool on, int32_t fsyncPolicy)
+{
+	aofEnabled = on;
+	aof.setFsyncPolicy(fsyncPolicy);
+}
+
 void Redis::run()
 {
+	bool fromAof = loadDataFromDisk();
+	if (aofEnabled)
+	{
+		if (!aof.start(REDIS_DEFAULT_AOF_FILENGTHAME))
+		{
+			aofEnabled = false;
+		}
+		else if (!fromAof)
+		{
+			/* The file only holds what follows this start, rewrite it so
+			 * the next restart does not lose the snapshot loaded instead. */
+			aof.rewriteBackground();
+		}
+	}
+
+	server.start();
+	LOG_INFO << "Ready to accept connections";
 	loop.run();
 }
 
@@ -3350,15 +5215,33 @@ void Redis::initConfig()
 	slaveEnabled = false;
 	authEnabled = false;
 	repliEnabled = false;
-	salveCount = 0;
 	clusterSlotEnabled = false;
-	clusterRepliMigratEnabled = false;
 	clusterRepliImportEnabeld = false;
 	monitorEnabled = false;
+	aofEnabled = false;
 	forkEnabled = false;
 	forkCondWaitCount = 0;
 	rdbChildPid = -1;
-	slavefd = -1;
+	rdbSaving = false;
+	bgsaveFork = false;
+	lastBgsaveOk = true;
+	bgsaveStart = 0;
+	lastBgsaveTime = -1;
+	lastSaveTime = time(nullptr);
+	lastForkUsec = 0;
+	lastCowSize = 0;
+	totalConnections = 0;
+	startTime = time(nullptr);
+	childInfoPipe[0] = -1;
+	childInfoPipe[1] = -1;
+	rdbSegments = REDIS_DEFAULT_RDB_SEGMENTS;
+	replSnapshotting = false;
+	replDiskless = REDIS_DEFAULT_REPL_DISKLESS_SYNC;
+	replServeStale = REDIS_DEFAULT_SLAVE_SERVE_STALE_DATA;
+	replMaxLag = REDIS_DEFAULT_SLAVE_MAX_LAG;
+	notifyKeyspaceEvents = 0;
+	snapshotLocks.reset(new std::mutex[kShards]);
+	replCuts.reset(new bool[kShards]());
 	masterfd = -1;
 	dbnum = 1;
 
@@ -3397,6 +5280,9 @@ void Redis::initConfig()
 	REGISTER_REDIS_COMMAND(shared.save, saveCommand);
 	REGISTER_REDIS_COMMAND(shared.slaveof, slaveofCommand);
 	REGISTER_REDIS_COMMAND(shared.sync, syncCommand);
+	REGISTER_REDIS_COMMAND(shared.psync, psyncCommand);
+	REGISTER_REDIS_COMMAND(shared.replconf, replconfCommand);
+	REGISTER_REDIS_COMMAND(shared.wait, waitCommand);
 	REGISTER_REDIS_COMMAND(shared.command, commandCommand);
 	REGISTER_REDIS_COMMAND(shared.config, configCommand);
 	REGISTER_REDIS_COMMAND(shared.auth, authCommand);
@@ -3406,14 +5292,29 @@ void Redis::initConfig()
 	REGISTER_REDIS_COMMAND(shared.del, delCommand);
 	REGISTER_REDIS_COMMAND(shared.keys, keysCommand);
 	REGISTER_REDIS_COMMAND(shared.bgsave, bgsaveCommand);
+	REGISTER_REDIS_COMMAND(shared.bgrewriteaof, bgrewriteaofCommand);
 	REGISTER_REDIS_COMMAND(shared.memory, memoryCommand);
 	REGISTER_REDIS_COMMAND(shared.cluster, clusterCommand);
+	REGISTER_REDIS_COMMAND(shared.asking, askingCommand);
 	REGISTER_REDIS_COMMAND(shared.migrate, migrateCommand);
 	REGISTER_REDIS_COMMAND(shared.debug, debugCommand);
 	REGISTER_REDIS_COMMAND(shared.ttl, ttlCommand);
 	REGISTER_REDIS_COMMAND(shared.incr, incrCommand);
 	REGISTER_REDIS_COMMAND(shared.decr, decrCommand);
 	REGISTER_REDIS_COMMAND(shared.monitor, monitorCommand);
+	REGISTER_REDIS_COMMAND(shared.subscribe, subscribeCommand);
+	REGISTER_REDIS_COMMAND(shared.unsubscribe, unsubscribeCommand);
+	REGISTER_REDIS_COMMAND(shared.publish, publishCommand);
+	REGISTER_REDIS_COMMAND(shared.pubsub, pubsubCommand);
+	REGISTER_REDIS_COMMAND(shared.psubscribe, psubscribeCommand);
+	REGISTER_REDIS_COMMAND(shared.punsubscribe, punsubscribeCommand);
+	REGISTER_REDIS_COMMAND(shared.slowlog, slowlogCommand);
+	REGISTER_REDIS_COMMAND(shared.latency, latencyCommand);
+
+	for (auto &it : handlerCommands)
+	{
+		commandStats.registerCommand(it.first);
+	}
 
 #define REGISTER_REDIS_REPLY_COMMAND(msgId) \
 	replyCommands.insert(msgId);
@@ -3437,12 +5338,62 @@ void Redis::initConfig()
 	REGISTER_REDIS_CHECK_COMMAND(shared.rpop);
 	REGISTER_REDIS_CHECK_COMMAND(shared.del);
 	REGISTER_REDIS_CHECK_COMMAND(shared.flushdb);
+	REGISTER_REDIS_CHECK_COMMAND(shared.hset);
+	REGISTER_REDIS_CHECK_COMMAND(shared.zadd);
+	REGISTER_REDIS_CHECK_COMMAND(shared.incr);
+	REGISTER_REDIS_CHECK_COMMAND(shared.decr);
+	REGISTER_REDIS_CHECK_COMMAND(shared.restore);
+
+#define REGISTER_REDIS_TRACK_COMMAND(msgId) \
+	trackCommands.insert(msgId);
+	REGISTER_REDIS_TRACK_COMMAND(shared.get);
+	REGISTER_REDIS_TRACK_COMMAND(shared.hget);
+	REGISTER_REDIS_TRACK_COMMAND(shared.hgetall);
+	REGISTER_REDIS_TRACK_COMMAND(shared.hlen);
+	REGISTER_REDIS_TRACK_COMMAND(shared.lrange);
+	REGISTER_REDIS_TRACK_COMMAND(shared.llen);
+	REGISTER_REDIS_TRACK_COMMAND(shared.scard);
+	REGISTER_REDIS_TRACK_COMMAND(shared.zrange);
+	REGISTER_REDIS_TRACK_COMMAND(shared.zrevrange);
+	REGISTER_REDIS_TRACK_COMMAND(shared.zcard);
+	REGISTER_REDIS_TRACK_COMMAND(shared.ttl);
+	REGISTER_REDIS_TRACK_COMMAND(shared.dump);
+
+#define REGISTER_REDIS_STALE_COMMAND(msgId) \
+	staleCommands.insert(msgId);
+	REGISTER_REDIS_STALE_COMMAND(shared.info);
+	REGISTER_REDIS_STALE_COMMAND(shared.slaveof);
+	REGISTER_REDIS_STALE_COMMAND(shared.config);
+	REGISTER_REDIS_STALE_COMMAND(shared.auth);
+	REGISTER_REDIS_STALE_COMMAND(shared.ping);
+	REGISTER_REDIS_STALE_COMMAND(shared.subscribe);
+	REGISTER_REDIS_STALE_COMMAND(shared.unsubscribe);
+	REGISTER_REDIS_STALE_COMMAND(shared.publish);
+	REGISTER_REDIS_STALE_COMMAND(shared.pubsub);
+	REGISTER_REDIS_STALE_COMMAND(shared.psubscribe);
+	REGISTER_REDIS_STALE_COMMAND(shared.punsubscribe);
+	REGISTER_REDIS_STALE_COMMAND(shared.slowlog);
+	REGISTER_REDIS_STALE_COMMAND(shared.latency);
 
 #define REGISTER_REDIS_CLUSTER_CHECK_COMMAND(msgId) \
 	cluterCommands.insert(msgId);
 	REGISTER_REDIS_CLUSTER_CHECK_COMMAND(shared.cluster);
 	REGISTER_REDIS_CLUSTER_CHECK_COMMAND(shared.migrate);
 	REGISTER_REDIS_CLUSTER_CHECK_COMMAND(shared.command);
+	REGISTER_REDIS_CLUSTER_CHECK_COMMAND(shared.slaveof);
+	REGISTER_REDIS_CLUSTER_CHECK_COMMAND(shared.sync);
+	REGISTER_REDIS_CLUSTER_CHECK_COMMAND(shared.psync);
+	REGISTER_REDIS_CLUSTER_CHECK_COMMAND(shared.replconf);
+	REGISTER_REDIS_CLUSTER_CHECK_COMMAND(shared.info);
+	REGISTER_REDIS_CLUSTER_CHECK_COMMAND(shared.subscribe);
+	REGISTER_REDIS_CLUSTER_CHECK_COMMAND(shared.unsubscribe);
+	REGISTER_REDIS_CLUSTER_CHECK_COMMAND(shared.publish);
+	REGISTER_REDIS_CLUSTER_CHECK_COMMAND(shared.pubsub);
+	REGISTER_REDIS_CLUSTER_CHECK_COMMAND(shared.client);
+	REGISTER_REDIS_CLUSTER_CHECK_COMMAND(shared.psubscribe);
+	REGISTER_REDIS_CLUSTER_CHECK_COMMAND(shared.punsubscribe);
+	REGISTER_REDIS_CLUSTER_CHECK_COMMAND(shared.slowlog);
+	REGISTER_REDIS_CLUSTER_CHECK_COMMAND(shared.latency);
 
 	master = "master";
 	slave = "slave";
@@ -8,10 +8,17 @@
 #include "session.h"
 #include "object.h"
 #include "rdb.h"
+#include "aof.h"
 #include "log.h"
 #include "socket.h"
 #include "replication.h"
 #include "cluster.h"
+#include "pubsub.h"
+#include "tracking.h"
+#include "monitor.h"
+#include "slowlog.h"
+#include "latency.h"
+#include "stats.h"
 #include "util.h"
 
 class Redis
@@ -23,18 +30,37 @@ public:
 	void initConfig();
 	void timeOut();
 	void serverCron();
+	void statsCron();
+	void clientsCron();
+	void clientsCronShrink(EventLoop *loop, const std::vector<TcpConnectionPtr> &conns);
 	void bgsaveCron();
+	void bgsaveDone(bool ok);
+	void rdbSaveThread();
 	void slaveRepliTimeOut(int32_t context);
 	void setExpireTimeOut(const RedisObjectPtr &expire);
 	void forkWait();
 
 	void run();
+	void setReusePort(bool on) { server.setReusePort(on); }
+	void setLeastConnections(bool on) { server.setLeastConnections(on); }
+	void setCpuAffinity(bool on) { server.getThreadPool()->setCpuAffinity(on); }
+	void setBusyPoll(int64_t us) { server.getThreadPool()->setBusyPoll(us); }
+	void setAppendOnly(bool on, int32_t fsyncPolicy);
+	void setBgsaveFork(bool on) { bgsaveFork = on; }
+	void setRdbSegments(int32_t segments) { rdbSegments = segments; }
+	void setReplDiskless(bool on) { replDiskless = on; }
+	void setReplBacklogSize(int64_t size) { repli.setBacklogSize(size); }
+	void setReplOutputLimit(int64_t limit) { repli.setOutputLimit(limit); }
+	void setReplServeStale(bool on) { replServeStale = on; }
+	void setReplMaxLag(int32_t seconds) { replMaxLag = seconds; }
+	void setClusterNodeTimeout(int32_t ms) { clus.getBus().setNodeTimeout(ms); }
+	void setTrackingMaxKeys(int64_t keys) { tracking.setMaxKeys(keys); }
 	void connCallBack(const TcpConnectionPtr &conn);
 	void highWaterCallBack(const TcpConnectionPtr &conn, size_t bytesToSent);
 	void writeCompleteCallBack(const TcpConnectionPtr &conn);
 	
 	void replyCheck();
-	void loadDataFromDisk();
+	bool loadDataFromDisk();
 	void flush();
 
 	bool saveCommand(const std::deque<RedisObjectPtr> &obj,
@@ -115,12 +141,20 @@ public:
 		const SessionPtr &session, const TcpConnectionPtr &conn);
 	bool psyncCommand(const std::deque<RedisObjectPtr> &obj,
 		const SessionPtr &session, const TcpConnectionPtr &conn);
+	bool replconfCommand(const std::deque<RedisObjectPtr> &obj,
+		const SessionPtr &session, const TcpConnectionPtr &conn);
+	bool waitCommand(const std::deque<RedisObjectPtr> &obj,
+		const SessionPtr &session, const TcpConnectionPtr &conn);
 	bool commandCommand(const std::deque<RedisObjectPtr> &obj,
 		const SessionPtr &session, const TcpConnectionPtr &conn);
 	bool clusterCommand(const std::deque<RedisObjectPtr> &obj,
 		const SessionPtr &session, const TcpConnectionPtr &conn);
+	bool askingCommand(const std::deque<RedisObjectPtr> &obj,
+		const SessionPtr &session, const TcpConnectionPtr &conn);
 	bool authCommand(const std::deque<RedisObjectPtr> &obj,
 		const SessionPtr &session, const TcpConnectionPtr &conn);
+	bool clientTrackingCommand(const std::deque<RedisObjectPtr> &obj,
+		const SessionPtr &session, const TcpConnectionPtr &conn);
 	bool configCommand(const std::deque<RedisObjectPtr> &obj,
 		const SessionPtr &session, const TcpConnectionPtr &conn);
 	bool infoCommand(const std::deque<RedisObjectPtr> &obj,
@@ -133,6 +167,8 @@ public:
 		const SessionPtr &session, const TcpConnectionPtr &conn);
 	bool bgsaveCommand(const std::deque<RedisObjectPtr> &obj,
 		const SessionPtr &session, const TcpConnectionPtr &conn);
+	bool bgrewriteaofCommand(const std::deque<RedisObjectPtr> &obj,
+		const SessionPtr &session, const TcpConnectionPtr &conn);
 	bool memoryCommand(const std::deque<RedisObjectPtr> &obj,
 		const SessionPtr &session, const TcpConnectionPtr &conn);
 	bool sentinelCommand(const std::deque<RedisObjectPtr> &obj,
@@ -149,6 +185,13 @@ public:
 		const SessionPtr &session, const TcpConnectionPtr &conn, int64_t incr);
 	bool monitorCommand(const std::deque<RedisObjectPtr> &obj,
 		const SessionPtr &session, const TcpConnectionPtr &conn);
+	bool slowlogCommand(const std::deque<RedisObjectPtr> &obj,
+		const SessionPtr &session, const TcpConnectionPtr &conn);
+	bool latencyCommand(const std::deque<RedisObjectPtr> &obj,
+		const SessionPtr &session, const TcpConnectionPtr &conn);
+	sds genRedisInfoString(const char *section);
+	sds genCommandStatsInfo(sds info);
+	sds genLatencyStatsInfo(sds info);
 public:
 #ifndef _WIN64
 	int32_t rdbSaveBackground(bool enabled = false);
@@ -156,30 +199,67 @@ public:
 		const TcpConnectionPtr &conn, bool enabled = false);
 #endif
 	bool save(const SessionPtr &session, const TcpConnectionPtr &conn);
+	int32_t rdbSaveSnapshot(bool singleFile);
+	bool isBgsaveRunning() { return rdbChildPid != -1 || rdbSaving; }
 	bool removeCommand(const RedisObjectPtr &obj);
+	void removeMigratedKeys(const std::vector<RedisObjectPtr> &keys);
+	void addSlotKey(size_t index, const RedisObjectPtr &key, bool staging = false);
+	void delSlotKey(size_t index, const RedisObjectPtr &key);
+	bool checkKeyExists(const RedisObjectPtr &obj);
 
 	bool clearClusterMigradeCommand();
 	void clearFork();
 	void clearCommand();
+	void createStaging();
+	void swapStaging();
+	void discardStaging();
+	void setStagingExpire(const RedisObjectPtr &key, int64_t when);
 	void clearSessionState(int32_t sockfd);
 	void clearRepliState(int32_t sockfd);
 	void clearClusterState(int32_t sockfd);
 	void clearPubSubState(int32_t sockfd);
+	void clearTrackingState(int32_t sockfd);
+	bool unsubscribeChannel(const SessionPtr &session,
+		const RedisObjectPtr &channel, int32_t sockfd);
+	bool unsubscribePattern(const SessionPtr &session,
+		const RedisObjectPtr &pattern, int32_t sockfd);
+	void deliverMessage(const std::vector<std::pair<BufferPtr, TcpConnectionPtr>> &messages);
+	int64_t publishMessage(const RedisObjectPtr &channel, const RedisObjectPtr &message);
+	TcpConnectionPtr getSubscriber(const RedisObjectPtr &channel, int32_t sockfd);
+	void notifyKeyspaceEvent(int32_t type, const char *event, const RedisObjectPtr &key);
+	void signalModifiedKey(const RedisObjectPtr &key, int64_t id);
 	void clearMonitorState(int32_t sockfd);
 	void clearCommand(std::deque<RedisObjectPtr> &commands);
 
 	RedisObjectPtr createDumpPayload(const RedisObjectPtr &dump);
-	void feedMonitor(const std::deque<RedisObjectPtr> &obj, int32_t sockfd);
 	void structureRedisProtocol(Buffer &buffer, std::deque<RedisObjectPtr> &robjs);
+	void structureCutProtocol(Buffer &buffer, std::deque<RedisObjectPtr> &robjs, bool *cuts);
+	void getCommandShards(const RedisObjectPtr &cmd,
+		const std::deque<RedisObjectPtr> &commands, std::vector<int32_t> &shards);
+	bool executeSnapshotCommand(const RedisObjectPtr &cmd,
+		std::deque<RedisObjectPtr> &commands, const std::function<bool()> &execute);
+	void waitForLoops();
 	void setExpire(const RedisObjectPtr &key, double when);
 	bool checkCommand(const RedisObjectPtr &cmd);
+	bool checkStaleCommand(const RedisObjectPtr &cmd);
+	bool checkTrackCommand(const RedisObjectPtr &cmd);
 
 	EventLoop *getEventLoop() { return &loop; }
 	Rdb *getRdb() { return &rdb; }
 	Cluster *getCluster() { return &clus; }
 	Replication *getReplication() { return &repli; }
-	size_t getDbsize();
+	Aof *getAof() { return &aof; }
+	Tracking *getTracking() { return &tracking; }
+	Monitor *getMonitor() { return &monitor; }
+	CommandStats *getCommandStats() { return &commandStats; }
+	SlowLog *getSlowLog() { return &slowlog; }
+	LatencyMonitor *getLatency() { return &latency; }
+	ServerStats *getStats() { return &stats; }
+	std::vector<EventLoop*> getAllLoops();
+	size_t getDbsize(int32_t begin = 0, int32_t end = kShards);
 	size_t getExpireSize();
+	void reserveShards(size_t keys, bool staging = false,
+		int32_t begin = 0, int32_t end = kShards);
 	int64_t getExpire(const RedisObjectPtr &obj);
 	std::string &getIp() { return ip; }
 	int16_t getPort() { return port; }
@@ -187,6 +267,9 @@ public:
 	auto &getHandlerCommandMap() { return handlerCommands; }
 
 	auto &getRedisShards() { return redisShards; }
+	auto &getLoadShards(bool staging) { return staging ? *stagingShards : redisShards; }
+	std::mutex &getSnapshotLock(int32_t index) { return snapshotLocks[index]; }
+	bool *getReplCuts() { return replCuts.get(); }
 	auto &getSession() { return sessions; }
 	auto &getSessionConn() { return sessionConns; }
 	auto &getClusterConn() { return clusterConns; }
@@ -199,10 +282,10 @@ public:
 	auto &getExpireMutex() { return expireMutex; }
 	auto &getMutex() { return mtx; }
 	auto &getForkMutex() { return forkMutex; }
-	auto &pubSubMutex() { return pubsubMutex; }
 
 public:
 	const static int32_t kShards = 1024;
+	const static int32_t kPubSubShards = 64;
 	typedef std::function<bool(const std::deque<RedisObjectPtr> &,
 		const SessionPtr &, const TcpConnectionPtr &)> CommandFunc;
 	typedef std::unordered_map<RedisObjectPtr,
@@ -226,20 +309,21 @@ private:
 
 	std::unordered_map<int32_t, SessionPtr> sessions;
 	std::unordered_map<int32_t, TcpConnectionPtr> sessionConns;
-	std::unordered_map<int32_t, TcpConnectionPtr> slaveConns;
+	std::unordered_map<int32_t, SlaveInfoPtr> slaveConns;
 	std::unordered_map<int32_t, TcpConnectionPtr> clusterConns;
 	std::unordered_map<int32_t, TimerPtr> repliTimers;
 	std::unordered_map<RedisObjectPtr, TimerPtr, Hash, Equal> expireTimers;
-	std::unordered_map<RedisObjectPtr,
-		std::unordered_map<int32_t, TcpConnectionPtr>, Hash, Equal> pubSubs;
-	std::unordered_map<int32_t, TcpConnectionPtr> monitorConns;
 	std::unordered_map<RedisObjectPtr, CommandFunc, Hash, Equal> handlerCommands;
 
 	Command checkCommands;
+	Command trackCommands;
+	Command staleCommands;
 	Command stopReplis;
 	Command replyCommands;
 	Command cluterCommands;
 
+	/* With cluster enabled the keys of a shard are also indexed by their
+	 * hash slot, a slot is walked without going over the whole keyspace. */
 	struct RedisMapLock
 	{
 		RedisMap redisMap;
@@ -248,11 +332,34 @@ private:
 		ListMap listMap;
 		ZsetMap zsetMap;
 		SetMap setMap;
+		std::unordered_map<int32_t, RedisMap> slotKeys;
 		std::mutex mtx;
 	};
 
 	std::array<RedisMapLock, kShards> redisShards;
 
+	/* Channel subscribers, spread over their own locks so that PUBLISH on
+	 * one channel does not wait for SUBSCRIBE on another. */
+	struct PubSubShard
+	{
+		std::unordered_map<RedisObjectPtr,
+			std::unordered_map<int32_t, TcpConnectionPtr>, Hash, Equal> channels;
+		std::mutex mtx;
+	};
+
+	std::array<PubSubShard, kPubSubShards> pubsubShards;
+	PatternIndex pubsubPatterns;
+
+	/* A slave loads the snapshot of its master in here, off the served
+	 * keyspace, and swaps it in once complete. */
+	std::unique_ptr<std::array<RedisMapLock, kShards>> stagingShards;
+	std::vector<std::pair<RedisObjectPtr, int64_t>> stagingExpires;
+
+	/* Write commands run under these while a snapshot is cut shard by shard
+	 * (AOF rewrite, replica sync), ordering each against the shard copy. */
+	std::unique_ptr<std::mutex[]> snapshotLocks;
+	std::unique_ptr<bool[]> replCuts;
+
 	EventLoop loop;
 	TcpServer server;
 
@@ -262,8 +369,7 @@ private:
 	std::mutex sentinelMutex;
 	std::mutex clusterMutex;
 	std::mutex forkMutex;
-	std::mutex pubsubMutex;
-	std::mutex monitorMutex;
+	std::mutex patternMutex;
 public:
 	std::atomic<bool> clusterEnabled;
 	std::atomic<bool> slaveEnabled;
@@ -271,20 +377,34 @@ public:
 	std::atomic<bool> repliEnabled;
 	std::atomic<bool> sentinelEnabled;
 	std::atomic<bool> clusterSlotEnabled;
-	std::atomic<bool> clusterRepliMigratEnabled;
 	std::atomic<bool> clusterRepliImportEnabeld;
 	std::atomic<bool> forkEnabled;
 	std::atomic<bool> monitorEnabled;
+	std::atomic<bool> aofEnabled;
+	std::atomic<bool> rdbSaving;
+	std::atomic<bool> bgsaveFork;
+	std::atomic<bool> lastBgsaveOk;
+	std::atomic<bool> replSnapshotting;
+	std::atomic<bool> replDiskless;
+	std::atomic<bool> replServeStale;
 
 	std::atomic<int32_t> forkCondWaitCount;
 	std::atomic<int32_t> rdbChildPid;
-	std::atomic<int32_t> salveCount;
+	std::atomic<int32_t> rdbSegments;
+	std::atomic<int32_t> replMaxLag;
+	std::atomic<int32_t> notifyKeyspaceEvents;
+	std::atomic<int64_t> bgsaveStart;
+	std::atomic<int64_t> lastBgsaveTime;
+	std::atomic<int64_t> lastSaveTime;
+	std::atomic<int64_t> lastForkUsec;
+	std::atomic<int64_t> lastCowSize;
+	std::atomic<int64_t> totalConnections;
+	int64_t startTime;
+	int32_t childInfoPipe[2];
 
 	std::condition_variable expireCondition;
 	std::condition_variable forkCondition;
 
-	Buffer slaveCached;
-	Buffer clusterMigratCached;
 	Buffer clusterImportCached;
 
 	std::string ip;
@@ -298,12 +418,25 @@ public:
 	int16_t threadCount;
 	int32_t masterPort;
 	int32_t dbnum;
-	int32_t slavefd;
 	int32_t masterfd;
 private:
 	Replication repli;
 	Cluster clus;
 	Rdb rdb;
+	Aof aof;
+	Tracking tracking;
+	Monitor monitor;
+	CommandStats commandStats;
+	SlowLog slowlog;
+	LatencyMonitor latency;
+	ServerStats stats;
+
+	/* Sampled by statsCron in the server loop. */
+	std::mutex statsMutex;
+	InstantaneousMetric opsSec;
+	InstantaneousMetric netInputSec;
+	InstantaneousMetric netOutputSec;
+	std::unordered_map<EventLoop*, InstantaneousMetric> loopBusy;
 };
 
 
@@ -2,50 +2,195 @@
 #include "redis.h"
 #include "log.h"
 
+void ReplLog::create(int64_t offset)
+{
+	head.reset(new ReplChunk(offset));
+	tail = head;
+}
+
+void ReplLog::append(const char *data, size_t len)
+{
+	while (len > 0)
+	{
+		size_t used = tail->used.load(std::memory_order_relaxed);
+		if (used == ReplChunk::kSize)
+		{
+			ReplChunkPtr chunk(new ReplChunk(tail->offset + ReplChunk::kSize));
+			{
+				std::unique_lock <std::mutex> lck(chunkMutex);
+				tail->next = chunk;
+			}
+			tail = chunk;
+			used = 0;
+		}
+
+		size_t thislen = std::min(ReplChunk::kSize - used, len);
+		memcpy(tail->data + used, data, thislen);
+		tail->used.store(used + thislen, std::memory_order_release);
+		len -= thislen;
+		data += thislen;
+	}
+	trim();
+}
+
+/* The chunk holding offset and the position of offset in it, which is the
+ * end of the tail for the next byte to be appended. */
+ReplChunkPtr ReplLog::seek(int64_t offset, size_t *pos)
+{
+	ReplChunkPtr chunk = head;
+	while (offset - chunk->offset > static_cast<int64_t>(chunk->used))
+	{
+		chunk = chunk->next;
+	}
+
+	*pos = offset - chunk->offset;
+	return chunk;
+}
+
+ReplChunkPtr ReplLog::next(const ReplChunkPtr &chunk)
+{
+	std::unique_lock <std::mutex> lck(chunkMutex);
+	return chunk->next;
+}
+
+void ReplLog::setSize(int64_t size)
+{
+	this->size = size;
+	if (head)
+	{
+		trim();
+	}
+}
+
+/* Chunks still to be sent to a slave live on through its reference. */
+void ReplLog::trim()
+{
+	int64_t end = tail->offset + tail->used;
+	while (head != tail && end - head->next->offset >= size)
+	{
+		head = head->next;
+	}
+}
+
 Replication::Replication(Redis *redis)
 	:redis(redis),
+	loop(nullptr),
+	client(nullptr),
+	loadRetval(REDIS_ERR),
+	masterReplOffset(0),
+	outputLimit(REDIS_DEFAULT_REPL_OUTPUT_LIMIT),
+	pingOffset(0),
+	replOffset(0),
+	masterLastIo(0),
+	psyncFloor(0),
+	reconnect(false),
+	linkLost(false),
 	port(0),
+	replState(0),
 	salveLen(0),
 	salveReadLen(0),
-	slaveSyncEnabled(false),
-	client(nullptr)
+	chunkLen(0),
+	slaveSyncEnabled(false)
 {
-
+	char buf[REDIS_RUN_ID_SIZE];
+	getRandomHexChars(buf, sizeof(buf));
+	replid.assign(buf, sizeof(buf));
 }
 
 Replication::~Replication()
 {
-
+	if (loader.joinable())
+	{
+		stream->abort();
+		loader.join();
+	}
 }
 
 void Replication::connectMaster()
 {
 	EventLoop loop;
 	this->loop = &loop;
+	loop.runAfter(1.0, true, std::bind(&Replication::replicationCron, this));
 	loop.run();
 }
 
+/* A slave acknowledges the applied offset once per second, the master
+ * derives the lag of the slave from it. A master pings its slaves when
+ * nothing was propagated for a second, they bound their staleness by it. */
 void Replication::replicationCron()
 {
+	/* A lost link is reconnected from here, paced even when the master
+	 * accepts and drops connections right away. */
+	if (linkLost && reconnect)
+	{
+		linkLost = false;
+		connectClient();
+		return;
+	}
+
+	sendAck();
+
+	if (masterReplOffset == pingOffset)
+	{
+		static const char ping[] = "*1\r\n$4\r\nPING\r\n";
+		feedStream(ping, sizeof(ping) - 1);
+	}
+	pingOffset = masterReplOffset;
+}
+
+void Replication::sendAck()
+{
+	if (repliConn && replState == REDIS_REPL_CONNECTED)
+	{
+		char buf[64];
+		int32_t len = snprintf(buf, sizeof(buf), "REPLCONF ACK %lld\r\n",
+			(long long)replOffset.load());
+		repliConn->send(buf, len);
+	}
+}
 
+/* Asked by REPLCONF GETACK, the ack goes out once the command is counted in
+ * the offset. */
+void Replication::requestAckToMaster()
+{
+	loop->queueInLoop(std::bind(&Replication::sendAck, this));
 }
 
 void Replication::disConnect()
 {
-	client->disConnect();
+	reconnect = false;
+	linkLost = false;
+	client->stop();
+	if (client->getConnection())
+	{
+		client->disConnect();
+	}
+	else
+	{
+		loop->runInLoop(std::bind(&Replication::clearMaster, this));
+	}
 }
 
+/* Asks to resume from the offset reached with the last master, which falls
+ * back to a full sync when that one does not have it anymore. The port this
+ * server listens on goes first, the master lists it in INFO. */
 void Replication::syncWrite(const TcpConnectionPtr &conn)
 {
-	char tmpfile[256];
-	snprintf(tmpfile, 256, "temp-%d.rdb", std::this_thread::get_id());
-	fp = ::fopen(tmpfile, "w");
-	if (!fp)
+	char buf[192];
+	int32_t len = snprintf(buf, sizeof(buf), "REPLCONF listening-port %d\r\n",
+		(int32_t)redis->getPort());
+	if (!masterReplid.empty() && replOffset >= psyncFloor)
 	{
-		LOG_TRACE << "Failed opening .rdb for saving:" << strerror(errno);
-		return;
+		len += snprintf(buf + len, sizeof(buf) - len, "PSYNC %s %lld\r\n",
+			masterReplid.c_str(), (long long)replOffset.load());
 	}
-	conn->send("sync\r\n", 6);
+	else
+	{
+		len += snprintf(buf + len, sizeof(buf) - len, "PSYNC ? -1\r\n");
+	}
+
+	replState = REDIS_REPL_RECEIVE_PORT;
+	conn->send(buf, len);
 }
 
 void Replication::syncWithMaster(const TcpConnectionPtr &conn)
@@ -69,94 +214,887 @@ void Replication::syncWithMaster(const TcpConnectionPtr &conn)
 
 void Replication::close()
 {
-	::fclose(fp);
+	stopLoader();
 	salveLen = 0;
 	repliConn->forceClose();
 }
 
+/* PSYNC is answered by +CONTINUE and the stream, or by +FULLRESYNC <replid>
+ * and the payload. The payload starts with its 64 bit length, or with
+ * REDIS_REPL_SYNC_EOF for a diskless one, which then comes as int32 length
+ * prefixed chunks up to an empty one. Two int64 follow: the offset the stream
+ * reaches once the commands filtered against the snapshot are applied, and
+ * their length. Whatever follows is the command stream. */
 void Replication::readCallback(const TcpConnectionPtr &conn, Buffer *buffer)
 {
-	while (buffer->readableBytes() >= sizeof(int32_t))
+	if (replState == REDIS_REPL_RECEIVE_PORT)
+	{
+		const char *crlf = buffer->findCRLF();
+		if (crlf == nullptr)
+		{
+			return;
+		}
+
+		std::string reply(buffer->peek(), crlf);
+		buffer->retrieveUntil(crlf + 2);
+		if (reply != "+OK")
+		{
+			LOG_WARN << "Master does not understand REPLCONF listening-port: " << reply;
+		}
+		replState = REDIS_REPL_RECEIVE_PSYNC;
+	}
+
+	if (replState == REDIS_REPL_RECEIVE_PSYNC)
+	{
+		const char *crlf = buffer->findCRLF();
+		if (crlf == nullptr)
+		{
+			return;
+		}
+
+		std::string reply(buffer->peek(), crlf);
+		buffer->retrieveUntil(crlf + 2);
+		if (!strncmp(reply.c_str(), "+CONTINUE", 9))
+		{
+			LOG_INFO << "Partial resynchronization with master from offset " << replOffset;
+			startStream(conn, buffer);
+			return;
+		}
+
+		if (strncmp(reply.c_str(), "+FULLRESYNC ", 12))
+		{
+			LOG_WARN << "Unexpected reply to PSYNC: " << reply;
+			close();
+			return;
+		}
+
+		startLoader();
+		pendingReplid = reply.substr(12);
+		salveLen = 0;
+		replState = REDIS_REPL_TRANSFER;
+	}
+
+	while (replState == REDIS_REPL_TRANSFER && buffer->readableBytes() > 0)
 	{
 		if (salveLen == 0)
 		{
-			salveLen = buffer->peekInt32();
-			buffer->retrieveInt32();
-			if (buffer->readableBytes() == 0)
+			if (buffer->readableBytes() < sizeof(int64_t))
 			{
 				break;
 			}
+
+			salveLen = buffer->readInt64();
+			salveReadLen = 0;
+			chunkLen = 0;
+			if (salveLen == 0)
+			{
+				replState = REDIS_REPL_RECEIVE_OFFSET;
+			}
+			continue;
 		}
 
-		int32_t status = redis->getRdb()->rdbSyncWrite(buffer->peek(),
-			fp, buffer->readableBytes());
-		assert(status != REDIS_ERR);
+		size_t len = buffer->readableBytes();
+		if (salveLen == REDIS_REPL_SYNC_EOF)
+		{
+			if (chunkLen == 0)
+			{
+				if (buffer->readableBytes() < sizeof(int32_t))
+				{
+					break;
+				}
 
-		salveReadLen += buffer->readableBytes();
-		buffer->retrieveAll();
+				chunkLen = buffer->readInt32();
+				if (chunkLen == 0)
+				{
+					replState = REDIS_REPL_RECEIVE_OFFSET;
+				}
+				continue;
+			}
+
+			len = std::min(len, static_cast<size_t>(chunkLen));
+			chunkLen -= static_cast<int32_t>(len);
+		}
+		else
+		{
+			len = std::min(len, static_cast<size_t>(salveLen - salveReadLen));
+		}
+
+		if (!stream->write(buffer->peek(), len))
+		{
+			LOG_WARN << "Failed loading the rdb streamed from the master";
+			close();
+			return;
+		}
+
+		buffer->retrieve(len);
+		salveReadLen += len;
+		if (salveLen != REDIS_REPL_SYNC_EOF && salveReadLen == salveLen)
+		{
+			replState = REDIS_REPL_RECEIVE_OFFSET;
+		}
+	}
+
+	if (replState == REDIS_REPL_RECEIVE_OFFSET)
+	{
+		stream->close();
+		if (buffer->readableBytes() >= 2 * sizeof(int64_t))
+		{
+			syncDone(conn, buffer);
+		}
+	}
+}
+
+/* The snapshot was parsed while it arrived, what is left is swapping it in. */
+bool Replication::syncDone(const TcpConnectionPtr &conn, Buffer *buffer)
+{
+	int64_t offset = buffer->readInt64();
+	int64_t cut = buffer->readInt64();
+	loader.join();
+	stream.reset();
+	if (loadRetval != REDIS_OK)
+	{
+		LOG_WARN << "Failed loading the rdb received from the master";
+		redis->discardStaging();
+		conn->forceClose();
+		return false;
+	}
+
+	redis->swapStaging();
+	masterReplid = pendingReplid;
+	psyncFloor = offset;
+	replOffset = offset - cut;
+	LOG_INFO << "Replication load rdb success " << salveReadLen << " bytes, offset " << offset;
+	startStream(conn, buffer);
+	return true;
+}
+
+void Replication::startLoader()
+{
+	redis->createStaging();
+	stream.reset(new RdbStream());
+	loader = std::thread([this]()
+	{
+		ThreadPool::clearThreadAffinity();
+		loadRetval = redis->getRdb()->rdbLoadStream(stream.get());
+	});
+}
+
+void Replication::stopLoader()
+{
+	if (loader.joinable())
+	{
+		stream->abort();
+		loader.join();
+		redis->discardStaging();
+	}
+	stream.reset();
+}
+
+void Replication::startStream(const TcpConnectionPtr &conn, Buffer *buffer)
+{
+	replState = REDIS_REPL_CONNECTED;
+	touchMaster();
+	std::shared_ptr<Session> session(new Session(redis, conn));
+	{
+		std::unique_lock <std::mutex> lck(redis->getMutex());
+		auto &sessions = redis->getSession();
+		sessions[conn->getSockfd()] = session;
+		auto &sessionConns = redis->getSessionConn();
+		sessionConns[conn->getSockfd()] = conn;
+	}
+
+	if (buffer->readableBytes() > 0)
+	{
+		session->readCallback(conn, buffer);
+	}
+}
+
+/* Registers a slave and gets it a snapshot: the running one if it was started
+ * for slaves, which then cannot include this one, is followed by another. */
+bool Replication::syncSlave(const TcpConnectionPtr &conn, bool psync, int32_t listeningPort)
+{
+	{
+		std::unique_lock <std::mutex> lck(redis->getSlaveMutex());
+		auto &slaveConns = redis->getSlaveConn();
+		if (slaveConns.find(conn->getSockfd()) != slaveConns.end())
+		{
+			return false;
+		}
 
-		assert(salveReadLen <= salveLen);
-		if (salveLen == salveReadLen)
+		if (!backlog.active())
 		{
-			redis->getRdb()->rdbSyncClose(REDIS_DEFAULT_RDB_FILENGTHAME, fp);
-			redis->clearCommand();
+			backlog.create(masterReplOffset);
+		}
+
+		TimerPtr timer = conn->getLoop()->runAfter(REPLI_TIME_OUT, false,
+			std::bind(&Redis::slaveRepliTimeOut, redis, conn->getSockfd()));
+		redis->getRepliTimer()[conn->getSockfd()] = timer;
+		SlaveInfoPtr slave(new SlaveInfo(conn));
+		slave->psync = psync;
+		slave->listeningPort = listeningPort;
+		slaveConns[conn->getSockfd()] = slave;
+		redis->repliEnabled = true;
+	}
+
+	if (psync)
+	{
+		std::string reply = "+FULLRESYNC " + replid + "\r\n";
+		conn->send(reply.data(), reply.size());
+	}
+
+	/* The snapshot is paced by the socket, the reply throttling must not
+	 * stop reading from it. */
+	conn->setHighWaterMarkCallback(HighWaterMarkCallback(), 0);
+	conn->setMessageCallback(std::bind(&Replication::slaveCallback,
+		this, std::placeholders::_1, std::placeholders::_2));
+	startBgsaveForSync();
+	return true;
+}
+
+/* Serves PSYNC from the backlog when it still holds the stream of this master
+ * from the offset the slave asks for. */
+bool Replication::tryPartialResync(const TcpConnectionPtr &conn, int32_t listeningPort,
+	const RedisObjectPtr &id, const RedisObjectPtr &off)
+{
+	int64_t offset;
+	if (!string2ll(off->ptr, sdslen(off->ptr), &offset))
+	{
+		return false;
+	}
 
-			assert(redis->getRdb()->rdbLoad(REDIS_DEFAULT_RDB_FILENGTHAME) != REDIS_ERR);
-			std::shared_ptr<Session> session(new Session(redis, conn));
+	SlaveInfoPtr slave(new SlaveInfo(conn));
+	{
+		std::unique_lock <std::mutex> lck(redis->getSlaveMutex());
+		auto &slaveConns = redis->getSlaveConn();
+		if (!backlog.active() || strcasecmp(id->ptr, replid.c_str())
+			|| offset < getBacklogOff() || offset > masterReplOffset
+			|| slaveConns.find(conn->getSockfd()) != slaveConns.end())
+		{
+			return false;
+		}
+
+		slave->state = REDIS_REPL_ONLINE;
+		slave->psync = true;
+		slave->listeningPort = listeningPort;
+		slave->ackOffset = offset;
+		slave->ackTime = time(nullptr);
+		slave->chunk = backlog.seek(offset, &slave->chunkPos);
+		slave->sentOffset = offset;
+		slaveConns[conn->getSockfd()] = slave;
+		redis->repliEnabled = true;
+		LOG_INFO << "Partial resynchronization request accepted, sending "
+			<< masterReplOffset - offset << " bytes of backlog";
+	}
+
+	conn->setHighWaterMarkCallback(HighWaterMarkCallback(), 0);
+	conn->setMessageCallback(std::bind(&Replication::slaveCallback,
+		this, std::placeholders::_1, std::placeholders::_2));
+	conn->setWriteCompleteCallback(std::bind(&Replication::streamWriteComplete,
+		this, std::placeholders::_1));
+	conn->sendInLoop("+CONTINUE\r\n", 11);
+	sendStream(slave);
+	return true;
+}
+
+void Replication::startBgsaveForSync()
+{
+	std::vector<SlaveInfoPtr> slaves;
+	{
+		std::unique_lock <std::mutex> lck(redis->getSlaveMutex());
+		if (redis->isBgsaveRunning() || redis->replSnapshotting)
+		{
+			return;
+		}
+
+		bool *cuts = redis->getReplCuts();
+		for (int32_t i = 0; i < Redis::kShards; i++)
+		{
+			cuts[i] = false;
+		}
+
+		auto &timers = redis->getRepliTimer();
+		for (auto &it : redis->getSlaveConn())
+		{
+			auto &slave = it.second;
+			if (slave->state != REDIS_REPL_WAIT_BGSAVE_START)
 			{
-				std::unique_lock <std::mutex> lck(redis->getMutex());
-				auto &sessions = redis->getSession();
-				sessions[conn->getSockfd()] = session;
-				auto &sessionConns = redis->getSessionConn();
-				sessionConns[conn->getSockfd()] = conn;
+				continue;
 			}
 
-			conn->send(shared.ok->ptr, sdslen(shared.ok->ptr));
-			LOG_INFO << "Replication load rdb success";
+			auto iter = timers.find(it.first);
+			if (iter != timers.end())
+			{
+				slave->conn->getLoop()->cancelAfter(iter->second);
+				timers.erase(iter);
+			}
+
+			slave->state = REDIS_REPL_WAIT_BGSAVE_END;
+			slaves.push_back(slave);
+		}
+
+		if (slaves.empty())
+		{
+			return;
 		}
+
+		redis->replSnapshotting = true;
+		redis->rdbSaving = true;
+		redis->bgsaveStart = mstime();
 	}
+
+	std::thread thread(std::bind(&Replication::snapshotThread, this, slaves));
+	thread.detach();
 }
 
-void Replication::slaveCallback(const TcpConnectionPtr &conn, Buffer *buffer)
+void Replication::snapshotThread(std::vector<SlaveInfoPtr> slaves)
+{
+	ThreadPool::clearThreadAffinity();
+	bool diskless = redis->replDiskless;
+	redis->waitForLoops();
+
+	int32_t retval;
+	if (diskless)
+	{
+		for (auto &it : slaves)
+		{
+			TcpConnectionPtr conn = it->conn;
+			conn->getLoop()->runInLoop([this, conn]()
+			{
+				Buffer header;
+				header.appendInt64(REDIS_REPL_SYNC_EOF);
+				conn->setWriteCompleteCallback(std::bind(&Replication::disklessAck,
+					this, std::placeholders::_1));
+				conn->sendInLoop(header.peek(), header.readableBytes());
+			});
+		}
+
+		retval = redis->getRdb()->rdbSaveStream(std::bind(&Replication::sendDiskless,
+			this, std::ref(slaves), std::placeholders::_1, std::placeholders::_2));
+		if (retval == REDIS_OK && !sendDiskless(slaves, nullptr, 0))
+		{
+			retval = REDIS_ERR;
+		}
+	}
+	else
+	{
+		retval = redis->rdbSaveSnapshot(true);
+	}
+
+	redis->getEventLoop()->runInLoop([this, retval, diskless]()
+	{
+		redis->rdbSaving = false;
+		if (!diskless)
+		{
+			redis->bgsaveDone(retval == REDIS_OK);
+		}
+		snapshotDone(retval == REDIS_OK, diskless);
+	});
+}
+
+/* One chunk in flight per slave: the next one is queued once the loop of
+ * every slave drained the previous one into its socket. */
+bool Replication::sendDiskless(std::vector<SlaveInfoPtr> &slaves, const char *data, size_t len)
+{
+	Buffer frame;
+	frame.appendInt32(static_cast<int32_t>(len));
+	if (len > 0)
+	{
+		frame.append(data, len);
+	}
+
+	std::unique_lock <std::mutex> lck(redis->getSlaveMutex());
+	auto &slaveConns = redis->getSlaveConn();
+	for (auto it = slaves.begin(); it != slaves.end();)
+	{
+		auto alive = [&]()
+		{
+			auto iter = slaveConns.find((*it)->conn->getSockfd());
+			return iter != slaveConns.end() && iter->second == *it;
+		};
+
+		while ((*it)->inflight && alive())
+		{
+			disklessCondition.wait_for(lck, std::chrono::milliseconds(100));
+		}
+
+		if (!alive())
+		{
+			it = slaves.erase(it);
+			continue;
+		}
+		++it;
+	}
+
+	for (auto &it : slaves)
+	{
+		it->inflight = true;
+		it->conn->queueOutput(frame.peek(), frame.readableBytes());
+	}
+	return !slaves.empty();
+}
+
+void Replication::disklessAck(const TcpConnectionPtr &conn)
 {
-	while (buffer->readableBytes() >= sdslen(shared.ok->ptr))
+	std::unique_lock <std::mutex> lck(redis->getSlaveMutex());
+	auto &slaveConns = redis->getSlaveConn();
+	auto it = slaveConns.find(conn->getSockfd());
+	if (it != slaveConns.end())
+	{
+		it->second->inflight = false;
+		disklessCondition.notify_all();
+	}
+}
+
+void Replication::snapshotDone(bool ok, bool diskless)
+{
+	std::vector<SlaveInfoPtr> slaves;
 	{
 		std::unique_lock <std::mutex> lck(redis->getSlaveMutex());
-		auto &salveConn = redis->getSlaveConn();
-		auto it = salveConn.find(conn->getSockfd());
-		if (it != salveConn.end())
+		for (auto &it : redis->getSlaveConn())
 		{
-			if (memcmp(buffer->peek(), shared.ok->ptr, sdslen(shared.ok->ptr)) == 0)
+			auto &slave = it.second;
+			if (slave->state != REDIS_REPL_WAIT_BGSAVE_END)
+			{
+				continue;
+			}
+
+			if (!ok)
+			{
+				slave->conn->forceClose();
+				continue;
+			}
+
+			if (!diskless)
 			{
-				buffer->retrieve(sdslen(shared.ok->ptr));
-				if (++redis->salveCount >= salveConn.size())
+				struct stat st;
+				slave->fd = ::open(REDIS_DEFAULT_RDB_FILENGTHAME, O_RDONLY);
+				if (slave->fd == -1 || ::fstat(slave->fd, &st) == -1)
 				{
-					if (redis->slaveCached.readableBytes() > 0)
-					{
-						conn->send(&redis->slaveCached);
-						Buffer buffer;
-						redis->slaveCached.swap(buffer);
-					}
-
-					auto &repliTimer = redis->getRepliTimer();
-					auto iter = repliTimer.find(conn->getSockfd());
-					assert(iter != repliTimer.end());
-					assert(iter->second != nullptr);
-					conn->getLoop()->cancelAfter(iter->second);
-					repliTimer.erase(conn->getSockfd());
-
-					{
-						std::shared_ptr<Session> session(new Session(redis, conn));
-						auto &sessions = redis->getSession();
-						std::unique_lock<std::mutex> lck(redis->getMutex());
-						sessions[conn->getSockfd()] = session;
-						auto &sessionConns = redis->getSessionConn();
-						sessionConns[conn->getSockfd()] = conn;
-					}
-					LOG_INFO << "Slaveof sync success";
+					LOG_WARN << "Can't open the rdb for the slave: " << strerror(errno);
+					slave->conn->forceClose();
+					continue;
 				}
+				slave->size = st.st_size;
+				slave->offset = 0;
 			}
+
+			/* From here on the slave reads the stream unfiltered from the log,
+			 * once the payload is out. */
+			slave->state = REDIS_REPL_SEND_BULK;
+			slave->streamOffset = masterReplOffset;
+			slave->streamCut = slave->pending.readableBytes();
+			slave->chunk = backlog.seek(masterReplOffset, &slave->chunkPos);
+			slave->sentOffset = masterReplOffset.load();
+			slaves.push_back(slave);
+		}
+		redis->replSnapshotting = false;
+	}
+
+	for (auto &it : slaves)
+	{
+		SlaveInfoPtr slave = it;
+		if (diskless)
+		{
+			slave->conn->getLoop()->runInLoop(std::bind(&Replication::slaveOnline, this, slave));
+			continue;
+		}
+
+		slave->conn->getLoop()->runInLoop([this, slave]()
+		{
+			Buffer header;
+			header.appendInt64(slave->size);
+			slave->conn->sendInLoop(header.peek(), header.readableBytes());
+			slave->conn->setWriteCompleteCallback(std::bind(&Replication::sendBulkToSlave,
+				this, std::placeholders::_1));
+			sendBulkToSlave(slave->conn);
+		});
+	}
+
+	if (!ok)
+	{
+		LOG_WARN << "Snapshot for slaves sync failed";
+	}
+	startBgsaveForSync();
+}
+
+/* Runs in the loop of the slave, once per drained chunk. */
+void Replication::sendBulkToSlave(const TcpConnectionPtr &conn)
+{
+	SlaveInfoPtr slave;
+	{
+		std::unique_lock <std::mutex> lck(redis->getSlaveMutex());
+		auto &slaveConns = redis->getSlaveConn();
+		auto it = slaveConns.find(conn->getSockfd());
+		if (it == slaveConns.end() || it->second->state != REDIS_REPL_SEND_BULK)
+		{
+			return;
+		}
+		slave = it->second;
+	}
+
+	if (slave->offset < slave->size)
+	{
+		char buf[REDIS_SLAVE_SYNC_SIZE];
+		size_t len = std::min(static_cast<int64_t>(sizeof(buf)), slave->size - slave->offset);
+		ssize_t n = ::pread(slave->fd, buf, len, slave->offset);
+		if (n <= 0)
+		{
+			LOG_WARN << "Read error sending the rdb to the slave: " << strerror(errno);
+			conn->forceClose();
+			return;
 		}
+
+		slave->offset += n;
+		conn->sendInLoop(buf, n);
+		return;
+	}
+
+	::close(slave->fd);
+	slave->fd = -1;
+	slaveOnline(slave);
+}
+
+void Replication::slaveOnline(const SlaveInfoPtr &slave)
+{
+	slave->conn->setWriteCompleteCallback(std::bind(&Replication::streamWriteComplete,
+		this, std::placeholders::_1));
+	{
+		std::unique_lock <std::mutex> lck(redis->getSlaveMutex());
+		slave->state = REDIS_REPL_ONLINE;
+		slave->ackTime = time(nullptr);
+		slave->inflight = false;
+	}
+
+	if (slave->psync)
+	{
+		Buffer offset;
+		offset.appendInt64(slave->streamOffset);
+		offset.appendInt64(slave->streamCut);
+		slave->conn->sendInLoop(offset.peek(), offset.readableBytes());
+	}
+
+	if (slave->pending.readableBytes() > 0)
+	{
+		slave->conn->sendInLoop(slave->pending.peek(), slave->pending.readableBytes());
+		slave->pending.retrieveAll();
+	}
+	sendStream(slave);
+	LOG_INFO << "Synchronization with slave succeeded";
+}
+
+/* Runs in the loop of the slave. Writes straight from the shared chunks, one
+ * span at a time, the next one once the socket took it. */
+void Replication::sendStream(const SlaveInfoPtr &slave)
+{
+	slave->flushScheduled = false;
+	if (slave->inflight || !slave->conn->connected())
+	{
+		return;
+	}
+
+	size_t used = slave->chunk->used.load(std::memory_order_acquire);
+	if (slave->chunkPos == used)
+	{
+		if (used < ReplChunk::kSize)
+		{
+			return;
+		}
+
+		ReplChunkPtr chunk = backlog.next(slave->chunk);
+		if (!chunk)
+		{
+			return;
+		}
+
+		slave->chunk = chunk;
+		slave->chunkPos = 0;
+		used = chunk->used.load(std::memory_order_acquire);
+		if (used == 0)
+		{
+			return;
+		}
+	}
+
+	const char *data = slave->chunk->data + slave->chunkPos;
+	size_t len = used - slave->chunkPos;
+	slave->chunkPos = used;
+	slave->sentOffset.store(slave->chunk->offset + used, std::memory_order_relaxed);
+	slave->inflight = true;
+	slave->conn->sendInLoop(data, len);
+}
+
+void Replication::streamWriteComplete(const TcpConnectionPtr &conn)
+{
+	SlaveInfoPtr slave;
+	{
+		std::unique_lock <std::mutex> lck(redis->getSlaveMutex());
+		auto &slaveConns = redis->getSlaveConn();
+		auto it = slaveConns.find(conn->getSockfd());
+		if (it == slaveConns.end() || it->second->state != REDIS_REPL_ONLINE)
+		{
+			return;
+		}
+		slave = it->second;
+	}
+
+	slave->inflight = false;
+	sendStream(slave);
+}
+
+/* Called with the snapshot locks of the command held while a snapshot is cut,
+ * so the state of each slave and the shard cuts are stable. The command is
+ * appended to the log once, only slaves still waiting for the end of their
+ * snapshot get a copy of it, filtered against the cut. Encoding happens
+ * before the slave mutex is taken, into buffers each thread keeps. A slave
+ * holding more than the output limit is disconnected. */
+void Replication::feedSlaves(const RedisObjectPtr &cmd, std::deque<RedisObjectPtr> &commands)
+{
+	thread_local Buffer buffer;
+	thread_local Buffer cut;
+	buffer.retrieveAll();
+	commands.push_front(cmd);
+	redis->structureRedisProtocol(buffer, commands);
+
+	bool cutBuilt = redis->replSnapshotting;
+	if (cutBuilt)
+	{
+		cut.retrieveAll();
+		redis->structureCutProtocol(cut, commands, redis->getReplCuts());
+	}
+
+	{
+		std::unique_lock <std::mutex> lck(redis->getSlaveMutex());
+		if (backlog.active())
+		{
+			backlog.append(buffer.peek(), buffer.readableBytes());
+			masterReplOffset += buffer.readableBytes();
+		}
+
+		int64_t limit = outputLimit.load(std::memory_order_relaxed);
+		for (auto &it : redis->getSlaveConn())
+		{
+			auto &slave = it.second;
+			if (slave->state == REDIS_REPL_WAIT_BGSAVE_END)
+			{
+				if (!cutBuilt)
+				{
+					cut.retrieveAll();
+					redis->structureCutProtocol(cut, commands, redis->getReplCuts());
+					cutBuilt = true;
+				}
+				slave->pending.append(cut.peek(), cut.readableBytes());
+			}
+
+			if (limit > 0 && !slave->closing && slaveOutput(slave) > limit)
+			{
+				LOG_WARN << "Slave " << slave->conn->getSockfd()
+					<< " scheduled to be closed for overcoming of output buffer limits";
+				slave->closing = true;
+				slave->conn->forceClose();
+			}
+		}
+	}
+	commands.pop_front();
+
+	if (buffer.internalCapacity() > 1024 * 1024)
+	{
+		buffer.shrink(0);
+	}
+
+	if (cut.internalCapacity() > 1024 * 1024)
+	{
+		cut.shrink(0);
+	}
+}
+
+/* Once per batch of commands, wakes the online slaves not woken yet. */
+void Replication::flushSlaves()
+{
+	std::unique_lock <std::mutex> lck(redis->getSlaveMutex());
+	for (auto &it : redis->getSlaveConn())
+	{
+		auto &slave = it.second;
+		if (slave->state == REDIS_REPL_ONLINE && !slave->flushScheduled.exchange(true))
+		{
+			slave->conn->getLoop()->queueInLoop(std::bind(&Replication::sendStream,
+				this, slave));
+		}
+	}
+}
+
+/* Appends to the stream what is no command on the keyspace, slaves waiting
+ * for their snapshot do not need it. */
+void Replication::feedStream(const char *data, size_t len)
+{
+	{
+		std::unique_lock <std::mutex> lck(redis->getSlaveMutex());
+		if (!backlog.active() || redis->getSlaveConn().empty())
+		{
+			return;
+		}
+
+		backlog.append(data, len);
+		masterReplOffset += len;
+	}
+	flushSlaves();
+}
+
+/* Called with the slave mutex held. What the slave has still to take: the
+ * commands held for its snapshot and the part of the log it keeps alive. */
+int64_t Replication::slaveOutput(const SlaveInfoPtr &slave)
+{
+	switch (slave->state)
+	{
+	case REDIS_REPL_WAIT_BGSAVE_END:
+		return slave->pending.readableBytes();
+	case REDIS_REPL_SEND_BULK:
+		return slave->streamCut + masterReplOffset - slave->sentOffset;
+	case REDIS_REPL_ONLINE:
+		return masterReplOffset - slave->sentOffset;
+	default:
+		return 0;
+	}
+}
+
+/* Called with the slave mutex held. */
+int32_t Replication::countAcked(int64_t offset)
+{
+	int32_t acked = 0;
+	for (auto &it : redis->getSlaveConn())
+	{
+		if (it.second->state == REDIS_REPL_ONLINE && it.second->ackOffset >= offset)
+		{
+			acked++;
+		}
+	}
+	return acked;
+}
+
+void Replication::waitForSlaves(const SessionPtr &session, const TcpConnectionPtr &conn,
+	int64_t numreplicas, int64_t timeout)
+{
+	{
+		std::unique_lock <std::mutex> lck(redis->getSlaveMutex());
+		int64_t offset = masterReplOffset;
+		int32_t acked = countAcked(offset);
+		if (acked >= numreplicas)
+		{
+			addReplyLongLong(conn->outputBuffer(), acked);
+			return;
+		}
+
+		WaitInfo waiter;
+		waiter.session = session;
+		waiter.conn = conn;
+		waiter.offset = offset;
+		waiter.numreplicas = numreplicas;
+		if (timeout > 0)
+		{
+			waiter.timer = conn->getLoop()->runAfter(timeout / 1000.0, false,
+				std::bind(&Replication::waitTimeout, this, conn->getSockfd()));
+		}
+		waiters[conn->getSockfd()] = waiter;
+		session->setBlocked();
+	}
+
+	/* Slaves ack right away instead of on their next cron. */
+	static const char getack[] = "*3\r\n$8\r\nREPLCONF\r\n$6\r\nGETACK\r\n$1\r\n*\r\n";
+	feedStream(getack, sizeof(getack) - 1);
+}
+
+/* Called with the slave mutex held whenever a slave acked. The reply is
+ * queued, the loop of the client may be the one of the slave. */
+void Replication::unblockWaiters()
+{
+	for (auto it = waiters.begin(); it != waiters.end();)
+	{
+		auto &waiter = it->second;
+		int32_t acked = countAcked(waiter.offset);
+		if (acked < waiter.numreplicas)
+		{
+			++it;
+			continue;
+		}
+
+		if (waiter.timer)
+		{
+			waiter.conn->getLoop()->cancelAfter(waiter.timer);
+		}
+
+		waiter.conn->getLoop()->queueInLoop(std::bind(&Session::unblock,
+			waiter.session, waiter.conn, static_cast<int64_t>(acked)));
+		it = waiters.erase(it);
+	}
+}
+
+void Replication::waitTimeout(int32_t sockfd)
+{
+	WaitInfo waiter;
+	int32_t acked;
+	{
+		std::unique_lock <std::mutex> lck(redis->getSlaveMutex());
+		auto it = waiters.find(sockfd);
+		if (it == waiters.end())
+		{
+			return;
+		}
+
+		waiter = it->second;
+		acked = countAcked(waiter.offset);
+		waiters.erase(it);
+	}
+	waiter.session->unblock(waiter.conn, acked);
+}
+
+void Replication::clearWaiter(int32_t sockfd)
+{
+	std::unique_lock <std::mutex> lck(redis->getSlaveMutex());
+	auto it = waiters.find(sockfd);
+	if (it != waiters.end())
+	{
+		if (it->second.timer)
+		{
+			it->second.conn->getLoop()->cancelAfter(it->second.timer);
+		}
+		waiters.erase(it);
+	}
+}
+
+void Replication::setBacklogSize(int64_t size)
+{
+	std::unique_lock <std::mutex> lck(redis->getSlaveMutex());
+	backlog.setSize(std::max(size, static_cast<int64_t>(REDIS_REPL_BACKLOG_MIN_SIZE)));
+}
+
+/* Slaves only send REPLCONF ACK <offset>, inline, once per second and when
+ * asked with GETACK. */
+void Replication::slaveCallback(const TcpConnectionPtr &conn, Buffer *buffer)
+{
+	const char *crlf;
+	while ((crlf = buffer->findCRLF()) != nullptr)
+	{
+		int64_t offset;
+		const char *ack = buffer->peek();
+		size_t len = crlf - ack;
+		if (len > 13 && !strncasecmp(ack, "replconf ack ", 13)
+			&& string2ll(ack + 13, len - 13, &offset))
+		{
+			std::unique_lock <std::mutex> lck(redis->getSlaveMutex());
+			auto &slaveConns = redis->getSlaveConn();
+			auto it = slaveConns.find(conn->getSockfd());
+			if (it != slaveConns.end())
+			{
+				it->second->ackOffset = offset;
+				it->second->ackTime = time(nullptr);
+				unblockWaiters();
+			}
+		}
+		buffer->retrieveUntil(crlf + 2);
+	}
+
+	if (buffer->readableBytes() > PROTO_INLINE_MAX_SIZE)
+	{
+		buffer->retrieveAll();
 	}
 }
 
@@ -184,18 +1122,42 @@ void Replication::connCallback(const TcpConnectionPtr &conn)
 	}
 	else
 	{
+		if (conn != repliConn)
+		{
+			return;
+		}
+
+		stopLoader();
 		repliConn = nullptr;
 		salveReadLen = 0;
 		salveLen = 0;
-		redis->masterHost.clear();
-		redis->masterPort = 0;
+		replState = 0;
 		redis->masterfd = 0;
-		redis->slaveEnabled = false;
-		redis->repliEnabled = false;
+		if (reconnect)
+		{
+			/* Still a slave of it, the cron connects again and resumes. */
+			linkLost = true;
+			LOG_INFO << "connect master lost, reconnecting";
+			return;
+		}
+
+		clearMaster();
 		LOG_INFO << "connect master disconnect";
 	}
 }
 
+void Replication::clearMaster()
+{
+	redis->masterHost.clear();
+	redis->masterPort = 0;
+	redis->masterfd = 0;
+	redis->slaveEnabled = false;
+
+	/* Writes keep feeding the backlog of a master that had slaves. */
+	std::unique_lock <std::mutex> lck(redis->getSlaveMutex());
+	redis->repliEnabled = backlog.active();
+}
+
 void Replication::reconnectTimer(const std::any &context)
 {
 	client->connect();
@@ -209,19 +1171,49 @@ void Replication::replicationSetMaster(const RedisObjectPtr &obj, int16_t port)
 		auto &slaveConns = redis->getSlaveConn();
 		for (auto &it : slaveConns)
 		{
-			it.second->forceClose();
+			it.second->conn->forceClose();
 		}
 	}
 
+	/* The client keeps a pointer to the address string. */
+	this->ip = obj->ptr;
+	this->port = port;
+	reconnect = true;
+	linkLost = false;
+	connectClient();
+}
+
+/* Runs on the replication loop. A slave moved to another master (cluster
+ * failover) drops the link to the old one first, its late disconnect is
+ * then ignored. */
+void Replication::replicationSwitchMaster(const RedisObjectPtr &obj, int16_t port)
+{
+	loop->assertInLoopThread();
+	if (client)
+	{
+		client->stop();
+	}
+
+	if (repliConn != nullptr)
+	{
+		stopLoader();
+		repliConn->forceClose();
+		repliConn = nullptr;
+		salveReadLen = 0;
+		salveLen = 0;
+		replState = 0;
+	}
+	replicationSetMaster(obj, port);
+}
+
+void Replication::connectClient()
+{
 	TcpClientPtr client(new TcpClient(loop, ip.c_str(), port, this));
 	client->setConnectionCallback(std::bind(&Replication::connCallback,
 		this, std::placeholders::_1));
 	client->setMessageCallback(std::bind(&Replication::readCallback,
 		this, std::placeholders::_1, std::placeholders::_2));
 	client->connect();
-
-	this->ip = obj->ptr;
-	this->port = port;
 	this->client = client;
 }
 
@@ -3,8 +3,140 @@
 #include "object.h"
 #include "tcpclient.h"
 #include "socket.h"
+#include "rdb.h"
 
 class Redis;
+
+/* A piece of the replication stream. Bytes are only appended and published
+ * through used, so readers take no lock and copy nothing inside a chunk. */
+struct ReplChunk
+{
+	static const size_t kSize = 64 * 1024;
+
+	ReplChunk(int64_t offset)
+		:offset(offset),
+		used(0)
+	{
+
+	}
+
+	/* Unlinks the chunks only this one holds without recursing. */
+	~ReplChunk()
+	{
+		std::shared_ptr<ReplChunk> chunk = std::move(next);
+		while (chunk && chunk.use_count() == 1)
+		{
+			chunk = std::move(chunk->next);
+		}
+	}
+
+	int64_t offset;
+	std::atomic<size_t> used;
+	std::shared_ptr<ReplChunk> next;
+	char data[kSize];
+};
+
+typedef std::shared_ptr<ReplChunk> ReplChunkPtr;
+
+/* The stream propagated to slaves, appended once and shared by all of them.
+ * Each online slave reads it from its own chunk and keeps alive the chunks it
+ * has still to send, the log keeps at least size bytes for PSYNC. Appended
+ * and searched with the slave mutex held, next is read under chunkMutex. */
+class ReplLog
+{
+public:
+	ReplLog()
+		:size(REDIS_DEFAULT_REPL_BACKLOG_SIZE)
+	{
+
+	}
+
+	void create(int64_t offset);
+	void append(const char *data, size_t len);
+	ReplChunkPtr seek(int64_t offset, size_t *pos);
+	ReplChunkPtr next(const ReplChunkPtr &chunk);
+	void setSize(int64_t size);
+
+	bool active() { return head != nullptr; }
+	int64_t getSize() { return size; }
+	int64_t getFirstOffset() { return head ? head->offset : 0; }
+	int64_t getHistlen() { return head ? tail->offset + tail->used - head->offset : 0; }
+
+private:
+	void trim();
+
+	ReplChunkPtr head;
+	ReplChunkPtr tail;
+	int64_t size;
+	std::mutex chunkMutex;
+};
+
+/* Master side state of one slave. Commands propagated while the slave waits
+ * for its snapshot are filtered into pending, from the end of the snapshot on
+ * it reads the log at chunk and chunkPos. */
+struct SlaveInfo
+{
+	SlaveInfo(const TcpConnectionPtr &conn)
+		:conn(conn),
+		state(REDIS_REPL_WAIT_BGSAVE_START),
+		fd(-1),
+		offset(0),
+		size(0),
+		streamOffset(0),
+		streamCut(0),
+		ackOffset(0),
+		ackTime(0),
+		listeningPort(0),
+		chunkPos(0),
+		sentOffset(0),
+		inflight(false),
+		psync(false),
+		closing(false),
+		flushScheduled(false)
+	{
+
+	}
+
+	~SlaveInfo()
+	{
+		if (fd != -1)
+		{
+			::close(fd);
+		}
+	}
+
+	TcpConnectionPtr conn;
+	int32_t state;
+	int32_t fd;
+	int64_t offset;
+	int64_t size;
+	int64_t streamOffset;
+	int64_t streamCut;
+	int64_t ackOffset;
+	int64_t ackTime;
+	int32_t listeningPort;
+	ReplChunkPtr chunk;
+	size_t chunkPos;
+	std::atomic<int64_t> sentOffset;
+	bool inflight;
+	bool psync;
+	bool closing;
+	std::atomic<bool> flushScheduled;
+	Buffer pending;
+};
+
+typedef std::shared_ptr<SlaveInfo> SlaveInfoPtr;
+
+/* A client blocked in WAIT until numreplicas slaves acknowledged offset. */
+struct WaitInfo
+{
+	SessionPtr session;
+	TcpConnectionPtr conn;
+	int64_t offset;
+	int64_t numreplicas;
+	TimerPtr timer;
+};
+
 class Replication
 {
 public:
@@ -13,6 +145,17 @@ public:
 
 	void connectMaster();
 	void replicationSetMaster(const RedisObjectPtr &obj, int16_t port);
+	void replicationSwitchMaster(const RedisObjectPtr &obj, int16_t port);
+
+	bool syncSlave(const TcpConnectionPtr &conn, bool psync, int32_t listeningPort);
+	bool tryPartialResync(const TcpConnectionPtr &conn, int32_t listeningPort,
+		const RedisObjectPtr &id, const RedisObjectPtr &off);
+	void startBgsaveForSync();
+	void feedSlaves(const RedisObjectPtr &cmd, std::deque<RedisObjectPtr> &commands);
+	void flushSlaves();
+	void waitForSlaves(const SessionPtr &session, const TcpConnectionPtr &conn,
+		int64_t numreplicas, int64_t timeout);
+	void clearWaiter(int32_t sockfd);
 
 	void slaveCallback(const TcpConnectionPtr &conn, Buffer *buffer);
 	void readCallback(const TcpConnectionPtr &conn, Buffer *buffer);
@@ -22,26 +165,91 @@ public:
 	void syncWithMaster(const TcpConnectionPtr &conn);
 	void replicationCron();
 	void syncWrite(const TcpConnectionPtr &conn);
+	void sendAck();
+	void requestAckToMaster();
+	void touchMaster() { masterLastIo = time(nullptr); }
+	int64_t getMasterLag() { return masterLastIo ? time(nullptr) - masterLastIo : -1; }
 	void disConnect();
 	void close();
+	EventLoop *getLoop() { return loop; }
+
+	void setBacklogSize(int64_t size);
+	void setOutputLimit(int64_t limit) { outputLimit = limit; }
+	int64_t getOutputLimit() { return outputLimit; }
+	void addReplOffset(int64_t len) { replOffset += len; }
+	const std::string &getReplid() { return replid; }
+	int64_t getMasterReplOffset() { return masterReplOffset; }
+	int64_t getReplOffset() { return replOffset; }
+	bool isLinkUp() { return replState == REDIS_REPL_CONNECTED; }
+	bool isSyncing() { return replState == REDIS_REPL_TRANSFER || replState == REDIS_REPL_RECEIVE_OFFSET; }
+
+	/* Called with the slave mutex held. */
+	bool hasBacklog() { return backlog.active(); }
+	int64_t getBacklogSize() { return backlog.getSize(); }
+	int64_t getBacklogOff() { return backlog.getFirstOffset(); }
+	int64_t getBacklogHistlen() { return backlog.getHistlen(); }
 
 private:
 	Replication(const Replication&);
 	void operator=(const Replication&);
 
+	void snapshotThread(std::vector<SlaveInfoPtr> slaves);
+	void snapshotDone(bool ok, bool diskless);
+	bool sendDiskless(std::vector<SlaveInfoPtr> &slaves, const char *data, size_t len);
+	void disklessAck(const TcpConnectionPtr &conn);
+	void sendBulkToSlave(const TcpConnectionPtr &conn);
+	void slaveOnline(const SlaveInfoPtr &slave);
+	void sendStream(const SlaveInfoPtr &slave);
+	void streamWriteComplete(const TcpConnectionPtr &conn);
+	bool syncDone(const TcpConnectionPtr &conn, Buffer *buffer);
+	void startStream(const TcpConnectionPtr &conn, Buffer *buffer);
+	void connectClient();
+	void feedStream(const char *data, size_t len);
+	int32_t countAcked(int64_t offset);
+	int64_t slaveOutput(const SlaveInfoPtr &slave);
+	void unblockWaiters();
+	void waitTimeout(int32_t sockfd);
+	void startLoader();
+	void stopLoader();
+	void clearMaster();
+
 	Redis *redis;
 	EventLoop *loop;
 	TcpClientPtr client;
 	std::string ip;
 	Buffer sendBuf;
-	FILE *fp;
 	TcpConnectionPtr repliConn;
+	std::unique_ptr<RdbStream> stream;
+	std::thread loader;
+	int32_t loadRetval;
+	std::condition_variable disklessCondition;
+
+	/* Master side: the id and offset of the stream it propagates, and the
+	 * log of it the slaves read and partial resynchronization is served from. */
+	std::string replid;
+	ReplLog backlog;
+	std::atomic<int64_t> masterReplOffset;
+	std::atomic<int64_t> outputLimit;
+	int64_t pingOffset;
+	std::unordered_map<int32_t, WaitInfo> waiters;
+
+	/* Slave side: where it is in the stream of its master. PSYNC can only
+	 * resume once the offset reached psyncFloor, the end of the part of the
+	 * stream filtered against the snapshot. */
+	std::string masterReplid;
+	std::string pendingReplid;
+	std::atomic<int64_t> replOffset;
+	std::atomic<int64_t> masterLastIo;
+	int64_t psyncFloor;
+	std::atomic<bool> reconnect;
+	std::atomic<bool> linkLost;
 	std::atomic<int32_t> port;
 	std::atomic<int32_t> replLen;
 	std::atomic<int32_t> replState;
 	std::atomic<int32_t> connectCount;
-	std::atomic<int32_t> salveLen;
-	std::atomic<int32_t> salveReadLen;
+	std::atomic<int64_t> salveLen;
+	std::atomic<int64_t> salveReadLen;
+	std::atomic<int32_t> chunkLen;
 	std::atomic<bool> slaveSyncEnabled;
 };
 
@@ -1,19 +1,34 @@
 #include "session.h"
 #include "redis.h"
 
+/* Client ids are never reused, unlike the sockets. */
+static std::atomic<int64_t> nextClientId(0);
+
 Session::Session(Redis *redis, const TcpConnectionPtr &conn)
-	:reqtype(0),
+	:redis(redis),
+	id(++nextClientId),
+	listeningPort(0),
+	reqtype(0),
 	multibulklen(0),
 	bulklen(-1),
 	argc(0),
-	redis(redis),
+	pos(0),
+	aofBuffer(0),
 	authEnabled(false),
 	replyBuffer(false),
 	fromMaster(false),
 	fromSlave(false),
-	pos(0)
+	slaveFeed(false),
+	blocked(false),
+	tracking(false),
+	asking(false)
 {
 	cmd = createStringObject(nullptr, REDIS_COMMAND_LENGTH);
+
+	char buf[64] = "";
+	auto addr = Socket::getPeerAddr(conn->getSockfd());
+	Socket::toIpPort(buf, sizeof(buf), (const struct sockaddr *)&addr);
+	peerAddr = createStringObject(buf, strlen(buf));
 	conn->setMessageCallback(std::bind(&Session::readCallback,
 		this, std::placeholders::_1, std::placeholders::_2));
 }
@@ -35,9 +50,11 @@ void Session::clearCommand()
 
 void Session::readCallback(const TcpConnectionPtr &conn, Buffer *buffer)
 {
-	/* Keep processing while there is something in the input buffer */
-	while (buffer->readableBytes() > 0)
+	/* Keep processing while there is something in the input buffer, a
+	 * blocked client goes on once unblocked. */
+	while (!blocked && buffer->readableBytes() > 0)
 	{
+		size_t readable = buffer->readableBytes();
 		/* Determine request type when unknown. */
 		if (!reqtype)
 		{
@@ -73,13 +90,38 @@ void Session::readCallback(const TcpConnectionPtr &conn, Buffer *buffer)
 		assert(multibulklen == 0);
 		processCommand(conn);
 		reset();
+
+		/* Commands are only consumed once complete, the offset of a slave
+		 * never covers half of one. */
+		if (conn->getSockfd() == redis->masterfd)
+		{
+			redis->getReplication()->addReplOffset(readable - buffer->readableBytes());
+		}
+	}
+
+	if (conn->getSockfd() == redis->masterfd)
+	{
+		redis->getReplication()->touchMaster();
+	}
+
+	if (aofBuffer.readableBytes() > 0)
+	{
+		redis->getAof()->feedAppendOnlyFile(&aofBuffer);
 	}
 
 	/* If there already are entries in the reply list, we cannot
 	 * add anything more to the static buffer. */
 	if (conn->outputBuffer()->readableBytes() > 0)
 	{
-		conn->sendPipe();
+		/* The master does not read replies to the stream it sends. */
+		if (conn->getSockfd() == redis->masterfd)
+		{
+			conn->outputBuffer()->retrieveAll();
+		}
+		else
+		{
+			conn->sendPipe();
+		}
 	}
 
 	if (pubsubBuffer.readableBytes() > 0)
@@ -87,18 +129,10 @@ void Session::readCallback(const TcpConnectionPtr &conn, Buffer *buffer)
 		pubsubBuffer.retrieveAll();
 	}
 
-	if (redis->repliEnabled)
+	if (slaveFeed)
 	{
-		std::unique_lock<std::mutex> lck(redis->getSlaveMutex());
-		auto &slaveConns = redis->getSlaveConn();
-		for (auto &it : slaveConns)
-		{
-			if (slaveBuffer.readableBytes() > 0)
-			{
-				it.second->send(&slaveBuffer);
-			}
-		}
-		slaveBuffer.retrieveAll();
+		slaveFeed = false;
+		redis->getReplication()->flushSlaves();
 	}
 }
 
@@ -107,9 +141,39 @@ void Session::setAuth(bool enbaled)
 	authEnabled = enbaled;
 }
 
+/* Runs in the loop of the client once the command it was blocked in has its
+ * reply, then goes on with what the client sent meanwhile. */
+void Session::unblock(const TcpConnectionPtr &conn, int64_t reply)
+{
+	blocked = false;
+	if (!conn->connected())
+	{
+		return;
+	}
+
+	addReplyLongLong(conn->outputBuffer(), reply);
+	readCallback(conn, conn->intputBuffer());
+}
+
+void Session::unblockReply(const TcpConnectionPtr &conn, const RedisObjectPtr &reply)
+{
+	blocked = false;
+	if (!conn->connected())
+	{
+		return;
+	}
+
+	addReply(conn->outputBuffer(), reply);
+	readCallback(conn, conn->intputBuffer());
+}
+
 /* Only reset the client when the command was executed. */
 int32_t Session::processCommand(const TcpConnectionPtr &conn)
 {
+	/* ASKING only holds for the command right after it. */
+	bool asked = asking;
+	asking = false;
+
 	if (redis->authEnabled)
 	{
 		if (!authEnabled)
@@ -122,9 +186,30 @@ int32_t Session::processCommand(const TcpConnectionPtr &conn)
 		}
 	}
 
+	/* Until the link to its master is up a slave serves the data it has, the
+	 * old one while a new snapshot is staged, unless told not to. */
+	if (redis->masterPort > 0 && !redis->replServeStale &&
+		!redis->getReplication()->isLinkUp() && !redis->checkStaleCommand(cmd))
+	{
+		addReply(conn->outputBuffer(), shared.masterdownerr);
+		return REDIS_ERR;
+	}
+
+	/* Reads are bounded in staleness by the time since the master, which
+	 * pings an idle stream every second, was last heard from. */
+	if (redis->masterPort > 0 && redis->replMaxLag > 0 &&
+		conn->getSockfd() != redis->masterfd && !redis->checkStaleCommand(cmd) &&
+		redis->getReplication()->getMasterLag() > redis->replMaxLag)
+	{
+		addReply(conn->outputBuffer(), shared.slavelagerr);
+		return REDIS_ERR;
+	}
+
 	if (redis->clusterEnabled)
 	{
-		if (redis->getClusterMap(cmd))
+		/* The master's stream carries the slots it serves, a slave applies it
+		 * as is. */
+		if (redis->getClusterMap(cmd) || conn->getSockfd() == redis->masterfd)
 		{
 			goto jump;
 		}
@@ -137,23 +222,9 @@ int32_t Session::processCommand(const TcpConnectionPtr &conn)
 		char *key = redisCommands[0]->ptr;
 		int32_t hashslot = redis->getCluster()->keyHashSlot(key, sdslen(key));
 
-		std::unique_lock <std::mutex> lck(redis->getClusterMutex());
-		if (redis->clusterRepliMigratEnabled)
-		{
-			auto &map = redis->getCluster()->getMigrating();
-			for (auto &it : map)
-			{
-				auto iter = it.second.find(hashslot);
-				if (iter != it.second.end())
-				{
-					redis->structureRedisProtocol(redis->clusterMigratCached, redisCommands);
-					goto jump;
-				}
-			}
-		}
-
 		if (redis->clusterRepliImportEnabeld)
 		{
+			std::unique_lock <std::mutex> lck(redis->getClusterMutex());
 			auto &map = redis->getCluster()->getImporting();
 			for (auto &it : map)
 			{
@@ -166,23 +237,33 @@ int32_t Session::processCommand(const TcpConnectionPtr &conn)
 			}
 		}
 
-		auto it = redis->getCluster()->checkClusterSlot(hashslot);
-		if (it == nullptr)
+		const ClusterSlotTablePtr &table = redis->getCluster()->getSlotTable();
+		const ClusterRoute *route = table->getSlot(hashslot);
+		if (route == nullptr)
 		{
 			redis->getCluster()->clusterRedirectClient(conn, shared_from_this(),
 				nullptr, hashslot, CLUSTER_REDIR_DOWN_UNBOUND);
 			return REDIS_ERR;
 		}
-		else
+		else if (!route->myself)
 		{
-			if (redis->ip == it->ip && redis->port == it->port)
+			/* A slot on its way here is served to clients sent by -ASK. */
+			if (!asked || !redis->getCluster()->checkSlotImporting(hashslot))
 			{
-				//FIXME
+				redis->getCluster()->clusterRedirectMoved(conn, route, hashslot);
+				return REDIS_ERR;
 			}
-			else
+		}
+		else if (redis->getCluster()->hasMigrations())
+		{
+			/* Keys of a slot on its way out that are gone already live
+			 * on the target. */
+			std::unique_lock <std::mutex> lck(redis->getClusterMutex());
+			ClusterNode *node = redis->getCluster()->getMigratingNode(hashslot);
+			if (node != nullptr && !redis->checkKeyExists(redisCommands[0]))
 			{
 				redis->getCluster()->clusterRedirectClient(conn, shared_from_this(),
-					it, hashslot, CLUSTER_REDIR_MOVED);
+					node, hashslot, CLUSTER_REDIR_ASK);
 				return REDIS_ERR;
 			}
 		}
@@ -190,18 +271,19 @@ int32_t Session::processCommand(const TcpConnectionPtr &conn)
 
 jump:
 
+	bool propagate = false;
 	if (redis->repliEnabled)
 	{
 		if (conn->getSockfd() == redis->masterfd)
 		{
 			fromMaster = true;
 
-			if (!redis->checkCommand(cmd))
+			if (!redis->checkCommand(cmd) && STRCMP(cmd->ptr, "replconf"))
 			{
 				return REDIS_ERR;
 			}
 		}
-		else if (redis->masterfd > 0)
+		else if (redis->masterPort > 0)
 		{
 			if (redis->checkCommand(cmd))
 			{
@@ -211,25 +293,19 @@ jump:
 		}
 		else
 		{
-			if (redis->checkCommand(cmd))
-			{
-				redisCommands.push_front(cmd);
-				{
-					std::unique_lock <std::mutex> lck(redis->getSlaveMutex());
-					if (redis->salveCount < redis->getSlaveConn().size())
-					{
-						redis->structureRedisProtocol(redis->slaveCached, redisCommands);
-					}
-					else
-					{
-						redis->structureRedisProtocol(slaveBuffer, redisCommands);
-					}
-				}
-				redisCommands.pop_front();
-			}
+			propagate = redis->checkCommand(cmd);
 		}
 	}
 
+	/* A key stays here until the target of its migration took it, writes
+	 * meanwhile would be lost. */
+	if (!redisCommands.empty() && redis->checkCommand(cmd) &&
+		redis->getCluster()->checkKeyMigrating(redisCommands[0]))
+	{
+		addReply(conn->outputBuffer(), shared.tryagainerr);
+		return REDIS_ERR;
+	}
+
 	auto &handlerCommands = redis->getHandlerCommandMap();
 	auto it = handlerCommands.find(cmd);
 	if (it == handlerCommands.end())
@@ -240,17 +316,71 @@ jump:
 	}
 	else
 	{
-		if (!it->second(redisCommands, shared_from_this(), conn))
+		/* Keys are remembered before they are read, so a write racing with
+		 * the read still invalidates them. */
+		if (tracking && !redisCommands.empty() && redis->checkTrackCommand(cmd))
+		{
+			redis->getTracking()->rememberKey(id, redisCommands[0]);
+		}
+
+		/* Slaves are fed inside the execution, under the snapshot locks when
+		 * a snapshot is being cut. */
+		auto execute = [&]()
+		{
+			if (!it->second(redisCommands, shared_from_this(), conn))
+			{
+				return false;
+			}
+
+			if (propagate)
+			{
+				redis->getReplication()->feedSlaves(cmd, redisCommands);
+				slaveFeed = true;
+			}
+			return true;
+		};
+
+		bool executed;
+		int64_t start = ustime();
+		bool rewriteFeed = redis->aofEnabled &&
+			redis->getAof()->isRewriting() && redis->checkCommand(cmd);
+		if (rewriteFeed)
+		{
+			executed = redis->getAof()->feedRewriteCommand(cmd, redisCommands, execute);
+		}
+		else if (redis->replSnapshotting && redis->checkCommand(cmd))
+		{
+			executed = redis->executeSnapshotCommand(cmd, redisCommands, execute);
+		}
+		else
+		{
+			executed = execute();
+		}
+		int64_t duration = ustime() - start;
+
+		if (!executed)
 		{
 			addReplyErrorFormat(conn->outputBuffer(),
 				"wrong number of arguments`%s`, for command", cmd->ptr);
 		}
 		else
 		{
+			if (!rewriteFeed && redis->aofEnabled && redis->checkCommand(cmd))
+			{
+				redisCommands.push_front(cmd);
+				redis->structureRedisProtocol(aofBuffer, redisCommands);
+				redisCommands.pop_front();
+			}
+
 			if (redis->monitorEnabled)
 			{
-				redisCommands.push_back(cmd);
-				redis->feedMonitor(redisCommands, conn->getSockfd());
+				redis->getMonitor()->feed(peerAddr, it->first, redisCommands);
+			}
+
+			redis->getCommandStats()->record(it->first, duration);
+			if (redis->getSlowLog()->isSlow(duration))
+			{
+				redis->getSlowLog()->push(it->first, redisCommands, peerAddr, duration);
 			}
 		}
 	}
@@ -277,7 +407,6 @@ void Session::reset()
 
 	if (fromMaster)
 	{
-		slaveBuffer.retrieveAll();
 		pubsubBuffer.retrieveAll();
 		fromMaster = false;
 	}
@@ -299,7 +428,7 @@ int32_t Session::processInlineBuffer(const TcpConnectionPtr &conn, Buffer *buffe
 	size_t queryLen;
 	sds *argv, aux;
 	/* Search for end of line */
-	newline = strchr(queryBuf, '\n');
+	newline = static_cast<const char*>(memchr(queryBuf, '\n', buffer->readableBytes()));
 
 	/* Nothing to do without a \r\n */
 	if (newline == nullptr)
@@ -381,14 +510,14 @@ int32_t Session::processMultibulkBuffer(const TcpConnectionPtr &conn, Buffer *bu
 	if (multibulklen == 0)
 	{
 		/* Multi bulk length cannot be read without a \r\n */
-		newline = strchr(queryBuf + pos, '\r');
+		newline = static_cast<const char*>(memchr(queryBuf + pos, '\r', buffer->readableBytes() - pos));
 		if (newline == nullptr)
 		{
 			return REDIS_ERR;
 		}
 
 		/* Buffer should also contain \n */
-		if ((newline - (queryBuf + pos)) > (buffer->readableBytes() - pos - 2))
+		if (newline + 2 > queryBuf + buffer->readableBytes())
 		{
 			return REDIS_ERR;
 		}
@@ -419,14 +548,14 @@ int32_t Session::processMultibulkBuffer(const TcpConnectionPtr &conn, Buffer *bu
 		/* Read bulk length if unknown */
 		if (bulklen == -1)
 		{
-			newline = strchr(queryBuf + pos, '\r');
+			newline = static_cast<const char*>(memchr(queryBuf + pos, '\r', buffer->readableBytes() - pos));
 			if (newline == nullptr)
 			{
 				break;
 			}
 
 			/* Buffer should also contain \n */
-			if ((newline - (queryBuf + pos)) > (buffer->readableBytes() - pos - 2))
+			if (newline + 2 > queryBuf + buffer->readableBytes())
 			{
 				return REDIS_ERR;
 			}
@@ -454,7 +583,7 @@ int32_t Session::processMultibulkBuffer(const TcpConnectionPtr &conn, Buffer *bu
 		}
 
 		/* Read bulk argument */
-		if ((buffer->readableBytes() - pos) < (bulklen + 2))
+		if (static_cast<int64_t>(buffer->readableBytes() - pos) < (bulklen + 2))
 		{
 			break;
 		}
@@ -21,12 +21,26 @@ public:
 	int32_t processInlineBuffer(const TcpConnectionPtr &conn, Buffer *buffer);
 	int32_t processCommand(const TcpConnectionPtr &conn);
 	void setAuth(bool enbaled);
+	void setTracking(bool enabled) { tracking = enabled; }
+	void setBlocked() { blocked = true; }
+	void setAsking() { asking = true; }
+	void setListeningPort(int32_t port) { listeningPort = port; }
+	int32_t getListeningPort() { return listeningPort; }
+	int64_t getId() { return id; }
+	bool isBlocked() { return blocked; }
+	void unblock(const TcpConnectionPtr &conn, int64_t reply);
+	void unblockReply(const TcpConnectionPtr &conn, const RedisObjectPtr &reply);
+	auto &getPubSubChannels() { return pubsubChannels; }
+	auto &getPubSubPatterns() { return pubsubPatterns; }
+	size_t getPubSubCount() { return pubsubChannels.size() + pubsubPatterns.size(); }
 
 private:
 	Session(const Session&);
 	void operator=(const Session&);
 
 	Redis *redis;
+	int64_t id;
+	int32_t listeningPort;
 	RedisObjectPtr cmd;
 	std::deque<RedisObjectPtr> redisCommands;
 
@@ -36,12 +50,19 @@ private:
 	int32_t argc;
 	size_t pos;
 
-	Buffer slaveBuffer;
+	RedisObjectPtr peerAddr;
 	Buffer pubsubBuffer;
+	std::unordered_set<RedisObjectPtr, Hash, Equal> pubsubChannels;
+	std::unordered_set<RedisObjectPtr, Hash, Equal> pubsubPatterns;
+	Buffer aofBuffer;
 
 	bool authEnabled;
 	bool replyBuffer;
 	bool fromMaster;
 	bool fromSlave;
+	bool slaveFeed;
+	std::atomic<bool> blocked;
+	bool tracking;
+	bool asking;
 };
 
@@ -0,0 +1,270 @@
+#include "slowlog.h"
+
+static thread_local CommandStat *localTable = nullptr;
+
+LatencyHistogram::LatencyHistogram()
+{
+	for (int32_t i = 0; i < kBuckets; i++)
+	{
+		buckets[i].store(0, std::memory_order_relaxed);
+	}
+}
+
+int32_t LatencyHistogram::bucketIndex(int64_t us)
+{
+	if (us < kSubBuckets)
+	{
+		return us < 0 ? 0 : static_cast<int32_t>(us);
+	}
+
+	int32_t msb = 63 - __builtin_clzll(us);
+	if (msb > kMaxBits)
+	{
+		return kBuckets - 1;
+	}
+
+	int32_t shift = msb - kSubBits;
+	return (shift + 1) * kSubBuckets + static_cast<int32_t>((us >> shift) - kSubBuckets);
+}
+
+/* The highest value falling into the bucket. */
+int64_t LatencyHistogram::bucketValue(int32_t index)
+{
+	if (index < kSubBuckets)
+	{
+		return index;
+	}
+
+	int32_t shift = index / kSubBuckets - 1;
+	int64_t sub = index % kSubBuckets + kSubBuckets;
+	return ((sub + 1) << shift) - 1;
+}
+
+int64_t LatencyHistogram::percentile(const uint64_t *counts, uint64_t total, double p)
+{
+	if (total == 0)
+	{
+		return 0;
+	}
+
+	uint64_t rank = static_cast<uint64_t>(p / 100.0 * total);
+	if (rank >= total)
+	{
+		rank = total - 1;
+	}
+
+	uint64_t seen = 0;
+	for (int32_t i = 0; i < kBuckets; i++)
+	{
+		seen += counts[i];
+		if (seen > rank)
+		{
+			return bucketValue(i);
+		}
+	}
+	return bucketValue(kBuckets - 1);
+}
+
+void LatencyHistogram::mergeInto(uint64_t *counts)
+{
+	for (int32_t i = 0; i < kBuckets; i++)
+	{
+		counts[i] += buckets[i].load(std::memory_order_relaxed);
+	}
+}
+
+CommandStats::CommandStats()
+	:baseCalls(0)
+{
+
+}
+
+CommandStats::~CommandStats()
+{
+
+}
+
+void CommandStats::registerCommand(const RedisObjectPtr &name)
+{
+	if (ids.find(name) == ids.end())
+	{
+		ids[name] = names.size();
+		names.push_back(name);
+	}
+}
+
+CommandStat *CommandStats::getTable()
+{
+	if (localTable == nullptr)
+	{
+		std::unique_lock <std::mutex> lck(mutex);
+		tables.push_back(std::unique_ptr<CommandStat[]>(new CommandStat[names.size()]));
+		localTable = tables.back().get();
+	}
+	return localTable;
+}
+
+void CommandStats::record(const RedisObjectPtr &name, int64_t us)
+{
+	auto it = ids.find(name);
+	if (it == ids.end())
+	{
+		return;
+	}
+
+	CommandStat &stat = getTable()[it->second];
+	stat.calls.store(stat.calls.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+	stat.usec.store(stat.usec.load(std::memory_order_relaxed) + us, std::memory_order_relaxed);
+	stat.hist.record(us);
+}
+
+void CommandStats::sum(std::vector<CommandStatInfo> &infos)
+{
+	infos.resize(names.size());
+	for (size_t i = 0; i < names.size(); i++)
+	{
+		infos[i].name = names[i];
+		infos[i].calls = 0;
+		infos[i].usec = 0;
+		infos[i].counts.assign(LatencyHistogram::kBuckets, 0);
+	}
+
+	for (auto &table : tables)
+	{
+		for (size_t i = 0; i < names.size(); i++)
+		{
+			infos[i].calls += table[i].calls.load(std::memory_order_relaxed);
+			infos[i].usec += table[i].usec.load(std::memory_order_relaxed);
+			table[i].hist.mergeInto(infos[i].counts.data());
+		}
+	}
+}
+
+void CommandStats::collect(std::vector<CommandStatInfo> &infos)
+{
+	std::unique_lock <std::mutex> lck(mutex);
+	sum(infos);
+	for (size_t i = 0; i < base.size(); i++)
+	{
+		infos[i].calls -= base[i].calls;
+		infos[i].usec -= base[i].usec;
+		for (int32_t j = 0; j < LatencyHistogram::kBuckets; j++)
+		{
+			infos[i].counts[j] -= base[i].counts[j];
+		}
+	}
+}
+
+int64_t CommandStats::getTotalCalls()
+{
+	int64_t calls = 0;
+	std::unique_lock <std::mutex> lck(mutex);
+	for (auto &table : tables)
+	{
+		for (size_t i = 0; i < names.size(); i++)
+		{
+			calls += table[i].calls.load(std::memory_order_relaxed);
+		}
+	}
+	return calls - baseCalls;
+}
+
+void CommandStats::reset()
+{
+	std::unique_lock <std::mutex> lck(mutex);
+	sum(base);
+	baseCalls = 0;
+	for (auto &it : base)
+	{
+		baseCalls += it.calls;
+	}
+}
+
+SlowLog::SlowLog()
+	:entryId(0),
+	slowerThan(REDIS_SLOWLOG_LOG_SLOWER_THAN),
+	maxLen(REDIS_SLOWLOG_MAX_LENGTH)
+{
+
+}
+
+/* Arguments are copied, at most kMaxArgc of them and kMaxArgLen bytes of
+ * each, the way the original slowlog trims them. */
+void SlowLog::push(const RedisObjectPtr &cmd, const std::deque<RedisObjectPtr> &argv,
+	const RedisObjectPtr &addr, int64_t duration)
+{
+	SlowLogEntry entry;
+	entry.time = time(nullptr);
+	entry.duration = duration;
+	entry.addr = addr;
+	entry.argv.push_back(cmd);
+
+	int32_t argc = argv.size() + 1 > kMaxArgc ? kMaxArgc - 1 : argv.size();
+	for (int32_t i = 0; i < argc; i++)
+	{
+		if (argc != (int32_t)argv.size() && i == argc - 1)
+		{
+			sds s = sdscatprintf(sdsempty(), "... (%d more arguments)",
+				(int32_t)(argv.size() - argc + 1));
+			entry.argv.push_back(createObject(REDIS_STRING, s));
+		}
+		else if (argv[i]->encoding == OBJ_ENCODING_INT)
+		{
+			entry.argv.push_back(createStringObjectFromLongLong((long)argv[i]->ptr));
+		}
+		else if (sdslen(argv[i]->ptr) > kMaxArgLen)
+		{
+			sds s = sdsnewlen(argv[i]->ptr, kMaxArgLen);
+			s = sdscatprintf(s, "... (%lu more bytes)",
+				(unsigned long)(sdslen(argv[i]->ptr) - kMaxArgLen));
+			entry.argv.push_back(createObject(REDIS_STRING, s));
+		}
+		else
+		{
+			entry.argv.push_back(createStringObject(argv[i]->ptr, sdslen(argv[i]->ptr)));
+		}
+	}
+
+	std::unique_lock <std::mutex> lck(mutex);
+	entry.id = entryId++;
+	entries.push_front(std::move(entry));
+	while (entries.size() > maxLen)
+	{
+		entries.pop_back();
+	}
+}
+
+void SlowLog::get(int64_t count, std::vector<SlowLogEntry> &result)
+{
+	std::unique_lock <std::mutex> lck(mutex);
+	for (auto &it : entries)
+	{
+		if (count-- <= 0)
+		{
+			break;
+		}
+		result.push_back(it);
+	}
+}
+
+size_t SlowLog::len()
+{
+	std::unique_lock <std::mutex> lck(mutex);
+	return entries.size();
+}
+
+void SlowLog::reset()
+{
+	std::unique_lock <std::mutex> lck(mutex);
+	entries.clear();
+}
+
+void SlowLog::setMaxLen(int64_t len)
+{
+	std::unique_lock <std::mutex> lck(mutex);
+	maxLen = len;
+	while (entries.size() > maxLen)
+	{
+		entries.pop_back();
+	}
+}
@@ -0,0 +1,134 @@
+#pragma once
+#include "all.h"
+#include "object.h"
+#include "util.h"
+
+/* Log-linear latency histogram in microseconds, 16 linear buckets per power
+ * of two, so any recorded value is off by at most 1/16. Written by a single
+ * thread, read by any. */
+class LatencyHistogram
+{
+public:
+	static const int32_t kSubBits = 4;
+	static const int32_t kSubBuckets = 1 << kSubBits;
+	static const int32_t kMaxBits = 34;
+	static const int32_t kBuckets = (kMaxBits - kSubBits + 1) * kSubBuckets + kSubBuckets;
+
+	LatencyHistogram();
+
+	void record(int64_t us)
+	{
+		auto &bucket = buckets[bucketIndex(us)];
+		bucket.store(bucket.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+	}
+
+	void mergeInto(uint64_t *counts);
+
+	static int32_t bucketIndex(int64_t us);
+	static int64_t bucketValue(int32_t index);
+	static int64_t percentile(const uint64_t *counts, uint64_t total, double p);
+
+private:
+	std::atomic<uint64_t> buckets[kBuckets];
+};
+
+struct CommandStat
+{
+	CommandStat()
+		:calls(0),
+		usec(0)
+	{
+
+	}
+
+	std::atomic<int64_t> calls;
+	std::atomic<int64_t> usec;
+	LatencyHistogram hist;
+};
+
+/* Merged view of one command over all threads. */
+struct CommandStatInfo
+{
+	RedisObjectPtr name;
+	int64_t calls;
+	int64_t usec;
+	std::vector<uint64_t> counts;
+};
+
+/* Per command call counts and latency histograms. Each thread dispatching
+ * commands records into a table of its own, the tables are summed when
+ * they are read. Only their owners write them: a reset keeps the sums of
+ * that moment as a base, taken off what is read afterwards. */
+class CommandStats
+{
+public:
+	CommandStats();
+	~CommandStats();
+
+	void registerCommand(const RedisObjectPtr &name);
+	void record(const RedisObjectPtr &name, int64_t us);
+	void collect(std::vector<CommandStatInfo> &infos);
+	int64_t getTotalCalls();
+	void reset();
+
+private:
+	CommandStats(const CommandStats&);
+	void operator=(const CommandStats&);
+
+	CommandStat *getTable();
+	void sum(std::vector<CommandStatInfo> &infos);
+
+	/* Filled once at startup, read only afterwards. */
+	std::unordered_map<RedisObjectPtr, int32_t, Hash, Equal> ids;
+	std::vector<RedisObjectPtr> names;
+
+	std::mutex mutex;
+	std::vector<std::unique_ptr<CommandStat[]>> tables;
+	std::vector<CommandStatInfo> base;
+	int64_t baseCalls;
+};
+
+struct SlowLogEntry
+{
+	int64_t id;
+	int64_t time;
+	int64_t duration;
+	std::vector<RedisObjectPtr> argv;
+	RedisObjectPtr addr;
+};
+
+class SlowLog
+{
+public:
+	SlowLog();
+
+	void push(const RedisObjectPtr &cmd, const std::deque<RedisObjectPtr> &argv,
+		const RedisObjectPtr &addr, int64_t duration);
+	void get(int64_t count, std::vector<SlowLogEntry> &entries);
+	size_t len();
+	void reset();
+
+	bool isSlow(int64_t duration)
+	{
+		int64_t slower = slowerThan;
+		return slower >= 0 && duration >= slower;
+	}
+
+	void setSlowerThan(int64_t us) { slowerThan = us; }
+	void setMaxLen(int64_t len);
+	int64_t getSlowerThan() { return slowerThan; }
+	int64_t getMaxLen() { return maxLen; }
+
+private:
+	SlowLog(const SlowLog&);
+	void operator=(const SlowLog&);
+
+	static const int32_t kMaxArgc = 32;
+	static const int32_t kMaxArgLen = 128;
+
+	std::mutex mutex;
+	std::deque<SlowLogEntry> entries;
+	int64_t entryId;
+	std::atomic<int64_t> slowerThan;
+	std::atomic<int64_t> maxLen;
+};
@@ -116,8 +116,9 @@ ssize_t Socket::write(int32_t sockfd, const void* buf, int32_t count)
 #endif
 
 #ifdef _WIN64
-	return ::send(sockfd, static_cast<const char*>(buf), count, 0);
+	ssize_t n = ::send(sockfd, static_cast<const char*>(buf), count, 0);
 #endif
+	return n;
 }
 
 int32_t Socket::pipe(int32_t fildes[2])
@@ -0,0 +1,90 @@
+#include "stats.h"
+
+static thread_local ThreadStats *localStats = nullptr;
+
+InstantaneousMetric::InstantaneousMetric()
+	:lastSampleTime(0),
+	lastSampleCount(0),
+	idx(0)
+{
+	for (auto &it : samples)
+	{
+		it = 0;
+	}
+}
+
+void InstantaneousMetric::track(int64_t current, int64_t now)
+{
+	/* A reset of the counter in between is not a negative rate. */
+	if (lastSampleTime != 0 && now > lastSampleTime && current >= lastSampleCount)
+	{
+		int64_t value = (current - lastSampleCount) * 1000 / (now - lastSampleTime);
+		samples[idx] = value;
+		idx = (idx + 1) % REDIS_OPS_SEC_SAMPLES;
+	}
+	lastSampleTime = now;
+	lastSampleCount = current;
+}
+
+int64_t InstantaneousMetric::get()
+{
+	int64_t sum = 0;
+	for (auto &it : samples)
+	{
+		sum += it;
+	}
+	return sum / REDIS_OPS_SEC_SAMPLES;
+}
+
+ServerStats::ServerStats()
+	:baseHits(0),
+	baseMisses(0),
+	baseExpired(0)
+{
+
+}
+
+ServerStats::~ServerStats()
+{
+
+}
+
+ThreadStats *ServerStats::getLocal()
+{
+	if (localStats == nullptr)
+	{
+		std::unique_lock <std::mutex> lck(mutex);
+		threads.push_back(std::unique_ptr<ThreadStats>(new ThreadStats()));
+		localStats = threads.back().get();
+	}
+	return localStats;
+}
+
+void ServerStats::sum(int64_t *hits, int64_t *misses, int64_t *expired)
+{
+	*hits = 0;
+	*misses = 0;
+	*expired = 0;
+
+	for (auto &it : threads)
+	{
+		*hits += it->keyspaceHits.load(std::memory_order_relaxed);
+		*misses += it->keyspaceMisses.load(std::memory_order_relaxed);
+		*expired += it->expiredKeys.load(std::memory_order_relaxed);
+	}
+}
+
+void ServerStats::collect(int64_t *hits, int64_t *misses, int64_t *expired)
+{
+	std::unique_lock <std::mutex> lck(mutex);
+	sum(hits, misses, expired);
+	*hits -= baseHits;
+	*misses -= baseMisses;
+	*expired -= baseExpired;
+}
+
+void ServerStats::reset()
+{
+	std::unique_lock <std::mutex> lck(mutex);
+	sum(&baseHits, &baseMisses, &baseExpired);
+}
@@ -0,0 +1,76 @@
+#pragma once
+#include "all.h"
+#include "util.h"
+
+/* Keyspace counters of one thread, written by it only. */
+struct ThreadStats
+{
+	ThreadStats()
+		:keyspaceHits(0),
+		keyspaceMisses(0),
+		expiredKeys(0)
+	{
+
+	}
+
+	std::atomic<int64_t> keyspaceHits;
+	std::atomic<int64_t> keyspaceMisses;
+	std::atomic<int64_t> expiredKeys;
+};
+
+/* A rate per second, sampled by one thread every REDIS_STATS_CRON_INTERVAL
+ * and averaged over the last REDIS_OPS_SEC_SAMPLES samples. */
+class InstantaneousMetric
+{
+public:
+	InstantaneousMetric();
+
+	void track(int64_t current, int64_t now);
+	int64_t get();
+
+private:
+	int64_t lastSampleTime;
+	int64_t lastSampleCount;
+	int32_t idx;
+	std::atomic<int64_t> samples[REDIS_OPS_SEC_SAMPLES];
+};
+
+class ServerStats
+{
+public:
+	ServerStats();
+	~ServerStats();
+
+	void lookupKey(bool hit)
+	{
+		ThreadStats *stats = getLocal();
+		auto &counter = hit ? stats->keyspaceHits : stats->keyspaceMisses;
+		counter.store(counter.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+	}
+
+	void expiredKey()
+	{
+		ThreadStats *stats = getLocal();
+		stats->expiredKeys.store(stats->expiredKeys.load(std::memory_order_relaxed) + 1,
+			std::memory_order_relaxed);
+	}
+
+	void collect(int64_t *hits, int64_t *misses, int64_t *expired);
+	void reset();
+
+private:
+	ServerStats(const ServerStats&);
+	void operator=(const ServerStats&);
+
+	ThreadStats *getLocal();
+	void sum(int64_t *hits, int64_t *misses, int64_t *expired);
+
+	std::mutex mutex;
+	std::vector<std::unique_ptr<ThreadStats>> threads;
+
+	/* Sums at the last reset, the counters themselves are only written by
+	 * their threads. */
+	int64_t baseHits;
+	int64_t baseMisses;
+	int64_t baseExpired;
+};
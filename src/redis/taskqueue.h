@@ -0,0 +1,269 @@
+#pragma once
+#include "all.h"
+#include <cstddef>
+
+class Task
+{
+public:
+	static const size_t kInlineSize = 64;
+
+	Task()
+		:ops(nullptr)
+	{
+
+	}
+
+	template<typename F, typename = typename std::enable_if<
+		!std::is_same<typename std::decay<F>::type, Task>::value>::type>
+	Task(F &&f)
+	{
+		typedef typename std::decay<F>::type Callable;
+		if constexpr (sizeof(Callable) <= kInlineSize && alignof(Callable) <= alignof(std::max_align_t)
+			&& std::is_nothrow_move_constructible<Callable>::value)
+		{
+			new (storage) Callable(std::forward<F>(f));
+			ops = &InlineOps<Callable>::ops;
+		}
+		else
+		{
+			*reinterpret_cast<Callable**>(storage) = new Callable(std::forward<F>(f));
+			ops = &HeapOps<Callable>::ops;
+		}
+	}
+
+	Task(Task &&other)
+		:ops(other.ops)
+	{
+		if (ops)
+		{
+			ops->move(storage, other.storage);
+			other.ops = nullptr;
+		}
+	}
+
+	Task &operator=(Task &&other)
+	{
+		if (this != &other)
+		{
+			reset();
+			ops = other.ops;
+			if (ops)
+			{
+				ops->move(storage, other.storage);
+				other.ops = nullptr;
+			}
+		}
+		return *this;
+	}
+
+	~Task()
+	{
+		reset();
+	}
+
+	void reset()
+	{
+		if (ops)
+		{
+			ops->destroy(storage);
+			ops = nullptr;
+		}
+	}
+
+	void operator()()
+	{
+		ops->invoke(storage);
+	}
+
+	explicit operator bool() const { return ops != nullptr; }
+
+private:
+	Task(const Task&);
+	void operator=(const Task&);
+
+	struct Ops
+	{
+		void (*invoke)(void *);
+		void (*move)(void *, void *);
+		void (*destroy)(void *);
+	};
+
+	template<typename Callable>
+	struct InlineOps
+	{
+		static void invoke(void *p) { (*static_cast<Callable*>(p))(); }
+		static void move(void *dst, void *src)
+		{
+			new (dst) Callable(std::move(*static_cast<Callable*>(src)));
+			static_cast<Callable*>(src)->~Callable();
+		}
+		static void destroy(void *p) { static_cast<Callable*>(p)->~Callable(); }
+		static const Ops ops;
+	};
+
+	template<typename Callable>
+	struct HeapOps
+	{
+		static void invoke(void *p) { (**static_cast<Callable**>(p))(); }
+		static void move(void *dst, void *src)
+		{
+			*static_cast<Callable**>(dst) = *static_cast<Callable**>(src);
+		}
+		static void destroy(void *p) { delete *static_cast<Callable**>(p); }
+		static const Ops ops;
+	};
+
+	alignas(std::max_align_t) char storage[kInlineSize];
+	const Ops *ops;
+};
+
+template<typename Callable>
+const Task::Ops Task::InlineOps<Callable>::ops =
+	{ &InlineOps::invoke, &InlineOps::move, &InlineOps::destroy };
+
+template<typename Callable>
+const Task::Ops Task::HeapOps<Callable>::ops =
+	{ &HeapOps::invoke, &HeapOps::move, &HeapOps::destroy };
+
+// Bounded multi-producer single-consumer ring. When the ring is full, tasks
+// spill into a mutex-protected overflow list; producers keep using it until
+// the consumer drains it. The overflow only runs once every ring slot claimed
+// before it has run, so per-producer ordering is preserved even when a slot
+// is claimed but not yet published.
+class TaskQueue
+{
+public:
+	explicit TaskQueue(size_t capacity = 4096)
+		:slots(new Slot[capacity]),
+		mask(capacity - 1),
+		head(0),
+		done(0),
+		tail(0),
+		overflowCount(0)
+	{
+		assert((capacity & mask) == 0);
+		for (size_t i = 0; i < capacity; i++)
+		{
+			slots[i].seq.store(i, std::memory_order_relaxed);
+		}
+	}
+
+	template<typename F>
+	void push(F &&f)
+	{
+		if (overflowCount.load(std::memory_order_acquire) == 0 && tryPush<F>(f))
+		{
+			return;
+		}
+
+		std::unique_lock<std::mutex> lk(overflowMutex);
+		overflow.emplace_back(std::forward<F>(f));
+		overflowCount.store(overflow.size(), std::memory_order_release);
+	}
+
+	bool empty() const
+	{
+		return slots[head & mask].seq.load(std::memory_order_acquire) != head + 1
+			&& overflowCount.load(std::memory_order_acquire) == 0;
+	}
+
+	size_t runAll()
+	{
+		size_t n = 0;
+		Task task;
+		while (n <= mask && pop(task))
+		{
+			task();
+			task.reset();
+			++n;
+		}
+
+		if (n <= mask && overflowCount.load(std::memory_order_acquire) > 0
+			&& head == tail.load(std::memory_order_acquire))
+		{
+			std::vector<Task> tasks;
+			{
+				std::unique_lock<std::mutex> lk(overflowMutex);
+				tasks.swap(overflow);
+				overflowCount.store(0, std::memory_order_release);
+			}
+
+			for (auto &it : tasks)
+			{
+				it();
+			}
+			n += tasks.size();
+		}
+		done.store(head, std::memory_order_relaxed);
+		return n;
+	}
+
+	// Approximate, for statistics read by other threads.
+	size_t size() const
+	{
+		return tail.load(std::memory_order_relaxed) - done.load(std::memory_order_relaxed)
+			+ overflowCount.load(std::memory_order_relaxed);
+	}
+
+private:
+	TaskQueue(const TaskQueue&);
+	void operator=(const TaskQueue&);
+
+	struct Slot
+	{
+		std::atomic<size_t> seq;
+		Task task;
+	};
+
+	template<typename F>
+	bool tryPush(F &f)
+	{
+		size_t pos = tail.load(std::memory_order_relaxed);
+		for (;;)
+		{
+			Slot &slot = slots[pos & mask];
+			size_t seq = slot.seq.load(std::memory_order_acquire);
+			intptr_t diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos);
+			if (diff == 0)
+			{
+				if (tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+				{
+					slot.task = Task(std::forward<F>(f));
+					slot.seq.store(pos + 1, std::memory_order_release);
+					return true;
+				}
+			}
+			else if (diff < 0)
+			{
+				return false;
+			}
+			else
+			{
+				pos = tail.load(std::memory_order_relaxed);
+			}
+		}
+	}
+
+	bool pop(Task &task)
+	{
+		Slot &slot = slots[head & mask];
+		if (slot.seq.load(std::memory_order_acquire) != head + 1)
+		{
+			return false;
+		}
+
+		task = std::move(slot.task);
+		slot.seq.store(head + mask + 1, std::memory_order_release);
+		++head;
+		return true;
+	}
+
+	std::unique_ptr<Slot[]> slots;
+	const size_t mask;
+	size_t head;
+	std::atomic<size_t> done;
+	alignas(64) std::atomic<size_t> tail;
+	std::atomic<size_t> overflowCount;
+	std::mutex overflowMutex;
+	std::vector<Task> overflow;
+};
@@ -96,9 +96,10 @@ void TcpClient::errorConnection()
 void TcpClient::newConnection(int32_t sockfd)
 {
 	TcpConnectionPtr conn(new TcpConnection(loop, sockfd, context));
-	conn->setConnectionCallback(std::move(connectionCallback));
-	conn->setMessageCallback(std::move(messageCallback));
-	conn->setWriteCompleteCallback(std::move(writeCompleteCallback));
+	/* Copied, a retrying client needs them for the next connection. */
+	conn->setConnectionCallback(ConnectionCallback(connectionCallback));
+	conn->setMessageCallback(MessageCallback(messageCallback));
+	conn->setWriteCompleteCallback(WriteCompleteCallback(writeCompleteCallback));
 	conn->setCloseCallback(std::bind(&TcpClient::removeConnection, this, std::placeholders::_1));
 
 	{
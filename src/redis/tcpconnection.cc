@@ -6,14 +6,27 @@ TcpConnection::TcpConnection(EventLoop *loop, int32_t sockfd, const std::any &co
 	:loop(loop),
 	sockfd(sockfd),
 	reading(true),
+	readBuffer(0),
+	writeBuffer(0),
+	pendingOutput(0),
+	flushOutput(0),
+	sendingBuffer(loop->canQueueSend() ? std::make_shared<Buffer>(0) : nullptr),
+	pendingQueued(0),
+	pendingFlushed(0),
+	flushTicket(0),
+	sendQueued(false),
 	state(kConnecting),
 	channel(new Channel(loop, sockfd)),
 	context(context)
 {
 	channel->setReadCallback(
 		std::bind(&TcpConnection::handleRead, this));
+	channel->setRecvCallback(
+		std::bind(&TcpConnection::handleRecv, this));
 	channel->setWriteCallback(
 		std::bind(&TcpConnection::handleWrite, this));
+	channel->setSendCallback(
+		std::bind(&TcpConnection::handleSend, this));
 	channel->setCloseCallback(
 		std::bind(&TcpConnection::handleClose, this));
 	channel->setErrorCallback(
@@ -62,7 +75,7 @@ void TcpConnection::forceCloseInLoop()
 void TcpConnection::shutdownInLoop()
 {
 	loop->assertInLoopThread();
-	if (!channel->isWriting())
+	if (!channel->isWriting() && !sendQueued)
 	{
 #ifdef _WIN64
 		if (::shutdown(sockfd, SD_SEND) < 0)
@@ -82,9 +95,11 @@ void TcpConnection::handleRead()
 {
 	loop->assertInLoopThread();
 	int saveErrno = 0;
+	readBuffer.acquire(loop->getBufferPool());
 	ssize_t n = readBuffer.readFd(channel->getfd(), &saveErrno);
 	if (n > 0)
 	{
+		loop->addNetInputBytes(n);
 		messageCallback(shared_from_this(), &readBuffer);
 	}
 #ifdef _WIN64
@@ -113,6 +128,41 @@ void TcpConnection::handleRead()
 #endif
 }
 
+/* Data the poller already received, all chunks go in one message callback. */
+void TcpConnection::handleRecv()
+{
+	loop->assertInLoopThread();
+	if (state == kDisconnected)
+	{
+		return;
+	}
+
+	ssize_t total = 0;
+	bool closed = false;
+	readBuffer.acquire(loop->getBufferPool());
+	for (auto &it : channel->getReceived())
+	{
+		if (it.second <= 0)
+		{
+			closed = true;
+			break;
+		}
+		readBuffer.append(it.first, it.second);
+		total += it.second;
+	}
+
+	if (total > 0)
+	{
+		loop->addNetInputBytes(total);
+		messageCallback(shared_from_this(), &readBuffer);
+	}
+
+	if (closed && (state == kConnected || state == kDisconnecting))
+	{
+		handleClose();
+	}
+}
+
 void TcpConnection::handleWrite()
 {
 	loop->assertInLoopThread();
@@ -123,9 +173,17 @@ void TcpConnection::handleWrite()
 
 	if (channel->isWriting())
 	{
+		if (sendingBuffer != nullptr && sendingBuffer->readableBytes() > 0)
+		{
+			channel->disableWriting();
+			queueSend();
+			return;
+		}
+
 		ssize_t n = Socket::write(channel->getfd(), writeBuffer.peek(), writeBuffer.readableBytes());
 		if (n > 0)
 		{
+			loop->addNetOutputBytes(n);
 			writeBuffer.retrieve(n);
 			if (writeBuffer.readableBytes() == 0)
 			{
@@ -152,6 +210,51 @@ void TcpConnection::handleWrite()
 	}
 }
 
+/* Completion of the send queued with the poller, the next one takes
+ * whatever was written meanwhile. */
+void TcpConnection::handleSend()
+{
+	loop->assertInLoopThread();
+	sendQueued = false;
+	if (state == kDisconnected)
+	{
+		return;
+	}
+
+	ssize_t n = channel->getSent();
+	if (n == -EAGAIN)
+	{
+		/* The socket was full, the send is retried on POLLOUT. */
+		channel->enableWriting();
+		return;
+	}
+
+	if (n < 0)
+	{
+		sendingBuffer->retrieveAll();
+		writeBuffer.retrieveAll();
+		return;
+	}
+
+	loop->addNetOutputBytes(n);
+	sendingBuffer->retrieve(n);
+	if (sendingBuffer->readableBytes() > 0 || writeBuffer.readableBytes() > 0)
+	{
+		queueSend();
+		return;
+	}
+
+	if (writeCompleteCallback)
+	{
+		loop->queueInLoop(std::bind(writeCompleteCallback, shared_from_this()));
+	}
+
+	if (state == kDisconnecting)
+	{
+		shutdownInLoop();
+	}
+}
+
 void TcpConnection::handleClose()
 {
 	loop->assertInLoopThread();
@@ -233,10 +336,7 @@ void TcpConnection::sendPipe()
 	loop->assertInLoopThread();
 	if (!channel->isNoneEvent())
 	{
-		if (!channel->isWriting())
-		{
-			channel->enableWriting();
-		}
+		startWriting();
 	}
 }
 
@@ -250,8 +350,8 @@ void TcpConnection::sendPipe(Buffer *buf)
 		}
 		else
 		{
-			void (TcpConnection::*fp)(const std::string_view &message) = &TcpConnection::sendPipeInLoop;
-			loop->runInLoop(std::bind(fp, this, buf->retrieveAllAsString()));
+			queueOutput(buf->peek(), buf->readableBytes());
+			buf->retrieveAll();
 		}
 	}
 }
@@ -271,8 +371,7 @@ void TcpConnection::sendPipe(const std::string_view &message)
 		}
 		else
 		{
-			void (TcpConnection::*fp)(const std::string_view &message) = &TcpConnection::sendPipeInLoop;
-			loop->runInLoop(std::bind(fp, this, std::string(message)));
+			queueOutput(message.data(), message.size());
 		}
 	}
 }
@@ -292,9 +391,7 @@ void TcpConnection::send(const std::string_view &message)
 		}
 		else
 		{
-			void (TcpConnection::*fp)(const std::string_view &message) = &TcpConnection::sendInLoop;
-			loop->runInLoop(std::bind(fp, this, std::string(message)));
-			//loop->runInLoop(std::bind(&bindSendInLoop,this,std::string(message)));
+			queueOutput(message.data(), message.size());
 		}
 	}
 }
@@ -306,13 +403,11 @@ void TcpConnection::sendPipeInLoop(const std::string_view &message)
 
 void TcpConnection::sendPipeInLoop(const void *message, size_t len)
 {
+	writeBuffer.acquire(loop->getBufferPool());
 	writeBuffer.append(message, len);
 	if (!channel->isNoneEvent())
 	{
-		if (!channel->isWriting())
-		{
-			channel->enableWriting();
-		}
+		startWriting();
 	}
 }
 
@@ -336,9 +431,55 @@ void TcpConnection::send(Buffer *buf)
 		}
 		else
 		{
-			loop->runInLoop(std::bind(&bindSendInLoop, this, buf->retrieveAllAsString()));
+			queueOutput(buf->peek(), buf->readableBytes());
+			buf->retrieveAll();
+		}
+	}
+}
+
+/* Output joins the newest scheduled flush only while no task was queued
+ * to the loop behind it, otherwise it would overtake that task. */
+void TcpConnection::queueOutput(const char *data, size_t len)
+{
+	std::unique_lock<std::mutex> lk(pendingMutex);
+	pendingOutput.append(data, len);
+	pendingQueued += len;
+	if (!flushMarks.empty() && loop->getQueuedTasks() == flushTicket)
+	{
+		flushMarks.back() = pendingQueued;
+		return;
+	}
+
+	flushMarks.push_back(pendingQueued);
+	uint64_t queued = loop->getQueuedTasks();
+	loop->queueInLoop(std::bind(&TcpConnection::flushOutputInLoop, shared_from_this()));
+	flushTicket = queued + 1;
+}
+
+void TcpConnection::flushOutputInLoop()
+{
+	loop->assertInLoopThread();
+	{
+		std::unique_lock<std::mutex> lk(pendingMutex);
+		size_t n = flushMarks.front() - pendingFlushed;
+		flushMarks.pop_front();
+		pendingFlushed += n;
+		if (n == pendingOutput.readableBytes())
+		{
+			flushOutput.swap(pendingOutput);
+		}
+		else
+		{
+			flushOutput.append(pendingOutput.peek(), n);
+			pendingOutput.retrieve(n);
 		}
 	}
+
+	if (flushOutput.readableBytes() > 0 && state != kDisconnected)
+	{
+		sendInLoop(flushOutput.peek(), flushOutput.readableBytes());
+	}
+	flushOutput.retrieveAll();
 }
 
 void TcpConnection::sendInLoop(const std::string_view &message)
@@ -359,7 +500,7 @@ void TcpConnection::sendInLoop(const void *data, size_t len)
 		return;
 	}
 
-	if (!channel->isWriting() && writeBuffer.readableBytes() == 0)
+	if (sendingBuffer == nullptr && !channel->isWriting() && writeBuffer.readableBytes() == 0)
 	{
 #ifdef _WIN64
 		nwrote = ::send(channel->getfd(), (const char *)data, len, 0);
@@ -368,6 +509,7 @@ void TcpConnection::sendInLoop(const void *data, size_t len)
 #endif
 		if (nwrote >= 0)
 		{
+			loop->addNetOutputBytes(nwrote);
 			remaining = len - nwrote;
 			if (remaining == 0 && writeCompleteCallback)
 			{
@@ -385,25 +527,115 @@ void TcpConnection::sendInLoop(const void *data, size_t len)
 				}
 			}
 		}
+	}
 
-		assert(remaining <= len);
-		if (!faultError && remaining > 0)
+	/* Output already pending is queued behind, never dropped. */
+	assert(remaining <= len);
+	if (!faultError && remaining > 0)
+	{
+		size_t oldLen = getWriteBytes();
+		if (oldLen + remaining >= highWaterMark
+			&& oldLen < highWaterMark
+			&& highWaterMarkCallback)
 		{
-			size_t oldLen = writeBuffer.readableBytes();
-			if (oldLen + remaining >= highWaterMark
-				&& oldLen < highWaterMark
-				&& highWaterMarkCallback)
-			{
-				loop->queueInLoop(std::bind(highWaterMarkCallback, shared_from_this(), oldLen + remaining));
-			}
+			loop->queueInLoop(std::bind(highWaterMarkCallback, shared_from_this(), oldLen + remaining));
+		}
 
-			writeBuffer.append(static_cast<const char*>(data) + nwrote, remaining);
-			if (!channel->isWriting())
-			{
-				channel->enableWriting();
-			}
+		writeBuffer.acquire(loop->getBufferPool());
+		writeBuffer.append(static_cast<const char*>(data) + nwrote, remaining);
+		startWriting();
+	}
+}
+
+/* With io_uring the output goes out as a send from its own buffer, as the
+ * kernel reads it after the call returns and writeBuffer may grow. */
+void TcpConnection::startWriting()
+{
+	if (sendingBuffer != nullptr && !channel->isWriting())
+	{
+		if (!sendQueued && writeBuffer.readableBytes() > 0)
+		{
+			queueSend();
+		}
+	}
+	else if (!channel->isWriting())
+	{
+		channel->enableWriting();
+	}
+}
+
+void TcpConnection::queueSend()
+{
+	if (sendingBuffer->readableBytes() == 0)
+	{
+		sendingBuffer->swap(writeBuffer);
+	}
+
+	sendQueued = loop->queueSend(channel.get(), sendingBuffer);
+	if (!sendQueued)
+	{
+		/* Not known to the poller yet, wait for POLLOUT instead. */
+		sendingBuffer->append(writeBuffer.peek(), writeBuffer.readableBytes());
+		writeBuffer.retrieveAll();
+		sendingBuffer->swap(writeBuffer);
+		channel->enableWriting();
+	}
+}
+
+Buffer *TcpConnection::outputBuffer()
+{
+	if (loop->isInLoopThread())
+	{
+		writeBuffer.acquire(loop->getBufferPool());
+	}
+	return &writeBuffer;
+}
+
+int64_t TcpConnection::shrinkBuffers()
+{
+	loop->assertInLoopThread();
+	if (readBuffer.readableBytes() == 0)
+	{
+		readBuffer.release(loop->getBufferPool());
+	}
+	else if (readBuffer.internalCapacity() > kShrinkThreshold)
+	{
+		readBuffer.shrink(0);
+	}
+
+	if (writeBuffer.readableBytes() == 0)
+	{
+		writeBuffer.release(loop->getBufferPool());
+	}
+	else if (!channel->isWriting() && writeBuffer.internalCapacity() > kShrinkThreshold)
+	{
+		writeBuffer.shrink(0);
+	}
+
+	if (flushOutput.readableBytes() == 0)
+	{
+		flushOutput.release(loop->getBufferPool());
+	}
+
+	int64_t bytes = readBuffer.internalCapacity() + writeBuffer.internalCapacity()
+		+ flushOutput.internalCapacity();
+	{
+		std::unique_lock<std::mutex> lk(pendingMutex);
+		if (pendingOutput.internalCapacity() > kShrinkThreshold)
+		{
+			pendingOutput.shrink(0);
+		}
+		bytes += pendingOutput.internalCapacity();
+	}
+	if (sendingBuffer != nullptr)
+	{
+		if (!sendQueued && sendingBuffer->readableBytes() == 0)
+		{
+			sendingBuffer->release(loop->getBufferPool());
 		}
+		bytes += sendingBuffer->internalCapacity();
 	}
+	return bytes;
 }
 
 void TcpConnection::connectEstablished()
@@ -9,6 +9,7 @@ class TcpConnection : public std::enable_shared_from_this<TcpConnection>
 {
 public:
 	enum StateE { kDisconnected, kConnecting, kConnected, kDisconnecting };
+	static const int32_t kShrinkThreshold = 64 * 1024;
 	TcpConnection(EventLoop *loop, int32_t sockfd, const std::any &context);
 	~TcpConnection();
 
@@ -49,6 +50,8 @@ public:
 	static void bindSendInLoop(TcpConnection *conn, const std::string_view &message);
 	static void bindSendPipeInLoop(TcpConnection *conn, const std::string_view &message);
 
+	void queueOutput(const char *data, size_t len);
+	void flushOutputInLoop();
 	void sendInLoopPipe();
 	void sendPipe();
 	void sendPipe(const std::string_view &message);
@@ -72,7 +75,9 @@ public:
 	void forceClose();
 
 	void handleRead();
+	void handleRecv();
 	void handleWrite();
+	void handleSend();
 	void handleClose();
 	void handleError();
 
@@ -87,19 +92,36 @@ public:
 	void resetContext() { context.reset(); }
 	void setContext(const std::any &context) { this->context = context; }
 
-	Buffer *outputBuffer() { return &writeBuffer; }
+	Buffer *outputBuffer();
+	size_t getWriteBytes() { return writeBuffer.readableBytes() + (sendingBuffer ? sendingBuffer->readableBytes() : 0); }
 	Buffer *intputBuffer() { return &readBuffer; }
+	int64_t shrinkBuffers();
 
 private:
 	TcpConnection(const TcpConnection&);
 	void operator=(const TcpConnection&);
 
+	void startWriting();
+	void queueSend();
+
 	EventLoop *loop;
 	int32_t sockfd;
 	bool reading;
 
 	Buffer readBuffer;
 	Buffer writeBuffer;
+	/* Output queued by other threads. Each scheduled flush sends up to its
+	 * mark, in the order the flushes were queued. */
+	Buffer pendingOutput;
+	Buffer flushOutput;
+	std::deque<uint64_t> flushMarks;
+	uint64_t pendingQueued;
+	uint64_t pendingFlushed;
+	uint64_t flushTicket;
+	/* Output the kernel is sending (io_uring), one send in flight. */
+	BufferPtr sendingBuffer;
+	bool sendQueued;
+	std::mutex pendingMutex;
 	ConnectionCallback connectionCallback;
 	MessageCallback messageCallback;
 	WriteCompleteCallback writeCompleteCallback;
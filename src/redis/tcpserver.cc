@@ -1,18 +1,23 @@
 #include "tcpserver.h"
 #include "tcpconnection.h"
+#include "log.h"
 
 TcpServer::TcpServer(EventLoop *loop, const char *ip, int16_t port, const std::any &context)
 	:loop(loop),
-	acceptor(new Acceptor(loop, ip, port)),
+	ip(ip),
+	port(port),
+	reusePort(false),
+	leastConnections(false),
 	threadPool(new ThreadPool(loop)),
 	context(context)
 {
-	acceptor->setNewConnectionCallback(std::bind(&TcpServer::newConnection, this, std::placeholders::_1));
+
 }
 
 TcpServer::~TcpServer()
 {
 	loop->assertInLoopThread();
+	std::unique_lock<std::mutex> lk(mutex);
 	for (auto &it : connections)
 	{
 		TcpConnectionPtr conn = it.second;
@@ -25,14 +30,33 @@ TcpServer::~TcpServer()
 void TcpServer::newConnection(int32_t sockfd)
 {
 	loop->assertInLoopThread();
-	EventLoop *loop = threadPool->getNextLoop();
-	TcpConnectionPtr conn(new TcpConnection(loop, sockfd, context));
-	connections[sockfd] = conn;
+	EventLoop *ioLoop = leastConnections ?
+		threadPool->getLeastLoop() : threadPool->getNextLoop();
+	establishConnection(ioLoop, sockfd);
+}
+
+void TcpServer::newConnectionInLoop(EventLoop *acceptLoop, int32_t sockfd)
+{
+	acceptLoop->assertInLoopThread();
+	EventLoop *ioLoop = leastConnections ?
+		threadPool->getLeastLoop() : acceptLoop;
+	establishConnection(ioLoop, sockfd);
+}
+
+void TcpServer::establishConnection(EventLoop *ioLoop, int32_t sockfd)
+{
+	TcpConnectionPtr conn(new TcpConnection(ioLoop, sockfd, context));
+	{
+		std::unique_lock<std::mutex> lk(mutex);
+		connections[sockfd] = conn;
+	}
+
+	ioLoop->incConnectionCount();
 	conn->setConnectionCallback(std::move(connectionCallback));
 	conn->setMessageCallback(std::move(messageCallback));
 	conn->setWriteCompleteCallback(std::move(writeCompleteCallback));
 	conn->setCloseCallback(std::bind(&TcpServer::removeConnection, this, std::placeholders::_1));
-	loop->runInLoop(std::bind(&TcpConnection::connectEstablished, conn));
+	ioLoop->runInLoop(std::bind(&TcpConnection::connectEstablished, conn));
 }
 
 void TcpServer::setThreadNum(int16_t numThreads)
@@ -43,7 +67,25 @@ void TcpServer::setThreadNum(int16_t numThreads)
 void TcpServer::start()
 {
 	threadPool->start(threadInitCallback);
-	acceptor->listen();
+	if (reusePort && threadPool->getAllLoops()[0] != loop)
+	{
+		for (auto &it : threadPool->getAllLoops())
+		{
+			AcceptorPtr acc(new Acceptor(it, ip.c_str(), port));
+			acc->setNewConnectionCallback(std::bind(&TcpServer::newConnectionInLoop,
+				this, it, std::placeholders::_1));
+			it->runInLoop(std::bind(&Acceptor::listen, acc.get()));
+			acceptors.push_back(std::move(acc));
+		}
+		LOG_INFO << "Listening with " << acceptors.size() << " SO_REUSEPORT acceptors";
+	}
+	else
+	{
+		acceptor.reset(new Acceptor(loop, ip.c_str(), port));
+		acceptor->setNewConnectionCallback(std::bind(&TcpServer::newConnection,
+			this, std::placeholders::_1));
+		acceptor->listen();
+	}
 }
 
 void TcpServer::removeConnection(const TcpConnectionPtr &conn)
@@ -54,9 +96,14 @@ void TcpServer::removeConnection(const TcpConnectionPtr &conn)
 void TcpServer::removeConnectionInLoop(const TcpConnectionPtr &conn)
 {
 	loop->assertInLoopThread();
-	size_t n = connections.erase(conn->getSockfd());
-	(void)n;
-	assert(n == 1);
+	{
+		std::unique_lock<std::mutex> lk(mutex);
+		size_t n = connections.erase(conn->getSockfd());
+		(void)n;
+		assert(n == 1);
+	}
+
 	EventLoop *ioLoop = conn->getLoop();
+	ioLoop->decConnectionCount();
 	ioLoop->queueInLoop(std::bind(&TcpConnection::connectDestroyed, conn));
 }
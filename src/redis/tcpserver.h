@@ -13,6 +13,7 @@ public:
 	~TcpServer();
 
 	void newConnection(int32_t sockfd);
+	void newConnectionInLoop(EventLoop *acceptLoop, int32_t sockfd);
 	void start();
 
 	void removeConnection(const TcpConnectionPtr &conn);
@@ -22,6 +23,8 @@ public:
 	void setMessageCallback(const MessageCallback &&cb) { messageCallback = std::move(cb); }
 	void setWriteCompleteCallback(const WriteCompleteCallback &&cb) { writeCompleteCallback = std::move(cb); }
 	void setThreadNum(int16_t numThreads);
+	void setReusePort(bool on) { reusePort = on; }
+	void setLeastConnections(bool on) { leastConnections = on; }
 
 	EventLoop *getLoop() const { return loop; }
 	ThreadPoolPtr getThreadPool() { return threadPool; }
@@ -34,8 +37,15 @@ private:
 	TcpServer(const TcpServer&);
 	void operator=(const TcpServer&);
 
+	void establishConnection(EventLoop *ioLoop, int32_t sockfd);
+
 	EventLoop *loop;
+	std::string ip;
+	int16_t port;
+	bool reusePort;
+	bool leastConnections;
 	AcceptorPtr acceptor;
+	std::vector<AcceptorPtr> acceptors;
 	ThreadPoolPtr threadPool;
 	ConnectionCallback connectionCallback;
 	MessageCallback messageCallback;
@@ -44,6 +54,7 @@ private:
 
 	typedef std::unordered_map<int32_t, TcpConnectionPtr> ConnectionMap;
 	ConnectionMap connections;
+	std::mutex mutex;
 	std::any context;
 
 };
@@ -1,10 +1,19 @@
 #include "threadpool.h"
 #include "eventloop.h"
+#include "log.h"
+#ifdef __linux__
+#include <pthread.h>
 
-Thread::Thread(const ThreadInitCallback &cb)
+static cpu_set_t processCpus;
+#endif
+static std::atomic<bool> affinitySaved(false);
+
+Thread::Thread(const ThreadInitCallback &cb, int32_t cpu, int64_t busyPollUs)
 	:loop(nullptr),
 	exiting(false),
-	callback(std::move(cb))
+	callback(std::move(cb)),
+	cpu(cpu),
+	busyPollUs(busyPollUs)
 {
 
 }
@@ -32,6 +41,11 @@ EventLoop *Thread::startLoop()
 void Thread::threadFunc()
 {
 	EventLoop xloop;
+	xloop.setBusyPoll(busyPollUs);
+	if (cpu >= 0)
+	{
+		ThreadPool::setThreadAffinity(cpu);
+	}
 
 	if (callback)
 	{
@@ -51,7 +65,9 @@ ThreadPool::ThreadPool(EventLoop *baseLoop)
 	:baseLoop(baseLoop),
 	started(false),
 	numThreads(0),
-	next(0)
+	next(0),
+	cpuAffinity(false),
+	busyPollUs(0)
 {
 
 }
@@ -68,19 +84,65 @@ void ThreadPool::start(const ThreadInitCallback &cb)
 
 	started = true;
 
+#ifdef __linux__
+	if (cpuAffinity && !affinitySaved)
+	{
+		pthread_getaffinity_np(pthread_self(), sizeof(processCpus), &processCpus);
+		affinitySaved.store(true, std::memory_order_release);
+	}
+#endif
+
+	int32_t cpus = std::thread::hardware_concurrency();
 	for (int i = 0; i < numThreads; i++)
 	{
-		ThreadPtr t(new Thread(cb));
+		int32_t cpu = (cpuAffinity && cpus > 0) ? (i + 1) % cpus : -1;
+		ThreadPtr t(new Thread(cb, cpu, busyPollUs));
 		threads.push_back(t);
 		loops.push_back(t->startLoop());
 	}
 
+	baseLoop->setBusyPoll(busyPollUs);
+	if (cpuAffinity)
+	{
+		setThreadAffinity(0);
+	}
+
 	if (numThreads == 0 && cb)
 	{
 		cb(baseLoop);
 	}
 }
 
+bool ThreadPool::setThreadAffinity(int32_t cpu)
+{
+#ifdef __linux__
+	cpu_set_t cpuset;
+	CPU_ZERO(&cpuset);
+	CPU_SET(cpu, &cpuset);
+	int32_t ret = pthread_setaffinity_np(pthread_self(), sizeof(cpuset), &cpuset);
+	if (ret != 0)
+	{
+		LOG_WARN << "pthread_setaffinity_np cpu " << cpu << " failed " << strerror(ret);
+		return false;
+	}
+	return true;
+#else
+	return false;
+#endif
+}
+
+/* Threads inherit the mask of the thread that spawns them, so workers
+ * started from a pinned loop call this to run on every cpu again. */
+void ThreadPool::clearThreadAffinity()
+{
+#ifdef __linux__
+	if (affinitySaved.load(std::memory_order_acquire))
+	{
+		pthread_setaffinity_np(pthread_self(), sizeof(processCpus), &processCpus);
+	}
+#endif
+}
+
 EventLoop *ThreadPool::getNextLoop()
 {
 	assert(started);
@@ -98,6 +160,25 @@ EventLoop *ThreadPool::getNextLoop()
 	return loop;
 }
 
+EventLoop *ThreadPool::getLeastLoop()
+{
+	assert(started);
+	EventLoop *loop = baseLoop;
+
+	if (!loops.empty())
+	{
+		loop = loops[0];
+		for (auto &it : loops)
+		{
+			if (it->getConnectionCount() < loop->getConnectionCount())
+			{
+				loop = it;
+			}
+		}
+	}
+	return loop;
+}
+
 EventLoop *ThreadPool::getLoopForHash(size_t hashCode)
 {
 	baseLoop->assertInLoopThread();
@@ -8,7 +8,8 @@ class Thread
 public:
 	typedef std::function<void(EventLoop*)> ThreadInitCallback;
 
-	Thread(const ThreadInitCallback &cb = ThreadInitCallback());
+	Thread(const ThreadInitCallback &cb = ThreadInitCallback(),
+		int32_t cpu = -1, int64_t busyPollUs = 0);
 	~Thread();
 	EventLoop *startLoop();
 
@@ -22,6 +23,8 @@ private:
 	mutable std::mutex mutex;
 	std::condition_variable condition;
 	ThreadInitCallback callback;
+	int32_t cpu;
+	int64_t busyPollUs;
 };
 
 class ThreadPool
@@ -32,9 +35,14 @@ public:
 	~ThreadPool();
 
 	void setThreadNum(int numThreads) { this->numThreads = numThreads; }
+	void setCpuAffinity(bool on) { cpuAffinity = on; }
+	void setBusyPoll(int64_t us) { busyPollUs = us; }
+	static bool setThreadAffinity(int32_t cpu);
+	static void clearThreadAffinity();
 	void start(const ThreadInitCallback &cb = ThreadInitCallback());
 
 	EventLoop *getNextLoop();
+	EventLoop *getLeastLoop();
 	EventLoop *getLoopForHash(size_t hashCode);
 	std::vector<EventLoop*> getAllLoops();
 	bool getStarted() const { return started; }
@@ -47,6 +55,8 @@ private:
 	bool started;
 	int32_t numThreads;
 	int32_t next;
+	bool cpuAffinity;
+	int64_t busyPollUs;
 
 	std::vector<ThreadPtr> threads;
 	std::vector<EventLoop*> loops;
@@ -1,5 +1,6 @@
 #include "timerqueue.h"
 #include "eventloop.h"
+#include "latency.h"
 
 std::atomic<int64_t> Timer::numCreated = 0;
 
@@ -186,10 +187,12 @@ TimerQueue::TimerQueue(EventLoop *loop)
 	timerfd(createTimerfd()),
 	timerfdChannel(loop, timerfd),
 #endif
-	callingExpiredTimers(false)
+	callingExpiredTimers(false),
+	latency(nullptr)
 {
 #ifdef __linux__
 	timerfdChannel.setReadCallback(std::bind(&TimerQueue::handleRead, this));
+	timerfdChannel.setEdgeTriggered(true);
 	timerfdChannel.enableReading();
 #endif
 }
@@ -282,11 +285,16 @@ void TimerQueue::handleRead()
 	cancelingTimers.clear();
 	// safe to callback outside critical section
 
+	int64_t start = latency ? latency->start() : 0;
 	for (auto &it : expired)
 	{
 		it.second->run();
 	}
 
+	if (latency)
+	{
+		latency->end("timer-queue", start);
+	}
 	callingExpiredTimers = false;
 	reset(now);
 }
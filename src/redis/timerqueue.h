@@ -4,6 +4,7 @@
 #include "callback.h"
 
 class EventLoop;
+class LatencyMonitor;
 class TimeStamp
 {
 public:
@@ -112,6 +113,7 @@ public:
 	TimerPtr getTimerBegin();
 	int64_t getTimeout() const;
 	size_t getTimerSize();
+	void setLatencyMonitor(LatencyMonitor *monitor) { latency = monitor; }
 
 private:
 	TimerQueue(const TimerQueue&);
@@ -138,6 +140,7 @@ private:
 	TimerList expired;
 	TimerList timers;
 	bool callingExpiredTimers;
+	LatencyMonitor *latency;
 };
 
 
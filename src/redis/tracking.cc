@@ -0,0 +1,272 @@
+#include "tracking.h"
+#include "redis.h"
+
+Tracking::Tracking(Redis *redis)
+	:redis(redis),
+	keyCount(0),
+	maxKeys(REDIS_DEFAULT_TRACKING_TABLE_MAX_KEYS),
+	evictCursor(0),
+	channel(createStringObject((char*)"__redis__:invalidate", 20)),
+	enabled(false),
+	bcastEnabled(false)
+{
+
+}
+
+Tracking::~Tracking()
+{
+
+}
+
+void Tracking::enable(const TrackingClientPtr &client)
+{
+	disable(client->id);
+
+	std::unique_lock <std::mutex> lck(mutex);
+	clients[client->id] = client;
+	if (client->bcast)
+	{
+		if (client->prefixes.empty())
+		{
+			client->prefixes.push_back("");
+		}
+
+		for (auto &it : client->prefixes)
+		{
+			prefixes[it].insert(client->id);
+		}
+		bcastEnabled = true;
+	}
+	enabled = true;
+}
+
+void Tracking::disable(int64_t id)
+{
+	std::unique_lock <std::mutex> lck(mutex);
+	auto it = clients.find(id);
+	if (it == clients.end())
+	{
+		return;
+	}
+
+	for (auto &prefix : it->second->prefixes)
+	{
+		auto iter = prefixes.find(prefix);
+		if (iter != prefixes.end())
+		{
+			iter->second.erase(id);
+			if (iter->second.empty())
+			{
+				prefixes.erase(iter);
+			}
+		}
+	}
+
+	clients.erase(it);
+	enabled = !clients.empty();
+	bcastEnabled = !prefixes.empty();
+}
+
+void Tracking::rememberKey(int64_t id, const RedisObjectPtr &key)
+{
+	{
+		auto &shard = shards[key->hash % kShards];
+		std::unique_lock <std::mutex> lck(shard.mtx);
+		auto it = shard.keys.find(key);
+		if (it == shard.keys.end())
+		{
+			it = shard.keys.insert(std::make_pair(key, std::unordered_set<int64_t>())).first;
+			keyCount++;
+		}
+		it->second.insert(id);
+	}
+
+	if (maxKeys > 0 && keyCount > maxKeys)
+	{
+		evictKeys(key);
+	}
+}
+
+/* Keys past maxKeys are evicted shard after shard, each one invalidated so
+ * its readers drop it as well. The key just read is kept. */
+void Tracking::evictKeys(const RedisObjectPtr &keep)
+{
+	int32_t tries = kShards;
+	while (maxKeys > 0 && keyCount > maxKeys && tries-- > 0)
+	{
+		RedisObjectPtr evicted;
+		std::unordered_set<int64_t> ids;
+		{
+			auto &shard = shards[evictCursor++ % kShards];
+			std::unique_lock <std::mutex> lck(shard.mtx);
+			for (auto it = shard.keys.begin(); it != shard.keys.end(); ++it)
+			{
+				if (Equal()(it->first, keep))
+				{
+					continue;
+				}
+
+				evicted = it->first;
+				ids.swap(it->second);
+				shard.keys.erase(it);
+				keyCount--;
+				break;
+			}
+		}
+
+		if (evicted != nullptr)
+		{
+			notifyClients(evicted, ids, -1, false);
+			tries = kShards;
+		}
+	}
+}
+
+void Tracking::invalidateKey(const RedisObjectPtr &key, int64_t id)
+{
+	if (!enabled)
+	{
+		return;
+	}
+
+	std::unordered_set<int64_t> ids;
+	{
+		auto &shard = shards[key->hash % kShards];
+		std::unique_lock <std::mutex> lck(shard.mtx);
+		auto it = shard.keys.find(key);
+		if (it != shard.keys.end())
+		{
+			ids.swap(it->second);
+			shard.keys.erase(it);
+			keyCount--;
+		}
+	}
+
+	if (ids.empty() && !bcastEnabled)
+	{
+		return;
+	}
+	notifyClients(key, ids, id, true);
+}
+
+/* An evicted key was not written, it only goes to the clients that read it. */
+void Tracking::notifyClients(const RedisObjectPtr &key,
+	std::unordered_set<int64_t> &ids, int64_t id, bool written)
+{
+	std::vector<TrackingClientPtr> targets;
+	{
+		std::unique_lock <std::mutex> lck(mutex);
+		if (written && bcastEnabled)
+		{
+			/* Every prefix of the key is looked up, the empty one included. */
+			size_t len = sdslen(key->ptr);
+			for (size_t i = 0; i <= len; i++)
+			{
+				auto it = prefixes.find(std::string(key->ptr, i));
+				if (it != prefixes.end())
+				{
+					ids.insert(it->second.begin(), it->second.end());
+				}
+			}
+		}
+
+		for (auto &it : ids)
+		{
+			auto iter = clients.find(it);
+			if (iter == clients.end() || (iter->second->noloop && it == id))
+			{
+				continue;
+			}
+			targets.push_back(iter->second);
+		}
+	}
+
+	for (auto &it : targets)
+	{
+		sendInvalidate(it, key);
+	}
+}
+
+void Tracking::invalidateAll()
+{
+	if (!enabled)
+	{
+		return;
+	}
+
+	for (auto &shard : shards)
+	{
+		std::unique_lock <std::mutex> lck(shard.mtx);
+		keyCount -= shard.keys.size();
+		shard.keys.clear();
+	}
+
+	std::vector<TrackingClientPtr> targets;
+	{
+		std::unique_lock <std::mutex> lck(mutex);
+		for (auto &it : clients)
+		{
+			targets.push_back(it.second);
+		}
+	}
+
+	for (auto &it : targets)
+	{
+		sendInvalidate(it, nullptr);
+	}
+}
+
+size_t Tracking::getClients()
+{
+	std::unique_lock <std::mutex> lck(mutex);
+	return clients.size();
+}
+
+size_t Tracking::getKeys()
+{
+	return keyCount;
+}
+
+size_t Tracking::getPrefixes()
+{
+	std::unique_lock <std::mutex> lck(mutex);
+	return prefixes.size();
+}
+
+/* There is no RESP3 push type here, invalidations take the RESP2 form of a
+ * message on __redis__:invalidate and only go to a redirect client that is
+ * subscribed to it. A null array stands for all keys. */
+void Tracking::sendInvalidate(const TrackingClientPtr &client, const RedisObjectPtr &key)
+{
+	TcpConnectionPtr conn;
+	{
+		std::unique_lock <std::mutex> lck(redis->getMutex());
+		auto &sessions = redis->getSession();
+		auto it = sessions.find(client->redirectFd);
+		if (it == sessions.end() || it->second->getId() != client->redirect)
+		{
+			return;
+		}
+		conn = redis->getSessionConn()[client->redirectFd];
+	}
+
+	if (conn == nullptr || redis->getSubscriber(channel, client->redirectFd) != conn)
+	{
+		return;
+	}
+
+	Buffer buffer;
+	addReply(&buffer, shared.mbulkhdr[3]);
+	addReply(&buffer, shared.messagebulk);
+	addReplyBulkCString(&buffer, "__redis__:invalidate");
+	if (key == nullptr)
+	{
+		addReply(&buffer, shared.nullmultibulk);
+	}
+	else
+	{
+		addReply(&buffer, shared.mbulkhdr[1]);
+		addReplyBulk(&buffer, key);
+	}
+	conn->sendPipe(std::string_view(buffer.peek(), buffer.readableBytes()));
+}
@@ -0,0 +1,86 @@
+#pragma once
+#include "all.h"
+#include "buffer.h"
+#include "object.h"
+#include "tcpconnection.h"
+
+/* A client with CLIENT TRACKING on, known by its client id since sockets are
+ * reused. Its invalidations go to the redirect client, found by its socket
+ * and checked against its id. */
+struct TrackingClient
+{
+	TrackingClient(const TcpConnectionPtr &conn, int64_t id)
+		:conn(conn),
+		id(id),
+		redirect(-1),
+		redirectFd(-1),
+		bcast(false),
+		noloop(false)
+	{
+
+	}
+
+	TcpConnectionPtr conn;
+	int64_t id;
+	int64_t redirect;
+	int32_t redirectFd;
+	bool bcast;
+	bool noloop;
+	std::vector<std::string> prefixes;
+};
+
+typedef std::shared_ptr<TrackingClient> TrackingClientPtr;
+
+class Redis;
+class Tracking
+{
+public:
+	Tracking(Redis *redis);
+	~Tracking();
+
+	void enable(const TrackingClientPtr &client);
+	void disable(int64_t id);
+	void rememberKey(int64_t id, const RedisObjectPtr &key);
+	void invalidateKey(const RedisObjectPtr &key, int64_t id);
+	void invalidateAll();
+
+	bool isEnabled() { return enabled; }
+	void setMaxKeys(int64_t keys) { maxKeys = keys; }
+	int64_t getMaxKeys() { return maxKeys; }
+	size_t getClients();
+	size_t getKeys();
+	size_t getPrefixes();
+
+private:
+	Tracking(const Tracking&);
+	void operator=(const Tracking&);
+
+	TrackingClientPtr lookupClient(int64_t id);
+	void evictKeys(const RedisObjectPtr &keep);
+	void notifyClients(const RedisObjectPtr &key,
+		std::unordered_set<int64_t> &ids, int64_t id, bool written);
+	void sendInvalidate(const TrackingClientPtr &client, const RedisObjectPtr &key);
+
+	const static int32_t kShards = 64;
+
+	/* Keys read by tracking clients, each entry is dropped once its key
+	 * was invalidated. Past maxKeys a shard evicts another of its keys and
+	 * invalidates it. Clients that left are skipped lazily. */
+	struct TrackingShard
+	{
+		std::unordered_map<RedisObjectPtr, std::unordered_set<int64_t>, Hash, Equal> keys;
+		std::mutex mtx;
+	};
+
+	Redis *redis;
+	std::array<TrackingShard, kShards> shards;
+	std::atomic<int64_t> keyCount;
+	std::atomic<int64_t> maxKeys;
+	std::atomic<uint32_t> evictCursor;
+	RedisObjectPtr channel;
+	std::unordered_map<int64_t, TrackingClientPtr> clients;
+	std::unordered_map<std::string, std::unordered_set<int64_t>> prefixes;
+	std::mutex mutex;
+	std::atomic<bool> enabled;
+	std::atomic<bool> bcastEnabled;
+};
@@ -1082,6 +1082,63 @@ int32_t stringmatch(const char *pattern, const char *string, int32_t nocase)
 	return stringmatchlen(pattern, strlen(pattern), string, strlen(string), nocase);
 }
 
+/* Turn a string representing notification classes into an integer
+ * representing notification flags xored.
+ *
+ * The function returns -1 if the input contains characters not mapping to
+ * any class. */
+int32_t keyspaceEventsStringToFlags(const char *classes)
+{
+	const char *p = classes;
+	int32_t c, flags = 0;
+
+	while ((c = *p++) != '\0')
+	{
+		switch (c)
+		{
+		case 'A': flags |= NOTIFY_ALL; break;
+		case 'g': flags |= NOTIFY_GENERIC; break;
+		case '$': flags |= NOTIFY_STRING; break;
+		case 'l': flags |= NOTIFY_LIST; break;
+		case 's': flags |= NOTIFY_SET; break;
+		case 'h': flags |= NOTIFY_HASH; break;
+		case 'z': flags |= NOTIFY_ZSET; break;
+		case 'x': flags |= NOTIFY_EXPIRED; break;
+		case 'e': flags |= NOTIFY_EVICTED; break;
+		case 'K': flags |= NOTIFY_KEYSPACE; break;
+		case 'E': flags |= NOTIFY_KEYEVENT; break;
+		default: return -1;
+		}
+	}
+	return flags;
+}
+
+/* This function does exactly the reverse of the function above: it gets
+ * as input an integer with the xored flags and returns a string
+ * representing the selected classes. */
+std::string keyspaceEventsFlagsToString(int32_t flags)
+{
+	std::string res;
+	if ((flags & NOTIFY_ALL) == NOTIFY_ALL)
+	{
+		res += "A";
+	}
+	else
+	{
+		if (flags & NOTIFY_GENERIC) res += "g";
+		if (flags & NOTIFY_STRING) res += "$";
+		if (flags & NOTIFY_LIST) res += "l";
+		if (flags & NOTIFY_SET) res += "s";
+		if (flags & NOTIFY_HASH) res += "h";
+		if (flags & NOTIFY_ZSET) res += "z";
+		if (flags & NOTIFY_EXPIRED) res += "x";
+		if (flags & NOTIFY_EVICTED) res += "e";
+	}
+	if (flags & NOTIFY_KEYSPACE) res += "K";
+	if (flags & NOTIFY_KEYEVENT) res += "E";
+	return res;
+}
+
 void getRandomHexChars(char *p, uint32_t len)
 {
 #ifndef _WIN64
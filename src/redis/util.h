@@ -317,6 +317,8 @@ int32_t string2ll(const char *s, size_t slen, int64_t *value);
 int32_t stringmatchlen(const char *p, int32_t plen,
 	const char *s, int32_t slen, int32_t nocase);
 int32_t stringmatch(const char *p, const char *s, int32_t nocase);
+int32_t keyspaceEventsStringToFlags(const char *classes);
+std::string keyspaceEventsFlagsToString(int32_t flags);
 void getRandomHexChars(char *p, uint32_t len);
 void memrev64(void *p);
 void bytesToHuman(char *s, uint64_t n);